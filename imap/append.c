@@ -57,9 +57,11 @@
 
 #include "acl.h"
 #include "assert.h"
+#include "blobstore.h"
 #include "imap_err.h"
 #include "mailbox.h"
 #include "message.h"
+#include "msgzip.h"
 #include "append.h"
 #include "global.h"
 #include "prot.h"
@@ -71,6 +73,7 @@
 #include "retry.h"
 #include "quota.h"
 #include "util.h"
+#include "search_text.h"
 
 #include "message_guid.h"
 
@@ -273,6 +276,14 @@ int append_commit(struct appendstate *as,
 	return r;
     }
 
+    /* get the new messages into the text index while still locked */
+    search_text_update(as->mailbox);
+
+    /* the SQUAT delta index is rebuilt by mailbox_close(), unlocked */
+    if (as->nummsg && (!as->mailbox->squat_delta_uid ||
+		       as->baseuid < as->mailbox->squat_delta_uid))
+	as->mailbox->squat_delta_uid = as->baseuid;
+
     if (mailboxptr) {
 	*mailboxptr = as->mailbox;
     }
@@ -458,6 +469,9 @@ int append_fromstage(struct appendstate *as, struct body **body,
     /* 'p' contains the message and is on the same partition
        as the mailbox we're looking at */
 
+    /* compress the staged copy rather than each link to it */
+    msgzip_file(mailbox->part, p);
+
     /* Setup */
     message_index.uid = as->baseuid + as->nummsg;
     message_index.internaldate = internaldate;
@@ -485,6 +499,10 @@ int append_fromstage(struct appendstate *as, struct body **body,
 	return r;
     }
 
+    /* share it with other deliveries of the same message */
+    if (!nolink && blobstore_enabled())
+	blobstore_share(mailbox->part, &message_index.guid, fname);
+
     /* Handle flags the user wants to set in the message */
     for (i = 0; i < nflags; i++) {
 	if (!strcmp(flag[i], "\\seen")) {
@@ -607,6 +625,11 @@ int append_fromstream(struct appendstate *as, struct body **body,
 	return r;
     }
 
+    msgzip_file(mailbox->part, fname);
+
+    if (blobstore_enabled())
+	blobstore_share(mailbox->part, &message_index.guid, fname);
+
     /* Handle flags the user wants to set in the message */
     for (i = 0; i < nflags; i++) {
 	if (!strcmp(flag[i], "\\seen")) {
@@ -710,7 +733,12 @@ int append_copy(struct mailbox *mailbox,
 	/* Link/copy message file */
 	srcfname = xstrdup(mailbox_message_fname(mailbox, copymsg[msg].uid));
 	destfname = xstrdup(mailbox_message_fname(as->mailbox, record.uid));
-	r = mailbox_copyfile(srcfname, destfname, nolink);
+	/* an existing blob saves copying between partitions */
+	r = IMAP_MAILBOX_NONEXISTENT;
+	if (!nolink && blobstore_enabled())
+	    r = blobstore_link(as->mailbox->part, &record.guid, destfname);
+	if (r)
+	    r = mailbox_copyfile(srcfname, destfname, nolink);
 	free(srcfname);
 	free(destfname);
 	if (r) goto fail;
@@ -0,0 +1,209 @@
+/* blobstore.c -- per-partition store of messages keyed by GUID
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "blobstore.h"
+#include "global.h"
+#include "imap_err.h"
+#include "mailbox.h"
+#include "util.h"
+#include "xstrlcat.h"
+
+#define BLOBDIR "blob."
+
+int blobstore_enabled(void)
+{
+    return config_getswitch(IMAPOPT_SINGLEINSTANCESTORE) &&
+	   config_getswitch(IMAPOPT_SINGLEINSTANCESTORE_BLOBS);
+}
+
+const char *blobstore_path(const char *part, struct message_guid *guid)
+{
+    static char buf[MAX_MAILBOX_PATH+1];
+    const char *partdir = config_partitiondir(part);
+    const char *hex;
+
+    if (!partdir || message_guid_isnull(guid)) return NULL;
+
+    /* spread them over 256 directories */
+    hex = message_guid_encode(guid);
+    snprintf(buf, sizeof(buf), "%s/" BLOBDIR "/%.2s/%s", partdir, hex, hex);
+
+    return buf;
+}
+
+int blobstore_link(const char *part, struct message_guid *guid,
+		   const char *fname)
+{
+    const char *blob = blobstore_path(part, guid);
+    struct stat sbuf;
+
+    if (!blob || stat(blob, &sbuf) == -1)
+	return IMAP_MAILBOX_NONEXISTENT;
+
+    if (link(blob, fname) == 0) return 0;
+
+    if (errno == EEXIST) {
+	if (unlink(fname) == -1) {
+	    syslog(LOG_ERR, "IOERROR: unlinking to recreate %s: %m", fname);
+	    return IMAP_IOERROR;
+	}
+    }
+    else if (errno == ENOENT) {
+	cyrus_mkdir(fname, 0755);
+    }
+    if (link(blob, fname) == 0) return 0;
+
+    /* it may have been swept in the meantime */
+    return errno == ENOENT ? IMAP_MAILBOX_NONEXISTENT : IMAP_IOERROR;
+}
+
+void blobstore_share(const char *part, struct message_guid *guid,
+		     const char *fname)
+{
+    const char *blob = blobstore_path(part, guid);
+    char tmp[MAX_MAILBOX_PATH+1];
+    struct stat fbuf, bbuf;
+
+    if (!blob) return;
+
+    /* the first copy becomes the blob */
+    if (link(fname, blob) == 0) return;
+    if (errno == ENOENT) {
+	cyrus_mkdir(blob, 0755);
+	if (link(fname, blob) == 0) return;
+    }
+    if (errno != EEXIST) {
+	syslog(LOG_ERR, "IOERROR: linking %s to %s: %m", fname, blob);
+	return;
+    }
+
+    /* there's one already - is it this file? */
+    if (stat(fname, &fbuf) == -1 || stat(blob, &bbuf) == -1)
+	return;
+    if (fbuf.st_dev == bbuf.st_dev && fbuf.st_ino == bbuf.st_ino)
+	return;
+    if (fbuf.st_size != bbuf.st_size) {
+	syslog(LOG_ERR, "IOERROR: size mismatch between %s and %s",
+	       fname, blob);
+	return;
+    }
+
+    /* swap our copy for a link to it; the new name isn't a message
+     * file name, so reconstruct won't pick it up if we die here */
+    snprintf(tmp, sizeof(tmp), "%sNEW", fname);
+    unlink(tmp);
+    if (link(blob, tmp) == -1)
+	return;
+    if (rename(tmp, fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: renaming %s to %s: %m", tmp, fname);
+	unlink(tmp);
+    }
+}
+
+void blobstore_release(const char *part, struct message_guid *guid)
+{
+    const char *blob = blobstore_path(part, guid);
+    struct stat sbuf;
+
+    /* if someone links to it between the stat and the unlink, they
+     * keep their file; the blob is just gone for the next one */
+    if (blob && stat(blob, &sbuf) == 0 && sbuf.st_nlink == 1)
+	unlink(blob);
+}
+
+unsigned long blobstore_sweep(const char *partdir)
+{
+    char path[MAX_MAILBOX_PATH+1];
+    DIR *topdir, *dirp;
+    struct dirent *d, *f;
+    struct stat sbuf;
+    unsigned long removed = 0;
+    size_t toplen, sublen;
+
+    toplen = snprintf(path, sizeof(path), "%s/" BLOBDIR "/", partdir);
+    if (toplen >= sizeof(path)) return 0;
+
+    topdir = opendir(path);
+    if (!topdir) return 0;
+
+    while ((d = readdir(topdir)) != NULL) {
+	if (d->d_name[0] == '.') continue;
+
+	path[toplen] = '\0';
+	sublen = strlcat(path, d->d_name, sizeof(path));
+	if (sublen + 1 >= sizeof(path)) continue;
+	path[sublen++] = '/';
+	path[sublen] = '\0';
+
+	dirp = opendir(path);
+	if (!dirp) continue;
+
+	while ((f = readdir(dirp)) != NULL) {
+	    if (f->d_name[0] == '.') continue;
+
+	    path[sublen] = '\0';
+	    if (strlcat(path, f->d_name, sizeof(path)) >= sizeof(path))
+		continue;
+	    if (lstat(path, &sbuf) == 0 && S_ISREG(sbuf.st_mode) &&
+		sbuf.st_nlink == 1 && unlink(path) == 0)
+		removed++;
+	}
+	closedir(dirp);
+    }
+    closedir(topdir);
+
+    return removed;
+}
@@ -0,0 +1,85 @@
+/* blobstore.h -- per-partition store of messages keyed by GUID
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_BLOBSTORE_H
+#define INCLUDED_BLOBSTORE_H
+
+#include "message_guid.h"
+
+/*
+ * Each partition may keep one file per distinct message under
+ * <partition>/blob./XX/<guid>, and message files in mailboxes are
+ * hard links to it.  The link count is the reference count: a blob
+ * with a link count of one is used by nothing else and can go.
+ *
+ * Everything here is best effort - a missing or stale blob just means
+ * a message gets its own copy, as it would without the store.
+ */
+
+/* is singleinstancestore_blobs set? */
+extern int blobstore_enabled(void);
+
+extern const char *blobstore_path(const char *part,
+				  struct message_guid *guid);
+
+/* Create 'fname' as a link to the blob for 'guid'.  Returns 0 on
+ * success, or IMAP_MAILBOX_NONEXISTENT if there is no usable blob */
+extern int blobstore_link(const char *part, struct message_guid *guid,
+			  const char *fname);
+
+/* 'fname' has just been created and its content is known to hash to
+ * 'guid': make it the blob if there isn't one yet, otherwise replace
+ * it with a link to the existing blob */
+extern void blobstore_share(const char *part, struct message_guid *guid,
+			    const char *fname);
+
+/* a message file for 'guid' has been unlinked: remove the blob if
+ * nothing links to it any more */
+extern void blobstore_release(const char *part,
+			      struct message_guid *guid);
+
+/* remove all unused blobs under partition directory 'partdir';
+ * returns how many were removed */
+extern unsigned long blobstore_sweep(const char *partdir);
+
+#endif /* INCLUDED_BLOBSTORE_H */
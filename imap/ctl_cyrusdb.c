@@ -154,6 +154,36 @@ static int fixmbox(char *name,
 
     return 0;
 }
+/* bring the Bloom filters up to date with their databases.  'force'
+   (at startup) rebuilds them regardless, which after a crash replaces
+   filters that missed unsynced additions.  otherwise writers are about,
+   so only filters which have filled up are rebuilt. */
+static void rebuild_filters(int force)
+{
+    int r;
+
+    duplicate_init(NULL, 0);
+    r = duplicate_rebuild_filter(force);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: rebuilding duplicate filter: %s",
+	       cyrusdb_strerror(r));
+    }
+    duplicate_done();
+
+    if (!config_getswitch(IMAPOPT_STATUSCACHE)) {
+	statuscache_remove_filter();
+	return;
+    }
+
+    statuscache_open(NULL);
+    r = statuscache_rebuild_filter(force);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: rebuilding statuscache filter: %s",
+	       cyrusdb_strerror(r));
+    }
+    statuscache_close();
+}
+
 void recover_reserved() 
 {
     char pattern[2] = { '*', '\0' };
@@ -202,6 +232,10 @@ static void check_convert(struct cyrusdb *db, const char *fname)
     /* unable to detect current type, assume all is good */
     if (!detectname) return;
 
+    /* a sharded mailbox list converts the old file as it splits it */
+    if (db->backendptr == &config_mboxlist_db &&
+	config_getint(IMAPOPT_MBOXLIST_DB_SHARDS) > 1) return;
+
     /* strip the -nosync from the name if present */
     strncpy(backendbuf, backend->name, 100);
     p = strstr(backendbuf, "-nosync");
@@ -388,6 +422,8 @@ int main(int argc, char *argv[])
     if(op == RECOVER && reserve_flag)
 	recover_reserved();
 
+    rebuild_filters(op == RECOVER);
+
     cyrus_done();
 
     syslog(LOG_NOTICE, "done %s", msg);
@@ -483,6 +483,7 @@ void do_dump(enum mboxop op, const char *part, int purge)
     if(d.tid) {
 	config_mboxlist_db->commit(mbdb, d.tid);
 	d.tid = NULL;
+	mboxlist_changed();
     }
 
     if(op == M_POPULATE) {
@@ -569,7 +570,17 @@ void do_dump(enum mboxop op, const char *part, int purge)
     return;
 }
 
-void do_undump(void)
+static int undump_empty_cb(void *rock,
+			   const char *key __attribute__((unused)),
+			   int keylen __attribute__((unused)),
+			   const char *data __attribute__((unused)),
+			   int datalen __attribute__((unused)))
+{
+    *(int *)rock = 0;
+    return CYRUSDB_DONE;
+}
+
+void do_undump(const char *fname)
 {
     int r = 0;
     char buf[16384];
@@ -579,9 +590,17 @@ void do_undump(void)
     int keylen, datalen;
     int untilCommit = PER_COMMIT;
     struct txn *tid = NULL;
+    struct cyrusdb_load *load = NULL;
+    int empty = 1;
     
     last_commit[0] = '\0';
 
+    /* a dump of a whole mailbox list is in order, so an empty one can
+       be built directly instead of a record at a time */
+    config_mboxlist_db->foreach(mbdb, "", 0, NULL, undump_empty_cb, &empty,
+				NULL);
+    if (empty && mboxlist_load_begin(fname, &load)) load = NULL;
+
     while (fgets(buf, sizeof(buf), stdin)) {
 	char *name, *partition, *acl;
 	char *p;
@@ -627,6 +646,24 @@ void do_undump(void)
 	data = mboxlist_makeentry(mbtype, partition, acl);
 	datalen = strlen(data);
 	
+	if (load) {
+	    r = cyrusdb_load_add(load, key, keylen, data, datalen);
+	    if (r != CYRUSDB_EXISTS) {
+		free(data);
+		if (r) break;
+		continue;
+	    }
+
+	    /* out of order after all: keep what we've loaded so far
+	       and store the rest */
+	    r = cyrusdb_load_end(load, 1);
+	    load = NULL;
+	    if (r) {
+		free(data);
+		break;
+	    }
+	}
+
 	tries = 0;
     retry:
 	r = config_mboxlist_db->store(mbdb, key, keylen, data, datalen, &tid);
@@ -664,6 +701,15 @@ void do_undump(void)
 	r=config_mboxlist_db->commit(mbdb, tid);
     }
 
+    if (load) {
+	/* put the new mailbox list in place, unless we failed */
+	if (!r) r = cyrusdb_load_end(load, 1);
+	else cyrusdb_load_end(load, 0);
+    }
+
+    /* even a failed load may have committed some of it */
+    mboxlist_changed();
+
     if (r) {
 	if(tid) config_mboxlist_db->abort(mbdb, tid);
 	fprintf(stderr, "db error: %s\n", cyrusdb_strerror(r));
@@ -1095,7 +1141,7 @@ int main(int argc, char *argv[])
 	annotatemore_init(0, NULL, NULL);
 	annotatemore_open(NULL);
 
-	do_undump();
+	do_undump(mboxdb_fname);
 
 	annotatemore_close();
 	annotatemore_done();
@@ -60,6 +60,7 @@
 #include <sasl/sasl.h>
 
 #include "annotate.h"
+#include "blobstore.h"
 #include "cyrusdb.h"
 #include "duplicate.h"
 #include "exitcodes.h"
@@ -355,6 +356,15 @@ int delete(char *name,
     }
     return(0);
 }
+/* config_foreachoverflowstring() callback: sweep one partition */
+static void sweep_blobs(const char *key, const char *val, void *rock)
+{
+    unsigned long *removed = (unsigned long *) rock;
+
+    if (!strncmp(key, "partition-", 10))
+	*removed += blobstore_sweep(val);
+}
+
 static void sighandler (int sig __attribute((unused)))
 {
     sigquit = 1;
@@ -543,6 +553,21 @@ int main(int argc, char *argv[])
 	goto finish;
     }
 
+    /* remove blobs left behind by deleted mailboxes */
+    if (blobstore_enabled()) {
+	unsigned long removed = 0;
+
+	config_foreachoverflowstring(sweep_blobs, &removed);
+
+	syslog(LOG_NOTICE, "Removed %lu unused message blobs", removed);
+	if (erock.verbose) {
+	    fprintf(stderr, "Removed %lu unused message blobs\n", removed);
+	}
+    }
+    if (sigquit) {
+	goto finish;
+    }
+
     /* purge deliver.db entries of expired messages */
     r = duplicate_prune(expire_seconds, &expire_table);
 
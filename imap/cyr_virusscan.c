@@ -63,6 +63,7 @@
 #include "mailbox.h"
 #include "xmalloc.h"
 #include "mboxlist.h"
+#include "msgzip.h"
 #include "prot.h"
 #include "util.h"
 #include "sync_log.h"
@@ -111,8 +112,8 @@ struct scan_engine {
     const char *name;
     void *state;
     void *(*init)(void);  /* initialize state */
-    int (*scanfile)(void *state,  /* scan fname & return non-zero if infected */
-		    const char *fname, const char **virname);
+    int (*scandesc)(void *state,  /* scan fd & return non-zero if infected */
+		    int fd, const char **virname);
     void (*destroy)(void *state);  /* destroy state */
 };
 
@@ -167,14 +168,13 @@ void *clamav_init()
 }
 
 
-int clamav_scanfile(void *state, const char *fname,
-		    const char **virname)
+int clamav_scandesc(void *state, int fd, const char **virname)
 {
     struct clamav_state *st = (struct clamav_state *) state;
     int r;
 
     /* scan file */
-    r = cl_scanfile(fname, virname, NULL, st->av_engine, &st->av_limits,
+    r = cl_scandesc(fd, virname, NULL, st->av_engine, &st->av_limits,
 		    CL_SCAN_STDOPT);
 
     switch (r) {
@@ -186,8 +186,8 @@ int clamav_scanfile(void *state, const char *fname,
 	break;
 
     default:
-	printf("cl_scanfile error: %s\n", cl_strerror(r));
-	syslog(LOG_ERR, "cl_scanfile error: %s\n", cl_strerror(r));
+	printf("cl_scandesc error: %s\n", cl_strerror(r));
+	syslog(LOG_ERR, "cl_scandesc error: %s\n", cl_strerror(r));
 	break;
     }
 
@@ -206,7 +206,7 @@ void clamav_destroy(void *state)
 }
 
 struct scan_engine engine =
-{ "ClamAV", NULL, &clamav_init, &clamav_scanfile, &clamav_destroy };
+{ "ClamAV", NULL, &clamav_init, &clamav_scandesc, &clamav_destroy };
 
 #elif defined(HAVE_SOME_UNKNOWN_VIRUS_SCANNER)
 /* XXX  Add other implementations here */
@@ -415,12 +415,24 @@ unsigned virus_check(struct mailbox *mailbox,
 {
     struct infected_mbox *i_mbox = (struct infected_mbox *) deciderock;
     char *fname;
+    FILE *f;
     const char *virname;
     int r = 0;
 
     fname = mailbox_message_fname(mailbox, record->uid);
 
-    if ((r = engine.scanfile(engine.state, fname, &virname))) {
+    /* scan what the message really is, not how it's stored */
+    f = msgzip_fopen(fname);
+    if (!f) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	if (i_mbox) i_mbox->recno++;
+	return 0;
+    }
+
+    r = engine.scandesc(engine.state, fileno(f), &virname);
+    fclose(f);
+
+    if (r) {
 	if (verbose) {
 	    printf("Virus detected in message %lu: %s\n", record->uid, virname);
 	}
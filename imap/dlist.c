@@ -78,6 +78,7 @@
 #include "imapd.h"
 #include "imparse.h"
 #include "message.h"
+#include "msgzip.h"
 #include "util.h"
 #include "retry.h"
 #include "cyr_lock.h"
@@ -91,7 +92,6 @@ const char *lastkey = NULL;
 
 static void printfile(struct protstream *out, const struct dlist *dl)
 {
-    struct stat sbuf;
     FILE *f;
     unsigned long size;
     struct message_guid guid2;
@@ -104,24 +104,23 @@ static void printfile(struct protstream *out, const struct dlist *dl)
 	prot_printf(out, "NIL");
 	return;
     }
-    if (fstat(fileno(f), &sbuf) == -1) {
-	syslog(LOG_ERR, "IOERROR: Failed to stat file %s", dl->sval);
+
+    /* always send the message itself, even if it's stored compressed */
+    if (msgzip_map(fileno(f), dl->sval, NULL, &msg_base, &msg_len)) {
 	prot_printf(out, "NIL");
 	fclose(f);
 	return;
     }
-    size = sbuf.st_size;
+    size = msg_len;
     if (size != dl->nval) {
 	syslog(LOG_ERR, "IOERROR: Size mismatch %s (%lu != " MODSEQ_FMT ")",
 	       dl->sval, size, dl->nval);
 	prot_printf(out, "NIL");
 	fclose(f);
+	msgzip_unmap(&msg_base, &msg_len);
 	return;
     }
 
-    map_refresh(fileno(f), 1, &msg_base, &msg_len, sbuf.st_size,
-		"new message", 0);
-
     message_guid_generate(&guid2, msg_base, msg_len);
 
     if (!message_guid_equal(&guid2, (struct message_guid *) &dl->gval)) {
@@ -129,7 +128,7 @@ static void printfile(struct protstream *out, const struct dlist *dl)
 	       dl->sval);
 	prot_printf(out, "NIL");
 	fclose(f);
-	map_free(&msg_base, &msg_len);
+	msgzip_unmap(&msg_base, &msg_len);
 	return;
     }
 
@@ -140,7 +139,7 @@ static void printfile(struct protstream *out, const struct dlist *dl)
     prot_printf(out, " %lu}\r\n", size);
     prot_write(out, msg_base, msg_len);
     fclose(f);
-    map_free(&msg_base, &msg_len);
+    msgzip_unmap(&msg_base, &msg_len);
 }
 
 /* XXX - these two functions should be out in append.c or reserve.c
@@ -71,6 +71,7 @@
 #include <errno.h>
 
 #include "assert.h"
+#include "bloom.h"
 #include "xmalloc.h"
 #include "imap_err.h"
 #include "global.h"
@@ -86,6 +87,8 @@
 
 static struct db *dupdb = NULL;
 static int duplicate_dbopen = 0;
+static struct bloom *dupbloom = NULL;
+static char *dupfname = NULL;
 
 /* must be called after cyrus_init */
 int duplicate_init(const char *fname, int myflags __attribute__((unused)))
@@ -98,6 +101,7 @@ int duplicate_init(const char *fname, int myflags __attribute__((unused)))
 	       cyrusdb_strerror(r));
     else {
 	char *tofree = NULL;
+	int flags;
 
 	if (!fname)
 	    fname = config_getstring(IMAPOPT_DUPLICATE_DB_PATH);
@@ -110,12 +114,21 @@ int duplicate_init(const char *fname, int myflags __attribute__((unused)))
 	    fname = tofree;
 	}
 
-	r = (DB->open)(fname, CYRUSDB_CREATE, &dupdb);
+	flags = CYRUSDB_CREATE;
+	if (config_getswitch(IMAPOPT_DUPLICATE_DB_GROUP_COMMIT)) {
+	    flags |= CYRUSDB_GROUPCOMMIT;
+	}
+
+	r = (DB->open)(fname, flags, &dupdb);
 	if (r != 0)
 	    syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
 		   cyrusdb_strerror(r));
-	else
+	else {
 	    duplicate_dbopen = 1;
+	    dupfname = xstrdup(fname);
+	    if (config_getswitch(IMAPOPT_DUPLICATE_DB_BLOOM))
+		dupbloom = bloom_open(fname);
+	}
 
 	free(tofree);
     }
@@ -145,6 +158,8 @@ time_t duplicate_check(duplicate_key_t *dkey)
     memcpy(buf + idlen + tolen + 2, dkey->date, datelen);
     buf[idlen + tolen + datelen + 2] = '\0';
 
+    if (!bloom_test(dupbloom, buf, idlen + tolen + datelen + 3)) return 0;
+
     do {
 	r = DB->fetch(dupdb, buf,
 		      idlen + tolen + datelen + 3, /* We have three concatenated values now, all parts ending with '\0' */
@@ -212,6 +227,8 @@ void duplicate_mark(duplicate_key_t *dkey, time_t mark, unsigned long uid)
 		      data, sizeof(mark)+sizeof(uid), NULL);
     } while (r == CYRUSDB_AGAIN);
 
+    if (!r) bloom_add(dupbloom, buf, idlen + tolen + datelen + 3);
+
 #if DEBUG
     syslog(LOG_DEBUG, "duplicate_mark: %-40s %-20s %-40s %ld %lu",
 	   buf, buf+idlen+1, buf+idlen+tolen+2, mark, uid); 
@@ -411,10 +428,31 @@ int duplicate_dump(FILE *f)
     return drock.count;
 }
 
+/* rebuild the Bloom filter if 'force' or it wants it, or get rid of it
+   if it's not wanted */
+int duplicate_rebuild_filter(int force)
+{
+    if (!duplicate_dbopen) return 0;
+
+    if (!config_getswitch(IMAPOPT_DUPLICATE_DB_BLOOM)) {
+	bloom_remove(dupfname);
+	return 0;
+    }
+
+    if (!force && !bloom_stale(dupbloom)) return 0;
+
+    return bloom_rebuild(dupbloom, DB, dupdb);
+}
+
 int duplicate_done(void)
 {
     int r = 0;
 
+    bloom_close(dupbloom);
+    dupbloom = NULL;
+    free(dupfname);
+    dupfname = NULL;
+
     if (duplicate_dbopen) {
 	r = (DB->close)(dupdb);
 	if (r) {
@@ -66,6 +66,7 @@ int duplicate_find(char *msgid, int (*proc)(), void *rock);
 
 int duplicate_prune(int seconds, struct hash_table *expire_table);
 int duplicate_dump(FILE *f);
+int duplicate_rebuild_filter(int force);
 
 int duplicate_done(void);
 
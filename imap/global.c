@@ -69,6 +69,7 @@
 #include "libconfig.h"
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
+#include "mboxlist_shard.h"
 #include "mupdate_err.h"
 #include "mutex.h"
 #include "prot.h" /* for PROT_BUFSIZE */
@@ -193,6 +194,9 @@ int cyrus_init(const char *alt_config, const char *ident, unsigned flags)
 	/* lookup the database backends */
 	config_mboxlist_db =
 	    cyrusdb_fromname(config_getstring(IMAPOPT_MBOXLIST_DB));
+	config_mboxlist_db =
+	    mboxlist_shard_backend(config_mboxlist_db,
+				   config_getint(IMAPOPT_MBOXLIST_DB_SHARDS));
 	config_quota_db =
 	    cyrusdb_fromname(config_getstring(IMAPOPT_QUOTA_DB));
 	config_subscription_db =
@@ -224,6 +228,12 @@ int cyrus_init(const char *alt_config, const char *ident, unsigned flags)
 				  config_getswitch(IMAPOPT_USERNAME_TOLOWER));
 	libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_UNSAFE,
 				  config_getswitch(IMAPOPT_SKIPLIST_UNSAFE));
+	libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_INCREMENTAL_CHECKPOINT,
+		  config_getswitch(IMAPOPT_SKIPLIST_INCREMENTAL_CHECKPOINT));
+	libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_PACKED,
+				  config_getswitch(IMAPOPT_SKIPLIST_PACKED_NODES));
+	libcyrus_config_setint(CYRUSOPT_GROUP_COMMIT_WINDOW,
+			       config_getint(IMAPOPT_GROUP_COMMIT_WINDOW));
 	libcyrus_config_setstring(CYRUSOPT_TEMP_PATH,
 				  config_getstring(IMAPOPT_TEMP_PATH));
 	libcyrus_config_setint(CYRUSOPT_PTS_CACHE_TIMEOUT,
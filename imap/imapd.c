@@ -101,6 +101,7 @@
 #include "mupdate-client.h"
 #include "proc.h"
 #include "quota.h"
+#include "search_kernels.h"
 #include "seen.h"
 #include "statuscache.h"
 #include "sync_log.h"
@@ -849,6 +850,8 @@ int service_init(int argc, char **argv, char **envp)
 	statuscache_open(NULL);
     }
 
+    syslog(LOG_DEBUG, "using %s search kernels", search_kernel_name());
+
     /* Create a protgroup for input from the client and selected backend */
     protin = protgroup_new(2);
 
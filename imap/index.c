@@ -72,6 +72,9 @@
 #include "message.h"
 #include "parseaddr.h"
 #include "search_engines.h"
+#include "search_text.h"
+#include "squat_delta.h"
+#include "search_kernels.h"
 #include "seen.h"
 #include "statuscache.h"
 #include "strhash.h"
@@ -130,7 +133,7 @@ static int index_searchheader(char *name, char *substr, comp_pat *pat,
 			      int size);
 static int index_searchcacheheader(struct index_state *state, uint32_t msgno, char *name, char *substr,
 				   comp_pat *pat);
-static int _index_search(unsigned **msgno_list, struct index_state *state,
+static int _index_search(bitvector_t *msgnos, struct index_state *state,
 			 struct searchargs *searchargs,
 			 modseq_t *highestmodseq);
 
@@ -148,7 +151,7 @@ static char *index_extract_subject(const char *subj, size_t len, int *is_refwd);
 static char *_index_extract_subject(char *s, int *is_refwd);
 static void index_get_ids(MsgData *msgdata,
 			  char *envtokens[], const char *headers, unsigned size);
-static MsgData *index_msgdata_load(struct index_state *state, unsigned *msgno_list, int n,
+static MsgData *index_msgdata_load(struct index_state *state, bitvector_t *msgnos, int n,
 				   struct sortcrit *sortcrit);
 
 static void *index_sort_getnext(MsgData *node);
@@ -162,13 +165,13 @@ static void index_thread_setnext(Thread *thread, Thread *next);
 static int index_thread_compare(Thread *t1, Thread *t2,
 				struct sortcrit *call_data);
 static void index_thread_orderedsubj(struct index_state *state,
-				     unsigned *msgno_list, int nmsg,
+				     bitvector_t *msgnos, int nmsg,
 				     int usinguid);
 static void index_thread_sort(Thread *root, struct sortcrit *sortcrit);
 static void index_thread_print(struct index_state *state,
 			       Thread *threads, int usinguid);
 static void index_thread_ref(struct index_state *state,
-			     unsigned *msgno_list, int nmsg, int usinguid);
+			     bitvector_t *msgnos, int nmsg, int usinguid);
 
 static void index_select(struct index_state *state);
 static struct seqset *_index_vanished(struct index_state *state,
@@ -176,6 +179,8 @@ static struct seqset *_index_vanished(struct index_state *state,
 static struct seqset *_parse_sequence(struct index_state *state,
 				      const char *sequence, int usinguid);
 static void massage_header(char *hdr);
+static void index_columns_free(struct index_columns **colsp);
+static void index_columns_set(struct index_state *state, uint32_t msgno);
 
 /* NOTE: Make sure these are listed in CAPABILITY_STRING */
 static const struct thread_algorithm thread_algs[] = {
@@ -195,6 +200,7 @@ int index_close(struct index_state **stateptr)
 
     free(state->userid);
     free(state->map);
+    index_columns_free(&state->columns);
     for (i = 0; i < MAX_USER_FLAGS; i++)
 	free(state->flagname[i]);
     mailbox_close(&state->mailbox);
@@ -294,6 +300,7 @@ int index_expunge(struct index_state *state, char *sequence)
     int r;
     uint32_t msgno;
     struct index_map *im;
+    struct index_record record;
     struct seqset *seq = NULL;
     int numexpunged = 0;
 
@@ -316,17 +323,22 @@ int index_expunge(struct index_state *state, char *sequence)
 	if (sequence && !seqset_ismember(seq, im->record.uid))
 	    continue; /* not in the list */
 
+	record = im->record;
+	record.system_flags |= FLAG_EXPUNGED;
+
+	r = mailbox_rewrite_index_record(state->mailbox, &record);
+	if (r) break;
+	im->record = record;
+
 	if (!im->isseen)
 	    state->numunseen--;
 
 	if (im->isrecent)
 	    state->numrecent--;
 
-	im->record.system_flags |= FLAG_EXPUNGED;
         numexpunged++;
 
-	r = mailbox_rewrite_index_record(state->mailbox, &im->record);
-	if (r) break;
+	index_columns_set(state, msgno);
     }
 
     seqset_free(seq);
@@ -483,6 +495,60 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
     return seenlist;
 }
 
+/*
+ * Column snapshot maintenance.  The snapshot is sized alongside
+ * state->map, and each slot is copied from its index_map whenever
+ * the record or the session's seen state for it changes.
+ */
+static void index_columns_free(struct index_columns **colsp)
+{
+    struct index_columns *cols = *colsp;
+
+    if (!cols) return;
+
+    free(cols->uid);
+    free(cols->modseq);
+    free(cols->system_flags);
+    free(cols->user_flags);
+    free(cols->internaldate);
+    free(cols->size);
+    free(cols);
+
+    *colsp = NULL;
+}
+
+static void index_columns_resize(struct index_columns *cols, unsigned alloc)
+{
+    cols->uid = xrealloc(cols->uid, alloc * sizeof(uint32_t));
+    cols->modseq = xrealloc(cols->modseq, alloc * sizeof(modseq_t));
+    cols->system_flags = xrealloc(cols->system_flags, alloc * sizeof(bit32));
+    cols->user_flags = xrealloc(cols->user_flags,
+				alloc * (MAX_USER_FLAGS/32) * sizeof(bit32));
+    cols->internaldate = xrealloc(cols->internaldate, alloc * sizeof(time_t));
+    cols->size = xrealloc(cols->size, alloc * sizeof(uint32_t));
+    cols->alloc = alloc;
+}
+
+static void index_columns_set(struct index_state *state, uint32_t msgno)
+{
+    struct index_columns *cols = state->columns;
+    struct index_map *im = &state->map[msgno-1];
+    bit32 *user_flags;
+    unsigned i;
+
+    if (!cols) return;
+
+    cols->uid[msgno-1] = im->record.uid;
+    cols->modseq[msgno-1] = im->record.modseq;
+    cols->system_flags[msgno-1] = (im->record.system_flags & ~FLAG_SEEN) |
+				  (im->isseen ? FLAG_SEEN : 0);
+    user_flags = INDEX_COLUMN_USER_FLAGS(cols, msgno);
+    for (i = 0; i < (MAX_USER_FLAGS/32); i++)
+	user_flags[i] = im->record.user_flags[i];
+    cols->internaldate[msgno-1] = im->record.internaldate;
+    cols->size[msgno-1] = im->record.size;
+}
+
 void index_refresh(struct index_state *state)
 {
     struct mailbox *mailbox = state->mailbox;
@@ -496,6 +562,7 @@ void index_refresh(struct index_state *state)
     modseq_t delayed_modseq = 0;
     uint32_t need_records;
     struct seqset *seenlist;
+    int mincolumns = config_getint(IMAPOPT_INDEX_COLUMNS);
 
     if (state->num_records) {
 	need_records = mailbox->i.num_records -
@@ -513,16 +580,25 @@ void index_refresh(struct index_state *state)
 			      state->mapsize * sizeof(struct index_map));
     }
 
+    /* big enough to be worth a column snapshot? */
+    if (!state->columns && mincolumns > 0 &&
+	need_records >= (unsigned) mincolumns)
+	state->columns = xzmalloc(sizeof(struct index_columns));
+    if (state->columns && state->columns->alloc < state->mapsize)
+	index_columns_resize(state->columns, state->mapsize);
+
     seenlist = _readseen(state, &recentuid);
 
     /* already known records - flag updates */
     for (msgno = 1; msgno <= state->exists; msgno++) {
 	im = &state->map[msgno-1];
-	if (mailbox_read_index_record(mailbox, im->record.recno, &im->record))
+	/* only decodes records which have been rewritten */
+	if (mailbox_refresh_index_record(mailbox, &im->record))
 	    continue; /* bogus read... should probably be fatal */
 
 	/* ignore expunged messages */
 	if (im->record.system_flags & FLAG_EXPUNGED) {
+	    index_columns_set(state, msgno);
 	    /* http://www.rfc-editor.org/errata_search.php?rfc=5162
 	     * Errata ID: 1809 - if there are expunged records we
 	     * aren't telling about, need to make the highestmodseq
@@ -548,6 +624,8 @@ void index_refresh(struct index_state *state)
 	    /* we don't need to dirty seen here, it's a refresh */
 	    numrecent++;
 	}
+
+	index_columns_set(state, msgno);
     }
 
     /* new records? */
@@ -587,6 +665,8 @@ void index_refresh(struct index_state *state)
 	/* don't auto-tell */
 	im->told_modseq = im->record.modseq;
 
+	index_columns_set(state, msgno);
+
 	msgno++;
     }
 
@@ -791,6 +871,7 @@ static struct seqset *_index_vanished(struct index_state *state,
 static int _fetch_setseen(struct index_state *state, uint32_t msgno)
 {
     struct index_map *im = &state->map[msgno-1];
+    struct index_record record;
     int r;
 
     /* already seen */
@@ -802,17 +883,20 @@ static int _fetch_setseen(struct index_state *state, uint32_t msgno)
 	return 0;
 
     /* store in the record if it's internal seen */
+    record = im->record;
     if (state->internalseen)
-	im->record.system_flags |= FLAG_SEEN;
+	record.system_flags |= FLAG_SEEN;
 
     /* need to bump modseq anyway, so always rewrite it */
-    r = mailbox_rewrite_index_record(state->mailbox, &im->record);
+    r = mailbox_rewrite_index_record(state->mailbox, &record);
     if (r) return r;
+    im->record = record;
 
     /* track changes internally */
     state->numunseen--;
     state->seen_dirty = 1;
     im->isseen = 1;
+    index_columns_set(state, msgno);
 
     /* RFC2060 says:
      * The \Seen flag is implicitly set; if this causes
@@ -1000,12 +1084,11 @@ static int index_scan_work(const char *s, unsigned long len,
  */
 int index_scan(struct index_state *state, const char *contents)
 {
-    unsigned *msgno_list;
+    bitvector_t msgnos;
     uint32_t msgno;
     struct mapfile msgfile;
     int n = 0;
-    int listindex;
-    int listcount;
+    int bit;
     struct searchargs searchargs;
     struct strlist strlist;
     unsigned long length;
@@ -1030,12 +1113,11 @@ int index_scan(struct index_state *state, const char *contents)
     strlist.p = charset_compilepat(strlist.s);
     strlist.next = NULL;
 
-    msgno_list = (unsigned *) xmalloc(state->exists * sizeof(unsigned));
-
-    listcount = search_prefilter_messages(msgno_list, state, &searchargs);
+    search_prefilter_messages(&msgnos, state, &searchargs);
 
-    for (listindex = 0; !n && listindex < listcount; listindex++) {
-        msgno = msgno_list[listindex];
+    for (bit = bitvector_first(&msgnos); !n && bit >= 0;
+	 bit = bitvector_next(&msgnos, bit + 1)) {
+	msgno = bit + 1;
 	im = &state->map[msgno-1];
 
 	msgfile.base = 0;
@@ -1053,54 +1135,154 @@ int index_scan(struct index_state *state, const char *contents)
 
     free(strlist.s);
     free(strlist.p);
-    free(msgno_list);
+    bitvector_fini(&msgnos);
+    search_prefilter_done(state);
 
     return n;
 }
 
+/*
+ * Run the per-message predicates at the top level of 'searchargs'
+ * which the column snapshot can answer (flags, MODSEQ, size,
+ * internaldate, single range UID sets) over the candidate messages,
+ * clearing the bits of messages which can't match.  Chunks with no
+ * candidates left are skipped entirely.
+ *
+ * Returns 1 if the candidates are the exact answer, i.e. there is
+ * nothing left in searchargs which needs index_search_evaluate().
+ */
+static int index_search_columns(struct index_state *state,
+				struct searchargs *searchargs,
+				bitvector_t *candidates)
+{
+    struct index_columns *cols = state->columns;
+    bit32 set = searchargs->system_flags_set;
+    bit32 unset = searchargs->system_flags_unset | FLAG_EXPUNGED;
+    uint32_t minsize = 0, maxsize = UINT32_MAX;
+    struct seqset *seq;
+    int exact = 1;
+    unsigned c, i;
+
+    /* the column has the session's view of \Seen, which is only
+     * the same as the record if seen state is internal */
+    if (!state->internalseen && ((set | unset) & FLAG_SEEN)) {
+	set &= ~FLAG_SEEN;
+	unset &= ~FLAG_SEEN;
+	exact = 0;
+    }
+    if (searchargs->flags & SEARCH_SEEN_SET)
+	set |= FLAG_SEEN;
+    if (searchargs->flags & SEARCH_SEEN_UNSET)
+	unset |= FLAG_SEEN;
+
+    if (searchargs->smaller)
+	maxsize = searchargs->smaller - 1;
+    if (searchargs->larger) {
+	if (searchargs->larger >= UINT32_MAX) {
+	    /* empty range: nothing can be larger */
+	    minsize = UINT32_MAX;
+	    maxsize = 0;
+	}
+	else minsize = searchargs->larger + 1;
+    }
+
+    for (c = 0; c < candidates->nchunks; c++) {
+	uint64_t *bitmap = bitvector_chunk(candidates, c);
+	unsigned base = c * BV_CHUNK_BITS;
+	unsigned n = state->exists - base;
+
+	if (!bitmap) continue;
+	if (n > BV_CHUNK_BITS) n = BV_CHUNK_BITS;
+
+	search_kernel_flags(cols->system_flags + base, 1, n,
+			    set, unset, bitmap);
+
+	for (i = 0; i < (MAX_USER_FLAGS/32); i++) {
+	    search_kernel_flags(INDEX_COLUMN_USER_FLAGS(cols, base+1) + i,
+				MAX_USER_FLAGS/32, n,
+				searchargs->user_flags_set[i],
+				searchargs->user_flags_unset[i], bitmap);
+	}
+
+	if (searchargs->smaller || searchargs->larger)
+	    search_kernel_range32(cols->size + base, n,
+				  minsize, maxsize, bitmap);
+
+	search_kernel_modseq(cols->modseq + base, n,
+			     searchargs->modseq, bitmap);
+
+	search_kernel_time(cols->internaldate + base, n,
+			   searchargs->after, searchargs->before, bitmap);
+
+	for (seq = searchargs->uidsequence; seq; seq = seq->nextseq) {
+	    if (seq->len == 1)
+		search_kernel_range32(cols->uid + base, n, seq->set[0].low,
+				      seq->set[0].high, bitmap);
+	}
+    }
+    bitvector_compact(candidates);
+
+    for (seq = searchargs->uidsequence; seq; seq = seq->nextseq) {
+	if (seq->len != 1)
+	    exact = 0;
+    }
+
+    if ((searchargs->flags & (SEARCH_RECENT_SET|SEARCH_RECENT_UNSET)) ||
+	searchargs->sentbefore || searchargs->sentafter ||
+	searchargs->sequence || searchargs->from || searchargs->to ||
+	searchargs->cc || searchargs->bcc || searchargs->subject ||
+	searchargs->messageid || searchargs->body || searchargs->text ||
+	searchargs->header_name || searchargs->sublist ||
+	searchargs->cache_atleast)
+	exact = 0;
+
+    return exact;
+}
+
 /*
  * Guts of the SEARCH command.
  * 
- * Returns message numbers in an array.  This function is used by
+ * Initialises 'msgnos' with bit msgno-1 set for each matching message
+ * and returns the number of matches.  This function is used by
  * SEARCH, SORT and THREAD.
  */
-static int _index_search(unsigned **msgno_list, struct index_state *state,
+static int _index_search(bitvector_t *msgnos, struct index_state *state,
 			 struct searchargs *searchargs,
 			 modseq_t *highestmodseq)
 {
     uint32_t msgno;
     struct mapfile msgfile;
+    bitvector_t candidates;
     int n = 0;
-    int listindex, min;
-    int listcount;
+    int bit, min, done = 0;
+    int exact = 0;
     struct mailbox *mailbox = state->mailbox;
     struct index_map *im;
 
+    bitvector_init(msgnos, state->exists, 0);
     if (state->exists <= 0) return 0;
 
-    *msgno_list = (unsigned *) xmalloc(state->exists * sizeof(unsigned));
+    /* Start with the messages the search engine says could match,
+       then cut them down with a pass over the column snapshot */
+    search_prefilter_messages(&candidates, state, searchargs);
 
-    /* OK, so I'm being a bit clever here. We fill the msgno list with
-       a list of message IDs returned by the search engine. Then we
-       scan through the list and store matching message IDs back into the
-       list. This is OK because we only overwrite message IDs that we've
-       already looked at. */
-    listcount = search_prefilter_messages(*msgno_list, state, searchargs);
+    if (state->columns)
+	exact = index_search_columns(state, searchargs, &candidates);
 
     if (searchargs->returnopts == SEARCH_RETURN_MAX) {
 	/* If we only want MAX, then skip forward search,
 	   and do complete reverse search */
-	listindex = listcount;
-	min = 0;
+	bit = -1;
+	min = -1;
     } else {
 	/* Otherwise use forward search, potentially skipping reverse search */
-	listindex = 0;
-	min = listcount;
+	bit = bitvector_first(&candidates);
+	min = state->exists;
     }
 
     /* Forward search.  Used for everything other than MAX-only */
-    for (; listindex < listcount; listindex++) {
-	msgno = (*msgno_list)[listindex];
+    for (; bit >= 0 && !done; bit = bitvector_next(&candidates, bit + 1)) {
+	msgno = bit + 1;
 	im = &state->map[msgno-1];
 	msgfile.base = 0;
 	msgfile.size = 0;
@@ -1109,8 +1291,9 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
 	if (im->record.system_flags & FLAG_EXPUNGED)
 	    continue;
 
-	if (index_search_evaluate(state, searchargs, msgno, &msgfile)) {
-	    (*msgno_list)[n++] = msgno;
+	if (exact || index_search_evaluate(state, searchargs, msgno, &msgfile)) {
+	    bitvector_set(msgnos, bit);
+	    n++;
 	    if (highestmodseq && im->record.modseq > *highestmodseq) {
 		*highestmodseq = im->record.modseq;
 	    }
@@ -1123,10 +1306,10 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
 
 		if (searchargs->returnopts & SEARCH_RETURN_MAX) {
 		    /* If we want MAX, setup for reverse search */
-		    min = listindex;
+		    min = bit;
 		}
 		/* We're done */
-		listindex = listcount;
+		done = 1;
 		if (highestmodseq)
 		    *highestmodseq = im->record.modseq;
 	    }
@@ -1138,8 +1321,10 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
     }
 
     /* Reverse search.  Stops at previously found MIN (if any) */
-    for (listindex = listcount; listindex > min; listindex--) {
-	msgno = (*msgno_list)[listindex-1];
+    done = 0;
+    for (bit = bitvector_last(&candidates); bit > min && !done;
+	 bit = bit ? bitvector_prev(&candidates, bit - 1) : -1) {
+	msgno = bit + 1;
 	im = &state->map[msgno-1];
 	msgfile.base = 0;
 	msgfile.size = 0;
@@ -1148,13 +1333,14 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
 	if (im->record.system_flags & FLAG_EXPUNGED)
 	    continue;
 
-	if (index_search_evaluate(state, searchargs, msgno, &msgfile)) {
-	    (*msgno_list)[n++] = msgno;
+	if (exact || index_search_evaluate(state, searchargs, msgno, &msgfile)) {
+	    bitvector_set(msgnos, bit);
+	    n++;
 	    if (highestmodseq && im->record.modseq > *highestmodseq) {
 		*highestmodseq = im->record.modseq;
 	    }
 	    /* We only care about MAX, so we're done on first match */
-	    listindex = 0;
+	    done = 1;
 	}
 	if (msgfile.base) {
 	    mailbox_unmap_message(mailbox, im->record.uid,
@@ -1162,11 +1348,8 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
 	}
     }
 
-    /* if we didn't find any matches, free msgno_list */
-    if (!n && *msgno_list) {
-	free(*msgno_list);
-	*msgno_list = NULL;
-    }
+    bitvector_fini(&candidates);
+    search_prefilter_done(state);
 
     return n;
 }
@@ -1181,20 +1364,23 @@ int index_getuidsequence(struct index_state *state,
 			 struct searchargs *searchargs,
 			 unsigned **uid_list)
 {
-    unsigned *msgno_list;
-    int i, n;
+    bitvector_t msgnos;
+    int i, n, bit;
 
-    n = _index_search(&msgno_list, state, searchargs, NULL);
+    n = _index_search(&msgnos, state, searchargs, NULL);
     if (n == 0) {
+	bitvector_fini(&msgnos);
 	*uid_list = NULL;
 	return 0;
     }
 
-    *uid_list = msgno_list;
+    *uid_list = (unsigned *) xmalloc(n * sizeof(unsigned));
 
-    /* filthy in-place replacement */
-    for (i = 0; i < n; i++)
-	(*uid_list)[i] = index_getuid(state, msgno_list[i]);
+    for (i = 0, bit = bitvector_first(&msgnos); i < n;
+	 i++, bit = bitvector_next(&msgnos, bit + 1))
+	(*uid_list)[i] = index_getuid(state, bit + 1);
+
+    bitvector_fini(&msgnos);
 
     return n;
 }
@@ -1243,8 +1429,8 @@ void index_unlock(struct index_state *state)
 int index_search(struct index_state *state, struct searchargs *searchargs,
 		 int usinguid)
 {
-    unsigned *list = NULL;
-    int i, n;
+    bitvector_t msgnos;
+    int bit, n;
     modseq_t highestmodseq = 0;
 
     /* update the index */
@@ -1252,13 +1438,11 @@ int index_search(struct index_state *state, struct searchargs *searchargs,
 	return 0;
 
     /* now do the search */
-    n = _index_search(&list, state, searchargs, 
+    n = _index_search(&msgnos, state, searchargs, 
 		      searchargs->modseq ? &highestmodseq : NULL);
 
-    /* replace the values now */
-    if (usinguid)
-	for (i = 0; i < n; i++)
-	    list[i] = state->map[list[i]-1].record.uid;
+#define SEARCH_NUMBER(bit) \
+    (usinguid ? state->map[(bit)].record.uid : (unsigned) (bit) + 1)
 
     if (searchargs->returnopts) {
 	prot_printf(state->out, "* ESEARCH");
@@ -1268,9 +1452,11 @@ int index_search(struct index_state *state, struct searchargs *searchargs,
 	if (n) {
 	    if (usinguid) prot_printf(state->out, " UID");
 	    if (searchargs->returnopts & SEARCH_RETURN_MIN)
-		prot_printf(state->out, " MIN %u", list[0]);
+		prot_printf(state->out, " MIN %u",
+			    SEARCH_NUMBER(bitvector_first(&msgnos)));
 	    if (searchargs->returnopts & SEARCH_RETURN_MAX)
-		prot_printf(state->out, " MAX %u", list[n-1]);
+		prot_printf(state->out, " MAX %u",
+			    SEARCH_NUMBER(bitvector_last(&msgnos)));
 	    if (highestmodseq)
 		prot_printf(state->out, " MODSEQ " MODSEQ_FMT, highestmodseq);
 	    if (searchargs->returnopts & SEARCH_RETURN_ALL) {
@@ -1279,8 +1465,9 @@ int index_search(struct index_state *state, struct searchargs *searchargs,
 
 		/* Create a sequence-set */
 		seq = seqset_init(0, SEQ_SPARSE);
-		for (i = 0; i < n; i++)
-		    seqset_add(seq, list[i], 1);
+		for (bit = bitvector_first(&msgnos); bit >= 0;
+		     bit = bitvector_next(&msgnos, bit + 1))
+		    seqset_add(seq, SEARCH_NUMBER(bit), 1);
 
 		if (seq->len) {
 		    str = seqset_cstring(seq);
@@ -1298,14 +1485,17 @@ int index_search(struct index_state *state, struct searchargs *searchargs,
     else {
 	prot_printf(state->out, "* SEARCH");
 
-	for (i = 0; i < n; i++)
-	    prot_printf(state->out, " %u", list[i]);
+	for (bit = bitvector_first(&msgnos); bit >= 0;
+	     bit = bitvector_next(&msgnos, bit + 1))
+	    prot_printf(state->out, " %u", SEARCH_NUMBER(bit));
 
 	if (highestmodseq)
 	    prot_printf(state->out, " (MODSEQ " MODSEQ_FMT ")", highestmodseq);
     }
 
-    if (n) free(list);
+#undef SEARCH_NUMBER
+
+    bitvector_fini(&msgnos);
 
     prot_printf(state->out, "\r\n");
 
@@ -1318,7 +1508,7 @@ int index_search(struct index_state *state, struct searchargs *searchargs,
 int index_sort(struct index_state *state, struct sortcrit *sortcrit,
 	       struct searchargs *searchargs, int usinguid)
 {
-    unsigned *msgno_list;
+    bitvector_t msgnos;
     MsgData *msgdata = NULL, *freeme = NULL;
     int nmsg;
     clock_t start;
@@ -1343,15 +1533,14 @@ int index_sort(struct index_state *state, struct sortcrit *sortcrit,
     }
 
     /* Search for messages based on the given criteria */
-    nmsg = _index_search(&msgno_list, state, searchargs,
+    nmsg = _index_search(&msgnos, state, searchargs,
 			 modseq ? &highestmodseq : NULL);
 
     prot_printf(state->out, "* SORT");
 
     if (nmsg) {
 	/* Create/load the msgdata array */
-	freeme = msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit);
-	free(msgno_list);
+	freeme = msgdata = index_msgdata_load(state, &msgnos, nmsg, sortcrit);
 
 	/* Sort the messages based on the given criteria */
 	msgdata = lsort(msgdata,
@@ -1375,6 +1564,7 @@ int index_sort(struct index_state *state, struct sortcrit *sortcrit,
 	/* free the msgdata array */
 	free(freeme);
     }
+    bitvector_fini(&msgnos);
 
     if (highestmodseq)
 	prot_printf(state->out, " (MODSEQ " MODSEQ_FMT ")", highestmodseq);
@@ -1419,7 +1609,7 @@ int index_sort(struct index_state *state, struct sortcrit *sortcrit,
 int index_thread(struct index_state *state, int algorithm,
 		 struct searchargs *searchargs, int usinguid)
 {
-    unsigned *msgno_list;
+    bitvector_t msgnos;
     int nmsg;
     clock_t start;
     modseq_t highestmodseq = 0;
@@ -1432,14 +1622,12 @@ int index_thread(struct index_state *state, int algorithm,
 	start = clock();
 
     /* Search for messages based on the given criteria */
-    nmsg = _index_search(&msgno_list, state, searchargs,
+    nmsg = _index_search(&msgnos, state, searchargs,
 			 searchargs->modseq ? &highestmodseq : NULL);
 
     if (nmsg) {
 	/* Thread messages using given algorithm */
-	(*thread_algs[algorithm].threader)(state, msgno_list, nmsg, usinguid);
-
-	free(msgno_list);
+	(*thread_algs[algorithm].threader)(state, &msgnos, nmsg, usinguid);
 
 	if (highestmodseq)
 	    prot_printf(state->out, " (MODSEQ " MODSEQ_FMT ")", highestmodseq);
@@ -1449,6 +1637,8 @@ int index_thread(struct index_state *state, int algorithm,
     else
 	index_thread_print(state, NULL, usinguid);
 
+    bitvector_fini(&msgnos);
+
     prot_printf(state->out, "\r\n");
 
     if (CONFIG_TIMING_VERBOSE) {
@@ -1668,7 +1858,8 @@ unsigned index_finduid(struct index_state *state, unsigned uid)
 
     while (low <= high) {
 	mid = (high - low)/2 + low;
-	miduid = index_getuid(state, mid);
+	miduid = state->columns ? state->columns->uid[mid-1]
+				: index_getuid(state, mid);
 	if (miduid == uid)
 	    return mid;
 	else if (miduid > uid)
@@ -1769,7 +1960,12 @@ unsigned octet_count;
     /* Non-text literal -- tell the protstream about it */
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 
-    prot_write(state->out, msg_base + offset, n);
+    /* Send large chunks of the message file without copying them */
+    if (msg_base != state->fetch_base || state->fetch_fd == -1 ||
+	n < (unsigned) config_getint(IMAPOPT_FETCH_SENDFILE_MINSIZE) ||
+	prot_sendfile(state->out, state->fetch_fd, offset, n) == 1) {
+	prot_write(state->out, msg_base + offset, n);
+    }
     while (n++ < size) {
 	/* File too short, resynch client.
 	 *
@@ -2327,8 +2523,10 @@ static void index_tellexpunge(struct index_state *state)
 	}
 
 	/* copy back if necessary (after first expunge) */
-	if (msgno < oldmsgno)
+	if (msgno < oldmsgno) {
 	    state->map[msgno-1] = *im;
+	    index_columns_set(state, msgno);
+	}
 
 	msgno++;
     }
@@ -2482,6 +2680,28 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	    prot_printf(state->out, "\r\n");
 	    return 0;
 	}
+
+	/* Large messages may be sent straight from the file */
+	state->fetch_base = msg_base;
+	state->fetch_fd = -1;
+	if (config_getint(IMAPOPT_FETCH_SENDFILE_MINSIZE) > 0 &&
+	    msg_size >= (unsigned long)
+			config_getint(IMAPOPT_FETCH_SENDFILE_MINSIZE) &&
+	    prot_can_sendfile(state->out)) {
+	    struct stat sbuf;
+
+	    state->fetch_fd = open(mailbox_message_fname(mailbox,
+							 im->record.uid),
+				   O_RDONLY, 0);
+	    /* Make sure it's still the file we mapped (a compressed
+	     * file never passes: it's always smaller than the message) */
+	    if (state->fetch_fd != -1 &&
+		(fstat(state->fetch_fd, &sbuf) == -1 ||
+		 (unsigned long) sbuf.st_size != msg_size)) {
+		close(state->fetch_fd);
+		state->fetch_fd = -1;
+	    }
+	}
     }
 
     /* display flags if asked _OR_ if they've changed */
@@ -2685,8 +2905,11 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	/* finsh the response if we have one */
 	prot_printf(state->out, ")\r\n");
     }
-    if (msg_base) 
+    if (msg_base) {
+	if (state->fetch_fd != -1) close(state->fetch_fd);
+	state->fetch_base = NULL;
 	mailbox_unmap_message(mailbox, im->record.uid, &msg_base, &msg_size);
+    }
 
     return r;
 }
@@ -2887,6 +3110,7 @@ static int index_storeflag(struct index_state *state, uint32_t msgno,
     modseq_t oldmodseq;
     struct mailbox *mailbox = state->mailbox;
     struct index_map *im = &state->map[msgno-1];
+    struct index_record record;
     int r;
 
     /* if it's changed already, skip out now */
@@ -2898,6 +3122,9 @@ static int index_storeflag(struct index_state *state, uint32_t msgno,
 
     oldmodseq = im->record.modseq;
 
+    /* work on a copy: the map only sees the change once it's on disk */
+    record = im->record;
+
     /* Change \Seen flag */
     if (state->myrights & ACL_SEEN) {
 	old = im->isseen ? 1 : 0;
@@ -2915,7 +3142,7 @@ static int index_storeflag(struct index_state *state, uint32_t msgno,
 	}
     }
 
-    old = im->record.system_flags;
+    old = record.system_flags;
     new = storeargs->system_flags;
 
     if (storeargs->operation == STORE_REPLACE) {
@@ -2923,26 +3150,26 @@ static int index_storeflag(struct index_state *state, uint32_t msgno,
 	    /* ACL_DELETE handled in index_store() */
 	    if ((old & FLAG_DELETED) != (new & FLAG_DELETED)) {
 		dirty++;
-	        im->record.system_flags = (old & ~FLAG_DELETED) | (new & FLAG_DELETED);
+	        record.system_flags = (old & ~FLAG_DELETED) | (new & FLAG_DELETED);
 	    }
 	}
 	else {
 	    if (!(state->myrights & ACL_DELETEMSG)) {
 		if ((old & ~FLAG_DELETED) != (new & ~FLAG_DELETED)) {
 		    dirty++;
-		    im->record.system_flags = (old & FLAG_DELETED) | (new & ~FLAG_DELETED);
+		    record.system_flags = (old & FLAG_DELETED) | (new & ~FLAG_DELETED);
 		}
 	    }
 	    else {
 		if (old != new) {
 		    dirty++;
-		    im->record.system_flags = new;
+		    record.system_flags = new;
 		}
 	    }
 	    for (i = 0; i < (MAX_USER_FLAGS/32); i++) {
-		if (im->record.user_flags[i] != storeargs->user_flags[i]) {
+		if (record.user_flags[i] != storeargs->user_flags[i]) {
 		    dirty++;
-		    im->record.user_flags[i] = storeargs->user_flags[i];
+		    record.user_flags[i] = storeargs->user_flags[i];
 		}
 	    }
 	}
@@ -2950,24 +3177,24 @@ static int index_storeflag(struct index_state *state, uint32_t msgno,
     else if (storeargs->operation == STORE_ADD) {
 	if (~old & new) {
 	    dirty++;
-	    im->record.system_flags = old | new;
+	    record.system_flags = old | new;
 	}
 	for (i = 0; i < (MAX_USER_FLAGS/32); i++) {
-	    if (~im->record.user_flags[i] & storeargs->user_flags[i]) {
+	    if (~record.user_flags[i] & storeargs->user_flags[i]) {
 		dirty++;
-		im->record.user_flags[i] |= storeargs->user_flags[i];
+		record.user_flags[i] |= storeargs->user_flags[i];
 	    }
 	}
     }
     else { /* STORE_REMOVE */
 	if (old & new) {
 	    dirty++;
-	    im->record.system_flags &= ~storeargs->system_flags;
+	    record.system_flags &= ~storeargs->system_flags;
 	}
 	for (i = 0; i < (MAX_USER_FLAGS/32); i++) {
-	    if (im->record.user_flags[i] & storeargs->user_flags[i]) {
+	    if (record.user_flags[i] & storeargs->user_flags[i]) {
 		dirty++;
-		im->record.user_flags[i] &= ~storeargs->user_flags[i];
+		record.user_flags[i] &= ~storeargs->user_flags[i];
 	    }
 	}
     }
@@ -2990,13 +3217,16 @@ static int index_storeflag(struct index_state *state, uint32_t msgno,
     if (state->internalseen) {
 	/* set the seen flag */
 	if (im->isseen)
-	    im->record.system_flags |= FLAG_SEEN;
+	    record.system_flags |= FLAG_SEEN;
 	else
-	    im->record.system_flags &= ~FLAG_SEEN;
+	    record.system_flags &= ~FLAG_SEEN;
     }
 
-    r = mailbox_rewrite_index_record(mailbox, &im->record);
+    r = mailbox_rewrite_index_record(mailbox, &record);
     if (r) return r;
+    im->record = record;
+
+    index_columns_set(state, msgno);
 
     /* if it's silent and unchanged, update the seen value, but
      * not if qresync is enabled - RFC 4551 says that the MODSEQ
@@ -3162,6 +3392,15 @@ static int index_search_evaluate(struct index_state *state,
 	}
     }
 
+    /* answer BODY and TEXT from the text index if we can */
+    if ((searchargs->body || searchargs->text) && state->searchtext &&
+	!searchargs->header_name &&
+	searchargs->cache_atleast <= im->record.cache_version) {
+	int r = search_text_evaluate(state->searchtext, im->record.uid,
+				     searchargs->body, searchargs->text);
+	if (r >= 0) return r;
+    }
+
     if (searchargs->body || searchargs->text ||
 	searchargs->cache_atleast > im->record.cache_version) {
 	if (!msgfile->size) { /* Map the message in if we haven't before */
@@ -3200,9 +3439,26 @@ static int index_search_evaluate(struct index_state *state,
     return 1;
 }
 
+struct searchmsg_rock {
+    char *substr;
+    comp_pat *pat;
+};
+
+static int searchmsg_cb(int kind, int istop __attribute__((unused)),
+			const char *text, unsigned long len,
+			int charset, int encoding, void *rock)
+{
+    struct searchmsg_rock *sr = (struct searchmsg_rock *) rock;
+
+    if (kind == MESSAGE_TEXT_HEADER)
+	return charset_searchstring(sr->substr, sr->pat, text, len);
+
+    return charset_searchfile(sr->substr, sr->pat, text, len,
+			      charset, encoding);
+}
+
 /*
  * Search part of a message for a substring.
- * Keep this in sync with index_getsearchtextmsg!
  */
 static int
 index_searchmsg(char *substr,
@@ -3211,60 +3467,16 @@ index_searchmsg(char *substr,
 		int skipheader,
 		const char *cachestr)
 {
-    int partsleft = 1;
-    int subparts;
-    unsigned long start;
-    int len, charset, encoding;
-    char *p, *q;
-    
-    /* Won't find anything in a truncated file */
-    if (msgfile->size == 0) return 0;
+    struct searchmsg_rock sr;
 
-    while (partsleft--) {
-	subparts = CACHE_ITEM_BIT32(cachestr);
-	cachestr += 4;
-	if (subparts) {
-	    partsleft += subparts-1;
+    sr.substr = substr;
+    sr.pat = pat;
 
-	    if (skipheader) {
-		skipheader = 0; /* Only skip top-level message header */
-	    }
-	    else {
-		len = CACHE_ITEM_BIT32(cachestr + CACHE_ITEM_SIZE_SKIP);
-		if (len > 0) {
-		    p = index_readheader(msgfile->base, msgfile->size,
-					 CACHE_ITEM_BIT32(cachestr),
-					 len);
-		    q = charset_decode_mimeheader(p, NULL, 0);
-		    if (charset_searchstring(substr, pat, q, strlen(q))) {
-			free(q);
-			return 1;
-		    }
-		    free(q);
-		}
-	    }
-	    cachestr += 5*4;
-
-	    while (--subparts) {
-		start = CACHE_ITEM_BIT32(cachestr+2*4);
-		len = CACHE_ITEM_BIT32(cachestr+3*4);
-		charset = CACHE_ITEM_BIT32(cachestr+4*4) >> 16;
-		encoding = CACHE_ITEM_BIT32(cachestr+4*4) & 0xff;
-
-		if (start < msgfile->size && len > 0 &&
-		    charset >= 0 && charset < 0xffff) {
-		    if (charset_searchfile(substr, pat,
-					   msgfile->base + start,
-					   len, charset, encoding)) return 1;
-		}
-		cachestr += 5*4;
-	    }
-	}
-    }
-
-    return 0;
+    return message_foreach_text_section(msgfile->base, msgfile->size,
+					cachestr, skipheader,
+					searchmsg_cb, &sr);
 }
-    
+
 /*
  * Search named header of a message for a substring
  */
@@ -3333,105 +3545,11 @@ static int index_searchcacheheader(struct index_state *state, uint32_t msgno,
 }
 
 
-/* This code was cribbed from index_searchmsg. Instead of checking for matches,
-   we call charset_extractfile to send the entire text out to 'receiver'.
-   Keep this in sync with index_searchmsg! */
-static void index_getsearchtextmsg(struct index_state *state,
-				   int uid,
-				   index_search_text_receiver_t receiver,
-				   void *rock,
-				   char const *cachestr) {
-  struct mapfile msgfile;
-  int partsleft = 1;
-  int subparts;
-  unsigned long start;
-  int len, charset, encoding;
-  int partcount = 0;
-  char *p, *q;
-  struct mailbox *mailbox = state->mailbox;
-  
-  if (mailbox_map_message(mailbox, uid, &msgfile.base, &msgfile.size)) {
-    return;
-  }
-
-  /* Won't find anything in a truncated file */
-  if (msgfile.size > 0) {
-    while (partsleft--) {
-	subparts = CACHE_ITEM_BIT32(cachestr);
-	cachestr += 4;
-	if (subparts) {
-	    partsleft += subparts-1;
-
-            partcount++;
-
-            len = CACHE_ITEM_BIT32(cachestr+4);
-            if (len > 0) {
-              p = index_readheader(msgfile.base, msgfile.size,
-                                   CACHE_ITEM_BIT32(cachestr),
-                                   len);
-              q = charset_decode_mimeheader(p, NULL, 0);
-              if (partcount == 1) {
-                receiver(uid, SEARCHINDEX_PART_HEADERS,
-                         SEARCHINDEX_CMD_STUFFPART, q, strlen(q), rock);
-                receiver(uid, SEARCHINDEX_PART_BODY,
-                         SEARCHINDEX_CMD_BEGINPART, NULL, 0, rock);
-              } else {
-                receiver(uid, SEARCHINDEX_PART_BODY,
-                         SEARCHINDEX_CMD_APPENDPART, q, strlen(q), rock);
-              }
-              free(q);
-            }
-	    cachestr += 5*4;
-
-	    while (--subparts) {
-		start = CACHE_ITEM_BIT32(cachestr+2*4);
-		len = CACHE_ITEM_BIT32(cachestr+3*4);
-		charset = CACHE_ITEM_BIT32(cachestr+4*4) >> 16;
-		encoding = CACHE_ITEM_BIT32(cachestr+4*4) & 0xff;
-
-		if (start < msgfile.size && len > 0) {
-		  charset_extractfile(receiver, rock, uid,
-				      msgfile.base + start,
-				      len, charset, encoding);
-		}
-		cachestr += 5*4;
-	    }
-	}
-    }
-
-    receiver(uid, SEARCHINDEX_PART_BODY,
-             SEARCHINDEX_CMD_ENDPART, NULL, 0, rock);
-  }
-  
-  mailbox_unmap_message(mailbox, uid, &msgfile.base, &msgfile.size);
-}
-
 void index_getsearchtext_single(struct index_state *state, uint32_t msgno,
 				index_search_text_receiver_t receiver,
 				void *rock) {
-    struct mailbox *mailbox = state->mailbox;
-    struct index_map *im = &state->map[msgno-1];
-
-    if (mailbox_cacherecord(mailbox, &im->record))
-	return;
-
-    index_getsearchtextmsg(state, im->record.uid, receiver, rock,
-	     cacheitem_base(&im->record, CACHE_SECTION));
-    receiver(im->record.uid, SEARCHINDEX_PART_FROM, SEARCHINDEX_CMD_STUFFPART,
-	     cacheitem_base(&im->record, CACHE_FROM),
-	     cacheitem_size(&im->record, CACHE_FROM), rock);
-    receiver(im->record.uid, SEARCHINDEX_PART_TO, SEARCHINDEX_CMD_STUFFPART,
-	     cacheitem_base(&im->record, CACHE_TO),
-	     cacheitem_size(&im->record, CACHE_TO), rock);
-    receiver(im->record.uid, SEARCHINDEX_PART_CC, SEARCHINDEX_CMD_STUFFPART,
-	     cacheitem_base(&im->record, CACHE_CC),
-	     cacheitem_size(&im->record, CACHE_CC), rock);
-    receiver(im->record.uid, SEARCHINDEX_PART_BCC, SEARCHINDEX_CMD_STUFFPART,
-	     cacheitem_base(&im->record, CACHE_BCC),
-	     cacheitem_size(&im->record, CACHE_BCC), rock);
-    receiver(im->record.uid, SEARCHINDEX_PART_SUBJECT, SEARCHINDEX_CMD_STUFFPART,
-	     cacheitem_base(&im->record, CACHE_SUBJECT),
-	     cacheitem_size(&im->record, CACHE_SUBJECT), rock);
+    squat_getsearchtext(state->mailbox, &state->map[msgno-1].record,
+			receiver, rock);
 }
 
 void index_getsearchtext(struct index_state *state,
@@ -3512,11 +3630,11 @@ static int index_copysetup(struct index_state *state, uint32_t msgno,
 #define ANNOTGROWSIZE 10
 
 static MsgData *index_msgdata_load(struct index_state *state,
-				   unsigned *msgno_list, int n,
+				   bitvector_t *msgnos, int n,
 				   struct sortcrit *sortcrit)
 {
     MsgData *md, *cur;
-    int i, j;
+    int i, j, bit;
     char *tmpenv;
     char *envtokens[NUMENVTOKENS];
     int did_cache, did_env, did_conv;
@@ -3531,9 +3649,11 @@ static MsgData *index_msgdata_load(struct index_state *state,
     md = (MsgData *) xmalloc(n * sizeof(MsgData));
     memset(md, 0, n * sizeof(MsgData));
 
+    bit = bitvector_first(msgnos);
     for (i = 0, cur = md; i < n; i++, cur = cur->next) {
 	/* set msgno */
-	cur->msgno = msgno_list[i];
+	cur->msgno = bit + 1;
+	bit = bitvector_next(msgnos, bit + 1);
 	im = &state->map[cur->msgno-1];
 	cur->uid = im->record.uid;
 
@@ -4188,7 +4308,7 @@ static void index_thread_sort(Thread *root, struct sortcrit *sortcrit)
  * Thread a list of messages using the ORDEREDSUBJECT algorithm.
  */
 static void index_thread_orderedsubj(struct index_state *state, 
-				     unsigned *msgno_list, int nmsg,
+				     bitvector_t *msgnos, int nmsg,
 				     int usinguid)
 {
     MsgData *msgdata, *freeme;
@@ -4200,7 +4320,7 @@ static void index_thread_orderedsubj(struct index_state *state,
     Thread *head, *newnode, *cur, *parent, *last;
 
     /* Create/load the msgdata array */
-    freeme = msgdata = index_msgdata_load(state, msgno_list, nmsg, sortcrit);
+    freeme = msgdata = index_msgdata_load(state, msgnos, nmsg, sortcrit);
 
     /* Sort messages by subject and date */
     msgdata = lsort(msgdata,
@@ -4874,7 +4994,7 @@ static void index_thread_search(struct index_state *state,
  * Guts of the REFERENCES algorithms.  Behavior is tweaked with loadcrit[],
  * searchproc() and sortcrit[].
  */
-static void _index_thread_ref(struct index_state *state, unsigned *msgno_list, int nmsg,
+static void _index_thread_ref(struct index_state *state, bitvector_t *msgnos, int nmsg,
 			      struct sortcrit loadcrit[],
 			      int (*searchproc) (MsgData *),
 			      struct sortcrit sortcrit[], int usinguid)
@@ -4886,7 +5006,7 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list, i
     struct rootset rootset;
 
     /* Create/load the msgdata array */
-    freeme = msgdata = index_msgdata_load(state, msgno_list, nmsg, loadcrit);
+    freeme = msgdata = index_msgdata_load(state, msgnos, nmsg, loadcrit);
 
     /* calculate the sum of the number of references for all messages */
     for (md = msgdata, tref = 0; md; md = md->next)
@@ -4959,7 +5079,7 @@ static void _index_thread_ref(struct index_state *state, unsigned *msgno_list, i
 /*
  * Thread a list of messages using the REFERENCES algorithm.
  */
-static void index_thread_ref(struct index_state *state, unsigned *msgno_list, int nmsg, int usinguid)
+static void index_thread_ref(struct index_state *state, bitvector_t *msgnos, int nmsg, int usinguid)
 {
     struct sortcrit loadcrit[] = {{ LOAD_IDS,      0, {{NULL,NULL}} },
 				  { SORT_SUBJECT,  0, {{NULL,NULL}} },
@@ -4968,7 +5088,7 @@ static void index_thread_ref(struct index_state *state, unsigned *msgno_list, in
     struct sortcrit sortcrit[] = {{ SORT_DATE,     0, {{NULL,NULL}} },
 				  { SORT_SEQUENCE, 0, {{NULL,NULL}} }};
 
-    _index_thread_ref(state, msgno_list, nmsg, loadcrit, NULL, sortcrit, usinguid);
+    _index_thread_ref(state, msgnos, nmsg, loadcrit, NULL, sortcrit, usinguid);
 }
 
 /*
@@ -63,6 +63,7 @@
 #include "annotate.h" /* for strlist functionality */
 #include "message_guid.h"
 #include "sequence.h"
+#include "bitvector.h"
 
 /* Special "sort criteria" to load message-id and references/in-reply-to
  * into msgdata array for threaders that need them.
@@ -94,6 +95,24 @@ struct index_map {
     int isrecent:1;
 };
 
+/* Decoded, column-oriented snapshot of the index_map, one slot per
+ * msgno.  system_flags carries the session's view of \Seen (like
+ * index_map.isseen) rather than the on-disk bit. */
+struct index_columns {
+    unsigned alloc;
+    uint32_t *uid;
+    modseq_t *modseq;
+    bit32 *system_flags;
+    bit32 *user_flags;		/* MAX_USER_FLAGS/32 words per message */
+    time_t *internaldate;
+    uint32_t *size;
+};
+
+#define INDEX_COLUMN_USER_FLAGS(cols, msgno) \
+    ((cols)->user_flags + ((msgno)-1) * (MAX_USER_FLAGS/32))
+
+struct search_text;
+
 struct index_state {
     struct mailbox *mailbox;
     unsigned num_records;
@@ -104,6 +123,10 @@ struct index_state {
     modseq_t delayed_modseq;
     struct index_map *map;
     unsigned mapsize;
+    struct index_columns *columns;	/* NULL unless enabled */
+    struct search_text *searchtext;	/* open during a search, if any */
+    const char *fetch_base;	/* message mapped by index_fetchreply() */
+    int fetch_fd;		/* its file if we may sendfile() it, or -1 */
     int internalseen;
     int skipped_expunge;
     int seen_dirty;
@@ -170,7 +193,7 @@ struct rootset {
 
 struct thread_algorithm {
     char *alg_name;
-    void (*threader)(struct index_state *state, unsigned *msgno_list, int nmsg, int usinguid);
+    void (*threader)(struct index_state *state, bitvector_t *msgnos, int nmsg, int usinguid);
 };
 
 struct nntp_overview {
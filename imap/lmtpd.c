@@ -85,6 +85,7 @@
 #include "mboxlist.h"
 #include "mboxname.h"
 #include "message.h"
+#include "msgzip.h"
 #include "mupdate.h"
 #include "notify.h"
 #include "prot.h"
@@ -899,7 +900,7 @@ int deliver(message_data_t *msgdata, char *authuser,
    
     /* cleanup */
     free(status);
-    if (content.base) map_free(&content.base, &content.len);
+    if (content.base) msgzip_unmap(&content.base, &content.len);
     if (content.body) {
 	message_free_body(content.body);
 	free(content.body);
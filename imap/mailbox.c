@@ -72,6 +72,7 @@
 #endif
 
 #include "acl.h"
+#include "blobstore.h"
 #include "assert.h"
 #include "caldav_db.h"
 #include "carddav_db.h"
@@ -85,11 +86,13 @@
 #include "message.h"
 #include "map.h"
 #include "mboxlist.h"
+#include "msgzip.h"
 #include "retry.h"
 #include "seen.h"
 #include "upgrade_index.h"
 #include "util.h"
 #include "sequence.h"
+#include "squat_delta.h"
 #include "statuscache.h"
 #include "sync_log.h"
 #include "webdav_db.h"
@@ -111,8 +114,13 @@ static struct mailboxlist *open_mailboxes = NULL;
                          (m).cache_fd = -1; \
                          (m).header_fd = -1; }
 
+/* appended records are written out when this much is pending, or at
+ * commit, whichever comes first */
+#define PENDING_MAX (1024*1024)
+
 static int mailbox_index_unlink(struct mailbox *mailbox);
 static int mailbox_index_repack(struct mailbox *mailbox);
+static int mailbox_flush_pending(struct mailbox *mailbox);
 
 static struct mailboxlist *create_listitem(const char *name)
 {
@@ -471,6 +479,8 @@ int mailbox_open_cache(struct mailbox *mailbox)
 	if (mailbox->cache_dirty)
 	    abort();
 
+	bitvector_fini(&mailbox->cache_verified);
+
 	fname = mailbox_meta_fname(mailbox, META_CACHE);
 	mailbox->cache_fd = open(fname, O_RDWR, 0);
 	if (mailbox->cache_fd == -1)
@@ -523,6 +533,8 @@ fail:
 	uint32_t offset;
 	char buf[4];
 
+	bitvector_fini(&mailbox->cache_verified);
+
 	/* make sure we have a file */
 	if (mailbox->cache_fd == -1) {
 	    fname = mailbox_meta_fname(mailbox, META_CACHE);
@@ -590,15 +602,28 @@ int mailbox_append_cache(struct mailbox *mailbox,
 	return r; /* unable to append */
     }
 
-    r = cache_append_record(mailbox->cache_fd, record);
-    if (r) {
+    if (record->cache_crc != crc32_buf(cache_buf(record))) {
 	syslog(LOG_ERR, "Failed to append cache to %s for %u",
 	       mailbox->name, record->uid);
-	return r;
+	return IMAP_MAILBOX_CRC;
     }
 
+    /* keep it until the index records go out */
+    if (!mailbox->cache_pending.len) {
+	off_t offset = lseek(mailbox->cache_fd, 0L, SEEK_END);
+	if (offset == -1) {
+	    syslog(LOG_ERR, "IOERROR: seeking cache for %s: %m",
+		   mailbox->name);
+	    return IMAP_IOERROR;
+	}
+	mailbox->cache_pending_offset = offset;
+    }
+    record->cache_offset = mailbox->cache_pending_offset +
+			   mailbox->cache_pending.len;
+    buf_appendmap(&mailbox->cache_pending, cache_base(record),
+		  cache_size(record));
+
     mailbox->cache_dirty = 1;
-    mailbox->need_cache_refresh = 1;
 
     return 0;
 }
@@ -607,6 +632,7 @@ int mailbox_cacherecord(struct mailbox *mailbox,
 			struct index_record *record)
 {
     uint32_t crc;
+    unsigned bit;
     int r = 0;
 
     /* do we already have a record loaded? */
@@ -617,6 +643,13 @@ int mailbox_cacherecord(struct mailbox *mailbox,
 	r = IMAP_IOERROR;
     if (r) goto done;
 
+    /* appended in this transaction and not written out yet */
+    if (mailbox->cache_pending.len &&
+	record->cache_offset >= mailbox->cache_pending_offset) {
+	r = mailbox_flush_pending(mailbox);
+	if (r) goto done;
+    }
+
     r = mailbox_open_cache(mailbox);
     if (r) goto done;
 
@@ -625,9 +658,24 @@ int mailbox_cacherecord(struct mailbox *mailbox,
 			  record->cache_offset, &record->crec);
 
     if (r) goto done;
+
+    /* already checked this session? */
+    bit = record->cache_offset / 4;
+    if (!(record->cache_offset % 4) &&
+	bitvector_isset(&mailbox->cache_verified, bit))
+	goto done;
+
     crc = crc32_buf(cache_buf(record));
-    if (crc != record->cache_crc)
+    if (crc != record->cache_crc) {
 	r = IMAP_MAILBOX_CRC;
+	goto done;
+    }
+
+    if (!(record->cache_offset % 4)) {
+	if (bit >= mailbox->cache_verified.nbits)
+	    bitvector_grow(&mailbox->cache_verified, mailbox->cache_buf.len / 4);
+	bitvector_set(&mailbox->cache_verified, bit);
+    }
 
 done:
     if (r) 
@@ -731,30 +779,25 @@ void mailbox_make_uniqueid(struct mailbox *mailbox)
 
 /*
  * Maps in the content for the message with UID 'uid' in 'mailbox'.
- * Returns map in 'basep' and 'lenp'
+ * Returns map in 'basep' and 'lenp'.  Compressed message files are
+ * returned decompressed.
  */
 int mailbox_map_message(struct mailbox *mailbox, unsigned long uid,
 			const char **basep, unsigned long *lenp)
 {
     int msgfd;
     char *fname;
-    struct stat sbuf;
+    int r;
 
     fname = mailbox_message_fname(mailbox, uid);
 
     msgfd = open(fname, O_RDONLY, 0666);
     if (msgfd == -1) return errno;
 
-    if (fstat(msgfd, &sbuf) == -1) {
-	syslog(LOG_ERR, "IOERROR: fstat on %s: %m", fname);
-	fatal("can't fstat message file", EC_OSFILE);
-    }
-    *basep = 0;
-    *lenp = 0;
-    map_refresh(msgfd, 1, basep, lenp, sbuf.st_size, fname, mailbox->name);
+    r = msgzip_map(msgfd, fname, mailbox->name, basep, lenp);
     close(msgfd);
 
-    return 0;
+    return r;
 }
 
 /*
@@ -764,7 +807,7 @@ void mailbox_unmap_message(struct mailbox *mailbox __attribute__((unused)),
 			   unsigned long uid __attribute__((unused)),
 			   const char **basep, unsigned long *lenp)
 {
-    map_free(basep, lenp);
+    msgzip_unmap(basep, lenp);
 }
 
 static void mailbox_release_resources(struct mailbox *mailbox)
@@ -793,6 +836,10 @@ static void mailbox_release_resources(struct mailbox *mailbox)
     }
     if (mailbox->cache_buf.s)
 	map_free((const char **)&mailbox->cache_buf.s, &mailbox->cache_len);
+
+    buf_free(&mailbox->index_pending);
+    buf_free(&mailbox->cache_pending);
+    bitvector_fini(&mailbox->cache_verified);
 }
 
 int mailbox_mboxlock_reopen(struct mailboxlist *listitem, int locktype)
@@ -1011,6 +1058,11 @@ void mailbox_close(struct mailbox **mailboxptr)
      * when try to upgrade the mboxlock anyway. */
     mailbox_unlock_index(mailbox, NULL);
 
+    /* index what was appended now that other writers can get in;
+     * our shared mboxlock keeps the files from being repacked */
+    if (!in_shutdown && mailbox->squat_delta_uid)
+	squat_delta_update(mailbox, mailbox->squat_delta_uid);
+
     /* do we need to try and clean up? (not if doing a shutdown,
      * speed is probably more important!) */
     if (!in_shutdown && (mailbox->i.options & MAILBOX_CLEANUP_MASK)) {
@@ -1331,6 +1383,48 @@ static int mailbox_refresh_index_map(struct mailbox *mailbox)
     return 0;
 }
 
+/*
+ * Write out the index records and cache entries appended since the
+ * last flush, each with a single write.  The index header isn't
+ * touched, so until the next commit they're invisible to others.
+ */
+static int mailbox_flush_pending(struct mailbox *mailbox)
+{
+    struct buf *pending;
+    int n;
+
+    pending = &mailbox->cache_pending;
+    if (pending->len) {
+	if (lseek(mailbox->cache_fd, mailbox->cache_pending_offset,
+		  SEEK_SET) == -1 ||
+	    (n = retry_write(mailbox->cache_fd, pending->s, pending->len)) == -1 ||
+	    (unsigned) n != pending->len) {
+	    syslog(LOG_ERR, "IOERROR: appending cache records for %s: %m",
+		   mailbox->name);
+	    return IMAP_IOERROR;
+	}
+	buf_reset(pending);
+	mailbox->need_cache_refresh = 1;
+    }
+
+    pending = &mailbox->index_pending;
+    if (pending->len) {
+	if (lseek(mailbox->index_fd, mailbox->index_size, SEEK_SET) == -1 ||
+	    (n = retry_write(mailbox->index_fd, pending->s, pending->len)) == -1 ||
+	    (unsigned) n != pending->len) {
+	    syslog(LOG_ERR, "IOERROR: appending index records for %s: %m",
+		   mailbox->name);
+	    return IMAP_IOERROR;
+	}
+	mailbox->index_size += pending->len;
+	buf_reset(pending);
+
+	return mailbox_refresh_index_map(mailbox);
+    }
+
+    return 0;
+}
+
 static int mailbox_read_index_header(struct mailbox *mailbox)
 {
     int r;
@@ -1423,15 +1517,22 @@ int mailbox_read_index_record(struct mailbox *mailbox,
 
     offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
 
-    if (offset + mailbox->i.record_size > mailbox->index_size) {
+    if (offset + mailbox->i.record_size <= mailbox->index_size) {
+	buf = mailbox->index_base + offset;
+    }
+    else if (offset >= mailbox->index_size &&
+	     offset - mailbox->index_size + INDEX_RECORD_SIZE <=
+	     mailbox->index_pending.len) {
+	/* appended but not written out yet */
+	buf = mailbox->index_pending.s + (offset - mailbox->index_size);
+    }
+    else {
 	syslog(LOG_ERR,
 	       "IOERROR: index record %u for %s past end of file",
 	       recno, mailbox->name);
 	return IMAP_IOERROR;
     }
 
-    buf = mailbox->index_base + offset;
-
     r = mailbox_buf_to_index_record(buf, record);
 
     if (!r) record->recno = recno;
@@ -1439,6 +1540,30 @@ int mailbox_read_index_record(struct mailbox *mailbox,
     return r;
 }
 
+/*
+ * Refresh an already decoded index record from the mailbox.  If the
+ * record CRC on disk still matches the one we decoded, the record
+ * hasn't been rewritten and is left alone (including any parsed
+ * cache record), saving the full decode and CRC check.
+ */
+int mailbox_refresh_index_record(struct mailbox *mailbox,
+				 struct index_record *record)
+{
+    const char *buf;
+    unsigned offset;
+
+    offset = mailbox->i.start_offset +
+	     (record->recno-1) * mailbox->i.record_size;
+
+    if (offset + mailbox->i.record_size <= mailbox->index_size) {
+	buf = mailbox->index_base + offset;
+	if (ntohl(*((bit32 *)(buf+OFFSET_RECORD_CRC))) == record->record_crc)
+	    return 0;
+    }
+
+    return mailbox_read_index_record(mailbox, record->recno, record);
+}
+
 /*
  * bsearch() function to compare two index record buffers by UID
  */
@@ -1460,11 +1585,17 @@ static int rec_compar(const void *key, const void *mem)
 int mailbox_find_index_record(struct mailbox *mailbox, uint32_t uid,
 			      struct index_record *record)
 {
-    const void *mem, *base = mailbox->index_base + mailbox->i.start_offset;
+    const void *mem, *base;
     size_t num_records = mailbox->i.num_records;
     size_t size = mailbox->i.record_size;
     int r;
 
+    if (mailbox->index_pending.len) {
+	r = mailbox_flush_pending(mailbox);
+	if (r) return r;
+    }
+    base = mailbox->index_base + mailbox->i.start_offset;
+
     mem =  bsearch(&uid, base, num_records, size, rec_compar);
     if (!mem) return CYRUSDB_NOTFOUND;
 
@@ -1849,7 +1980,10 @@ int mailbox_commit(struct mailbox *mailbox)
     static unsigned char buf[INDEX_HEADER_SIZE];
     int n, r;
 
-    /* try to commit sub parts first */
+    /* write out any appends, then commit sub parts */
+    r = mailbox_flush_pending(mailbox);
+    if (r) return r;
+
     r = mailbox_commit_cache(mailbox);
     if (r) return r;
 
@@ -2431,6 +2565,12 @@ int mailbox_rewrite_index_record(struct mailbox *mailbox,
     assert(record->recno > 0 &&
 	   record->recno <= mailbox->i.num_records);
 
+    /* records are rewritten in place, so appends must be out first */
+    if (mailbox->index_pending.len) {
+	r = mailbox_flush_pending(mailbox);
+	if (r) return r;
+    }
+
     r = mailbox_read_index_record(mailbox, record->recno, &oldrecord);
     if (r) return r;
 
@@ -2482,7 +2622,7 @@ int mailbox_rewrite_index_record(struct mailbox *mailbox,
 
     mailbox_update_indexes(mailbox, &oldrecord, record);
 
-    mailbox_index_record_to_buf(record, buf);
+    record->record_crc = mailbox_index_record_to_buf(record, buf);
 
     offset = mailbox->i.start_offset +
 	     (record->recno-1) * mailbox->i.record_size;
@@ -2528,7 +2668,6 @@ int mailbox_append_index_record(struct mailbox *mailbox,
     unsigned char *buf = ibuf.buf;
     size_t offset;
     int r;
-    int n;
     struct utimbuf settime;
     uint32_t recno;
 
@@ -2594,30 +2733,21 @@ int mailbox_append_index_record(struct mailbox *mailbox,
     /* add counts */
     mailbox_update_indexes(mailbox, NULL, record);
 
-    mailbox_index_record_to_buf(record, buf);
+    record->record_crc = mailbox_index_record_to_buf(record, buf);
 
     recno = mailbox->i.num_records + 1;
 
     offset = mailbox->i.start_offset +
 	     ((recno - 1) * mailbox->i.record_size);
 
-    n = lseek(mailbox->index_fd, offset, SEEK_SET);
-    if (n == -1) {
-	syslog(LOG_ERR, "IOERROR: seeking to append for %s: %m",
-	       mailbox->name);
-	return IMAP_IOERROR;
-    }
-
-    n = retry_write(mailbox->index_fd, buf, INDEX_RECORD_SIZE);
-    if (n != INDEX_RECORD_SIZE) {
-	syslog(LOG_ERR, "IOERROR: appending index record for %s: %m",
-	       mailbox->name);
-	return IMAP_IOERROR;
-    }
+    /* written out with the rest of the batch, see
+     * mailbox_flush_pending() */
+    assert(offset == mailbox->index_size + mailbox->index_pending.len);
+    buf_appendmap(&mailbox->index_pending, (const char *) buf,
+		  INDEX_RECORD_SIZE);
 
     mailbox->i.last_uid = record->uid;
     mailbox->i.num_records = recno;
-    mailbox->index_size += INDEX_RECORD_SIZE;
 
     if (config_auditlog)
 	syslog(LOG_NOTICE, "auditlog: append sessionid=<%s> mailbox=<%s> uniqueid=<%s> uid=<%u> guid=<%s>",
@@ -2646,19 +2776,26 @@ int mailbox_append_index_record(struct mailbox *mailbox,
 		   record->uid);
     }
 
-    return mailbox_refresh_index_map(mailbox);
+    if (mailbox->index_pending.len + mailbox->cache_pending.len >= PENDING_MAX)
+	return mailbox_flush_pending(mailbox);
+
+    return 0;
 }
 
-static void mailbox_message_unlink(struct mailbox *mailbox, uint32_t uid)
+static void mailbox_message_unlink(struct mailbox *mailbox,
+				   struct index_record *record)
 {
-    const char *fname = mailbox_message_fname(mailbox, uid);
+    const char *fname = mailbox_message_fname(mailbox, record->uid);
 
     /* no error, we removed a file */
     if (unlink(fname) == 0) {
 	if (config_auditlog)
 	    syslog(LOG_NOTICE, "auditlog: unlink sessionid=<%s> "
 		   "mailbox=<%s> uniqueid=<%s> uid=<%u>",
-		   session_id(), mailbox->name, mailbox->uniqueid, uid);
+		   session_id(), mailbox->name, mailbox->uniqueid,
+		   record->uid);
+	if (blobstore_enabled())
+	    blobstore_release(mailbox->part, &record->guid);
     }
 }
 
@@ -2679,7 +2816,7 @@ static int mailbox_index_unlink(struct mailbox *mailbox)
 	if (r) return r;
 
 	if (record.system_flags & FLAG_UNLINKED)
-	    mailbox_message_unlink(mailbox, record.uid);
+	    mailbox_message_unlink(mailbox, &record);
     }
 
     /* need to clear the flag, even if nothing needed unlinking! */
@@ -2868,7 +3005,7 @@ static int mailbox_index_repack(struct mailbox *mailbox)
 	if (record.system_flags & FLAG_UNLINKED) {
 	    /* just in case it was left lying around */
 	    /* XXX - log error if unlink fails */
-	    mailbox_message_unlink(mailbox, record.uid);
+	    mailbox_message_unlink(mailbox, &record);
 	    if (record.modseq > repack->i.deletedmodseq)
 		repack->i.deletedmodseq = record.modseq;
 	    continue;
@@ -3399,6 +3536,8 @@ static struct meta_file meta_files[] = {
     { META_INDEX,  0, 1 },
     { META_CACHE,  0, 1 },
     { META_SQUAT,  1, 0 },
+    { META_SEARCH, 1, 0 },
+    { META_SQUATDELTA, 1, 0 },
     { 0, 0, 0 }
 };
 
@@ -3410,8 +3549,13 @@ int mailbox_copy_files(struct mailbox *mailbox, const char *newpart,
     struct meta_file *mf;
     uint32_t recno;
     struct index_record record;
+    int compress;
     int r;
 
+    /* moving onto a partition which compresses: msgzip_file() leaves
+       hard links alone, so copy the messages to compress them */
+    compress = strcmp(newpart, mailbox->part) && msgzip_enabled(newpart);
+
     /* make initial paths */
     path = mboxname_datapath(newpart, newname, 0);
     cyrus_mkdir(path, 0755);
@@ -3449,8 +3593,10 @@ int mailbox_copy_files(struct mailbox *mailbox, const char *newpart,
 	strncpy(newbuf, mboxname_datapath(newpart, newname, record.uid),
 		MAX_MAILBOX_PATH);
 
-	r = mailbox_copyfile(oldbuf, newbuf, 0);
+	r = mailbox_copyfile(oldbuf, newbuf, compress);
 	if (r) return r;
+
+	if (compress) msgzip_file(newpart, newbuf);
     }
 
     return 0;
@@ -4048,7 +4194,8 @@ static int mailbox_reconstruct_compare_update(struct mailbox *mailbox,
 
     /* does the file actually exist? */
     if (have_file && do_stat) {
-    	if (stat(fname, &sbuf) == -1 || (sbuf.st_size == 0)) {
+	/* the index has the uncompressed size */
+    	if (msgzip_stat(fname, &sbuf) == -1 || (sbuf.st_size == 0)) {
 	    have_file = 0;
 	}
 	else if (record->size != (unsigned) sbuf.st_size) {
@@ -4332,6 +4479,11 @@ static int mailbox_wipe_index_record(struct mailbox *mailbox,
     assert(record->recno > 0 &&
 	   record->recno <= mailbox->i.num_records);
 
+    if (mailbox->index_pending.len) {
+	n = mailbox_flush_pending(mailbox);
+	if (n) return n;
+    }
+
     record->uid = 0;
     record->system_flags |= FLAG_EXPUNGED | FLAG_UNLINKED;
 
@@ -51,6 +51,7 @@
 #include <config.h>
 
 #include "auth.h"
+#include "bitvector.h"
 #include "byteorder64.h"
 #include "message_guid.h"
 #include "prot.h"
@@ -77,6 +78,8 @@
 #define FNAME_SQUAT "/cyrus.squat"
 #define FNAME_EXPUNGE "/cyrus.expunge"
 #define FNAME_DAV "/cyrus.dav"
+#define FNAME_SEARCH "/cyrus.search"
+#define FNAME_SQUATDELTA "/cyrus.squat.delta"
 
 enum meta_filename {
   META_HEADER = 1,
@@ -84,7 +87,9 @@ enum meta_filename {
   META_CACHE,
   META_SQUAT,
   META_EXPUNGE,
-  META_DAV
+  META_DAV,
+  META_SEARCH,
+  META_SQUATDELTA
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -203,6 +208,17 @@ struct mailbox {
     size_t index_size;
     int need_cache_refresh;
 
+    /* appended records and their cache entries not yet written out;
+     * they follow index_size and cache_pending_offset respectively */
+    struct buf index_pending;
+    struct buf cache_pending;
+    unsigned long cache_pending_offset;
+
+    /* cache records (by offset/4) whose CRC has already been checked
+     * since the cache file was opened; it is append-only, so they
+     * can't change underneath us */
+    bitvector_t cache_verified;
+
     /* Information in mailbox list */
     char *name;
     int mbtype;
@@ -224,6 +240,7 @@ struct mailbox {
     int has_changed;
     time_t last_updated; /* for appends*/
     quota_t quota_previously_used; /* for quota change */
+    uint32_t squat_delta_uid; /* first uid for the SQUAT delta at close */
 };
 
 /* Offsets of index/expunge header fields
@@ -455,6 +472,8 @@ extern void mailbox_modseq_dirty(struct mailbox *mailbox);
 extern int mailbox_read_index_record(struct mailbox *mailbox,
 				     uint32_t recno,
 				     struct index_record *record);
+extern int mailbox_refresh_index_record(struct mailbox *mailbox,
+				        struct index_record *record);
 extern int mailbox_rewrite_index_record(struct mailbox *mailbox,
 				        struct index_record *record);
 extern int mailbox_append_index_record(struct mailbox *mailbox,
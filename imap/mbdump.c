@@ -73,6 +73,7 @@
 #include "mbdump.h"
 #include "mboxkey.h"
 #include "mboxlist.h"
+#include "msgzip.h"
 #include "quota.h"
 #include "retry.h"
 #include "seen.h"
@@ -89,6 +90,9 @@ static int dump_file(int first, int sync,
 		     struct protstream *pin, struct protstream *pout,
 		     const char *filename, const char *ftag,
 		     const char *fbase, unsigned long flen);
+static int send_file(int first, int sync,
+		     struct protstream *pin, struct protstream *pout,
+		     const char *ftag, const char *base, unsigned long len);
 
 /* support for downgrading index files on copying back to an
  * earlier version of Cyrus */
@@ -384,11 +388,10 @@ static int dump_file(int first, int sync,
 		     const char *filename, const char *ftag,
 		     const char *fbase, unsigned long flen)
 {
-    int filefd;
+    int filefd, r;
     const char *base;
     unsigned long len;
     struct stat sbuf;
-    char c;
 
     /* map file */
     syslog(LOG_DEBUG, "wanting to dump %s", filename);
@@ -429,7 +432,47 @@ static int dump_file(int first, int sync,
 	close(filefd);
     }
 
-    /* send: name, size, and contents */
+    r = send_file(first, sync, pin, pout, ftag, base, len);
+    if (!fbase) map_free(&base, &len);
+
+    return r;
+}
+
+/* message files may be compressed on disk (see msgzip.h), but the
+   other end is sent the message itself */
+static int dump_message(int sync,
+			struct protstream *pin, struct protstream *pout,
+			const char *filename, const char *ftag)
+{
+    const char *base = NULL;
+    unsigned long len = 0;
+    int filefd, r;
+
+    syslog(LOG_DEBUG, "wanting to dump %s", filename);
+    filefd = open(filename, O_RDONLY, 0666);
+    if (filefd == -1) {
+	if (errno == ENOENT) return 0;
+	syslog(LOG_ERR, "IOERROR: open on %s: %m", filename);
+	return IMAP_SYS_ERROR;
+    }
+
+    r = msgzip_map(filefd, filename, NULL, &base, &len);
+    close(filefd);
+    if (r) return IMAP_IOERROR;
+
+    r = send_file(0, sync, pin, pout, ftag, base, len);
+    msgzip_unmap(&base, &len);
+
+    return r;
+}
+
+/* send: name, size, and contents */
+static int send_file(int first, int sync,
+		     struct protstream *pin, struct protstream *pout,
+		     const char *ftag, const char *base, unsigned long len)
+{
+    char c;
+
     if (first) {
 	prot_printf(pout, " {" SIZE_T_FMT "}\r\n", strlen(ftag));
 
@@ -452,7 +495,6 @@ static int dump_file(int first, int sync,
 		    ftag, len, (sync ? "+" : ""));
     }
     prot_write(pout, base, len);
-    if (!fbase) map_free(&base, &len);
 
     return 0;
 }
@@ -592,7 +634,7 @@ int dump_mailbox(const char *tag, struct mailbox *mailbox, uint32_t uid_start,
 	/* construct path/filename */
 	fname = mailbox_message_fname(mailbox, uid);
 
-	r = dump_file(0, !tag, pin, pout, fname, name, NULL, 0);
+	r = dump_message(!tag, pin, pout, fname, name);
 	if (r) goto done;
     }
 
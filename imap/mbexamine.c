@@ -90,6 +90,7 @@
 #include "message_guid.h"
 #include "mboxname.h"
 #include "mboxlist.h"
+#include "msgzip.h"
 #include "seen.h"
 #include "retry.h"
 #include "util.h"
@@ -402,7 +403,7 @@ int do_quota(char *name,
 
 	fname = mailbox_message_fname(mailbox, record.uid);
 
-	if (stat(fname, &sbuf) != 0) {
+	if (msgzip_stat(fname, &sbuf) != 0) {
 	    syslog(LOG_WARNING,
 		   "Can not open message file %s -- skipping\n", fname);
 	    continue;
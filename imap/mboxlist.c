@@ -54,6 +54,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <syslog.h>
@@ -65,13 +66,16 @@
 #include "annotate.h"
 #include "auth.h"
 #include "bsearch.h"
+#include "cyr_lock.h"
 #include "glob.h"
+#include "hash.h"
 #include "assert.h"
 #include "global.h"
 #include "cyrusdb.h"
 #include "util.h"
 #include "mailbox.h"
 #include "exitcodes.h"
+#include "retry.h"
 #include "imap_err.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -82,6 +86,7 @@
 #include "mupdate-client.h"
 
 #include "mboxlist.h"
+#include "mboxlist_shard.h"
 #include "quota.h"
 #include "sync_log.h"
 
@@ -216,6 +221,170 @@ uint32_t mboxlist_string_to_mbtype(const char *string)
     return mbtype;
 }
 
+/*
+ * Per-process cache of decoded mailbox list entries.
+ *
+ * Whoever changes the mailbox list bumps a counter kept in a small
+ * shared file ("<mboxlist>.GEN") after committing.  A process only
+ * trusts its cache while that counter is the same as when the cached
+ * entries were read; otherwise the whole cache is thrown away.
+ */
+struct lookup_entry {
+    char *name;
+    int r;			/* 0 or IMAP_MAILBOX_NONEXISTENT */
+    int mbtype;
+    char *partition;
+    char *acl;
+    struct lookup_entry *prev;	/* most recently used first */
+    struct lookup_entry *next;
+};
+
+static hash_table lookup_table;
+static struct lookup_entry *lookup_head, *lookup_tail;
+static int lookup_count, lookup_max;
+static uint64_t lookup_gen;
+
+static char *lookup_genfname;
+static int lookup_genfd = -1;
+static const volatile uint64_t *lookup_genmap;
+
+static void lookup_free(void *data)
+{
+    struct lookup_entry *e = (struct lookup_entry *) data;
+
+    free(e->name);
+    free(e->partition);
+    free(e->acl);
+    free(e);
+}
+
+static void lookup_flush(void)
+{
+    if (!lookup_count) return;
+
+    free_hash_table(&lookup_table, lookup_free);
+    construct_hash_table(&lookup_table, lookup_max, 0);
+    lookup_head = lookup_tail = NULL;
+    lookup_count = 0;
+}
+
+static void lookup_unlink(struct lookup_entry *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else lookup_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else lookup_tail = e->prev;
+}
+
+static void lookup_push(struct lookup_entry *e)
+{
+    e->prev = NULL;
+    e->next = lookup_head;
+    if (lookup_head) lookup_head->prev = e;
+    else lookup_tail = e;
+    lookup_head = e;
+}
+
+static void lookup_insert(const char *name, int r, int mbtype,
+			  const char *partition, const char *acl)
+{
+    struct lookup_entry *e;
+
+    if (lookup_count >= lookup_max) {
+	e = lookup_tail;
+	lookup_unlink(e);
+	hash_del(e->name, &lookup_table);
+	lookup_free(e);
+	lookup_count--;
+    }
+
+    e = xzmalloc(sizeof(struct lookup_entry));
+    e->name = xstrdup(name);
+    e->r = r;
+    e->mbtype = mbtype;
+    e->partition = xstrdup(partition);
+    e->acl = xstrdup(acl);
+
+    hash_insert(name, e, &lookup_table);
+    lookup_push(e);
+    lookup_count++;
+}
+
+/* map the generation file, creating it if 'create' */
+static int lookup_genopen(int create)
+{
+    struct stat sbuf;
+    void *base;
+    int fd;
+
+    fd = open(lookup_genfname, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd == -1) {
+	if (create || errno != ENOENT) {
+	    syslog(LOG_ERR, "IOERROR: opening %s: %m", lookup_genfname);
+	}
+	return -1;
+    }
+
+    if (fstat(fd, &sbuf) == -1 ||
+	(sbuf.st_size < (off_t) sizeof(uint64_t) &&
+	 ftruncate(fd, sizeof(uint64_t)) == -1)) {
+	syslog(LOG_ERR, "IOERROR: sizing %s: %m", lookup_genfname);
+	close(fd);
+	return -1;
+    }
+
+    base = mmap((caddr_t)0, sizeof(uint64_t), PROT_READ, MAP_SHARED, fd, 0L);
+    if (base == MAP_FAILED) {
+	syslog(LOG_ERR, "IOERROR: mapping %s: %m", lookup_genfname);
+	close(fd);
+	return -1;
+    }
+
+    lookup_genfd = fd;
+    lookup_genmap = (const volatile uint64_t *) base;
+
+    return 0;
+}
+
+static void lookup_genclose(void)
+{
+    if (lookup_genmap) {
+	munmap((caddr_t) lookup_genmap, sizeof(uint64_t));
+	lookup_genmap = NULL;
+    }
+    if (lookup_genfd != -1) {
+	close(lookup_genfd);
+	lookup_genfd = -1;
+    }
+}
+
+/*
+ * Tell every process's lookup cache that the mailbox list has changed.
+ * Call it after a change has been committed.
+ */
+void mboxlist_changed(void)
+{
+    uint64_t gen;
+
+    /* only processes with a cache create the file, so look for it
+       again in case one has done so since we opened the list */
+    if (!lookup_genfname) return;
+    if (!lookup_genmap && lookup_genopen(0)) return;
+
+    if (lock_blocking(lookup_genfd) < 0) {
+	syslog(LOG_ERR, "IOERROR: locking %s: %m", lookup_genfname);
+	return;
+    }
+
+    gen = *lookup_genmap + 1;
+    if (lseek(lookup_genfd, 0, SEEK_SET) == -1 ||
+	retry_write(lookup_genfd, &gen, sizeof(gen)) != sizeof(gen)) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", lookup_genfname);
+    }
+
+    lock_unlock(lookup_genfd);
+}
+
 static int mboxlist_mylookup(const char *name, struct mboxlist_entry *entry,
 			     struct txn **tid, int wrlock)
 {
@@ -228,8 +397,38 @@ static int mboxlist_mylookup(const char *name, struct mboxlist_entry *entry,
     char *p, *q;
     int datalen;
     int mbtype;
+    int cacheable = 0;
+    struct lookup_entry *e = NULL;
+
+    /* changes made in a transaction aren't anyone else's business yet */
+    if (lookup_max > 0 && !tid && !wrlock) {
+	cacheable = 1;
+
+	if (*lookup_genmap != lookup_gen) {
+	    lookup_flush();
+	    lookup_gen = *lookup_genmap;
+	}
+
+	e = (struct lookup_entry *) hash_lookup(name, &lookup_table);
+	if (e) {
+	    if (e != lookup_head) {
+		lookup_unlink(e);
+		lookup_push(e);
+	    }
+	    if (e->r) return e->r;
+
+	    mbtype = e->mbtype;
+	    strlcpy(partition, e->partition, sizeof(partition));
+	    data = e->acl;
+	    acllen = strlen(data);
+	    goto found;
+	}
+    }
 
     r = mboxlist_read(name, &data, &datalen, tid, wrlock);
+    if (r == IMAP_MAILBOX_NONEXISTENT && cacheable) {
+	lookup_insert(name, r, 0, "", "");
+    }
     if (r) return r;
 
     /* copy out interesting parts */
@@ -247,13 +446,20 @@ static int mboxlist_mylookup(const char *name, struct mboxlist_entry *entry,
     p++;
 
     acllen = datalen - (p - data);
+    data = p;
+
+ found:
     if (acllen >= aclresultalloced) {
 	aclresultalloced = acllen + 100;
 	aclresult = xrealloc(aclresult, aclresultalloced);
     }
-    memcpy(aclresult, p, acllen);
+    memcpy(aclresult, data, acllen);
     aclresult[acllen] = '\0';
 
+    if (cacheable && !e) {
+	lookup_insert(name, 0, mbtype, partition, aclresult);
+    }
+
     if (entry) {
 	entry->name = name;
 	entry->partition = partition;
@@ -341,6 +547,7 @@ int mboxlist_update(const char *name, int mbtype,
 	    r2 = DB->abort(mbdb, tid);
 	} else {
 	    r2 = DB->commit(mbdb, tid);
+	    if (!r2) mboxlist_changed();
 	}
     }
 
@@ -677,6 +884,7 @@ int mboxlist_createmailbox_full(const char *name, int mbtype,
 	       name, cyrusdb_strerror(r));
 	r = IMAP_IOERROR;
     }
+    else mboxlist_changed();
 
     /* 9. set MUPDATE entry as commited (CRASH: commited) */
     if (!r && config_mupdate_server && !localonly) {
@@ -690,6 +898,7 @@ int mboxlist_createmailbox_full(const char *name, int mbtype,
 	    syslog(LOG_ERR,
 		   "MUPDATE: can't commit mailbox entry for '%s'", name);
 	    DB->delete(mbdb, name, strlen(name), NULL, 0);
+	    mboxlist_changed();
 	}
 	if (mupdate_h) mupdate_disconnect(&mupdate_h);
     }
@@ -766,6 +975,8 @@ int mboxlist_insertremote(const char *name, int mbtype,
     r = DB->store(mbdb, name, strlen(name), mboxent, strlen(mboxent), tid);
     switch (r) {
     case CYRUSDB_OK:
+	/* otherwise it's committed with mboxlist_commit() */
+	if (!tid) mboxlist_changed();
 	break;
     case CYRUSDB_AGAIN:
 	abort(); /* shouldn't happen ! */
@@ -841,6 +1052,7 @@ int mboxlist_deleteremote(const char *name, struct txn **in_tid)
 		   cyrusdb_strerror(r));
 	    r = IMAP_IOERROR;
 	}
+	else mboxlist_changed();
 	tid = NULL;
     }
 
@@ -1026,6 +1238,7 @@ int mboxlist_deletemailbox(const char *name, int isadmin,
 	r = IMAP_IOERROR;
 	if (!force) goto done;
     }
+    else mboxlist_changed();
     if (r && !force) goto done;
 
     /* delete underlying mailbox */
@@ -1218,6 +1431,7 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
 	r = IMAP_IOERROR;
 	goto done;
     }
+    mboxlist_changed();
 
     if (!local_only && config_mupdate_server) {
 	/* commit the mailbox in MUPDATE */
@@ -1475,6 +1689,7 @@ int mboxlist_setacl(const char *name, const char *identifier,
 		   cyrusdb_strerror(r));
 	    r = IMAP_IOERROR;
 	}
+	else mboxlist_changed();
 	tid = NULL;
     }
 
@@ -1576,6 +1791,7 @@ mboxlist_sync_setacls(const char *name, const char *newacl)
 		   name, cyrusdb_strerror(r));
 	    r = IMAP_IOERROR;
 	}
+	else mboxlist_changed();
 	tid = NULL;
     }
 
@@ -2027,10 +2243,9 @@ int mboxlist_findall(struct namespace *namespace,
 
 	cbrock.find_namespace = NAMESPACE_INBOX;
 	/* iterate through prefixes matching usermboxname */
-	r = DB->foreach(mbdb,
-			usermboxname, usermboxnamelen,
-			&find_p, &find_cb, &cbrock,
-			NULL);
+	r = cyrusdb_foreach_snapshot(DB, mbdb,
+				     usermboxname, usermboxnamelen,
+				     &find_p, &find_cb, &cbrock);
 
 	free(cbrock.prev);
 	cbrock.prev = NULL;
@@ -2051,10 +2266,9 @@ int mboxlist_findall(struct namespace *namespace,
 	/* search for all remaining mailboxes.
 	   just bother looking at the ones that have the same pattern
 	   prefix. */
-	r = DB->foreach(mbdb,
-			domainpat, domainlen + prefixlen,
-			&find_p, &find_cb, &cbrock,
-			NULL);
+	r = cyrusdb_foreach_snapshot(DB, mbdb,
+				     domainpat, domainlen + prefixlen,
+				     &find_p, &find_cb, &cbrock);
 
 	free(cbrock.prev);
 	cbrock.prev = NULL;
@@ -2169,10 +2383,9 @@ int mboxlist_findall_alt(struct namespace *namespace,
 	cbrock.find_namespace = NAMESPACE_INBOX;
 
 	/* iterate through prefixes matching usermboxname */
-	DB->foreach(mbdb,
-		    usermboxname, usermboxnamelen,
-		    &find_p, &find_cb, &cbrock,
-		    NULL);
+	cyrusdb_foreach_snapshot(DB, mbdb,
+				 usermboxname, usermboxnamelen,
+				 &find_p, &find_cb, &cbrock);
 
 	free(cbrock.prev);
 	cbrock.prev = NULL;
@@ -2213,10 +2426,9 @@ int mboxlist_findall_alt(struct namespace *namespace,
 
 	    /* iterate through prefixes matching usermboxname */
 	    strlcpy(domainpat+domainlen, "user", sizeof(domainpat)-domainlen);
-	    DB->foreach(mbdb,
-			domainpat, strlen(domainpat),
-			&find_p, &find_cb, &cbrock,
-			NULL);
+	    cyrusdb_foreach_snapshot(DB, mbdb,
+				     domainpat, strlen(domainpat),
+				     &find_p, &find_cb, &cbrock);
 
 	    glob_free(&cbrock.g);
 	    free(cbrock.prev);
@@ -2266,20 +2478,18 @@ int mboxlist_findall_alt(struct namespace *namespace,
 		}
 
 		domainpat[domainlen] = '\0';
-		DB->foreach(mbdb,
-			    domainpat, domainlen,
-			    &find_p, &find_cb, &cbrock,
-			    NULL);
+		cyrusdb_foreach_snapshot(DB, mbdb,
+					 domainpat, domainlen,
+					 &find_p, &find_cb, &cbrock);
 	    }
 	    else if (pattern[len] == '.') {
 		strlcpy(domainpat+domainlen, pattern+len+1,
 			sizeof(domainpat)-domainlen);
 		cbrock.g = glob_init(domainpat, GLOB_HIERARCHY);
 
-		DB->foreach(mbdb,
-			    domainpat, domainlen+prefixlen-(len+1),
-			    &find_p, &find_cb, &cbrock,
-			NULL);
+		cyrusdb_foreach_snapshot(DB, mbdb,
+					 domainpat, domainlen+prefixlen-(len+1),
+					 &find_p, &find_cb, &cbrock);
 	    }
 	    free(cbrock.prev);
 	    cbrock.prev = NULL;
@@ -2604,6 +2814,18 @@ void mboxlist_open(const char *fname)
     if (config_getswitch(IMAPOPT_IMPROVED_MBOXLIST_SORT)) {
 	flags |= CYRUSDB_MBOXSORT;
     }
+    if (config_getswitch(IMAPOPT_MBOXLIST_DB_GROUP_COMMIT)) {
+	flags |= CYRUSDB_GROUPCOMMIT;
+    }
+
+    /* a sharded mailbox list is checked as it's opened, but once
+       mboxlist_db_shards is off we'd quietly start an empty one */
+    if (config_getint(IMAPOPT_MBOXLIST_DB_SHARDS) <= 1 &&
+	(ret = mboxlist_shard_count(fname)) != 0) {
+	syslog(LOG_ERR, "DBERROR: %s is split into shards, "
+	       "but mboxlist_db_shards is off", fname);
+	fatal("can't read mailboxes file", EC_TEMPFAIL);
+    }
 
     ret = (DB->open)(fname, flags, &mbdb);
     if (ret != 0) {
@@ -2614,11 +2836,48 @@ void mboxlist_open(const char *fname)
 	fatal("can't read mailboxes file", EC_TEMPFAIL);
     }    
 
+    lookup_genfname = strconcat(fname, ".GEN", (char *)NULL);
+    lookup_max = config_getint(IMAPOPT_MBOXLIST_LOOKUP_CACHE);
+    if (lookup_max > 0 && lookup_genopen(1)) lookup_max = 0;
+    if (lookup_max > 0) {
+	construct_hash_table(&lookup_table, lookup_max, 0);
+	lookup_gen = *lookup_genmap;
+    }
+
     free(tofree);
 
     mboxlist_dbopen = 1;
 }
 
+int mboxlist_load_begin(const char *fname, struct cyrusdb_load **loadp)
+{
+    int r, flags = 0;
+    char *tofree = NULL;
+
+    if (!fname)
+	fname = config_getstring(IMAPOPT_MBOXLIST_DB_PATH);
+
+    /* create db file name */
+    if (!fname) {
+	tofree = strconcat(config_dir, FNAME_MBOXLIST, (char *)NULL);
+	fname = tofree;
+    }
+
+    if (config_getswitch(IMAPOPT_IMPROVED_MBOXLIST_SORT)) {
+	flags |= CYRUSDB_MBOXSORT;
+    }
+
+    r = cyrusdb_load_begin(DB, fname, flags, loadp);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: loading %s: %s", fname,
+	       cyrusdb_strerror(r));
+    }
+
+    free(tofree);
+
+    return r;
+}
+
 void mboxlist_close(void)
 {
     int r;
@@ -2629,6 +2888,14 @@ void mboxlist_close(void)
 	    syslog(LOG_ERR, "DBERROR: error closing mailboxes: %s",
 		   cyrusdb_strerror(r));
 	}
+	if (lookup_max > 0) {
+	    free_hash_table(&lookup_table, lookup_free);
+	    lookup_head = lookup_tail = NULL;
+	    lookup_count = lookup_max = 0;
+	}
+	lookup_genclose();
+	free(lookup_genfname);
+	lookup_genfname = NULL;
 	mboxlist_dbopen = 0;
     }
 }
@@ -2802,10 +3069,9 @@ int mboxlist_findsub(struct namespace *namespace,
 
 	cbrock.find_namespace = NAMESPACE_INBOX;
 	/* iterate through prefixes matching usermboxname */
-	SUBDB->foreach(subs,
-		       usermboxname, usermboxnamelen,
-		       &find_p, &find_cb, &cbrock,
-		       NULL);
+	cyrusdb_foreach_snapshot(SUBDB, subs,
+				 usermboxname, usermboxnamelen,
+				 &find_p, &find_cb, &cbrock);
 	free(cbrock.prev);
 	cbrock.prev = NULL;
 	cbrock.prevlen = 0;
@@ -2830,8 +3096,9 @@ int mboxlist_findsub(struct namespace *namespace,
 	}
 	/* search for all remaining mailboxes.
 	   just bother looking at the ones that have the same pattern prefix. */
-	SUBDB->foreach(subs, domainpat, domainlen + prefixlen,
-		       &find_p, &find_cb, &cbrock, NULL);
+	cyrusdb_foreach_snapshot(SUBDB, subs,
+				 domainpat, domainlen + prefixlen,
+				 &find_p, &find_cb, &cbrock);
 	free(cbrock.prev);
 	cbrock.prev = NULL;
 	cbrock.prevlen = 0;
@@ -2965,10 +3232,9 @@ int mboxlist_findsub_alt(struct namespace *namespace,
 	cbrock.find_namespace = NAMESPACE_INBOX;
 
 	/* iterate through prefixes matching usermboxname */
-	SUBDB->foreach(subs,
-		       usermboxname, usermboxnamelen,
-		       &find_p, &find_cb, &cbrock,
-		       NULL);
+	cyrusdb_foreach_snapshot(SUBDB, subs,
+				 usermboxname, usermboxnamelen,
+				 &find_p, &find_cb, &cbrock);
 	free(cbrock.prev);
 	cbrock.prev = NULL;
 	cbrock.prevlen = 0;
@@ -3016,10 +3282,9 @@ int mboxlist_findsub_alt(struct namespace *namespace,
 	
 	    /* iterate through prefixes matching usermboxname */
 	    strlcpy(domainpat+domainlen, "user", sizeof(domainpat)-domainlen);
-	    SUBDB->foreach(subs,
-			   domainpat, strlen(domainpat),
-			   &find_p, &find_cb, &cbrock,
-			   NULL);
+	    cyrusdb_foreach_snapshot(SUBDB, subs,
+				     domainpat, strlen(domainpat),
+				     &find_p, &find_cb, &cbrock);
 	    free(cbrock.prev);
 	    cbrock.prev = NULL;
 	    cbrock.prevlen = 0;
@@ -3070,10 +3335,9 @@ int mboxlist_findsub_alt(struct namespace *namespace,
 		}
 
 		domainpat[domainlen] = '\0';
-		SUBDB->foreach(subs,
-			       domainpat, domainlen,
-			       &find_p, &find_cb, &cbrock,
-			       NULL);
+		cyrusdb_foreach_snapshot(SUBDB, subs,
+					 domainpat, domainlen,
+					 &find_p, &find_cb, &cbrock);
 		free(cbrock.prev);
 		cbrock.prev = NULL;
 		cbrock.prevlen = 0;
@@ -3083,10 +3347,9 @@ int mboxlist_findsub_alt(struct namespace *namespace,
 		        sizeof(domainpat)-domainlen);
 		cbrock.g = glob_init(domainpat, GLOB_HIERARCHY);
 
-		SUBDB->foreach(subs,
-			       domainpat, domainlen+prefixlen-(len+1),
-			       &find_p, &find_cb, &cbrock,
-			       NULL);
+		cyrusdb_foreach_snapshot(SUBDB, subs,
+					 domainpat, domainlen+prefixlen-(len+1),
+					 &find_p, &find_cb, &cbrock);
 		free(cbrock.prev);
 		cbrock.prev = NULL;
 		cbrock.prevlen = 0;
@@ -3173,9 +3436,14 @@ int mboxlist_changesub(const char *name, const char *userid,
 /* Transaction Handlers */
 int mboxlist_commit(struct txn *tid) 
 {
+    int r;
+
     assert(tid);
     
-    return DB->commit(mbdb, tid);
+    r = DB->commit(mbdb, tid);
+    if (!r) mboxlist_changed();
+
+    return r;
 }
 
 int mboxlist_abort(struct txn *tid) 
@@ -217,6 +217,14 @@ void mboxlist_open(const char *name);
 /* close the database */
 void mboxlist_close(void);
 
+/* build a new mailboxes db from entries in mailbox list order, which
+   replaces the old one when done (see cyrusdb_load_begin()) */
+int mboxlist_load_begin(const char *name, struct cyrusdb_load **loadp);
+
+/* tell every process's lookup cache that the mailbox list has changed,
+   for callers that change the db directly */
+void mboxlist_changed(void);
+
 /* initialize database structures */
 #define MBOXLIST_SYNC 0x02
 void mboxlist_init(int flags);
@@ -0,0 +1,938 @@
+/* mboxlist_shard.c -- the mailbox list spread over several databases
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "bsearch.h"
+#include "cyr_lock.h"
+#include "cyrusdb.h"
+#include "global.h"
+#include "mboxlist_shard.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* the backend holding the shards, and how many of them there are */
+static struct cyrusdb_backend *base;
+static int nshards;
+
+/* the databases in 'shard' are the underlying backend's own */
+struct db {
+    struct db **shard;
+    int (*compar) (const char *s1, int l1, const char *s2, int l2);
+};
+
+/* a change made in a transaction, kept in case its shards have to be
+   locked again */
+struct shard_op {
+    enum { OP_CREATE, OP_STORE, OP_DELETE } type;
+    int shard;
+    char *key;
+    int keylen;
+    char *data;
+    int datalen;
+    int force;
+};
+
+/* a transaction on each shard it has touched so far, and its changes */
+struct txn {
+    struct txn **sub;
+    int top;			/* highest shard locked, or -1 */
+    struct shard_op *ops;
+    int nops;
+    int opsalloc;
+};
+
+struct bulkload {
+    struct cyrusdb_load **load;
+};
+
+static int compare(const char *s1, int l1, const char *s2, int l2)
+{
+    int min = l1 < l2 ? l1 : l2;
+    int cmp = 0;
+
+    while (min-- > 0 && (cmp = *s1 - *s2) == 0) {
+	s1++;
+	s2++;
+    }
+    if (min >= 0) {
+	return cmp;
+    } else {
+	if (l1 > l2) return 1;
+	else if (l2 > l1) return -1;
+	else return 0;
+    }
+}
+
+static char *shard_fname(const char *fname, int i)
+{
+    char *ret = xmalloc(strlen(fname) + 5);
+
+    sprintf(ret, "%s.%d", fname, i);
+    return ret;
+}
+
+/* which shard holds 'key': the domain plus "user.<name>", or plus the
+   top level folder for shared mailboxes, decide.  a deleted mailbox
+   goes with the mailbox it was.  'complete' is set if every key
+   starting with 'key' belongs in the same shard, which tells foreach()
+   whether it has to look at them all. */
+static int shardof(const char *key, int keylen, int *complete)
+{
+    const char *deletedprefix = config_getstring(IMAPOPT_DELETEDPREFIX);
+    int deletedlen = deletedprefix ? strlen(deletedprefix) : 0;
+    const char *end = key + keylen;
+    const char *name = key, *p;
+    bit32 hash = 2166136261U;	/* FNV-1a */
+    int hasdomain = 0;
+
+    if (config_virtdomains && (p = memchr(key, '!', keylen))) {
+	name = p + 1;
+	hasdomain = 1;
+    }
+
+    if (deletedlen && end - name > deletedlen &&
+	!strncmp(name, deletedprefix, deletedlen) &&
+	name[deletedlen] == '.') {
+	name += deletedlen + 1;
+    }
+
+    p = name;
+    if (end - p >= 5 && !strncmp(p, "user.", 5)) p += 5;
+    p = memchr(p, '.', end - p);
+
+    /* with virtual domains, a prefix without a domain might yet turn
+       out to be the start of one */
+    *complete = p && (hasdomain || !config_virtdomains);
+
+    if (hasdomain) {
+	for (; *key != '!'; key++) {
+	    hash = (hash ^ (unsigned char) *key) * 16777619U;
+	}
+    }
+    for (end = p ? p : end; name < end; name++) {
+	hash = (hash ^ (unsigned char) *name) * 16777619U;
+    }
+
+    return hash % nshards;
+}
+
+static int redo(struct db *db, struct txn *tid, const struct shard_op *op)
+{
+    struct txn **sub = &tid->sub[op->shard];
+
+    switch (op->type) {
+    case OP_CREATE:
+	return base->create(db->shard[op->shard], op->key, op->keylen,
+			    op->data, op->datalen, sub);
+    case OP_STORE:
+	return base->store(db->shard[op->shard], op->key, op->keylen,
+			   op->data, op->datalen, sub);
+    case OP_DELETE:
+	return base->delete(db->shard[op->shard], op->key, op->keylen,
+			    sub, op->force);
+    }
+
+    return CYRUSDB_INTERNAL;
+}
+
+/* give up every shard 'tid' holds, take them and shard 'want' again in
+   ascending order, and redo its changes.  anything it read before may
+   have changed in between; the callers which change more than one
+   user's mailboxes at once hold those mailboxes' own locks. */
+static int relock(struct db *db, struct txn *tid, int want)
+{
+    char *wanted = xzmalloc(nshards);
+    const char *data;
+    int datalen;
+    int i, r = 0;
+
+    wanted[want] = 1;
+    for (i = 0; i < nshards; i++) {
+	if (!tid->sub[i]) continue;
+	wanted[i] = 1;
+	base->abort(db->shard[i], tid->sub[i]);
+	tid->sub[i] = NULL;
+    }
+
+    /* any lookup in a transaction locks the shard */
+    tid->top = -1;
+    for (i = 0; !r && i < nshards; i++) {
+	if (!wanted[i]) continue;
+	r = base->fetch(db->shard[i], "", 0, &data, &datalen, &tid->sub[i]);
+	if (r == CYRUSDB_NOTFOUND) r = 0;
+	tid->top = i;
+    }
+    free(wanted);
+
+    for (i = 0; !r && i < tid->nops; i++) {
+	r = redo(db, tid, tid->ops + i);
+    }
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: relocking mailbox list shards: %s",
+	       cyrusdb_strerror(r));
+    }
+
+    return r;
+}
+
+/* the transaction on shard 'i' for 'tidptr' (NULL if none), in 'ret'.
+   shards are always locked in ascending order, so that transactions
+   which span shards (renaming a user, say) can't deadlock: one which
+   already holds a higher shard starts again from the bottom. */
+static int subtid(struct db *db, struct txn **tidptr, int i,
+		  struct txn ***ret)
+{
+    struct txn *tid;
+    int r = 0;
+
+    *ret = NULL;
+    if (!tidptr) return 0;
+
+    if (!*tidptr) {
+	*tidptr = xzmalloc(sizeof(struct txn));
+	(*tidptr)->sub = xzmalloc(nshards * sizeof(struct txn *));
+	(*tidptr)->top = -1;
+    }
+    tid = *tidptr;
+
+    if (!tid->sub[i] && i < tid->top) r = relock(db, tid, i);
+    if (r) return r;
+
+    if (i > tid->top) tid->top = i;
+    *ret = &tid->sub[i];
+
+    return 0;
+}
+
+/* remember a change 'tidptr' has made, in case relock() needs it */
+static void log_op(struct txn **tidptr, int type, int shard,
+		   const char *key, int keylen,
+		   const char *data, int datalen, int force)
+{
+    struct txn *tid = *tidptr;
+    struct shard_op *op;
+
+    if (tid->nops == tid->opsalloc) {
+	tid->opsalloc = tid->opsalloc ? 2 * tid->opsalloc : 8;
+	tid->ops = xrealloc(tid->ops, tid->opsalloc * sizeof(*op));
+    }
+    op = &tid->ops[tid->nops++];
+
+    op->type = type;
+    op->shard = shard;
+    op->key = xmalloc(keylen + datalen + 1);
+    memcpy(op->key, key, keylen);
+    op->keylen = keylen;
+    op->data = op->key + keylen;
+    if (datalen) memcpy(op->data, data, datalen);
+    op->datalen = datalen;
+    op->force = force;
+}
+
+static void free_txn(struct txn *tid)
+{
+    int i;
+
+    for (i = 0; i < tid->nops; i++) {
+	free(tid->ops[i].key);
+    }
+    free(tid->ops);
+    free(tid->sub);
+    free(tid);
+}
+
+static int myinit(const char *dbdir, int myflags)
+{
+    return base->init(dbdir, myflags);
+}
+
+static int mydone(void)
+{
+    return base->done();
+}
+
+static int mysync(void)
+{
+    return base->sync();
+}
+
+/* archive the shards in place of the files we're asked for */
+static int myarchive(const char **fnames, const char *dirname)
+{
+    const char **shards;
+    int n, i, j, r;
+
+    for (n = 0; fnames[n]; n++);
+    shards = xmalloc((n * nshards + 1) * sizeof(char *));
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < nshards; j++) {
+	    shards[i * nshards + j] = shard_fname(fnames[i], j);
+	}
+    }
+    shards[n * nshards] = NULL;
+
+    r = base->archive(shards, dirname);
+
+    for (i = 0; i < n * nshards; i++) {
+	free((char *) shards[i]);
+    }
+    free(shards);
+
+    return r;
+}
+
+struct split_rock {
+    struct cyrusdb_load **load;
+};
+
+static int split_cb(void *rock,
+		    const char *key, int keylen,
+		    const char *data, int datalen)
+{
+    struct split_rock *sr = (struct split_rock *) rock;
+    int complete;
+
+    return cyrusdb_load_add(sr->load[shardof(key, keylen, &complete)],
+			    key, keylen, data, datalen);
+}
+
+/* the first time we're opened on an unsharded mailbox list, split it
+   up.  shard 0 is written last, so once it exists the job's done; the
+   old file is then renamed out of the way.
+
+   the backend takes and drops its own locks on the old file as it
+   reads it, and fcntl() locks belong to the process, so a lock on the
+   old file itself wouldn't last.  splitters lock <fname>.SPLIT, which
+   nothing else opens, instead. */
+static int split_unsharded(const char *fname, int flags)
+{
+    struct stat sbuf;
+    struct split_rock sr;
+    struct cyrusdb_backend *from = base;
+    struct db *olddb = NULL;
+    const char *detected;
+    char *name, *lockname;
+    int fd, i, r = 0;
+
+    name = shard_fname(fname, 0);
+    if (!stat(name, &sbuf) || stat(fname, &sbuf) == -1) {
+	/* done already, or nothing to do */
+	free(name);
+	return 0;
+    }
+
+    lockname = strconcat(fname, ".SPLIT", (char *) NULL);
+    fd = open(lockname, O_RDWR | O_CREAT, 0644);
+    if (fd == -1 || lock_blocking(fd) == -1) {
+	syslog(LOG_ERR, "IOERROR: locking %s: %m", lockname);
+	if (fd != -1) close(fd);
+	free(lockname);
+	free(name);
+	return CYRUSDB_IOERROR;
+    }
+
+    /* did somebody else beat us to it? */
+    if (!stat(name, &sbuf)) goto done;
+    if (stat(fname, &sbuf) == -1 || sbuf.st_size == 0) goto done;
+
+    syslog(LOG_NOTICE, "splitting %s into %d shards", fname, nshards);
+
+    detected = cyrusdb_detect(fname);
+    if (detected) from = cyrusdb_fromname(detected);
+
+    sr.load = xzmalloc(nshards * sizeof(struct cyrusdb_load *));
+    r = from->open(fname, flags & ~CYRUSDB_CREATE, &olddb);
+    for (i = 0; !r && i < nshards; i++) {
+	char *shardname = shard_fname(fname, i);
+	r = cyrusdb_load_begin(base, shardname, flags, &sr.load[i]);
+	free(shardname);
+    }
+    if (!r) r = from->foreach(olddb, "", 0, NULL, &split_cb, &sr, NULL);
+
+    /* shard 0 last */
+    for (i = nshards - 1; i >= 0; i--) {
+	if (!sr.load[i]) continue;
+	if (!r) r = cyrusdb_load_end(sr.load[i], 1);
+	else cyrusdb_load_end(sr.load[i], 0);
+    }
+    free(sr.load);
+    if (olddb) from->close(olddb);
+
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: splitting %s: %s", fname,
+	       cyrusdb_strerror(r));
+	goto done;
+    }
+
+    free(name);
+    name = strconcat(fname, ".unsharded", (char *) NULL);
+    if (rename(fname, name) == -1) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", fname);
+    }
+
+    /* anyone still waiting for the lock will find shard 0 there */
+    unlink(lockname);
+
+ done:
+    close(fd);
+    free(lockname);
+    free(name);
+
+    return r;
+}
+
+int mboxlist_shard_count(const char *fname)
+{
+    char *markname = strconcat(fname, ".SHARDS", (char *) NULL);
+    char buf[32];
+    int fd, len, n = 0;
+
+    fd = open(markname, O_RDONLY, 0);
+    if (fd != -1) {
+	len = read(fd, buf, sizeof(buf) - 1);
+	buf[len > 0 ? len : 0] = '\0';
+	n = atoi(buf);
+	if (n <= 0) n = -1;
+	close(fd);
+    }
+    else if (errno != ENOENT) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", markname);
+	n = -1;
+    }
+    free(markname);
+
+    return n;
+}
+
+/* write <fname>.SHARDS, unless somebody else has */
+static int record_nshards(const char *fname)
+{
+    char *markname = strconcat(fname, ".SHARDS", (char *) NULL);
+    char *tmpname = xmalloc(strlen(markname) + 20);
+    char buf[32];
+    int fd, len, r = 0;
+
+    sprintf(tmpname, "%s.%d", markname, (int) getpid());
+    len = snprintf(buf, sizeof(buf), "%d\n", nshards);
+
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || retry_write(fd, buf, len) != len || fsync(fd) == -1 ||
+	(link(tmpname, markname) == -1 && errno != EEXIST)) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", markname);
+	r = CYRUSDB_IOERROR;
+    }
+    if (fd != -1) close(fd);
+    unlink(tmpname);
+    free(tmpname);
+    free(markname);
+
+    return r;
+}
+
+/* with a different number of shards every key would be looked for in
+   the wrong one, so refuse to open shards made for another number.
+   the first to open them records it. */
+static int check_nshards(const char *fname, int flags)
+{
+    int n = mboxlist_shard_count(fname);
+
+    if (!n && (flags & CYRUSDB_CREATE)) {
+	int r = record_nshards(fname);
+	if (r) return r;
+	n = mboxlist_shard_count(fname);
+    }
+
+    if (n && n != nshards) {
+	syslog(LOG_ERR, "DBERROR: %s is split into %d shards, "
+	       "but mboxlist_db_shards asks for %d", fname, n, nshards);
+	return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+static int myclose(struct db *db);
+
+static int myopen(const char *fname, int flags, struct db **ret)
+{
+    struct db *db;
+    int i, r;
+
+    db = xzmalloc(sizeof(struct db));
+    db->shard = xzmalloc(nshards * sizeof(struct db *));
+    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare : compare;
+
+    r = split_unsharded(fname, flags);
+    if (!r) r = check_nshards(fname, flags);
+    for (i = 0; !r && i < nshards; i++) {
+	char *shardname = shard_fname(fname, i);
+	r = base->open(shardname, flags, &db->shard[i]);
+	free(shardname);
+    }
+
+    if (r) {
+	myclose(db);
+	return r;
+    }
+
+    *ret = db;
+    return 0;
+}
+
+static int myclose(struct db *db)
+{
+    int i, r = 0, r2;
+
+    for (i = 0; i < nshards; i++) {
+	if (!db->shard[i]) continue;
+	r2 = base->close(db->shard[i]);
+	if (!r) r = r2;
+    }
+    free(db->shard);
+    free(db);
+
+    return r;
+}
+
+static int fetch(struct db *db,
+		 const char *key, int keylen,
+		 const char **data, int *datalen,
+		 struct txn **tidptr)
+{
+    struct txn **sub;
+    int complete;
+    int i = shardof(key, keylen, &complete);
+    int r = subtid(db, tidptr, i, &sub);
+
+    if (r) return r;
+
+    return base->fetch(db->shard[i], key, keylen, data, datalen, sub);
+}
+
+static int fetchlock(struct db *db,
+		     const char *key, int keylen,
+		     const char **data, int *datalen,
+		     struct txn **tidptr)
+{
+    struct txn **sub;
+    int complete;
+    int i = shardof(key, keylen, &complete);
+    int r = subtid(db, tidptr, i, &sub);
+
+    if (r) return r;
+
+    return base->fetchlock(db->shard[i], key, keylen, data, datalen, sub);
+}
+
+/* the records from one shard that the caller's predicate accepts */
+struct copy_rock {
+    foreach_p *goodp;
+    void *rock;
+    struct buf copy;
+};
+
+/* gathers the records from one shard, each as key size, data size,
+   key, data */
+static int copy_cb(void *rock,
+		   const char *key, int keylen,
+		   const char *data, int datalen)
+{
+    struct copy_rock *cr = (struct copy_rock *) rock;
+    struct buf *copy = &cr->copy;
+    int lens[2];
+
+    if (cr->goodp && !cr->goodp(cr->rock, key, keylen, data, datalen))
+	return 0;
+
+    lens[0] = keylen;
+    lens[1] = datalen;
+    buf_appendmap(copy, (char *) lens, sizeof(lens));
+    buf_appendmap(copy, key, keylen);
+    buf_appendmap(copy, data, datalen);
+
+    return 0;
+}
+
+/* a prefix that could be in any shard: gather what 'goodp' accepts
+   from each, then merge them in order.  shards the transaction (if
+   any) already holds are read in it, so it sees its own changes; the
+   rest are read from a snapshot.  no shard is locked for the
+   transaction here: taking them all at once, whatever order its
+   other operations took theirs in, could deadlock with another
+   process. */
+static int merged_foreach(struct db *db,
+			  char *prefix, int prefixlen,
+			  foreach_p *goodp,
+			  foreach_cb *cb, void *rock,
+			  struct txn **tidptr)
+{
+    struct copy_rock *copy = xzmalloc(nshards * sizeof(struct copy_rock));
+    const char **pos = xzmalloc(nshards * sizeof(const char *));
+    const char *key, *data;
+    int lens[2], best[2];
+    int i, next, r = 0;
+
+    for (i = 0; !r && i < nshards; i++) {
+	copy[i].goodp = goodp;
+	copy[i].rock = rock;
+	if (tidptr && *tidptr && (*tidptr)->sub[i]) {
+	    r = base->foreach(db->shard[i], prefix, prefixlen, NULL,
+			      &copy_cb, &copy[i], &(*tidptr)->sub[i]);
+	} else {
+	    r = cyrusdb_foreach_snapshot(base, db->shard[i],
+					 prefix, prefixlen, NULL,
+					 &copy_cb, &copy[i]);
+	}
+	pos[i] = copy[i].copy.s;
+    }
+
+    while (!r) {
+	next = -1;
+	for (i = 0; i < nshards; i++) {
+	    if (pos[i] == copy[i].copy.s + copy[i].copy.len) continue;
+	    memcpy(lens, pos[i], sizeof(lens));
+	    if (next == -1 ||
+		db->compar(pos[i] + sizeof(lens), lens[0],
+			   pos[next] + sizeof(best), best[0]) < 0) {
+		next = i;
+		memcpy(best, lens, sizeof(best));
+	    }
+	}
+	if (next == -1) break;
+
+	key = pos[next] + sizeof(best);
+	data = key + best[0];
+	pos[next] = data + best[1];
+
+	r = cb(rock, key, best[0], data, best[1]);
+    }
+
+    for (i = 0; i < nshards; i++) {
+	buf_free(&copy[i].copy);
+    }
+    free(copy);
+    free(pos);
+
+    return r;
+}
+
+static int myforeach(struct db *db,
+		     char *prefix, int prefixlen,
+		     foreach_p *goodp,
+		     foreach_cb *cb, void *rock,
+		     struct txn **tidptr)
+{
+    struct txn **sub;
+    int complete;
+    int i = shardof(prefix, prefixlen, &complete);
+    int r;
+
+    if (!complete) {
+	return merged_foreach(db, prefix, prefixlen, goodp, cb, rock, tidptr);
+    }
+
+    r = subtid(db, tidptr, i, &sub);
+    if (r) return r;
+
+    return base->foreach(db->shard[i], prefix, prefixlen, goodp, cb, rock,
+			 sub);
+}
+
+static int myforeach_snapshot(struct db *db,
+			      char *prefix, int prefixlen,
+			      foreach_p *goodp,
+			      foreach_cb *cb, void *rock)
+{
+    int complete;
+    int i = shardof(prefix, prefixlen, &complete);
+
+    if (!complete) {
+	return merged_foreach(db, prefix, prefixlen, goodp, cb, rock, NULL);
+    }
+
+    return cyrusdb_foreach_snapshot(base, db->shard[i], prefix, prefixlen,
+				    goodp, cb, rock);
+}
+
+static int create(struct db *db,
+		  const char *key, int keylen,
+		  const char *data, int datalen,
+		  struct txn **tidptr)
+{
+    struct txn **sub;
+    int complete;
+    int i = shardof(key, keylen, &complete);
+    int r = subtid(db, tidptr, i, &sub);
+
+    if (!r) r = base->create(db->shard[i], key, keylen, data, datalen, sub);
+    if (!r && tidptr) {
+	log_op(tidptr, OP_CREATE, i, key, keylen, data, datalen, 0);
+    }
+
+    return r;
+}
+
+static int store(struct db *db,
+		 const char *key, int keylen,
+		 const char *data, int datalen,
+		 struct txn **tidptr)
+{
+    struct txn **sub;
+    int complete;
+    int i = shardof(key, keylen, &complete);
+    int r = subtid(db, tidptr, i, &sub);
+
+    if (!r) r = base->store(db->shard[i], key, keylen, data, datalen, sub);
+    if (!r && tidptr) {
+	log_op(tidptr, OP_STORE, i, key, keylen, data, datalen, 0);
+    }
+
+    return r;
+}
+
+static int delete(struct db *db,
+		  const char *key, int keylen,
+		  struct txn **tidptr, int force)
+{
+    struct txn **sub;
+    int complete;
+    int i = shardof(key, keylen, &complete);
+    int r = subtid(db, tidptr, i, &sub);
+
+    if (!r) r = base->delete(db->shard[i], key, keylen, sub, force);
+    if (!r && tidptr) {
+	log_op(tidptr, OP_DELETE, i, key, keylen, NULL, 0, force);
+    }
+
+    return r;
+}
+
+/* each shard commits on its own: should one fail, the ones after it
+   are aborted, but those before it stand.  only a transaction which
+   spans users (renaming a user, say) can be caught like that, so say
+   which shards it was left applied to. */
+static int mycommit(struct db *db, struct txn *tid)
+{
+    struct buf done = BUF_INITIALIZER, undone = BUF_INITIALIZER;
+    int i, r = 0;
+
+    for (i = 0; i < nshards; i++) {
+	if (!tid->sub[i]) continue;
+
+	if (!r) {
+	    r = base->commit(db->shard[i], tid->sub[i]);
+	    buf_printf(r ? &undone : &done, " %d", i);
+	} else {
+	    base->abort(db->shard[i], tid->sub[i]);
+	    buf_printf(&undone, " %d", i);
+	}
+    }
+
+    if (r && done.len) {
+	buf_cstring(&done);
+	buf_cstring(&undone);
+	syslog(LOG_ERR, "DBERROR: mailbox list transaction only partly "
+	       "committed: shards%s committed, shards%s not: %s",
+	       done.s, undone.s, cyrusdb_strerror(r));
+    }
+    buf_free(&done);
+    buf_free(&undone);
+    free_txn(tid);
+
+    return r;
+}
+
+static int myabort(struct db *db, struct txn *tid)
+{
+    int i, r = 0, r2;
+
+    for (i = 0; i < nshards; i++) {
+	if (!tid->sub[i]) continue;
+
+	r2 = base->abort(db->shard[i], tid->sub[i]);
+	if (!r) r = r2;
+    }
+    free_txn(tid);
+
+    return r;
+}
+
+static int dump(struct db *db, int detail)
+{
+    int i, r = 0;
+
+    if (!base->dump) return 0;
+
+    for (i = 0; !r && i < nshards; i++) {
+	printf("shard %d:\n", i);
+	r = base->dump(db->shard[i], detail);
+    }
+
+    return r;
+}
+
+static int consistent(struct db *db)
+{
+    int i, r = 0;
+
+    if (!base->consistent) return 0;
+
+    for (i = 0; !r && i < nshards; i++) {
+	r = base->consistent(db->shard[i]);
+    }
+
+    return r;
+}
+
+static int bulkload_end(struct bulkload *bl, int commit);
+
+static int bulkload_begin(const char *fname, int flags,
+			  struct bulkload **ret)
+{
+    struct bulkload *bl;
+    int i, r = 0;
+
+    bl = xmalloc(sizeof(struct bulkload));
+    bl->load = xzmalloc(nshards * sizeof(struct cyrusdb_load *));
+
+    for (i = 0; !r && i < nshards; i++) {
+	char *shardname = shard_fname(fname, i);
+	r = cyrusdb_load_begin(base, shardname, flags, &bl->load[i]);
+	free(shardname);
+    }
+
+    if (r) {
+	bulkload_end(bl, 0);
+	return r;
+    }
+
+    *ret = bl;
+    return 0;
+}
+
+static int bulkload_add(struct bulkload *bl,
+			const char *key, int keylen,
+			const char *data, int datalen)
+{
+    int complete;
+
+    return cyrusdb_load_add(bl->load[shardof(key, keylen, &complete)],
+			    key, keylen, data, datalen);
+}
+
+static int bulkload_end(struct bulkload *bl, int commit)
+{
+    int i, r = 0, r2;
+
+    for (i = nshards - 1; i >= 0; i--) {
+	if (!bl->load[i]) continue;
+
+	r2 = cyrusdb_load_end(bl->load[i], commit && !r);
+	if (!r) r = r2;
+    }
+    free(bl->load);
+    free(bl);
+
+    return r;
+}
+
+static struct cyrusdb_backend mboxlist_shards =
+{
+    NULL,			/* name: the underlying backend's */
+
+    &myinit,
+    &mydone,
+    &mysync,
+    &myarchive,
+
+    &myopen,
+    &myclose,
+
+    &fetch,
+    &fetchlock,
+    &myforeach,
+    &create,
+    &store,
+    &delete,
+
+    &mycommit,
+    &myabort,
+
+    &dump,
+    &consistent,
+
+    &bulkload_begin,
+    &bulkload_add,
+    &bulkload_end,
+
+    &myforeach_snapshot
+};
+
+struct cyrusdb_backend *mboxlist_shard_backend(
+    struct cyrusdb_backend *backend, int nshards_wanted)
+{
+    if (nshards_wanted <= 1) return backend;
+    if (nshards_wanted > MBOXLIST_MAXSHARDS) {
+	nshards_wanted = MBOXLIST_MAXSHARDS;
+    }
+
+    base = backend;
+    nshards = nshards_wanted;
+    mboxlist_shards.name = backend->name;
+
+    return &mboxlist_shards;
+}
@@ -0,0 +1,67 @@
+/* mboxlist_shard.h -- the mailbox list spread over several databases
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_MBOXLIST_SHARD_H
+#define INCLUDED_MBOXLIST_SHARD_H
+
+#include "cyrusdb.h"
+
+/* the most files the mailbox list may be split into */
+#define MBOXLIST_MAXSHARDS 256
+
+/* Returns a backend which keeps the mailbox list in 'nshards' files
+ * of 'backend', named after the mailbox list with ".0", ".1" etc.
+ * appended.  Each user's mailboxes, and each top level shared folder
+ * with everything below it, live together in one of them, so that
+ * writes for different users rarely wait for each other.  An existing
+ * unsharded mailbox list is split up the first time it is opened. */
+extern struct cyrusdb_backend *mboxlist_shard_backend(
+    struct cyrusdb_backend *backend, int nshards);
+
+/* Returns how many shards the mailbox list 'fname' was split into, as
+ * recorded in a file named after it with ".SHARDS" appended, 0 if it
+ * never was, or -1 if that can't be read.  Opening it with a different
+ * number fails. */
+extern int mboxlist_shard_count(const char *fname);
+
+#endif /* INCLUDED_MBOXLIST_SHARD_H */
@@ -1256,6 +1256,17 @@ char *mboxname_metapath(const char *partition, const char *mboxname,
 	metaflag = IMAP_ENUM_METAPARTITION_FILES_DAV;
 	filename = FNAME_DAV;
 	break;
+    case META_SEARCH:
+	snprintf(confkey, 256, "metadir-search-%s", partition);
+	metaflag = IMAP_ENUM_METAPARTITION_FILES_SEARCH;
+	filename = FNAME_SEARCH;
+	break;
+    case META_SQUATDELTA:
+	/* lives alongside cyrus.squat */
+	snprintf(confkey, 256, "metadir-squat-%s", partition);
+	metaflag = IMAP_ENUM_METAPARTITION_FILES_SQUAT;
+	filename = FNAME_SQUATDELTA;
+	break;
     case 0:
 	break;
     default:
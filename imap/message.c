@@ -66,6 +66,7 @@
 #include "mkgmtime.h"
 #include "message.h"
 #include "message_guid.h"
+#include "msgzip.h"
 #include "parseaddr.h"
 #include "charset.h"
 #include "stristr.h"
@@ -292,14 +293,16 @@ int message_parse(const char *fname, struct index_record *record)
  * The caller MUST free the allocated body struct.
  *
  * If msg_base/msg_len are non-NULL, the file will remain memory-mapped
- * and returned to the caller.  The caller MUST unmap the file.
+ * and returned to the caller.  The caller MUST unmap the file with
+ * msgzip_unmap().
+ *
+ * Compressed message files are parsed (and returned) decompressed.
  */
 int message_parse_file(FILE *infile,
 		       const char **msg_base, unsigned long *msg_len,
 		       struct body **body)
 {
     int fd = fileno(infile);
-    struct stat sbuf;
     const char *tmp_base;
     unsigned long tmp_len;
     int unmap = 0, r;
@@ -309,23 +312,19 @@ int message_parse_file(FILE *infile,
 	msg_base = &tmp_base;
 	msg_len = &tmp_len;
     }
-    *msg_base = NULL;
-    *msg_len = 0;
 
-    if (fstat(fd, &sbuf) == -1) {
-	syslog(LOG_ERR, "IOERROR: fstat on new message in spool: %m");
-	fatal("can't fstat message file", EC_OSFILE);
-    }
-    map_refresh(fd, 1, msg_base, msg_len, sbuf.st_size,
-		"new message", 0);
+    r = msgzip_map(fd, "new message", 0, msg_base, msg_len);
+    if (r) return r;
 
-    if (!*msg_base || !*msg_len)
+    if (!*msg_base || !*msg_len) {
+	msgzip_unmap(msg_base, msg_len);
 	return IMAP_IOERROR; /* zero length file? */
+    }
 
     if (!*body) *body = (struct body *) xmalloc(sizeof(struct body));
     r = message_parse_mapped(*msg_base, *msg_len, *body);
 
-    if (unmap) map_free(msg_base, msg_len);
+    if (unmap) msgzip_unmap(msg_base, msg_len);
 
     return r;
 }
@@ -3281,3 +3280,67 @@ void message_read_bodystructure(struct index_record *record, struct body **body)
     binbody = cacheitem_base(record, CACHE_SECTION);
     message_read_binarybody(&toplevel, &binbody);
 }
+
+/*
+ * Call 'proc' for each piece of the message in 'msg_base' that BODY
+ * and TEXT searches look at, in file order: the MIME header of each
+ * part ('istop' set for the message's own), decoded, and each leaf
+ * body with a known charset.  'cachestr' is the message's
+ * CACHE_SECTION item.  With 'skipheader' set, the message's own
+ * header is left out.  Stops at, and returns, the first non-zero
+ * value from 'proc'.
+ */
+int message_foreach_text_section(const char *msg_base,
+				 unsigned long msg_size,
+				 const char *cachestr, int skipheader,
+				 message_text_proc_t *proc, void *rock)
+{
+    static struct buf hdr;
+    int partsleft = 1, subparts, istop = 1;
+    unsigned long start, len;
+    int charset, encoding;
+    char *q;
+    int r = 0;
+
+    /* Won't find anything in a truncated file */
+    if (!msg_size) return 0;
+
+    while (!r && partsleft--) {
+	subparts = CACHE_ITEM_BIT32(cachestr);
+	cachestr += 4;
+	if (!subparts) continue;
+
+	partsleft += subparts-1;
+
+	start = CACHE_ITEM_BIT32(cachestr);
+	len = CACHE_ITEM_BIT32(cachestr + CACHE_ITEM_SIZE_SKIP);
+	if (len > 0 && !(istop && skipheader)) {
+	    /* Message file may be too short, truncate request */
+	    if (start > msg_size) start = msg_size;
+	    if (len > msg_size - start) len = msg_size - start;
+	    buf_setmap(&hdr, msg_base + start, len);
+	    q = charset_decode_mimeheader(buf_cstring(&hdr), NULL, 0);
+	    r = proc(MESSAGE_TEXT_HEADER, istop, q, strlen(q), 0, 0, rock);
+	    free(q);
+	}
+	istop = 0;
+	cachestr += 5*4;
+
+	while (!r && --subparts) {
+	    start = CACHE_ITEM_BIT32(cachestr+2*4);
+	    len = CACHE_ITEM_BIT32(cachestr+3*4);
+	    charset = CACHE_ITEM_BIT32(cachestr+4*4) >> 16;
+	    encoding = CACHE_ITEM_BIT32(cachestr+4*4) & 0xff;
+
+	    if (start < msg_size && len > 0 &&
+		charset >= 0 && charset < 0xffff) {
+		if (len > msg_size - start) len = msg_size - start;
+		r = proc(MESSAGE_TEXT_BODY, 0, msg_base + start, len,
+			 charset, encoding, rock);
+	    }
+	    cachestr += 5*4;
+	}
+    }
+
+    return r;
+}
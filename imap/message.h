@@ -182,4 +182,17 @@ extern void message_free_body P((struct body *body));
 extern void message_read_bodystructure(struct index_record *record,
 				       struct body **body);
 
+/* the kinds of text message_foreach_text_section() finds */
+#define MESSAGE_TEXT_HEADER	1	/* a part's MIME header, decoded */
+#define MESSAGE_TEXT_BODY	2	/* a leaf part's body, still encoded */
+
+typedef int message_text_proc_t(int kind, int istop,
+				const char *text, unsigned long len,
+				int charset, int encoding, void *rock);
+
+extern int message_foreach_text_section(const char *msg_base,
+					unsigned long msg_size,
+					const char *cachestr, int skipheader,
+					message_text_proc_t *proc, void *rock);
+
 #endif /* INCLUDED_MESSAGE_H */
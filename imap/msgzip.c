@@ -0,0 +1,429 @@
+/* msgzip.c -- transparently compressed message files
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "msgzip.h"
+#include "exitcodes.h"
+#include "global.h"
+#include "imap_err.h"
+#include "mailbox.h"
+#include "map.h"
+#include "retry.h"
+#include "strarray.h"
+#include "xmalloc.h"
+
+static const char msgzip_magic[4] = { '\0', 'C', 'Y', 'Z' };
+
+int msgzip_enabled(const char *part)
+{
+#ifdef HAVE_ZLIB
+    static strarray_t *parts = NULL;
+
+    if (!parts) {
+	const char *val =
+	    config_getstring(IMAPOPT_SPOOL_COMPRESS_PARTITIONS);
+
+	parts = strarray_split(val, NULL);
+    }
+
+    return part && strarray_find(parts, part, 0) >= 0;
+#else
+    return 0;
+#endif
+}
+
+int msgzip_iscompressed(const char *base, unsigned long len)
+{
+    return len >= MSGZIP_HEADER_SIZE &&
+	   !memcmp(base, msgzip_magic, sizeof(msgzip_magic));
+}
+
+static unsigned long msgzip_rawsize(const char *base)
+{
+    bit32 netsize;
+
+    memcpy(&netsize, base + 8, sizeof(netsize));
+    return ntohl(netsize);
+}
+
+/*
+ * Decompressed messages, most recently used first.  They're keyed on
+ * the file rather than its name, so hard links to one message share
+ * an entry and a file replaced under the same name doesn't hit.
+ * Entries still handed out by msgzip_map() are never dropped.
+ */
+struct msgzip_entry {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    char *base;
+    unsigned long len;
+    int refcount;
+    struct msgzip_entry *prev, *next;
+};
+
+static struct msgzip_entry *msgzip_head = NULL, *msgzip_tail = NULL;
+static unsigned long msgzip_cached = 0;
+
+static void msgzip_unlink_entry(struct msgzip_entry *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else msgzip_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else msgzip_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void msgzip_push_entry(struct msgzip_entry *e)
+{
+    e->prev = NULL;
+    e->next = msgzip_head;
+    if (msgzip_head) msgzip_head->prev = e;
+    else msgzip_tail = e;
+    msgzip_head = e;
+}
+
+static void msgzip_trim(void)
+{
+    unsigned long limit =
+	(unsigned long) config_getint(IMAPOPT_SPOOL_COMPRESS_CACHESIZE) * 1024;
+    struct msgzip_entry *e, *prev;
+
+    for (e = msgzip_tail; e && msgzip_cached > limit; e = prev) {
+	prev = e->prev;
+	if (e->refcount) continue;
+
+	msgzip_unlink_entry(e);
+	msgzip_cached -= e->len;
+	free(e->base);
+	free(e);
+    }
+}
+
+static int msgzip_inflate(const char *base, unsigned long len,
+			  const char *fname, char **outp,
+			  unsigned long *outlenp)
+{
+#ifdef HAVE_ZLIB
+    unsigned long rawlen = msgzip_rawsize(base);
+    uLongf outlen = rawlen;
+    char *out;
+    int zr;
+
+    if (base[4] != MSGZIP_ZLIB) {
+	syslog(LOG_ERR, "IOERROR: %s: unknown compression method %d",
+	       fname, base[4]);
+	return IMAP_IOERROR;
+    }
+
+    /* one extra byte so that empty messages still get a buffer */
+    out = xmalloc(rawlen + 1);
+    zr = uncompress((Bytef *) out, &outlen,
+		    (const Bytef *) base + MSGZIP_HEADER_SIZE,
+		    len - MSGZIP_HEADER_SIZE);
+    if (zr != Z_OK || outlen != rawlen) {
+	syslog(LOG_ERR, "IOERROR: decompressing %s: %s", fname,
+	       zr != Z_OK ? zError(zr) : "size mismatch");
+	free(out);
+	return IMAP_IOERROR;
+    }
+
+    *outp = out;
+    *outlenp = rawlen;
+    return 0;
+#else
+    (void) base;
+    (void) len;
+    (void) outp;
+    (void) outlenp;
+    syslog(LOG_ERR, "IOERROR: %s is compressed, but zlib support "
+	   "is not compiled in", fname);
+    return IMAP_IOERROR;
+#endif
+}
+
+int msgzip_map(int fd, const char *fname, const char *mboxname,
+	       const char **basep, unsigned long *lenp)
+{
+    struct stat sbuf;
+    struct msgzip_entry *e;
+    int r;
+
+    if (fstat(fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat on %s: %m", fname);
+	fatal("can't fstat message file", EC_OSFILE);
+    }
+    *basep = NULL;
+    *lenp = 0;
+
+    /* only compressed files ever get an entry */
+    for (e = msgzip_head; e; e = e->next) {
+	if (e->ino == sbuf.st_ino && e->dev == sbuf.st_dev &&
+	    e->mtime == sbuf.st_mtime && e->size == sbuf.st_size)
+	    break;
+    }
+
+    if (e) {
+	msgzip_unlink_entry(e);
+    }
+    else {
+	map_refresh(fd, 1, basep, lenp, sbuf.st_size, fname, mboxname);
+	if (!*basep || !msgzip_iscompressed(*basep, *lenp))
+	    return 0;
+
+	e = xzmalloc(sizeof(struct msgzip_entry));
+	r = msgzip_inflate(*basep, *lenp, fname, &e->base, &e->len);
+	map_free(basep, lenp);
+	if (r) {
+	    free(e);
+	    return r;
+	}
+	e->dev = sbuf.st_dev;
+	e->ino = sbuf.st_ino;
+	e->mtime = sbuf.st_mtime;
+	e->size = sbuf.st_size;
+	msgzip_cached += e->len;
+    }
+
+    e->refcount++;
+    msgzip_push_entry(e);
+    msgzip_trim();
+
+    *basep = e->base;
+    *lenp = e->len;
+    return 0;
+}
+
+void msgzip_unmap(const char **basep, unsigned long *lenp)
+{
+    struct msgzip_entry *e;
+
+    for (e = msgzip_head; e; e = e->next) {
+	if (e->refcount && e->base == *basep) {
+	    e->refcount--;
+	    *basep = NULL;
+	    *lenp = 0;
+	    msgzip_trim();
+	    return;
+	}
+    }
+
+    map_free(basep, lenp);
+}
+
+int msgzip_file(const char *part, const char *fname)
+{
+#ifdef HAVE_ZLIB
+    char tmp[MAX_MAILBOX_PATH+1];
+    const char *base = NULL;
+    unsigned long len = 0;
+    struct stat sbuf;
+    struct utimbuf settime;
+    uLongf zlen;
+    bit32 netsize;
+    char *out;
+    int fd, zr, r = 0;
+
+    if (!msgzip_enabled(part)) return 0;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	return IMAP_IOERROR;
+    }
+    if (fstat(fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat on %s: %m", fname);
+	close(fd);
+	return IMAP_IOERROR;
+    }
+    /* linked to other mailboxes or a blob: renaming a compressed copy
+     * over this name would split it from the rest of them */
+    if (sbuf.st_nlink > 1) {
+	close(fd);
+	return 0;
+    }
+    map_refresh(fd, 1, &base, &len, sbuf.st_size, fname, NULL);
+    close(fd);
+
+    if (!len || msgzip_iscompressed(base, len)) {
+	map_free(&base, &len);
+	return 0;
+    }
+
+    zlen = compressBound(len);
+    out = xmalloc(MSGZIP_HEADER_SIZE + zlen);
+    zr = compress2((Bytef *) out + MSGZIP_HEADER_SIZE, &zlen,
+		   (const Bytef *) base, len,
+		   config_getint(IMAPOPT_SPOOL_COMPRESS_LEVEL));
+    map_free(&base, &len);
+
+    if (zr != Z_OK) {
+	syslog(LOG_ERR, "IOERROR: compressing %s: %s", fname, zError(zr));
+	r = IMAP_IOERROR;
+	goto done;
+    }
+    /* not worth it */
+    if (MSGZIP_HEADER_SIZE + zlen >= (unsigned long) sbuf.st_size)
+	goto done;
+
+    memcpy(out, msgzip_magic, sizeof(msgzip_magic));
+    out[4] = MSGZIP_ZLIB;
+    out[5] = out[6] = out[7] = 0;
+    netsize = htonl(sbuf.st_size);
+    memcpy(out + 8, &netsize, sizeof(netsize));
+
+    /* the new name isn't a message file name, so reconstruct won't
+     * pick it up if we die here */
+    snprintf(tmp, sizeof(tmp), "%sNEW", fname);
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", tmp);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+    if (retry_write(fd, out, MSGZIP_HEADER_SIZE + zlen) == -1 ||
+	fsync(fd) == -1) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", tmp);
+	close(fd);
+	unlink(tmp);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+    close(fd);
+
+    /* the file times are the message's internaldate */
+    settime.actime = sbuf.st_atime;
+    settime.modtime = sbuf.st_mtime;
+    utime(tmp, &settime);
+
+    if (rename(tmp, fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: renaming %s to %s: %m", tmp, fname);
+	unlink(tmp);
+	r = IMAP_IOERROR;
+    }
+
+ done:
+    free(out);
+    return r;
+#else
+    (void) part;
+    (void) fname;
+    return 0;
+#endif
+}
+
+FILE *msgzip_fopen(const char *fname)
+{
+    char magic[sizeof(msgzip_magic)];
+    const char *base;
+    unsigned long len;
+    FILE *f, *tmp;
+
+    f = fopen(fname, "r");
+    if (!f) return NULL;
+
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	memcmp(magic, msgzip_magic, sizeof(magic))) {
+	rewind(f);
+	return f;
+    }
+
+    tmp = tmpfile();
+    if (tmp && !msgzip_map(fileno(f), fname, NULL, &base, &len)) {
+	if (fwrite(base, 1, len, tmp) != len || fflush(tmp)) {
+	    syslog(LOG_ERR, "IOERROR: writing temporary file for %s: %m",
+		   fname);
+	    fclose(tmp);
+	    tmp = NULL;
+	}
+	msgzip_unmap(&base, &len);
+    }
+    else if (tmp) {
+	fclose(tmp);
+	tmp = NULL;
+    }
+    fclose(f);
+
+    if (tmp) rewind(tmp);
+    return tmp;
+}
+
+int msgzip_stat(const char *fname, struct stat *sbuf)
+{
+    char hdr[MSGZIP_HEADER_SIZE];
+    int fd;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) return -1;
+
+    if (fstat(fd, sbuf) == -1) {
+	close(fd);
+	return -1;
+    }
+    if (retry_read(fd, hdr, sizeof(hdr)) == sizeof(hdr) &&
+	msgzip_iscompressed(hdr, sizeof(hdr)))
+	sbuf->st_size = msgzip_rawsize(hdr);
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+/* msgzip.h -- transparently compressed message files
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_MSGZIP_H
+#define INCLUDED_MSGZIP_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+/*
+ * Message files on the partitions listed in spool_compress_partitions
+ * may be stored zlib-compressed behind a small header:
+ *
+ *   4 bytes  "\0CYZ" - no RFC 822 message starts with a NUL
+ *   1 byte   compression method (MSGZIP_ZLIB)
+ *   3 bytes  reserved, zero
+ *   4 bytes  size of the uncompressed message, network byte order
+ *
+ * followed by the zlib stream.  Everything else about the message -
+ * its size in the index, its GUID, what sync and FETCH send - is that
+ * of the uncompressed content, so a compressed file can be read
+ * through these functions wherever it turns up, whether or not its
+ * partition is configured to compress.
+ */
+
+#define MSGZIP_HEADER_SIZE 12
+#define MSGZIP_ZLIB 1
+
+/* is 'part' one of spool_compress_partitions? */
+extern int msgzip_enabled(const char *part);
+
+/* does this look like a compressed message file? */
+extern int msgzip_iscompressed(const char *base, unsigned long len);
+
+/* If 'part' compresses, rewrite the (not yet visible) message file
+ * 'fname' compressed, keeping its times.  Files that are already
+ * compressed, hard linked or wouldn't shrink are left alone. */
+extern int msgzip_file(const char *part, const char *fname);
+
+/* Map the message file open on 'fd', decompressing it if necessary.
+ * Release the result with msgzip_unmap(), never map_free(). */
+extern int msgzip_map(int fd, const char *fname, const char *mboxname,
+		      const char **basep, unsigned long *lenp);
+extern void msgzip_unmap(const char **basep, unsigned long *lenp);
+
+/* fopen() 'fname' for reading; compressed files come back as an
+ * anonymous temporary file holding the uncompressed message */
+extern FILE *msgzip_fopen(const char *fname);
+
+/* stat() 'fname', with st_size set to the uncompressed size */
+extern int msgzip_stat(const char *fname, struct stat *sbuf);
+
+#endif /* INCLUDED_MSGZIP_H */
@@ -95,6 +95,7 @@
 #include "map.h"
 #include "mboxlist.h"
 #include "mkgmtime.h"
+#include "msgzip.h"
 #include "mupdate-client.h"
 #include "nntp_err.h"
 #include "proc.h"
@@ -1933,7 +1934,7 @@ static void cmd_article(int part, char *msgid, unsigned long uid)
 
     fname = mailbox_message_fname(group_state->mailbox, uid);
 
-    msgfile = fopen(fname, "r");
+    msgfile = msgzip_fopen(fname);
     if (!msgfile) {
 	prot_printf(nntp_out, "502 Could not read message file\r\n");
 	return;
@@ -78,6 +78,7 @@
 #include "imapd.h"
 #include "imap_err.h"
 #include "mailbox.h"
+#include "msgzip.h"
 #include "version.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -1943,7 +1944,7 @@ static int blat(int msgno, int lines)
     int thisline = -2;
 
     fname = mailbox_message_fname(popd_mailbox, popd_msg[msgno].uid);
-    msgfile = fopen(fname, "r");
+    msgfile = msgzip_fopen(fname);
     if (!msgfile) {
 	prot_printf(popd_out, "-ERR [SYS/PERM] Could not read message file\r\n");
 	return IMAP_IOERROR;
@@ -61,16 +61,47 @@
 #include "xstrlcat.h"
 
 #include "squat.h"
+#include "squat_delta.h"
+#include "search_text.h"
 
 typedef struct {
-  unsigned char* vector;
+  bitvector_t* vector;
   struct index_state *state;
   char const* part_types;
   int found_validity;
 } SquatSearchResult;
 
-static int vector_len(struct index_state *state) {
-  return (state->exists >> 3) + 1;
+/* Scratch vectors for the engines' query functions, two per level of
+   nesting, which are reused for every subquery at that level instead
+   of being allocated per node. */
+typedef struct {
+  unsigned alloc;
+  bitvector_t** vectors;
+} SearchScratch;
+
+static bitvector_t* scratch_get(SearchScratch* s, struct index_state *state,
+                                unsigned i) {
+  if (i >= s->alloc) {
+    unsigned n = s->alloc;
+
+    s->alloc = i + 8;
+    s->vectors = xrealloc(s->vectors, s->alloc * sizeof(bitvector_t*));
+    for (; n < s->alloc; n++) {
+      s->vectors[n] = xmalloc(sizeof(bitvector_t));
+      bitvector_init(s->vectors[n], state->exists, 0);
+    }
+  }
+  return s->vectors[i];
+}
+
+static void scratch_free(SearchScratch* s) {
+  unsigned i;
+
+  for (i = 0; i < s->alloc; i++) {
+    bitvector_fini(s->vectors[i]);
+    free(s->vectors[i]);
+  }
+  free(s->vectors);
 }
 
 /* The document name is of the form
@@ -82,13 +113,13 @@ static int vector_len(struct index_state *state) {
    is the UID validity value.
 
    This function parses the document name and returns the message
-   UID only if the name has the right part type and it corresponds
+   number only if the name has the right part type and it corresponds
    to a real message UID.
 */
 static int parse_doc_name(SquatSearchResult* r, char const* doc_name) {
   int ch = doc_name[0];
   char const* t = r->part_types;
-  int doc_UID, index;
+  unsigned doc_UID, index;
 
   if (ch == 'v' && strncmp(doc_name, "validity.", 9) == 0) {
       if ((unsigned) atoi(doc_name + 9) == r->state->mailbox->i.uidvalidity) {
@@ -115,38 +146,41 @@ static int parse_doc_name(SquatSearchResult* r, char const* doc_name) {
   }
   
   index = index_finduid(r->state, doc_UID);
+  if (!index || index_getuid(r->state, index) != doc_UID) {
+    return -1;
+  }
 
   return index;
 }
 
 static int drop_indexed_docs(void* closure, SquatListDoc const* doc) {
   SquatSearchResult* r = (SquatSearchResult*)closure;
-  int doc_uid = parse_doc_name(r, doc->doc_name);
+  int msgno = parse_doc_name(r, doc->doc_name);
 
-  if (doc_uid >= 0) {
-    unsigned char* vect = r->vector;
-    vect[doc_uid >> 3] &= ~(1 << (doc_uid & 0x7));
+  if (msgno > 0) {
+    bitvector_clear(r->vector, msgno - 1);
   }
   return SQUAT_CALLBACK_CONTINUE;
 }
 
 static int fill_with_hits(void* closure, char const* doc) {
   SquatSearchResult* r = (SquatSearchResult*)closure;
-  int doc_uid = parse_doc_name(r, doc);
+  int msgno = parse_doc_name(r, doc);
 
-  if (doc_uid >= 0) {
-    unsigned char* vect = r->vector;
-    vect[doc_uid >> 3] |= 1 << (doc_uid & 0x7);
+  if (msgno > 0) {
+    bitvector_set(r->vector, msgno - 1);
   }
   return SQUAT_CALLBACK_CONTINUE;
 }
 
-static int search_strlist(SquatSearchIndex* index, struct index_state *state,
-  unsigned char* output, unsigned char* tmp, struct strlist* strs,
-  char const* part_types) {
+/* 'indexes' is a NULL terminated list of the SQUAT index files to use:
+   the mailbox's main index and, if it has one, its delta index. A hit
+   in any of them counts. */
+static int search_strlist(SquatSearchIndex** indexes,
+  struct index_state *state, bitvector_t* output, bitvector_t* tmp,
+  struct strlist* strs, char const* part_types) {
   SquatSearchResult r;
-  int i;
-  int len = vector_len(state);
+  SquatSearchIndex** index;
 
   r.part_types = part_types;
   r.vector = tmp;
@@ -154,101 +188,83 @@ static int search_strlist(SquatSearchIndex* index, struct index_state *state,
   while (strs != NULL) {
     char const* s = strs->s;
 
-    memset(tmp, 0, len);
-    if (squat_search_execute(index, s, strlen(s), fill_with_hits, &r)
-        != SQUAT_OK) {
-      if (squat_get_last_error() == SQUAT_ERR_SEARCH_STRING_TOO_SHORT)
-        return 1; /* The rest of the search is still viable */
-      syslog(LOG_DEBUG, "SQUAT string list search failed on string %s "
-             "with part types %s", s, part_types);
-      return 0;
-    }
-    for (i = 0; i < len; i++) {
-      output[i] &= tmp[i];
+    bitvector_fill(tmp, 0);
+    for (index = indexes; *index != NULL; index++) {
+      if (squat_search_execute(*index, s, strlen(s), fill_with_hits, &r)
+          != SQUAT_OK) {
+        if (squat_get_last_error() == SQUAT_ERR_SEARCH_STRING_TOO_SHORT)
+          return 1; /* The rest of the search is still viable */
+        syslog(LOG_DEBUG, "SQUAT string list search failed on string %s "
+               "with part types %s", s, part_types);
+        return 0;
+      }
     }
+    bitvector_and(output, tmp);
 
     strs = strs->next;
   }
   return 1;
 }
 
-static unsigned char* search_squat_do_query(SquatSearchIndex* index,
-  struct index_state *state, struct searchargs* args) {
-  int vlen = vector_len(state);
-  unsigned char* vect = xmalloc(vlen);
-  unsigned char* t_vect = xmalloc(vlen);
+/* Narrow 'vect' (which the caller has filled) down to the messages
+   which could match 'args'.  Returns 0 if the query failed. */
+static int search_squat_do_query(SquatSearchIndex** indexes,
+  struct index_state *state, struct searchargs* args,
+  bitvector_t* vect, SearchScratch* scratch, unsigned level) {
+  bitvector_t* t_vect = scratch_get(scratch, state, 2 * level);
   struct searchsub* sub;
-  int found_something = 1;
-    
-  memset(vect, 255, vlen);
-  
-  if (!(search_strlist(index, state, vect, t_vect, args->to, "t")
-      && search_strlist(index, state, vect, t_vect, args->from, "f")
-      && search_strlist(index, state, vect, t_vect, args->cc, "c")
-      && search_strlist(index, state, vect, t_vect, args->bcc, "b")
-      && search_strlist(index, state, vect, t_vect, args->subject, "s")
-      && search_strlist(index, state, vect, t_vect, args->header_name, "h")
-      && search_strlist(index, state, vect, t_vect, args->header, "h")
-      && search_strlist(index, state, vect, t_vect, args->body, "m")
-      && search_strlist(index, state, vect, t_vect, args->text, "mh"))) {
-    found_something = 0;
-    goto cleanup;
+
+  if (!(search_strlist(indexes, state, vect, t_vect, args->to, "t")
+      && search_strlist(indexes, state, vect, t_vect, args->from, "f")
+      && search_strlist(indexes, state, vect, t_vect, args->cc, "c")
+      && search_strlist(indexes, state, vect, t_vect, args->bcc, "b")
+      && search_strlist(indexes, state, vect, t_vect, args->subject, "s")
+      && search_strlist(indexes, state, vect, t_vect, args->header_name, "h")
+      && search_strlist(indexes, state, vect, t_vect, args->header, "h")
+      && search_strlist(indexes, state, vect, t_vect, args->body, "m")
+      && search_strlist(indexes, state, vect, t_vect, args->text, "mh"))) {
+    return 0;
   }
 
-  sub = args->sublist;
-  while (sub != NULL) {
-    if (args->sublist->sub2 == NULL) {
+  for (sub = args->sublist; sub != NULL; sub = sub->next) {
+    if (sub->sub2 == NULL) {
       /* do nothing; because our search is conservative (may include false
          positives) we can't compute the NOT (since the result might include
          false negatives, which we do not allow) */
       /* Note that it's OK to do nothing. We'll just be returning more
          false positives. */
     } else {
-      unsigned char* sub1_vect =
-        search_squat_do_query(index, state, args->sublist->sub1);
-      unsigned char* sub2_vect;
-      int i;
-
-      if (sub1_vect == NULL) {
-        found_something = 0;
-        goto cleanup;
-      }
-
-      sub2_vect = search_squat_do_query(index, state, args->sublist->sub2);
-
-      if (sub2_vect == NULL) {
-        found_something = 0;
-        free(sub1_vect);
-        goto cleanup;
+      /* the subqueries' scratch vectors live one level down, so
+         these stay untouched while they run */
+      bitvector_t* sub1_vect = scratch_get(scratch, state, 2 * level);
+      bitvector_t* sub2_vect = scratch_get(scratch, state, 2 * level + 1);
+
+      bitvector_fill(sub1_vect, 1);
+      if (!search_squat_do_query(indexes, state, sub->sub1,
+                                 sub1_vect, scratch, level + 1)) {
+        return 0;
       }
 
-      for (i = 0; i < vlen; i++) {
-        vect[i] &= sub1_vect[i] | sub2_vect[i];
+      bitvector_fill(sub2_vect, 1);
+      if (!search_squat_do_query(indexes, state, sub->sub2,
+                                 sub2_vect, scratch, level + 1)) {
+        return 0;
       }
 
-      free(sub1_vect);
-      free(sub2_vect);
+      bitvector_or(sub1_vect, sub2_vect);
+      bitvector_and(vect, sub1_vect);
     }
-
-    sub = sub->next;
   }
 
-cleanup:
-  free(t_vect);
-  if (!found_something) {
-    free(vect);
-    return NULL;
-  }
-  
-  return vect;
+  return 1;
 }
 
-static int search_squat(unsigned* msg_list, struct index_state *state,
+static int search_squat(bitvector_t* msg_vector, struct index_state *state,
                         struct searchargs *searchargs) {
   char *fname;
-  int fd;
-  SquatSearchIndex* index;
-  unsigned char* msg_vector;
+  int fd, delta_fd = -1;
+  SquatSearchIndex* indexes[3];
+  SearchScratch scratch;
   int result;
 
   fname = mailbox_meta_fname(state->mailbox, META_SQUAT);
@@ -256,64 +272,166 @@ static int search_squat(unsigned* msg_list, struct index_state *state,
     syslog(LOG_DEBUG, "SQUAT failed to open index file");
     return -1;   /* probably not found. Just bail */
   }
-  if ((index = squat_search_open(fd)) == NULL) {
+  if ((indexes[0] = squat_search_open(fd)) == NULL) {
     syslog(LOG_DEBUG, "SQUAT failed to open index");
     close(fd);
     return -1;
   }
-  if ((msg_vector = search_squat_do_query(index, state, searchargs))
-      == NULL) {
+  /* messages appended since squatter ran, if any */
+  indexes[1] = squat_delta_open(state->mailbox, &delta_fd);
+  indexes[2] = NULL;
+
+  memset(&scratch, 0, sizeof(scratch));
+  bitvector_fill(msg_vector, 1);
+  if (!search_squat_do_query(indexes, state, searchargs,
+                             msg_vector, &scratch, 0)) {
     result = -1;
   } else {
-    unsigned i;
-    unsigned vlen = vector_len(state);
-    unsigned char* unindexed_vector = xmalloc(vlen);
+    bitvector_t unindexed_vector;
     SquatSearchResult r;
     
-    memset(unindexed_vector, 255, vlen);
-    r.vector = unindexed_vector;
+    bitvector_init(&unindexed_vector, state->exists, 1);
+    r.vector = &unindexed_vector;
     r.state = state;
     r.part_types = "tfcbsmh";
     r.found_validity = 0;
-    if (squat_search_list_docs(index, drop_indexed_docs, &r) != SQUAT_OK) {
+    if (squat_search_list_docs(indexes[0], drop_indexed_docs, &r) != SQUAT_OK) {
       syslog(LOG_DEBUG, "SQUAT failed to get list of indexed documents");
       result = -1;
     } else if (!r.found_validity) {
       syslog(LOG_DEBUG, "SQUAT didn't find validity record");
       result = -1;
+    } else if (indexes[1] != NULL &&
+               squat_search_list_docs(indexes[1], drop_indexed_docs, &r)
+               != SQUAT_OK) {
+      syslog(LOG_DEBUG, "SQUAT failed to get list of delta documents");
+      result = -1;
     } else {
       /* Add in any unindexed messages. They must be searched manually. */
-      for (i = 0; i < vlen; i++) {
-        msg_vector[i] |= unindexed_vector[i];
-      }
-
+      bitvector_or(msg_vector, &unindexed_vector);
       result = 0;
-      for (i = 1; i <= state->exists; i++) {
-        if ((msg_vector[i >> 3] & (1 << (i & 7))) != 0) {
-          msg_list[result] = i;
-          result++;
-        }
-      }
     }
-    free(msg_vector);
-    free(unindexed_vector);
+    bitvector_fini(&unindexed_vector);
   }
-  squat_search_close(index);
+  scratch_free(&scratch);
+  squat_delta_close(indexes[1], delta_fd);
+  squat_search_close(indexes[0]);
   close(fd);
   return result;
 }
 
-int search_prefilter_messages(unsigned *msgno_list, struct index_state *state,
-                              struct searchargs *searchargs) 
+/* Does the search have BODY or TEXT criteria anywhere? */
+static int search_has_text(struct searchargs *args) {
+  struct searchsub* sub;
+
+  if (args->body || args->text) return 1;
+  for (sub = args->sublist; sub != NULL; sub = sub->next) {
+    if (search_has_text(sub->sub1)) return 1;
+    if (sub->sub2 && search_has_text(sub->sub2)) return 1;
+  }
+  return 0;
+}
+
+typedef struct {
+  struct index_state *state;
+  bitvector_t* vector;
+} TextSearchResult;
+
+static void text_candidate(unsigned uid, void* rock) {
+  TextSearchResult* r = (TextSearchResult*)rock;
+  unsigned msgno = index_finduid(r->state, uid);
+
+  if (msgno && index_getuid(r->state, msgno) == uid) {
+    bitvector_set(r->vector, msgno - 1);
+  }
+}
+
+static void search_text_strlist(struct search_text* st,
+  struct index_state *state, bitvector_t* output, bitvector_t* tmp,
+  struct strlist* strs) {
+  TextSearchResult r;
+
+  r.state = state;
+  r.vector = tmp;
+  for (; strs != NULL; strs = strs->next) {
+    bitvector_fill(tmp, 0);
+    if (search_text_candidates(st, strs->s, text_candidate, &r) == 0) {
+      bitvector_and(output, tmp);
+    }
+  }
+}
+
+/* Narrow 'vect' (which the caller has filled) down to the indexed
+   messages which could match the BODY and TEXT criteria in 'args'. */
+static void search_text_do_query(struct search_text* st,
+  struct index_state *state, struct searchargs* args,
+  bitvector_t* vect, SearchScratch* scratch, unsigned level) {
+  bitvector_t* t_vect = scratch_get(scratch, state, 2 * level);
+  struct searchsub* sub;
+
+  search_text_strlist(st, state, vect, t_vect, args->body);
+  search_text_strlist(st, state, vect, t_vect, args->text);
+
+  for (sub = args->sublist; sub != NULL; sub = sub->next) {
+    /* as for SQUAT, we can't narrow down a NOT */
+    if (sub->sub2 != NULL) {
+      bitvector_t* sub1_vect = scratch_get(scratch, state, 2 * level);
+      bitvector_t* sub2_vect = scratch_get(scratch, state, 2 * level + 1);
+
+      bitvector_fill(sub1_vect, 1);
+      search_text_do_query(st, state, sub->sub1, sub1_vect,
+                           scratch, level + 1);
+      bitvector_fill(sub2_vect, 1);
+      search_text_do_query(st, state, sub->sub2, sub2_vect,
+                           scratch, level + 1);
+
+      bitvector_or(sub1_vect, sub2_vect);
+      bitvector_and(vect, sub1_vect);
+    }
+  }
+}
+
+static void search_text(bitvector_t* msg_vector, struct index_state *state,
+                        struct searchargs *searchargs) {
+  SearchScratch scratch;
+  unsigned msgno;
+
+  memset(&scratch, 0, sizeof(scratch));
+  bitvector_fill(msg_vector, 1);
+  search_text_do_query(state->searchtext, state, searchargs,
+                       msg_vector, &scratch, 0);
+  scratch_free(&scratch);
+
+  /* Messages appended since the word index was built aren't in it;
+     their text is checked by index_search_evaluate(). */
+  msgno = index_finduid(state, search_text_baseuid(state->searchtext));
+  for (msgno++; msgno <= state->exists; msgno++) {
+    bitvector_set(msg_vector, msgno - 1);
+  }
+}
+
+void search_prefilter_messages(bitvector_t *msg_vector,
+			       struct index_state *state,
+			       struct searchargs *searchargs)
 {
-    unsigned i;
-    int count;
+    bitvector_init(msg_vector, state->exists, 0);
+
+    if (config_getswitch(IMAPOPT_SEARCH_TEXTINDEX) && !state->searchtext &&
+	search_has_text(searchargs)) {
+	search_text_open(state->mailbox, 0, &state->searchtext);
+    }
+    if (state->searchtext) {
+	search_text(msg_vector, state, searchargs);
+	syslog(LOG_DEBUG, "text index returned %u messages",
+	       bitvector_count(msg_vector));
+	return;
+    }
 
     if (SQUAT_ENGINE) {
-	count = search_squat(msgno_list, state, searchargs);
-	if (count >= 0) {
-	    syslog(LOG_DEBUG, "SQUAT returned %d messages", count);
-	    return count;
+	if (search_squat(msg_vector, state, searchargs) == 0) {
+	    syslog(LOG_DEBUG, "SQUAT returned %u messages",
+		   bitvector_count(msg_vector));
+	    return;
 	} else {
 	    /* otherwise, we failed for some reason, so do the default */
 	    syslog(LOG_DEBUG, "SQUAT failed");
@@ -322,10 +440,10 @@ int search_prefilter_messages(unsigned *msgno_list, struct index_state *state,
   
     /* Just put in all possible messages. This falls back to Cyrus' default
      * search. */
-    
-    for (i = 0; i < state->exists; i++) {
-	msgno_list[i] = i + 1;
-    }
+    bitvector_fill(msg_vector, 1);
+}
 
-    return state->exists;
+void search_prefilter_done(struct index_state *state)
+{
+    search_text_close(&state->searchtext);
 }
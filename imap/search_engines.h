@@ -46,13 +46,15 @@
 #define INCLUDED_SEARCH_ENGINES_H
 
 #include "index.h"
+#include "bitvector.h"
 
-/* Fill the msg_list with a list of message IDs which could match the
- * searchargs.
- * Return the number of message IDs inserted.
+/* Initialise msg_vector with one bit per message, setting bit msgno-1
+ * for each message which could match the searchargs.  Call
+ * search_prefilter_done() once the messages have been evaluated.
  */
-extern int search_prefilter_messages(unsigned* msg_list,
-				     struct index_state *state,
-				     struct searchargs *searchargs);
+extern void search_prefilter_messages(bitvector_t *msg_vector,
+				      struct index_state *state,
+				      struct searchargs *searchargs);
+extern void search_prefilter_done(struct index_state *state);
 
 #endif
@@ -0,0 +1,396 @@
+/* search_kernels.c -- column scan kernels for SEARCH
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * Each predicate has a portable scalar version and, where the compiler
+ * supports it, SSE2 and AVX2 versions which build 64 result bits at a
+ * time.  The implementation is picked on first use by asking the CPU
+ * what it supports, so a single binary runs everywhere.
+ *
+ * The vector versions only work on whole 64 message blocks and hand
+ * the tail to the scalar code, and skip blocks where an earlier
+ * kernel has already cleared every bit.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "search_kernels.h"
+
+#define CLEARBIT(bitmap, i) ((bitmap)[(i) / 64] &= ~(UINT64_C(1) << ((i) % 64)))
+
+/* ====================================================================== */
+
+/* portable versions */
+
+static void flags_scalar(const bit32 *col, unsigned stride, unsigned n,
+			 bit32 set, bit32 unset, uint64_t *bitmap)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++, col += stride) {
+	if ((*col & set) != set || (*col & unset))
+	    CLEARBIT(bitmap, i);
+    }
+}
+
+static void range32_scalar(const uint32_t *col, unsigned n,
+			   uint32_t min, uint32_t max, uint64_t *bitmap)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+	if (col[i] < min || col[i] > max)
+	    CLEARBIT(bitmap, i);
+    }
+}
+
+static void modseq_scalar(const modseq_t *col, unsigned n,
+			  modseq_t min, uint64_t *bitmap)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+	if (col[i] < min)
+	    CLEARBIT(bitmap, i);
+    }
+}
+
+static void time_scalar(const time_t *col, unsigned n,
+			time_t min, time_t max, uint64_t *bitmap)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+	if (col[i] < min || (max && col[i] >= max))
+	    CLEARBIT(bitmap, i);
+    }
+}
+
+/* ====================================================================== */
+
+#ifdef HAVE_X86_SIMD
+
+/* SSE2: four 32 bit lanes.  There's no 64 bit compare, so modseq and
+ * time use the scalar code. */
+
+__attribute__((target("sse2")))
+static void flags_sse2(const bit32 *col, unsigned stride, unsigned n,
+		       bit32 set, bit32 unset, uint64_t *bitmap)
+{
+    const __m128i vset = _mm_set1_epi32(set);
+    const __m128i vunset = _mm_set1_epi32(unset);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned w, j;
+
+    if (stride != 1) {
+	flags_scalar(col, stride, n, set, unset, bitmap);
+	return;
+    }
+
+    for (w = 0; w < n / 64; w++) {
+	const bit32 *p = col + w * 64;
+	uint64_t bits = 0;
+
+	if (!bitmap[w]) continue;
+
+	for (j = 0; j < 64; j += 4) {
+	    __m128i v = _mm_loadu_si128((const __m128i *) (p + j));
+	    __m128i ok = _mm_and_si128(
+		_mm_cmpeq_epi32(_mm_and_si128(v, vset), vset),
+		_mm_cmpeq_epi32(_mm_and_si128(v, vunset), zero));
+	    bits |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(ok)) << j;
+	}
+	bitmap[w] &= bits;
+    }
+
+    flags_scalar(col + w * 64, 1, n - w * 64, set, unset, bitmap + w);
+}
+
+__attribute__((target("sse2")))
+static void range32_sse2(const uint32_t *col, unsigned n,
+			 uint32_t min, uint32_t max, uint64_t *bitmap)
+{
+    /* no unsigned compare: flip the sign bit and compare signed */
+    const __m128i sign = _mm_set1_epi32(0x80000000);
+    const __m128i vmin = _mm_xor_si128(_mm_set1_epi32(min), sign);
+    const __m128i vmax = _mm_xor_si128(_mm_set1_epi32(max), sign);
+    unsigned w, j;
+
+    for (w = 0; w < n / 64; w++) {
+	const uint32_t *p = col + w * 64;
+	uint64_t bits = 0;
+
+	if (!bitmap[w]) continue;
+
+	for (j = 0; j < 64; j += 4) {
+	    __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (p + j)),
+				      sign);
+	    __m128i bad = _mm_or_si128(_mm_cmpgt_epi32(vmin, v),
+				       _mm_cmpgt_epi32(v, vmax));
+	    bits |= (uint64_t)
+		(~_mm_movemask_ps(_mm_castsi128_ps(bad)) & 0xf) << j;
+	}
+	bitmap[w] &= bits;
+    }
+
+    range32_scalar(col + w * 64, n - w * 64, min, max, bitmap + w);
+}
+
+/* AVX2: eight 32 bit or four 64 bit lanes, plus gather for strided
+ * columns */
+
+__attribute__((target("avx2")))
+static void flags_avx2(const bit32 *col, unsigned stride, unsigned n,
+		       bit32 set, bit32 unset, uint64_t *bitmap)
+{
+    const __m256i vset = _mm256_set1_epi32(set);
+    const __m256i vunset = _mm256_set1_epi32(unset);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i vindex = _mm256_mullo_epi32(_mm256_set1_epi32(stride),
+					      _mm256_setr_epi32(0, 1, 2, 3,
+								4, 5, 6, 7));
+    unsigned w, j;
+
+    for (w = 0; w < n / 64; w++) {
+	const bit32 *p = col + w * 64 * stride;
+	uint64_t bits = 0;
+
+	if (!bitmap[w]) continue;
+
+	for (j = 0; j < 64; j += 8) {
+	    __m256i v = (stride == 1) ?
+		_mm256_loadu_si256((const __m256i *) (p + j)) :
+		_mm256_i32gather_epi32((const int *) (p + j * stride),
+				       vindex, 4);
+	    __m256i ok = _mm256_and_si256(
+		_mm256_cmpeq_epi32(_mm256_and_si256(v, vset), vset),
+		_mm256_cmpeq_epi32(_mm256_and_si256(v, vunset), zero));
+	    bits |= (uint64_t) _mm256_movemask_ps(_mm256_castsi256_ps(ok)) << j;
+	}
+	bitmap[w] &= bits;
+    }
+
+    flags_scalar(col + w * 64 * stride, stride, n - w * 64,
+		 set, unset, bitmap + w);
+}
+
+__attribute__((target("avx2")))
+static void range32_avx2(const uint32_t *col, unsigned n,
+			 uint32_t min, uint32_t max, uint64_t *bitmap)
+{
+    const __m256i vmin = _mm256_set1_epi32(min);
+    const __m256i vmax = _mm256_set1_epi32(max);
+    unsigned w, j;
+
+    for (w = 0; w < n / 64; w++) {
+	const uint32_t *p = col + w * 64;
+	uint64_t bits = 0;
+
+	if (!bitmap[w]) continue;
+
+	for (j = 0; j < 64; j += 8) {
+	    __m256i v = _mm256_loadu_si256((const __m256i *) (p + j));
+	    /* min <= v <= max  <=>  max(v, min) == v && min(v, max) == v */
+	    __m256i ok = _mm256_and_si256(
+		_mm256_cmpeq_epi32(_mm256_max_epu32(v, vmin), v),
+		_mm256_cmpeq_epi32(_mm256_min_epu32(v, vmax), v));
+	    bits |= (uint64_t) _mm256_movemask_ps(_mm256_castsi256_ps(ok)) << j;
+	}
+	bitmap[w] &= bits;
+    }
+
+    range32_scalar(col + w * 64, n - w * 64, min, max, bitmap + w);
+}
+
+__attribute__((target("avx2")))
+static void modseq_avx2(const modseq_t *col, unsigned n,
+			modseq_t min, uint64_t *bitmap)
+{
+    /* 64 bit compares are signed only, flip the sign bit */
+    const __m256i sign = _mm256_set1_epi64x((long long) UINT64_C(0x8000000000000000));
+    const __m256i vmin = _mm256_xor_si256(_mm256_set1_epi64x(min), sign);
+    unsigned w, j;
+
+    if (sizeof(modseq_t) != 8) {
+	modseq_scalar(col, n, min, bitmap);
+	return;
+    }
+
+    for (w = 0; w < n / 64; w++) {
+	const modseq_t *p = col + w * 64;
+	uint64_t bits = 0;
+
+	if (!bitmap[w]) continue;
+
+	for (j = 0; j < 64; j += 4) {
+	    __m256i v = _mm256_xor_si256(
+		_mm256_loadu_si256((const __m256i *) (p + j)), sign);
+	    __m256i bad = _mm256_cmpgt_epi64(vmin, v);
+	    bits |= (uint64_t)
+		(~_mm256_movemask_pd(_mm256_castsi256_pd(bad)) & 0xf) << j;
+	}
+	bitmap[w] &= bits;
+    }
+
+    modseq_scalar(col + w * 64, n - w * 64, min, bitmap + w);
+}
+
+__attribute__((target("avx2")))
+static void time_avx2(const time_t *col, unsigned n,
+		      time_t min, time_t max, uint64_t *bitmap)
+{
+    const __m256i vmin = _mm256_set1_epi64x(min);
+    const __m256i vmax = _mm256_set1_epi64x(max);
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    unsigned w, j;
+
+    if (sizeof(time_t) != 8) {
+	time_scalar(col, n, min, max, bitmap);
+	return;
+    }
+
+    for (w = 0; w < n / 64; w++) {
+	const time_t *p = col + w * 64;
+	uint64_t bits = 0;
+
+	if (!bitmap[w]) continue;
+
+	for (j = 0; j < 64; j += 4) {
+	    __m256i v = _mm256_loadu_si256((const __m256i *) (p + j));
+	    __m256i below = max ? _mm256_cmpgt_epi64(vmax, v) : ones;
+	    __m256i ok = _mm256_andnot_si256(_mm256_cmpgt_epi64(vmin, v), below);
+	    bits |= (uint64_t) _mm256_movemask_pd(_mm256_castsi256_pd(ok)) << j;
+	}
+	bitmap[w] &= bits;
+    }
+
+    time_scalar(col + w * 64, n - w * 64, min, max, bitmap + w);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+/* ====================================================================== */
+
+struct search_kernels {
+    const char *name;
+    void (*flags)(const bit32 *, unsigned, unsigned, bit32, bit32,
+		  uint64_t *);
+    void (*range32)(const uint32_t *, unsigned, uint32_t, uint32_t,
+		    uint64_t *);
+    void (*modseq)(const modseq_t *, unsigned, modseq_t, uint64_t *);
+    void (*time)(const time_t *, unsigned, time_t, time_t, uint64_t *);
+};
+
+static const struct search_kernels scalar_kernels = {
+    "scalar", flags_scalar, range32_scalar, modseq_scalar, time_scalar
+};
+
+#ifdef HAVE_X86_SIMD
+static const struct search_kernels sse2_kernels = {
+    "sse2", flags_sse2, range32_sse2, modseq_scalar, time_scalar
+};
+
+static const struct search_kernels avx2_kernels = {
+    "avx2", flags_avx2, range32_avx2, modseq_avx2, time_avx2
+};
+#endif
+
+static const struct search_kernels *kernels = NULL;
+
+static const struct search_kernels *get_kernels(void)
+{
+    if (kernels) return kernels;
+
+    kernels = &scalar_kernels;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	kernels = &avx2_kernels;
+    else if (__builtin_cpu_supports("sse2"))
+	kernels = &sse2_kernels;
+#endif
+
+    return kernels;
+}
+
+void search_kernel_flags(const bit32 *col, unsigned stride, unsigned n,
+			 bit32 set, bit32 unset, uint64_t *bitmap)
+{
+    if (!set && !unset) return;
+    get_kernels()->flags(col, stride, n, set, unset, bitmap);
+}
+
+void search_kernel_range32(const uint32_t *col, unsigned n,
+			   uint32_t min, uint32_t max, uint64_t *bitmap)
+{
+    if (min > max) {
+	/* nothing can match */
+	memset(bitmap, 0, SEARCH_BITMAP_WORDS(n) * sizeof(uint64_t));
+	return;
+    }
+    get_kernels()->range32(col, n, min, max, bitmap);
+}
+
+void search_kernel_modseq(const modseq_t *col, unsigned n,
+			  modseq_t min, uint64_t *bitmap)
+{
+    if (!min) return;
+    get_kernels()->modseq(col, n, min, bitmap);
+}
+
+void search_kernel_time(const time_t *col, unsigned n,
+			time_t min, time_t max, uint64_t *bitmap)
+{
+    if (!min && !max) return;
+    get_kernels()->time(col, n, min, max, bitmap);
+}
+
+const char *search_kernel_name(void)
+{
+    return get_kernels()->name;
+}
@@ -0,0 +1,82 @@
+/* search_kernels.h -- column scan kernels for SEARCH
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_SEARCH_KERNELS_H
+#define INCLUDED_SEARCH_KERNELS_H
+
+#include <config.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "util.h"
+
+/* Result bitmaps hold one bit per message: message n (counting from
+ * zero) is bit (n % 64) of word (n / 64).  Every kernel ANDs its own
+ * result into the bitmap, so a search is a series of kernel calls
+ * over a bitmap which starts out with all messages set. */
+#define SEARCH_BITMAP_WORDS(n) (((n) + 63) / 64)
+
+/* keep messages where (col & set) == set && !(col & unset).  'stride'
+ * is the distance in words between consecutive messages, so that a
+ * single word of the user flags column can be scanned in place */
+extern void search_kernel_flags(const bit32 *col, unsigned stride,
+				unsigned n, bit32 set, bit32 unset,
+				uint64_t *bitmap);
+
+/* keep messages where min <= col <= max */
+extern void search_kernel_range32(const uint32_t *col, unsigned n,
+				  uint32_t min, uint32_t max,
+				  uint64_t *bitmap);
+
+/* keep messages where col >= min */
+extern void search_kernel_modseq(const modseq_t *col, unsigned n,
+				 modseq_t min, uint64_t *bitmap);
+
+/* keep messages where min <= col < max; a max of 0 means no upper bound */
+extern void search_kernel_time(const time_t *col, unsigned n,
+			       time_t min, time_t max, uint64_t *bitmap);
+
+/* name of the implementation picked for this CPU, for logging */
+extern const char *search_kernel_name(void);
+
+#endif /* INCLUDED_SEARCH_KERNELS_H */
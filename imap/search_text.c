@@ -0,0 +1,792 @@
+/* search_text.c -- persistent decoded text index for BODY/TEXT searches
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * The text index is a skiplist file, cyrus.search, next to the
+ * mailbox's other metadata.  Keys are:
+ *
+ *   #validity	  UIDVALIDITY the file was built for (decimal)
+ *   #base	  highest UID covered by the word index (decimal)
+ *   #last	  highest UID whose text has been stored (decimal)
+ *   #longterms	  UIDs of messages with words too long to index
+ *   #unindexed	  UIDs up to #base whose text could not be extracted
+ *   #suffixes	  present once the S keys below are written (decimal)
+ *   D<uid>	  the message's text, as a series of segments
+ *   T<word>	  UIDs of messages containing the word
+ *   S<tail> <head> one for each proper suffix <tail> of each indexed
+ *		  word <head><tail>, with no data
+ *
+ * UID lists are ascending, stored as varint-encoded deltas.  A text
+ * segment is a type byte, a 32-bit network order length and the text
+ * in canonical search form.  Segment boundaries are kept because
+ * index_searchmsg() never matches across MIME parts.
+ *
+ * The S keys let a query word which may be the end or the middle of
+ * an indexed word find its candidate words by a prefix search, rather
+ * than a walk over every T key.  They cost about one key per byte of
+ * distinct word.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "bitvector.h"
+#include "charset.h"
+#include "cyrusdb.h"
+#include "global.h"
+#include "hash.h"
+#include "imap_err.h"
+#include "mailbox.h"
+#include "message.h"
+#include "strarray.h"
+#include "util.h"
+#include "xmalloc.h"
+
+#include "search_text.h"
+
+/* we need binary values and prefix iteration in byte order */
+#define DB (&cyrusdb_skiplist)
+
+#define SEARCH_TEXT_MAXTERM	40	/* longer words go in #longterms */
+#define SEARCH_TEXT_CATCHUP	256	/* most messages one update indexes */
+#define SEARCH_TEXT_SUFFIXES	1	/* version of the S keys */
+
+/* separates tail and head in S keys; sorts below every word byte */
+#define SUFFIX_SEP	' '
+
+/* text segment types */
+#define SEG_HEADER	'H'		/* top level header, TEXT only */
+#define SEG_BODY	'B'		/* body parts and their headers */
+
+#define ISWORD(c) \
+    (((unsigned char)(c)) >= 0x80 || ((c) >= '0' && (c) <= '9') || \
+     ((c) >= 'A' && (c) <= 'Z') || ((c) >= 'a' && (c) <= 'z'))
+
+struct posting {
+    struct buf uids;
+    unsigned lastuid;
+};
+
+struct search_text {
+    struct mailbox *mailbox;
+    struct db *db;
+    struct txn *tid;
+    int flags;
+    unsigned base;
+    unsigned last;
+    /* only used when rebuilding */
+    hash_table terms;
+    struct posting longterms;
+    struct posting unindexed;
+    struct buf doc;
+};
+
+/* ====================================================================== */
+
+static void posting_add(struct posting *p, unsigned uid)
+{
+    unsigned delta;
+
+    if (uid <= p->lastuid) return;	/* already there */
+
+    delta = uid - p->lastuid;
+    while (delta >= 0x80) {
+	buf_putc(&p->uids, (delta & 0x7f) | 0x80);
+	delta >>= 7;
+    }
+    buf_putc(&p->uids, delta);
+    p->lastuid = uid;
+}
+
+static void posting_free(void *data)
+{
+    struct posting *p = (struct posting *) data;
+
+    buf_free(&p->uids);
+    free(p);
+}
+
+/* set the bit for each UID in the list, ignoring any past the end */
+static void posting_to_bitvector(const char *data, int datalen,
+				 bitvector_t *bv)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + datalen;
+    unsigned uid = 0, delta, shift;
+
+    while (p < end) {
+	delta = 0;
+	shift = 0;
+	while (p < end && (*p & 0x80)) {
+	    delta |= (*p++ & 0x7f) << shift;
+	    shift += 7;
+	}
+	if (p == end) break;	/* truncated */
+	delta |= *p++ << shift;
+	uid += delta;
+	bitvector_set(bv, uid);
+    }
+}
+
+static unsigned fetch_number(struct search_text *st, const char *key)
+{
+    const char *data;
+    int datalen, r;
+    char buf[30];
+
+    r = DB->fetch(st->db, key, strlen(key), &data, &datalen, &st->tid);
+    if (r || datalen <= 0 || datalen >= (int) sizeof(buf)) return 0;
+
+    memcpy(buf, data, datalen);
+    buf[datalen] = '\0';
+    return strtoul(buf, NULL, 10);
+}
+
+static int store_number(struct search_text *st, const char *key,
+			unsigned value)
+{
+    char buf[30];
+
+    snprintf(buf, sizeof(buf), "%u", value);
+    return DB->store(st->db, key, strlen(key), buf, strlen(buf), &st->tid);
+}
+
+static int make_dockey(char *buf, size_t size, unsigned uid)
+{
+    return snprintf(buf, size, "D%08x", uid);
+}
+
+/* ====================================================================== */
+
+static void segment_receiver(int uid __attribute__((unused)),
+			     int part __attribute__((unused)),
+			     int cmds __attribute__((unused)),
+			     char const *text, int text_len, void *rock)
+{
+    buf_appendmap((struct buf *) rock, text, text_len);
+}
+
+static void segment_finish(struct buf *doc, unsigned start)
+{
+    bit32 len = htonl(doc->len - start - 5);
+
+    memcpy(doc->s + start + 1, &len, sizeof(len));
+}
+
+struct extract_rock {
+    struct buf *doc;
+    unsigned uid;
+};
+
+/* file each piece of text as a segment of the document */
+static int extract_cb(int kind, int istop,
+		      const char *text, unsigned long len,
+		      int charset, int encoding, void *rock)
+{
+    struct extract_rock *er = (struct extract_rock *) rock;
+    struct buf *doc = er->doc;
+    unsigned segstart = doc->len;
+
+    if (kind == MESSAGE_TEXT_HEADER) {
+	buf_putc(doc, istop ? SEG_HEADER : SEG_BODY);
+	buf_appendbit32(doc, 0);
+	buf_appendmap(doc, text, len);
+	segment_finish(doc, segstart);
+    }
+    else {
+	buf_putc(doc, SEG_BODY);
+	buf_appendbit32(doc, 0);
+	if (charset_extractfile(segment_receiver, doc, er->uid,
+				text, len, charset, encoding))
+	    segment_finish(doc, segstart);
+	else
+	    buf_truncate(doc, segstart);
+    }
+
+    return 0;
+}
+
+/*
+ * Extract the text of 'record' that index_searchmsg() would search,
+ * in the same per-part pieces.
+ */
+static int search_text_extract(struct mailbox *mailbox,
+			       struct index_record *record,
+			       struct buf *doc)
+{
+    const char *msg_base = NULL;
+    unsigned long msg_size = 0;
+    struct extract_rock er;
+
+    buf_reset(doc);
+
+    if (mailbox_cacherecord(mailbox, record))
+	return IMAP_IOERROR;
+    if (mailbox_map_message(mailbox, record->uid, &msg_base, &msg_size))
+	return IMAP_IOERROR;
+
+    er.doc = doc;
+    er.uid = record->uid;
+    message_foreach_text_section(msg_base, msg_size,
+				 cacheitem_base(record, CACHE_SECTION), 0,
+				 extract_cb, &er);
+
+    mailbox_unmap_message(mailbox, record->uid, &msg_base, &msg_size);
+
+    return 0;
+}
+
+/* add the words of the document to the in-memory word index */
+static void search_text_addterms(struct search_text *st, unsigned uid)
+{
+    const char *p = st->doc.s, *end = p + st->doc.len;
+    const char *text, *textend, *word;
+    char term[SEARCH_TEXT_MAXTERM+1];
+    struct posting *posting;
+    bit32 len;
+
+    while (p + 5 <= end) {
+	memcpy(&len, p + 1, sizeof(len));
+	text = p + 5;
+	textend = text + ntohl(len);
+	p = textend;
+
+	while (text < textend) {
+	    if (!ISWORD(*text)) {
+		text++;
+		continue;
+	    }
+	    for (word = text; text < textend && ISWORD(*text); text++);
+
+	    if (text - word > SEARCH_TEXT_MAXTERM) {
+		posting_add(&st->longterms, uid);
+		continue;
+	    }
+
+	    memcpy(term, word, text - word);
+	    term[text - word] = '\0';
+	    posting = hash_lookup(term, &st->terms);
+	    if (!posting) {
+		posting = xzmalloc(sizeof(struct posting));
+		hash_insert(term, posting, &st->terms);
+	    }
+	    posting_add(posting, uid);
+	}
+    }
+}
+
+/* ====================================================================== */
+
+int search_text_open(struct mailbox *mailbox, int flags,
+		     struct search_text **stp)
+{
+    struct search_text *st;
+    struct stat sbuf;
+    const char *fname;
+    int r;
+
+    st = xzmalloc(sizeof(struct search_text));
+    st->mailbox = mailbox;
+    st->flags = flags;
+
+    if (flags & SEARCH_TEXT_REBUILD) {
+	fname = mailbox_meta_newfname(mailbox, META_SEARCH);
+	unlink(fname);
+	r = DB->open(fname, CYRUSDB_CREATE, &st->db);
+	if (!r) construct_hash_table(&st->terms, 65536, 1);
+    }
+    else {
+	fname = mailbox_meta_fname(mailbox, META_SEARCH);
+	if (stat(fname, &sbuf) < 0) {
+	    free(st);
+	    return IMAP_MAILBOX_NONEXISTENT;
+	}
+	r = DB->open(fname, 0, &st->db);
+    }
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+	       cyrusdb_strerror(r));
+	free(st);
+	return IMAP_IOERROR;
+    }
+
+    if (!(flags & SEARCH_TEXT_REBUILD)) {
+	if (fetch_number(st, "#validity") != mailbox->i.uidvalidity ||
+	    fetch_number(st, "#suffixes") != SEARCH_TEXT_SUFFIXES) {
+	    search_text_close(&st);
+	    return IMAP_MAILBOX_BADFORMAT;
+	}
+	st->base = fetch_number(st, "#base");
+	st->last = fetch_number(st, "#last");
+	/* don't hold the lock between calls */
+	DB->commit(st->db, st->tid);
+	st->tid = NULL;
+    }
+
+    *stp = st;
+    return 0;
+}
+
+void search_text_close(struct search_text **stp)
+{
+    struct search_text *st = *stp;
+
+    if (!st) return;
+
+    if (st->tid) DB->abort(st->db, st->tid);
+    DB->close(st->db);
+
+    if (st->flags & SEARCH_TEXT_REBUILD) {
+	/* never committed, throw it away */
+	if (st->terms.table) {
+	    unlink(mailbox_meta_newfname(st->mailbox, META_SEARCH));
+	    free_hash_table(&st->terms, posting_free);
+	}
+	buf_free(&st->longterms.uids);
+	buf_free(&st->unindexed.uids);
+    }
+    buf_free(&st->doc);
+
+    free(st);
+    *stp = NULL;
+}
+
+int search_text_add(struct search_text *st, struct index_record *record)
+{
+    char key[20];
+    int keylen, r;
+
+    if (record->uid <= st->last) return 0;
+
+    /* expunged messages never match, so don't bother */
+    if (record->system_flags & (FLAG_EXPUNGED|FLAG_UNLINKED)) {
+	st->last = record->uid;
+	return 0;
+    }
+
+    r = search_text_extract(st->mailbox, record, &st->doc);
+    if (r) {
+	if (!(st->flags & SEARCH_TEXT_REBUILD)) return r;
+	/* leave it for the slow path */
+	posting_add(&st->unindexed, record->uid);
+	st->last = record->uid;
+	return 0;
+    }
+
+    keylen = make_dockey(key, sizeof(key), record->uid);
+    r = DB->store(st->db, key, keylen, st->doc.s, st->doc.len, &st->tid);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: storing text of %s:%u: %s",
+	       st->mailbox->name, record->uid, cyrusdb_strerror(r));
+	return IMAP_IOERROR;
+    }
+
+    if (st->flags & SEARCH_TEXT_REBUILD)
+	search_text_addterms(st, record->uid);
+
+    st->last = record->uid;
+    return 0;
+}
+
+struct termlist {
+    const char **terms;
+    unsigned count;
+};
+
+static void collect_term(const char *key,
+			 void *data __attribute__((unused)), void *rock)
+{
+    struct termlist *tl = (struct termlist *) rock;
+
+    tl->terms[tl->count++] = key;
+}
+
+static int compare_term(const void *a, const void *b)
+{
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/* store the S keys for the sorted words in 'tl' */
+static int search_text_storesuffixes(struct search_text *st,
+				     struct termlist *tl)
+{
+    strarray_t keys = STRARRAY_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
+    unsigned i;
+    size_t len, j;
+    int k, r = 0;
+
+    for (i = 0; i < tl->count; i++) {
+	len = strlen(tl->terms[i]);
+	for (j = 1; j < len; j++) {
+	    buf_reset(&key);
+	    buf_putc(&key, 'S');
+	    buf_appendcstr(&key, tl->terms[i] + j);
+	    buf_putc(&key, SUFFIX_SEP);
+	    buf_appendmap(&key, tl->terms[i], j);
+	    strarray_append(&keys, buf_cstring(&key));
+	}
+    }
+    strarray_sort(&keys);
+
+    for (k = 0; !r && k < keys.count; k++) {
+	r = DB->store(st->db, keys.data[k], strlen(keys.data[k]),
+		      "", 0, &st->tid);
+    }
+
+    buf_free(&key);
+    strarray_fini(&keys);
+
+    if (!r) r = store_number(st, "#suffixes", SEARCH_TEXT_SUFFIXES);
+
+    return r;
+}
+
+/* store the word index, in key order so the skiplist appends cheaply */
+static int search_text_storeterms(struct search_text *st)
+{
+    struct termlist tl;
+    struct posting *posting;
+    struct buf key = BUF_INITIALIZER;
+    unsigned i, n = 0;
+    int r = 0;
+
+    for (i = 0; i < st->terms.size; i++) {
+	bucket *b;
+	for (b = st->terms.table[i]; b; b = b->next) n++;
+    }
+
+    tl.terms = xmalloc((n ? n : 1) * sizeof(const char *));
+    tl.count = 0;
+    hash_enumerate(&st->terms, collect_term, &tl);
+    qsort(tl.terms, tl.count, sizeof(const char *), compare_term);
+
+    for (i = 0; !r && i < tl.count; i++) {
+	posting = hash_lookup(tl.terms[i], &st->terms);
+	buf_setcstr(&key, "T");
+	buf_appendcstr(&key, tl.terms[i]);
+	r = DB->store(st->db, key.s, key.len,
+		      posting->uids.s, posting->uids.len, &st->tid);
+    }
+
+    buf_free(&key);
+
+    if (!r) r = search_text_storesuffixes(st, &tl);
+    free(tl.terms);
+
+    if (!r && st->longterms.uids.len)
+	r = DB->store(st->db, "#longterms", 10, st->longterms.uids.s,
+		      st->longterms.uids.len, &st->tid);
+    if (!r && st->unindexed.uids.len)
+	r = DB->store(st->db, "#unindexed", 10, st->unindexed.uids.s,
+		      st->unindexed.uids.len, &st->tid);
+
+    return r;
+}
+
+int search_text_commit(struct search_text *st)
+{
+    int rebuild = st->flags & SEARCH_TEXT_REBUILD;
+    int r = 0;
+
+    if (rebuild) {
+	st->base = st->last;
+	r = search_text_storeterms(st);
+	if (!r) r = store_number(st, "#validity",
+				 st->mailbox->i.uidvalidity);
+	if (!r) r = store_number(st, "#base", st->base);
+    }
+    if (!r) r = store_number(st, "#last", st->last);
+    if (!r) {
+	r = DB->commit(st->db, st->tid);
+	st->tid = NULL;
+    }
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: writing text index for %s: %s",
+	       st->mailbox->name, cyrusdb_strerror(r));
+	return IMAP_IOERROR;
+    }
+
+    if (rebuild) {
+	free_hash_table(&st->terms, posting_free);
+	if (mailbox_meta_rename(st->mailbox, META_SEARCH)) {
+	    syslog(LOG_ERR, "IOERROR: renaming text index for %s: %m",
+		   st->mailbox->name);
+	    return IMAP_IOERROR;
+	}
+    }
+
+    return 0;
+}
+
+void search_text_update(struct mailbox *mailbox)
+{
+    struct search_text *st = NULL;
+    struct index_record record;
+    uint32_t recno;
+    int r;
+
+    if (!config_getswitch(IMAPOPT_SEARCH_TEXTINDEX) ||
+	!config_getswitch(IMAPOPT_SEARCH_TEXTINDEX_APPEND))
+	return;
+    if (search_text_open(mailbox, 0, &st)) return;
+
+    if (mailbox->i.last_uid <= st->last) goto done;
+
+    /* the new records are at the end, find the first one */
+    for (recno = mailbox->i.num_records; recno > 0; recno--) {
+	if (mailbox->i.num_records - recno >= SEARCH_TEXT_CATCHUP) {
+	    /* too far behind, leave it for squatter */
+	    goto done;
+	}
+	r = mailbox_read_index_record(mailbox, recno, &record);
+	if (r) goto done;
+	if (record.uid <= st->last) break;
+    }
+
+    for (recno++; recno <= mailbox->i.num_records; recno++) {
+	r = mailbox_read_index_record(mailbox, recno, &record);
+	if (!r) r = search_text_add(st, &record);
+	if (r) break;
+    }
+
+    search_text_commit(st);
+
+ done:
+    search_text_close(&st);
+}
+
+unsigned search_text_baseuid(struct search_text *st)
+{
+    return st->base;
+}
+
+/* ====================================================================== */
+
+/* how a query word may line up with the words in the index */
+#define MATCH_PREFIX	(1<<0)	/* query word may continue to the right */
+#define MATCH_SUFFIX	(1<<1)	/* query word may continue to the left */
+
+struct termmatch {
+    bitvector_t *uids;
+    strarray_t words;
+};
+
+/* a T key which starts with the query word */
+static int termmatch_cb(void *rock,
+			const char *key __attribute__((unused)),
+			int keylen __attribute__((unused)),
+			const char *data, int datalen)
+{
+    struct termmatch *tm = (struct termmatch *) rock;
+
+    posting_to_bitvector(data, datalen, tm->uids);
+    return 0;
+}
+
+/* an S key which starts with the query word: note the whole word, its
+ * posting list is looked up once the foreach is done */
+static int suffixmatch_cb(void *rock, const char *key, int keylen,
+			  const char *data __attribute__((unused)),
+			  int datalen __attribute__((unused)))
+{
+    struct termmatch *tm = (struct termmatch *) rock;
+    const char *sep = memchr(key, SUFFIX_SEP, keylen);
+    struct buf word = BUF_INITIALIZER;
+
+    if (!sep) return 0;
+
+    buf_putc(&word, 'T');
+    buf_appendmap(&word, sep + 1, key + keylen - sep - 1);
+    buf_appendmap(&word, key + 1, sep - key - 1);
+    strarray_appendm(&tm->words, buf_release(&word));
+
+    return 0;
+}
+
+/* set the bits of the messages which could contain the word */
+static void search_text_word(struct search_text *st, const char *word,
+			     int len, int how, bitvector_t *uids)
+{
+    struct termmatch tm;
+    struct buf key = BUF_INITIALIZER;
+    const char *data;
+    int datalen, i;
+
+    if (!DB->fetch(st->db, "#longterms", 10, &data, &datalen, NULL))
+	posting_to_bitvector(data, datalen, uids);
+    if (len > SEARCH_TEXT_MAXTERM) return;
+
+    tm.uids = uids;
+    strarray_init(&tm.words);
+
+    /* the word itself, or any word starting with it */
+    buf_putc(&key, 'T');
+    buf_appendmap(&key, word, len);
+    if (how & MATCH_PREFIX)
+	DB->foreach(st->db, key.s, key.len, NULL, termmatch_cb, &tm, NULL);
+    else if (!DB->fetch(st->db, key.s, key.len, &data, &datalen, NULL))
+	posting_to_bitvector(data, datalen, uids);
+
+    /* words ending with it, or with it anywhere after the start */
+    if (how & MATCH_SUFFIX) {
+	buf_reset(&key);
+	buf_putc(&key, 'S');
+	buf_appendmap(&key, word, len);
+	if (!(how & MATCH_PREFIX)) buf_putc(&key, SUFFIX_SEP);
+	DB->foreach(st->db, key.s, key.len, NULL, suffixmatch_cb, &tm, NULL);
+
+	for (i = 0; i < tm.words.count; i++) {
+	    const char *w = strarray_nth(&tm.words, i);
+	    if (!DB->fetch(st->db, w, strlen(w), &data, &datalen, NULL))
+		posting_to_bitvector(data, datalen, uids);
+	}
+    }
+
+    strarray_fini(&tm.words);
+    buf_free(&key);
+}
+
+int search_text_candidates(struct search_text *st, const char *substr,
+			   void (*proc)(unsigned uid, void *rock), void *rock)
+{
+    bitvector_t result, uids;
+    const char *p, *word;
+    const char *data;
+    int datalen, how, bit;
+    int narrowed = 0;
+
+    memset(&result, 0, sizeof(result));
+    for (p = substr; *p; ) {
+	if (!ISWORD(*p)) {
+	    p++;
+	    continue;
+	}
+	for (word = p; *p && ISWORD(*p); p++);
+
+	/* words at the ends of the string may be parts of longer ones */
+	how = 0;
+	if (word == substr) how |= MATCH_SUFFIX;
+	if (!*p) how |= MATCH_PREFIX;
+
+	bitvector_init(&uids, st->base + 1, 0);
+	search_text_word(st, word, p - word, how, &uids);
+	if (!narrowed) {
+	    result = uids;
+	    narrowed = 1;
+	}
+	else {
+	    bitvector_and(&result, &uids);
+	    bitvector_fini(&uids);
+	}
+    }
+
+    if (!narrowed) return 1;
+
+    if (!DB->fetch(st->db, "#unindexed", 10, &data, &datalen, NULL))
+	posting_to_bitvector(data, datalen, &result);
+
+    for (bit = bitvector_first(&result); bit >= 0;
+	 bit = bitvector_next(&result, bit + 1))
+	proc(bit, rock);
+
+    bitvector_fini(&result);
+    return 0;
+}
+
+/* search the segments of a stored document like index_searchmsg() */
+static int search_text_doc(const char *doc, int doclen, const char *substr,
+			   comp_pat *pat, int skipheader)
+{
+    const char *p = doc, *end = doc + doclen;
+    bit32 len;
+
+    while (p + 5 <= end) {
+	memcpy(&len, p + 1, sizeof(len));
+	len = ntohl(len);
+	if (len > (bit32) (end - p - 5)) break;	/* corrupt */
+	if (!(skipheader && *p == SEG_HEADER) &&
+	    charset_searchstring(substr, pat, p + 5, len))
+	    return 1;
+	p += 5 + len;
+    }
+    return 0;
+}
+
+int search_text_evaluate(struct search_text *st, unsigned uid,
+			 struct strlist *body, struct strlist *text)
+{
+    struct strlist *l;
+    const char *data;
+    char key[20];
+    int keylen, datalen;
+
+    if (uid > st->last) return -1;
+
+    /* an empty string matches any part with a known charset, which
+     * we don't record */
+    for (l = body; l; l = l->next)
+	if (!*l->s) return -1;
+    for (l = text; l; l = l->next)
+	if (!*l->s) return -1;
+
+    keylen = make_dockey(key, sizeof(key), uid);
+    if (DB->fetch(st->db, key, keylen, &data, &datalen, NULL))
+	return -1;
+
+    for (l = body; l; l = l->next)
+	if (!search_text_doc(data, datalen, l->s, l->p, 1)) return 0;
+    for (l = text; l; l = l->next)
+	if (!search_text_doc(data, datalen, l->s, l->p, 0)) return 0;
+
+    return 1;
+}
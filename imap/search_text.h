@@ -0,0 +1,100 @@
+/* search_text.h -- persistent decoded text index for BODY/TEXT searches
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_SEARCH_TEXT_H
+#define INCLUDED_SEARCH_TEXT_H
+
+#include "annotate.h" /* for strlist functionality */
+#include "mailbox.h"
+
+/*
+ * The text index (cyrus.search) of a mailbox holds, for each message,
+ * the decoded text that index_searchmsg() would search, already in
+ * canonical search form, plus a word index over that text.
+ *
+ * squatter rebuilds it from scratch; the word index covers messages
+ * up to the "base" UID.  Messages appended since then have their text
+ * added by append_commit() but are not in the word index, so they are
+ * always candidates (but can still be checked without touching the
+ * message file).  Messages past the "last" UID are not indexed at all.
+ */
+
+struct search_text;
+
+/* flags for search_text_open() */
+#define SEARCH_TEXT_REBUILD	(1<<0)	/* build a new file from scratch */
+
+extern int search_text_open(struct mailbox *mailbox, int flags,
+			    struct search_text **stp);
+extern void search_text_close(struct search_text **stp);
+
+/* index one message; records must be added in ascending UID order */
+extern int search_text_add(struct search_text *st,
+			   struct index_record *record);
+
+/* write out the word index (when rebuilding) and commit.  A rebuilt
+ * file replaces the mailbox's current one. */
+extern int search_text_commit(struct search_text *st);
+
+/* If search_textindex_append is set, index any messages appended to
+ * 'mailbox' since the text index was last updated.  The mailbox must
+ * be locked. */
+extern void search_text_update(struct mailbox *mailbox);
+
+extern unsigned search_text_baseuid(struct search_text *st);
+
+/* Call 'proc' with the UID of every message up to the base UID which
+ * could contain 'substr'.  Returns 1 if the word index can't narrow
+ * the search (e.g. 'substr' has no words in it) and 'proc' was not
+ * called. */
+extern int search_text_candidates(struct search_text *st, const char *substr,
+				  void (*proc)(unsigned uid, void *rock),
+				  void *rock);
+
+/* Evaluate BODY 'body' and TEXT 'text' criteria against the indexed
+ * text of message 'uid'.  Returns 1 or 0 for match or no match, or -1
+ * if the index can't answer and the message must be searched. */
+extern int search_text_evaluate(struct search_text *st, unsigned uid,
+				struct strlist *body, struct strlist *text);
+
+#endif /* INCLUDED_SEARCH_TEXT_H */
@@ -153,6 +153,10 @@ cleanup_index:
   return NULL;
 }
 
+SquatSearchIndex* squat_search_reopen(SquatSearchIndex* index) {
+  return squat_search_open(index->index_fd);
+}
+
 int squat_search_list_docs(SquatSearchIndex* index,
   SquatListDocCallback handler, void* closure) {
   char const* s = index->doc_list;
@@ -183,6 +183,19 @@ typedef union { /* An event report */
 } SquatStatsEvent;
 typedef void (* SquatStatsCallback)(void* closure, SquatStatsEvent* params);
 
+/* A way of running work on several threads. It calls
+   'work(closure, worker, i)' for each 0 <= i < n, on up to 'threads'
+   threads told apart by 'worker' (0 <= worker < threads), and
+   'done(closure, i)' on the calling thread for each i in order, once
+   its work has finished. No work is started more than 'ahead' places
+   past the last one done. It stops at the first non-zero result from
+   'done' and returns it. */
+typedef int (* SquatThreadRunner)(int threads, int n, int ahead,
+                                  void (*work)(void* closure, int worker,
+                                               int i),
+                                  int (*done)(void* closure, int i),
+                                  void* closure);
+
 /* Create a SQUAT index. The index is dumped into 'fd', which should
    be an empty file opened for writing.
 
@@ -199,6 +212,7 @@ typedef void (* SquatStatsCallback)(void* closure, SquatStatsEvent* params);
 #define SQUAT_OPTION_VALID_CHARS 0x02  /* The valid_chars options field is valid. */
 #define SQUAT_OPTION_STATISTICS  0x04  /* The stats_callback* options
 					  fields are valid. */
+#define SQUAT_OPTION_THREADS     0x08  /* The threads options field is valid. */
 typedef struct {
   int option_mask;                   /* Which options fields have been
 					initialized? */
@@ -225,6 +239,14 @@ typedef struct {
   SquatStatsCallback stats_callback; /* See above */
   void* stats_callback_closure;      /* Private data passed down into
 					the callback function */
+  int threads;                       /* How many threads to use to
+					build the word tries when the
+					index is finished. Only
+					squat_index_finish is affected;
+					the callbacks are still made
+					from the calling thread. */
+  SquatThreadRunner run_threads;     /* What starts those threads,
+					e.g. squat_run_threads */
 } SquatOptions;
 SquatIndex* squat_index_init(int fd, SquatOptions const* options);
 
@@ -290,6 +312,10 @@ int         squat_count_docs(SquatSearchIndex* index, char first_char,
 */
 SquatSearchIndex* squat_search_open(int fd);
 
+/* Open another handle on the index that 'index' is open on, e.g. for
+   another thread to scan. */
+SquatSearchIndex* squat_search_reopen(SquatSearchIndex* index);
+
 /* Get a list of the documents included in the index.
    The callback function is called once for each document. The
    callback function returns one of the following results to control
@@ -335,4 +361,12 @@ int squat_index_add_existing(SquatIndex* index,
                              SquatSearchIndex *old_index,
                              SquatDocChooserCallback choose_existing,
                              void *closure);
+
+/* A SquatThreadRunner using pthreads. It lives in squat_threads.c,
+   which is kept out of libimap so that only the programs using it
+   need to link with pthreads. */
+int squat_run_threads(int threads, int n, int ahead,
+                      void (*work)(void* closure, int worker, int i),
+                      int (*done)(void* closure, int i),
+                      void* closure);
 #endif
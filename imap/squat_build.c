@@ -88,6 +88,12 @@
   Each "all document" trie assumes a fixed first word byte, and
   therefore is only of depth 3. The leaves store the list of document
   IDs containing the word.
+
+  Trie nodes are allocated from memory pools rather than one by one,
+  and released a whole trie at a time. The "all document" tries are
+  independent of each other, so with the 'threads' option several are
+  built at once, each serialized into memory; the main thread appends
+  them to the index file in order of initial byte.
 */
 
 #include <config.h>
@@ -102,6 +108,7 @@
 
 #include "assert.h"
 #include "index.h"
+#include "mpool.h"
 #include "xmalloc.h"
 
 /* A simple write-buffering module which avoids copying of the output data. */
@@ -111,7 +118,8 @@ typedef struct {
 			      isn't one. */
   int buf_size;            /* The size of that buffer. */
   int data_len;            /* How much data in that buffer is valid. */
-  int fd;                  /* The fd to write to. */
+  int fd;                  /* The fd to write to, or -1 if the data
+			      is just collected in the buffer. */
   int total_output_bytes;  /* How much data have we written out
 			      through this buffer in total? */
 } SquatWriteBuffer;
@@ -126,10 +134,23 @@ static int init_write_buffer(SquatWriteBuffer* b, int buf_size, int fd) {
   return SQUAT_OK;
 }
 
+/* An in-memory buffer. Its offsets are counted from 1, so that an offset
+   of 0 still means "nothing here" as it does for the index file. */
+static void init_memory_buffer(SquatWriteBuffer* b, int buf_size) {
+  init_write_buffer(b, buf_size, -1);
+  b->total_output_bytes = 1;
+}
+
 /* Make sure that there is enough space in the buffer to write 'len' bytes.
    Return a pointer to where the written data should be placed. */
 static char* prepare_buffered_write(SquatWriteBuffer* b, int len) {
   if (b->data_len + len >= b->buf_size) {
+    if (b->fd < 0) {
+      /* In-memory buffers just grow */
+      b->buf_size = 2*(b->data_len + len);
+      b->buf = (char*)xrealloc(b->buf, b->buf_size);
+      return b->buf + b->data_len;
+    }
     if (write(b->fd, b->buf, b->data_len) != b->data_len) {
       squat_set_last_error(SQUAT_ERR_SYSERR);
       return NULL;
@@ -277,19 +298,24 @@ struct _SquatIndex {
 					 source document. */ 
   SquatWordTable *doc_word_table;     /* The root of the trie being
 					 built for the current
-					 document or for the current
-					 initial byte. */
+					 document, and later of the
+					 table of initial bytes. */
+  struct mpool* doc_tables;           /* Branch nodes of the "per
+					 document" trie. These are
+					 reused from one document to
+					 the next. */
+  struct mpool* doc_leaves;           /* Leaves of the "per document"
+					 trie, released at the end
+					 of every document */
   char runover_buf[SQUAT_WORD_SIZE];  /* holds the last runover_len
 					 bytes of the current source
 					 document */
   int runover_len;
-  WordDocEntry* word_doc_allocator;   /* A preallocated buffer of
-					 WordDocEntries; this pointer
-					 is bumped up one every
-					 allocation */
   unsigned char valid_char_bits[32];  /* Saved valid_char_bits option */
   SquatStatsCallback stats_callback;  /* Saved stats_callback option */
   void* stats_callback_closure;
+  int threads;                        /* Saved threads option */
+  SquatThreadRunner run_threads;      /* and what starts them */
 
   SquatSearchIndex* old_index;        /* Link to old index in incremental */
   struct doc_ID_map doc_ID_map;       /* Map doc_IDs in old index to new */
@@ -390,20 +416,37 @@ static int copy_docIDs(void* closure, SquatListDoc const* doc)
   return SQUAT_CALLBACK_CONTINUE;
 }
 
+/* The state for building and serializing the "all documents" trie
+   for one initial byte. Each one is private to whichever thread builds
+   it; the SquatIndex is only read. */
+typedef struct {
+  SquatIndex* index;
+  struct mpool* arena;                /* Every node of the trie */
+  SquatWordTable* root;
+  WordDocEntry* word_doc_allocator;   /* A preallocated buffer of
+					 WordDocEntries; this pointer
+					 is bumped up one every
+					 allocation */
+  SquatWriteBuffer out;               /* The serialized trie */
+  int root_offset;                    /* Offset of the root table within
+					 'out', or 0 if the trie is empty */
+  int error;                          /* SQUAT_ERR_OK, or what went wrong */
+} SquatTrieBuild;
+
 /* Comes later */
-static int add_word_to_trie(SquatIndex* index, char const* word_ptr,
+static int add_word_to_trie(SquatTrieBuild* b, char const* word_ptr,
                             int doc_ID);
 
 static int add_word_callback(void* closure, char *name, int doc_ID)
 {
-  SquatIndex* index = (SquatIndex*)closure;
-  struct doc_ID_map *doc_ID_map = &index->doc_ID_map;
+  SquatTrieBuild* b = (SquatTrieBuild*)closure;
+  struct doc_ID_map *doc_ID_map = &b->index->doc_ID_map;
 
   /* Find doc_ID in the new index which corresponds to this old doc_ID */
   if ((doc_ID = doc_ID_map_lookup(doc_ID_map, doc_ID)) == 0)
     return SQUAT_ERR;
 
-  add_word_to_trie(index, name+1, doc_ID);
+  add_word_to_trie(b, name+1, doc_ID);
 
   return SQUAT_CALLBACK_CONTINUE;
 }
@@ -431,6 +474,18 @@ static void init_doc_word_table(SquatWordTable** t) {
   *t = ret;
 }
 
+/* Allocate an empty branch node from 'pool'. Initially there are no
+   valid entries. Set things up so that the obvious tests will set
+   first_valid_entry and last_valid_entry correctly. */
+static SquatWordTable* new_word_table(struct mpool* pool) {
+  SquatWordTable* t = (SquatWordTable*)mpool_malloc(pool, sizeof(SquatWordTable));
+
+  t->first_valid_entry = 256;
+  t->last_valid_entry = 0;
+  memset(t->entries, 0, sizeof(t->entries));
+  return t;
+}
+
 SquatIndex* squat_index_init(int fd, SquatOptions const* options) {
   SquatIndex* index;
   unsigned i;
@@ -475,6 +530,16 @@ SquatIndex* squat_index_init(int fd, SquatOptions const* options) {
     index->stats_callback = NULL;
   }
 
+  if (options != NULL &&
+      (options->option_mask & SQUAT_OPTION_THREADS) != 0 &&
+      options->threads > 1 && options->run_threads != NULL) {
+    index->threads = options->threads;
+    index->run_threads = options->run_threads;
+  } else {
+    index->threads = 1;
+    index->run_threads = NULL;
+  }
+
   /* Finish initializing the SquatIndex */
   for (i = 0; i < VECTOR_SIZE(index->index_buffers); i++) {
     index->index_buffers[i].buf = NULL;
@@ -499,6 +564,8 @@ SquatIndex* squat_index_init(int fd, SquatOptions const* options) {
 
   index->current_doc_ID = 0;
   init_doc_word_table(&index->doc_word_table);
+  index->doc_tables = new_mpool(0);
+  index->doc_leaves = new_mpool(0);
 
   memset(index->total_num_words, 0, sizeof(index->total_num_words));
 
@@ -589,35 +656,6 @@ int squat_index_open_document(SquatIndex* index, char const* name) {
   return SQUAT_OK;
 }
 
-/* Destroy the SquatWordTable. The leaf data and the internal nodes are free'd. */
-static void delete_doc_word_table(SquatWordTable* t, int depth) {
-  if (depth > 2) {
-    unsigned i;
-
-    depth--;
-    for (i = 0; i < VECTOR_SIZE(t->entries); i++) {
-      SquatWordTableEntry* e = &(t->entries[i]);
-      
-      if (e->table != NULL) {
-        delete_doc_word_table(e->table, depth);
-      }
-    }
-  } else {
-    unsigned i;
-
-    /* this happens to work whether the leaf entries are leaf_presence
-       or leaf_docs. This is ugly but acceptable :-) */
-    for (i = 0; i < VECTOR_SIZE(t->entries); i++) {
-      SquatWordTableEntry* e = &(t->entries[i]);
-      
-      if (e->leaf_presence != NULL && ((unsigned long)e->leaf_presence & 1) == 0) {
-        free(e->leaf_presence);
-      }
-    }
-  }
-  free(t);
-}
-
 #define SQUAT_ADD_NEW_WORD (SQUAT_LAST_BUILTIN + 1)
 
 /* Add an entry to the compressed presence set. We maintain
@@ -646,11 +684,12 @@ static int set_presence_bit(SquatWordTableLeafPresence* p, int ch) {
 /* Add a word to the SquatWordTable trie.
    If word_entry is NULL then we are in "per document" mode and just record
    the presence or absence of a word, not the actual document.
+   Branch nodes are allocated from 'tables' and leaves from 'leaves'.
    We return SQUAT_ADD_NEW_WORD if this is the first occurrence of the
    word in the trie. */
-static int add_to_table(SquatIndex* index, char const* data, int data_len,
+static int add_to_table(SquatWordTable* t, struct mpool* tables,
+                        struct mpool* leaves, char const* data, int data_len,
                         WordDocEntry* word_entry) {
-  SquatWordTable* t = index->doc_word_table;
   int ch;
   SquatWordTableEntry* e;
 
@@ -671,14 +710,8 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
     t = e->table;
     /* Allocate the next branch node if it doesn't already exist. */
     if (t == NULL) {
-      t = (SquatWordTable*)xmalloc(sizeof(SquatWordTable));
+      t = new_word_table(tables);
       e->table = t;
-      /* Initially there are no valid entries. Set things up so that
-	 the obvious tests will set first_valid_entry and
-	 last_valid_entry correctly. */
-      t->first_valid_entry = 256;
-      t->last_valid_entry = 0;
-      memset(t->entries, 0, sizeof(t->entries));
     }
 
     data++;
@@ -712,7 +745,7 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
 
 	/* Make an empty bit vector. */
         p = (SquatWordTableLeafPresence*)
-          xmalloc(sizeof(SquatWordTableLeafPresence));
+          mpool_malloc(leaves, sizeof(SquatWordTableLeafPresence));
         p->first_valid_entry = 256;
         p->last_valid_entry = 0;
         memset(p->presence, 0, sizeof(p->presence));
@@ -742,7 +775,7 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
     /* Make a new leaf table if we don't already have one. */
     if (docs == NULL) {
       docs = (SquatWordTableLeafDocs*)
-        xmalloc(sizeof(SquatWordTableLeafDocs));
+        mpool_malloc(leaves, sizeof(SquatWordTableLeafDocs));
       docs->first_valid_entry = 256;
       docs->last_valid_entry = 0;
       memset(docs->docs, 0, sizeof(docs->docs));
@@ -782,12 +815,13 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
 
 /* Add 'doc_ID' to the list of document IDs for word 'word_ptr'
    in the "all documents" trie. */
-static int add_word_to_trie(SquatIndex* index, char const* word_ptr,
+static int add_word_to_trie(SquatTrieBuild* b, char const* word_ptr,
                             int doc_ID) {
-  WordDocEntry* word_entry = index->word_doc_allocator++;
+  WordDocEntry* word_entry = b->word_doc_allocator++;
 
   word_entry->doc_ID = doc_ID;
-  add_to_table(index, word_ptr, SQUAT_WORD_SIZE - 1, word_entry);
+  add_to_table(b->root, b->arena, b->arena, word_ptr, SQUAT_WORD_SIZE - 1,
+               word_entry);
 
   return SQUAT_OK;
 }
@@ -808,7 +842,8 @@ static int add_word_to_table(SquatIndex* index, char const* data) {
     }
   }
 
-  r = add_to_table(index, data, SQUAT_WORD_SIZE, NULL);
+  r = add_to_table(index->doc_word_table, index->doc_tables,
+                   index->doc_leaves, data, SQUAT_WORD_SIZE, NULL);
   if (r == SQUAT_ADD_NEW_WORD) {
     /* Remember how many unique words in this document started with
        the given first character. */
@@ -906,7 +941,8 @@ static int output_word(SquatWriteBuffer* b, char const* word) {
    'word'; we assume that 'len' bytes have already been assembled
    leading up to 'word'. This function clears the word data after
    writing it out. This makes it ready to handle the next document
-   without reallocating everything. */
+   without reallocating the branch nodes; the caller releases the
+   leaves. */
 static int write_words(SquatIndex* index, SquatWriteBuffer* b,
                        SquatWordTable* t, int len, char* word) {
   if (len == 2) {
@@ -952,7 +988,6 @@ static int write_words(SquatIndex* index, SquatWriteBuffer* b,
 		}
 	    }
         }
-        free(p);
         e->leaf_presence = NULL;
       }
     }
@@ -1050,6 +1085,10 @@ int squat_index_close_document(SquatIndex* index) {
     }
   }
 
+  /* write_words() has dropped every leaf, so release them all at once */
+  free_mpool(index->doc_leaves);
+  index->doc_leaves = new_mpool(0);
+
   index->current_doc_len = -1;
 
   index->current_doc_ID++;
@@ -1061,7 +1100,7 @@ int squat_index_close_document(SquatIndex* index) {
    file. It's dumped as a presence table (telling us which branches
    are non-NULL) followed by a list of relative file offsets in
    I-format pointing to the subtries for the non-NULL branches. */
-static int dump_word_table_offsets(SquatIndex* index, SquatWordTable* t,
+static int dump_word_table_offsets(SquatWriteBuffer* out, SquatWordTable* t,
                                    int *offset_buf) {
   int start_present = t->first_valid_entry;
   int end_present = t->last_valid_entry;
@@ -1070,11 +1109,11 @@ static int dump_word_table_offsets(SquatIndex* index, SquatWordTable* t,
 
   if (start_present > end_present) {
     /* There are no non-empty branches so just write an empty presence table */
-    if ((buf = prepare_buffered_write(&index->out, 2)) == NULL) {
+    if ((buf = prepare_buffered_write(out, 2)) == NULL) {
       return SQUAT_ERR;
     } else {
       buf[0] = buf[1] = 0;
-      complete_buffered_write(&index->out, buf + 2);
+      complete_buffered_write(out, buf + 2);
       return SQUAT_OK;
     }
   }
@@ -1085,7 +1124,7 @@ static int dump_word_table_offsets(SquatIndex* index, SquatWordTable* t,
      start) presence vector header. A singleton whose index is >= 32
      can be written out without ambiguity. */
   if (end_present == start_present && end_present >= 32) {
-    if ((buf = prepare_buffered_write(&index->out, 1)) == NULL) {
+    if ((buf = prepare_buffered_write(out, 1)) == NULL) {
       return SQUAT_ERR;
     } else {
       *buf++ = (char)end_present;
@@ -1096,7 +1135,7 @@ static int dump_word_table_offsets(SquatIndex* index, SquatWordTable* t,
     int first_byte = start_present >> 3;
     int byte_count = (end_present >> 3) - first_byte + 1;
 
-    if ((buf = prepare_buffered_write(&index->out, 2 + byte_count)) == NULL) {
+    if ((buf = prepare_buffered_write(out, 2 + byte_count)) == NULL) {
       return SQUAT_ERR;
     } else {
       int i;
@@ -1118,10 +1157,10 @@ static int dump_word_table_offsets(SquatIndex* index, SquatWordTable* t,
       buf += byte_count;
     }
   }
-  complete_buffered_write(&index->out, buf);
+  complete_buffered_write(out, buf);
   
   /* Now we write out the actual offset table in I-format. */
-  if ((buf = prepare_buffered_write(&index->out, 10*present_count)) == NULL) {
+  if ((buf = prepare_buffered_write(out, 10*present_count)) == NULL) {
     return SQUAT_ERR;
   } else {
     int i;
@@ -1134,13 +1173,13 @@ static int dump_word_table_offsets(SquatIndex* index, SquatWordTable* t,
       }
     }
   }
-  complete_buffered_write(&index->out, buf);
+  complete_buffered_write(out, buf);
 
   return SQUAT_OK;
 }
 
 /* Write out the presence table for an "all documents" trie leaf. */
-static int dump_doc_list_present_bits(SquatIndex* index,
+static int dump_doc_list_present_bits(SquatWriteBuffer* out,
                                       SquatWordTableLeafDocs* docs) {
   int start_present = docs->first_valid_entry;
   int end_present = docs->last_valid_entry;
@@ -1153,7 +1192,7 @@ static int dump_doc_list_present_bits(SquatIndex* index,
   /* if it's a singleton < 32, then we can't use the one-byte
      representation because it would be mistaken for a starting byte */
   if (end_present == start_present && end_present >= 32) {
-    if ((buf = prepare_buffered_write(&index->out, 1)) == NULL) {
+    if ((buf = prepare_buffered_write(out, 1)) == NULL) {
       return SQUAT_ERR;
     } else {
       *buf++ = (char)end_present;
@@ -1163,7 +1202,7 @@ static int dump_doc_list_present_bits(SquatIndex* index,
     int first_byte = start_present >> 3;
     int byte_count = (end_present >> 3) - first_byte + 1;
 
-    if ((buf = prepare_buffered_write(&index->out, 2 + byte_count)) == NULL) {
+    if ((buf = prepare_buffered_write(out, 2 + byte_count)) == NULL) {
       return SQUAT_ERR;
     } else {
       int i;
@@ -1181,13 +1220,13 @@ static int dump_doc_list_present_bits(SquatIndex* index,
       buf += byte_count;
     }
   }
-  complete_buffered_write(&index->out, buf);
+  complete_buffered_write(out, buf);
   
   return SQUAT_OK;
 }
 
 /* Write out the document lists for an "all documents" trie leaf. */
-static int dump_doc_list_docs(SquatIndex* index,
+static int dump_doc_list_docs(SquatWriteBuffer* out,
                               SquatWordTableLeafDocs* docs) {
   int i;
   WordDocEntry** doc_list = docs->docs;
@@ -1237,7 +1276,7 @@ static int dump_doc_list_docs(SquatIndex* index,
       }
 
       /* reserve more than enough space in the buffer */
-      if ((buf = prepare_buffered_write(&index->out, 10 + run_size))
+      if ((buf = prepare_buffered_write(out, 10 + run_size))
           == NULL) {
         return SQUAT_ERR;
       }
@@ -1280,23 +1319,22 @@ static int dump_doc_list_docs(SquatIndex* index,
         }
       }
 
-      complete_buffered_write(&index->out, buf);
+      complete_buffered_write(out, buf);
     }
   }
 
   return SQUAT_OK;
 }
 
-/* Write an "all documents" subtrie to the index file.
-   'result_offset' is an absolute offset within the file where this
-   subtrie was stored. We free the trie leaves as we go. */
-static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
+/* Write an "all documents" subtrie to 'out'.
+   'result_offset' is an absolute offset within 'out' where this
+   subtrie was stored. */
+static int write_trie_word_data(SquatWriteBuffer* out, SquatWordTable* t, int len,
                                 int* result_offset) {
   int i;
   int offsets[256];  /* Collect the offsets of the subtries in this array. */
   int off;
   SquatWordTableEntry* entries = t->entries;
-  int r;
 
   memset(offsets, 0, t->first_valid_entry*sizeof(int));
   if (len > 2) {
@@ -1305,12 +1343,10 @@ static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
       SquatWordTable* new_t = entries[i].table;
 
       if (new_t != NULL) {
-        if (write_trie_word_data(index, new_t, len - 1, offsets + i)
+        if (write_trie_word_data(out, new_t, len - 1, offsets + i)
             != SQUAT_OK) {
           return SQUAT_ERR;
         }
-        free(entries[i].table);
-        entries[i].table = NULL;
       } else {
         offsets[i] = 0;
       }
@@ -1321,14 +1357,12 @@ static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
       SquatWordTableLeafDocs* leaf_docs = entries[i].leaf_docs;
 
       if (leaf_docs != NULL) {
-        offsets[i] = index->out.total_output_bytes;
+        offsets[i] = out->total_output_bytes;
  
-        if (dump_doc_list_present_bits(index, leaf_docs) != SQUAT_OK
-            || dump_doc_list_docs(index, leaf_docs) != SQUAT_OK) {
+        if (dump_doc_list_present_bits(out, leaf_docs) != SQUAT_OK
+            || dump_doc_list_docs(out, leaf_docs) != SQUAT_OK) {
           return SQUAT_ERR;
         }
-        free(entries[i].leaf_docs);
-        entries[i].leaf_docs = NULL;
       } else {
         offsets[i] = 0;
       }
@@ -1338,7 +1372,7 @@ static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
 
   /* Now we've written out our subtries, we know where our branch
      table is going to be. */
-  *result_offset = off = index->out.total_output_bytes;
+  *result_offset = off = out->total_output_bytes;
 
   /* Relativize the offsets. This is just to reduce the probable
      magnitude of the numbers so they will pack better into I-format. */
@@ -1348,131 +1382,264 @@ static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
     }
   }
 
-  r = dump_word_table_offsets(index, t, offsets);
-
-  /* Mark this subtrie as empty. */
-  t->first_valid_entry = 256;
-  t->last_valid_entry = 0;
-
-  return r;
+  return dump_word_table_offsets(out, t, offsets);
 }
 
-/* Dump out a complete trie for the given initial byte from its temporary file.
-   The absolute offset of the trie's root table within the file is
-   returned in 'result_offset'. */
-static int dump_index_trie_words(SquatIndex* index, int first_char,
-                                 int* result_offset) {
-  SquatSearchIndex* old_index = index->old_index;
+/* Build the complete trie for the given initial byte from its temporary
+   file (which must have been flushed) and 'old_index', if any, and
+   serialize it into 'b->out'. Errors are recorded in 'b->error' rather
+   than the global error state, since this may be running on any
+   thread; so is the 'old_index' handle, which must not be used by any
+   other thread meanwhile. */
+static void build_trie(SquatIndex* index, SquatSearchIndex* old_index,
+                       int first_char, SquatTrieBuild* b) {
   SquatWriteBuffer* buf = index->index_buffers + first_char;
-  int num_words = index->total_num_words[first_char];
+  int num_words = buf->buf != NULL ? index->total_num_words[first_char] : 0;
   WordDocEntry* doc_table;
-  char const* word_list_ptr;
-  int r = SQUAT_OK;
+  char const* word_list_ptr = NULL;
   char const* word_ptr;
   int existing = 0;
 
+  b->index = index;
+  b->error = SQUAT_ERR_OK;
+  b->root_offset = 0;
+  b->out.buf = NULL;
+
   if (old_index &&
       squat_count_docs(old_index, first_char, &existing) != SQUAT_OK) {
-    return(SQUAT_ERR);
+    b->error = SQUAT_ERR_INVALID_INDEX_FILE;
+    return;
+  }
+  if (num_words + existing == 0) {
+    return;
   }
 
+  b->arena = new_mpool(0);
+  b->root = new_word_table(b->arena);
+
   /* Allocate all the necessary document-ID linked list entries at once. */
   doc_table = (WordDocEntry*)xmalloc(sizeof(WordDocEntry)*(num_words+existing));
-  index->word_doc_allocator = doc_table;
+  b->word_doc_allocator = doc_table;
 
   /* Send existing trie across first as those leafs have lowest doc IDs */
-  if (old_index) {
-    r = squat_scan(old_index, first_char, add_word_callback, index);
-    if (r != SQUAT_OK) {
-      r = SQUAT_ERR;
+  if (old_index &&
+      squat_scan(old_index, first_char, add_word_callback, b) != SQUAT_OK) {
+    b->error = SQUAT_ERR_INVALID_INDEX_FILE;
+    goto cleanup;
+  }
+
+  if (num_words > 0) {
+    /* mmap the temporary file. */
+    word_list_ptr = mmap(NULL, buf->total_output_bytes, PROT_READ, MAP_SHARED,
+                         buf->fd, 0);
+    if (word_list_ptr == MAP_FAILED) {
+      b->error = SQUAT_ERR_SYSERR;
       goto cleanup;
     }
-  }
+    word_ptr = word_list_ptr;
 
-  /* mmap the temporary file. */
-  word_list_ptr = mmap(NULL, buf->total_output_bytes, PROT_READ, MAP_SHARED,
-                       buf->fd, 0);
-  if (word_list_ptr == MAP_FAILED) {
-    squat_set_last_error(SQUAT_ERR_SYSERR);
-    r = SQUAT_ERR;
-    goto cleanup;
-  }
-  word_ptr = word_list_ptr;
+    /* Scan through the file */
+    while (num_words > 0) {
+      /* For each document, add all its words to the trie with this
+         document ID */
+      int doc_ID = (int)squat_decode_I(&word_ptr);
+      int doc_words = (int)squat_decode_I(&word_ptr);
 
-  /* Scan through the file */
-  while (num_words > 0) {
-    /* For each document, add all its words to the trie with this document ID */
-    int doc_ID = (int)squat_decode_I(&word_ptr);
-    int doc_words = (int)squat_decode_I(&word_ptr);
-   
-    num_words -= doc_words;
+      num_words -= doc_words;
 
-    while (doc_words > 0) {
-      if (add_word_to_trie(index, word_ptr, doc_ID)
-          != SQUAT_OK) {
-        r = SQUAT_ERR;
-        goto cleanup_map;
+      while (doc_words > 0) {
+        add_word_to_trie(b, word_ptr, doc_ID);
+        word_ptr += SQUAT_WORD_SIZE - 1;
+        doc_words--;
       }
-      word_ptr += SQUAT_WORD_SIZE - 1;
-      doc_words--;
     }
-  }
 
-  /* Make sure we read all the bytes from the temporary file. */
-  assert(word_ptr - word_list_ptr == buf->total_output_bytes);
- 
-  /* Now dump the trie to the index file. */
-  r = write_trie_word_data(index, index->doc_word_table,
-                           SQUAT_WORD_SIZE - 1, result_offset);
+    /* Make sure we read all the bytes from the temporary file. */
+    assert(word_ptr - word_list_ptr == buf->total_output_bytes);
 
-cleanup_map:
-  if (munmap((void*)word_list_ptr, buf->total_output_bytes) != 0
-    && r == SQUAT_OK) {
-    squat_set_last_error(SQUAT_ERR_SYSERR);
-    r = SQUAT_ERR;
+    if (munmap((void*)word_list_ptr, buf->total_output_bytes) != 0) {
+      b->error = SQUAT_ERR_SYSERR;
+      goto cleanup;
+    }
+  }
+
+  if (b->word_doc_allocator > doc_table) {
+    /* Now serialize the trie. The buffer grows as required, so
+       this can only fail on an internal error. */
+    init_memory_buffer(&b->out, 64*1024);
+    if (write_trie_word_data(&b->out, b->root, SQUAT_WORD_SIZE - 1,
+                             &b->root_offset) != SQUAT_OK) {
+      b->error = SQUAT_ERR;
+    }
   }
 
 cleanup:
   free(doc_table);
+  free_mpool(b->arena);
+}
+
+/* Append the serialized trie in 'b' to the index file and release it.
+   The absolute offset of the trie's root table within the file is
+   returned in 'result_offset', or 0 if the trie is empty. */
+static int write_trie(SquatIndex* index, SquatTrieBuild* b,
+                      int* result_offset) {
+  int base = index->out.total_output_bytes - 1;
+  int r = SQUAT_OK;
+
+  *result_offset = 0;
+  if (b->error != SQUAT_ERR_OK) {
+    squat_set_last_error(b->error);
+    r = SQUAT_ERR;
+  } else if (b->root_offset > 0) {
+    char* buf = prepare_buffered_write(&index->out, b->out.data_len);
+
+    if (buf == NULL) {
+      r = SQUAT_ERR;
+    } else {
+      memcpy(buf, b->out.buf, b->out.data_len);
+      complete_buffered_write(&index->out, buf + b->out.data_len);
+      *result_offset = base + b->root_offset;
+    }
+  }
+
+  free(b->out.buf);
+  b->out.buf = NULL;
 
   return r;
 }
 
-static int dump_index_trie_words_no_file(SquatIndex* index,
-                                         int first_char,
-                                         int* result_offset) {
-  SquatSearchIndex* old_index = index->old_index;
-  WordDocEntry* doc_table;
+/* The tries being built by squat_index_finish, and the handles on
+   the old index they are built from, one for each worker thread. */
+typedef struct {
+  SquatIndex* index;
+  SquatSearchIndex** old_indexes;
+  int* offset_buf;
+  SquatTrieBuild builds[256];
+} SquatTrieBuilds;
+
+static void build_trie_work(void* closure, int worker, int i) {
+  SquatTrieBuilds* tb = (SquatTrieBuilds*)closure;
+
+  build_trie(tb->index, tb->old_indexes[worker], i, tb->builds + i);
+}
+
+static int write_trie_done(void* closure, int i) {
+  SquatTrieBuilds* tb = (SquatTrieBuilds*)closure;
+  SquatIndex* index = tb->index;
+  int r;
+
+  if (index->stats_callback != NULL) {
+    SquatStatsEvent event;
+
+    event.generic.type = SQUAT_STATS_COMPLETED_INITIAL_CHAR;
+    event.completed_initial_char.completed_char = i;
+    event.completed_initial_char.num_words = index->total_num_words[i];
+    if (index->index_buffers[i].buf != NULL) {
+      event.completed_initial_char.temp_file_size =
+        index->index_buffers[i].total_output_bytes;
+    } else {
+      event.completed_initial_char.temp_file_size = 0;
+    }
+    index->stats_callback(index->stats_callback_closure, &event);
+  }
+
+  r = write_trie(index, tb->builds + i, tb->offset_buf + i);
+
+  /* Close files and free memory as we go. This could be important
+     if disk space is low and we're generating a huge index. */
+  if (index->index_buffers[i].buf != NULL) {
+    if (close(index->index_buffers[i].fd) < 0 && r == SQUAT_OK) {
+      squat_set_last_error(SQUAT_ERR_SYSERR);
+      r = SQUAT_ERR;
+    }
+    free(index->index_buffers[i].buf);
+    index->index_buffers[i].buf = NULL;
+  }
+
+  return r == SQUAT_OK ? 0 : r;
+}
+
+/* The SquatThreadRunner for when we have no threads */
+static int run_serial(int threads __attribute__((unused)), int n,
+                      int ahead __attribute__((unused)),
+                      void (*work)(void* closure, int worker, int i),
+                      int (*done)(void* closure, int i),
+                      void* closure) {
+  int i, r;
+
+  for (i = 0; i < n; i++) {
+    work(closure, 0, i);
+    if ((r = done(closure, i)) != 0) {
+      return r;
+    }
+  }
+  return 0;
+}
+
+/* Build and write out the trie for every initial byte. The offsets
+   are collected in 'offset_buf'. */
+static int write_tries(SquatIndex* index, int* offset_buf) {
+  SquatThreadRunner run = run_serial;
+  SquatTrieBuilds* tb;
+  int threads = 1;
   int r = SQUAT_OK;
-  int existing = 0;
+  int err;
+  unsigned i;
+  int t;
 
-  if (!old_index)
-    return(SQUAT_OK);   /* Should never happen? */
-    
-  if (squat_count_docs(old_index, first_char, &existing) != SQUAT_OK)
-    return(SQUAT_ERR);
-  if (existing == 0)
-    return(SQUAT_OK);
+  /* We have to flush the temporary file output buffers before we try
+     to use the temporary files. */
+  for (i = 0; i < VECTOR_SIZE(index->index_buffers); i++) {
+    if (index->index_buffers[i].buf != NULL
+        && flush_and_reset_buffered_writes(index->index_buffers + i)
+           != SQUAT_OK) {
+      return SQUAT_ERR;
+    }
+  }
 
-  /* Allocate all the necessary document-ID linked list entries at once. */
-  doc_table = (WordDocEntry*)xmalloc(sizeof(WordDocEntry)*existing);
-  index->word_doc_allocator = doc_table;
+  if (index->run_threads != NULL) {
+    run = index->run_threads;
+    threads = index->threads;
+  }
 
-  /* Send existing trie across first as those leafs have lowest doc IDs */
-  r = squat_scan(old_index, first_char, add_word_callback, index);
-  if (r != SQUAT_OK) {
+  tb = (SquatTrieBuilds*)xzmalloc(sizeof(SquatTrieBuilds));
+  tb->index = index;
+  tb->offset_buf = offset_buf;
+  tb->old_indexes =
+    (SquatSearchIndex**)xzmalloc(threads*sizeof(SquatSearchIndex*));
+
+  /* Each thread scans the old index through its own handle */
+  tb->old_indexes[0] = index->old_index;
+  for (t = 1; index->old_index != NULL && t < threads; t++) {
+    tb->old_indexes[t] = squat_search_reopen(index->old_index);
+    if (tb->old_indexes[t] == NULL) {
+      r = SQUAT_ERR;
+      break;
+    }
+  }
+
+  if (r == SQUAT_OK &&
+      run(threads, VECTOR_SIZE(tb->builds), 2*threads,
+          build_trie_work, write_trie_done, tb) != 0) {
     r = SQUAT_ERR;
-    goto cleanup;
   }
- 
-  if (index->word_doc_allocator > doc_table) {
-    /* Now dump the trie to the index file. */
-    r = write_trie_word_data(index, index->doc_word_table,
-                             SQUAT_WORD_SIZE - 1, result_offset);
+
+  /* Closing the extra handles mustn't hide why we failed */
+  err = squat_get_last_error();
+  for (t = 1; t < threads; t++) {
+    if (tb->old_indexes[t] != NULL) {
+      squat_search_close(tb->old_indexes[t]);
+    }
   }
+  squat_set_last_error(err);
+
+  /* On error, there may be tries built but never written */
+  for (i = 0; i < VECTOR_SIZE(tb->builds); i++) {
+    free(tb->builds[i].out.buf);
+  }
+  free(tb->old_indexes);
+  free(tb);
 
- cleanup:
-  free(doc_table);
   return r;
 }
 
@@ -1499,9 +1666,12 @@ static int index_close_internal(SquatIndex* index, int OK) {
     squat_index_close_document(index);
   }
 
-  /* Clear the current trie. We are now going to use it to build
-     all-documents tries. */
-  delete_doc_word_table(index->doc_word_table, SQUAT_WORD_SIZE);
+  /* Release the per-document trie. Its root is reused for the table
+     of initial bytes. */
+  free_mpool(index->doc_leaves);
+  free_mpool(index->doc_tables);
+  index->doc_leaves = index->doc_tables = NULL;
+  free(index->doc_word_table);
   init_doc_word_table(&index->doc_word_table);
 
   /* Write out the array that maps document IDs to offsets of the
@@ -1522,46 +1692,9 @@ static int index_close_internal(SquatIndex* index, int OK) {
   /* Now write out the trie for every initial byte that we saw. The
      offsets are collected in 'offset_buf'. */
   memset(offset_buf, 0, sizeof(offset_buf));
-  for (i = 0; i < VECTOR_SIZE(index->index_buffers); i++) {
-    if (index->stats_callback != NULL) {
-      SquatStatsEvent event;
-
-      event.generic.type = SQUAT_STATS_COMPLETED_INITIAL_CHAR;
-      event.completed_initial_char.completed_char = i;
-      event.completed_initial_char.num_words = index->total_num_words[i];
-      if (index->index_buffers[i].buf != NULL) {
-        event.completed_initial_char.temp_file_size =
-          index->index_buffers[i].total_output_bytes;
-      } else {
-        event.completed_initial_char.temp_file_size = 0;
-      }
-      index->stats_callback(index->stats_callback_closure, &event);
-    }
-
-    if (index->index_buffers[i].buf != NULL) {
-      /* We have to flush the temporary file output buffer before we try to use
-	 the temporary file. */
-      if (flush_and_reset_buffered_writes(index->index_buffers + i) != SQUAT_OK
-          || dump_index_trie_words(index, i, offset_buf + i) != SQUAT_OK) {
-        r = SQUAT_ERR;
-        goto cleanup;
-      }
-      /* Close files and free memory as we go. This could be important
-	 if disk space is low and we're generating a huge index. */
-      if (close(index->index_buffers[i].fd) < 0) {
-        squat_set_last_error(SQUAT_ERR_SYSERR);
-        r = SQUAT_ERR;
-      }
-      free(index->index_buffers[i].buf);
-      index->index_buffers[i].buf = NULL;
-    } else if (index->old_index) {
-      /* Only needed if incremental updates going on */
-      /* Just copy across existing trie if nothing new to merge in */
-      if (dump_index_trie_words_no_file(index, i, offset_buf + i) != SQUAT_OK) {
-        r = SQUAT_ERR;
-        goto cleanup;
-      }
-    }
+  if (write_tries(index, offset_buf) != SQUAT_OK) {
+    r = SQUAT_ERR;
+    goto cleanup;
   }
 
   /* Save the offset where the root of the index trie is going to go. */
@@ -1580,7 +1713,7 @@ static int index_close_internal(SquatIndex* index, int OK) {
   }
 
   /* Dump out the offset buffer at last. */
-  if (dump_word_table_offsets(index, index->doc_word_table, offset_buf)
+  if (dump_word_table_offsets(&index->out, index->doc_word_table, offset_buf)
       != SQUAT_OK) {
     r = SQUAT_ERR;
     goto cleanup;
@@ -1625,7 +1758,9 @@ static int index_close_internal(SquatIndex* index, int OK) {
 
 cleanup:
   free(index->out.buf);
-  delete_doc_word_table(index->doc_word_table, SQUAT_WORD_SIZE - 1);
+  free_mpool(index->doc_leaves);
+  free_mpool(index->doc_tables);
+  free(index->doc_word_table);
   /* If we're bailing out because of an error, we might not have
      released all the temporary file resources. */
   for (i = 0; i < VECTOR_SIZE(index->index_buffers); i++) {
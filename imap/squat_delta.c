@@ -0,0 +1,495 @@
+/* squat_delta.c -- SQUAT index of recently appended messages
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "charset.h"
+#include "cyr_lock.h"
+#include "global.h"
+#include "imap_err.h"
+#include "mailbox.h"
+#include "message.h"
+#include "xmalloc.h"
+
+#include "squat_delta.h"
+
+/* ====================================================================== */
+
+struct getsearchtext_rock {
+    int uid;
+    index_search_text_receiver_t *receiver;
+    void *rock;
+};
+
+static int getsearchtext_cb(int kind, int istop,
+			    const char *text, unsigned long len,
+			    int charset, int encoding, void *rock)
+{
+    struct getsearchtext_rock *gr = (struct getsearchtext_rock *) rock;
+
+    if (kind == MESSAGE_TEXT_BODY) {
+	charset_extractfile(gr->receiver, gr->rock, gr->uid,
+			    text, len, charset, encoding);
+    }
+    else if (istop) {
+	gr->receiver(gr->uid, SEARCHINDEX_PART_HEADERS,
+		     SEARCHINDEX_CMD_STUFFPART, text, len, gr->rock);
+	gr->receiver(gr->uid, SEARCHINDEX_PART_BODY,
+		     SEARCHINDEX_CMD_BEGINPART, NULL, 0, gr->rock);
+    }
+    else {
+	gr->receiver(gr->uid, SEARCHINDEX_PART_BODY,
+		     SEARCHINDEX_CMD_APPENDPART, text, len, gr->rock);
+    }
+
+    return 0;
+}
+
+/*
+ * Extract the text of a message's MIME parts.
+ */
+static void squat_getsearchtextmsg(struct mailbox *mailbox, int uid,
+				   index_search_text_receiver_t receiver,
+				   void *rock, const char *cachestr)
+{
+    const char *msg_base = NULL;
+    unsigned long msg_size = 0;
+    struct getsearchtext_rock gr;
+
+    if (mailbox_map_message(mailbox, uid, &msg_base, &msg_size))
+	return;
+
+    /* Won't find anything in a truncated file */
+    if (msg_size > 0) {
+	gr.uid = uid;
+	gr.receiver = receiver;
+	gr.rock = rock;
+	message_foreach_text_section(msg_base, msg_size, cachestr, 0,
+				     getsearchtext_cb, &gr);
+
+	receiver(uid, SEARCHINDEX_PART_BODY,
+		 SEARCHINDEX_CMD_ENDPART, NULL, 0, rock);
+    }
+
+    mailbox_unmap_message(mailbox, uid, &msg_base, &msg_size);
+}
+
+void squat_getsearchtext(struct mailbox *mailbox,
+			 struct index_record *record,
+			 index_search_text_receiver_t receiver,
+			 void *rock)
+{
+    if (mailbox_cacherecord(mailbox, record))
+	return;
+
+    squat_getsearchtextmsg(mailbox, record->uid, receiver, rock,
+			   cacheitem_base(record, CACHE_SECTION));
+    receiver(record->uid, SEARCHINDEX_PART_FROM, SEARCHINDEX_CMD_STUFFPART,
+	     cacheitem_base(record, CACHE_FROM),
+	     cacheitem_size(record, CACHE_FROM), rock);
+    receiver(record->uid, SEARCHINDEX_PART_TO, SEARCHINDEX_CMD_STUFFPART,
+	     cacheitem_base(record, CACHE_TO),
+	     cacheitem_size(record, CACHE_TO), rock);
+    receiver(record->uid, SEARCHINDEX_PART_CC, SEARCHINDEX_CMD_STUFFPART,
+	     cacheitem_base(record, CACHE_CC),
+	     cacheitem_size(record, CACHE_CC), rock);
+    receiver(record->uid, SEARCHINDEX_PART_BCC, SEARCHINDEX_CMD_STUFFPART,
+	     cacheitem_base(record, CACHE_BCC),
+	     cacheitem_size(record, CACHE_BCC), rock);
+    receiver(record->uid, SEARCHINDEX_PART_SUBJECT, SEARCHINDEX_CMD_STUFFPART,
+	     cacheitem_base(record, CACHE_SUBJECT),
+	     cacheitem_size(record, CACHE_SUBJECT), rock);
+}
+
+/* ====================================================================== */
+
+struct delta_docs {
+    struct mailbox *mailbox;
+    unsigned long dropuid;	/* drop documents up to this UID */
+    unsigned long lastuid;	/* of the last document kept */
+    unsigned nmsgs;		/* messages kept */
+    int found_validity;
+    int valid;
+};
+
+static int delta_validity(void *closure, SquatListDoc const *doc)
+{
+    struct delta_docs *dd = (struct delta_docs *) closure;
+
+    /* the validity document is always written first */
+    if (!strncmp(doc->doc_name, "validity.", 9) &&
+	strtoul(doc->doc_name + 9, NULL, 10) == dd->mailbox->i.uidvalidity) {
+	dd->found_validity = 1;
+    }
+    return SQUAT_CALLBACK_ABORT;
+}
+
+/* decide which documents of the old delta index to keep */
+static int delta_choose(void *closure, SquatListDoc const *doc)
+{
+    struct delta_docs *dd = (struct delta_docs *) closure;
+    unsigned long uid;
+
+    if (!strncmp(doc->doc_name, "validity.", 9))
+	return 1;
+
+    if (!doc->doc_name[0] || !strchr("tfcbsmh", doc->doc_name[0])) {
+	syslog(LOG_ERR, "Invalid document name: %s", doc->doc_name);
+	dd->valid = 0;
+	return 0;
+    }
+
+    uid = strtoul(doc->doc_name + 1, NULL, 10);
+    if (uid <= dd->dropuid)
+	return 0;
+
+    /* a message's documents are added together */
+    if (uid != dd->lastuid) {
+	dd->nmsgs++;
+	dd->lastuid = uid;
+    }
+    return 1;
+}
+
+SquatSearchIndex *squat_delta_open(struct mailbox *mailbox, int *fdp)
+{
+    SquatSearchIndex *index;
+    struct delta_docs dd;
+    int fd;
+
+    fd = open(mailbox_meta_fname(mailbox, META_SQUATDELTA), O_RDONLY);
+    if (fd < 0) return NULL;
+
+    index = squat_search_open(fd);
+    if (!index) {
+	close(fd);
+	return NULL;
+    }
+
+    memset(&dd, 0, sizeof(dd));
+    dd.mailbox = mailbox;
+    squat_search_list_docs(index, delta_validity, &dd);
+    if (!dd.found_validity) {
+	squat_delta_close(index, fd);
+	return NULL;
+    }
+
+    *fdp = fd;
+    return index;
+}
+
+void squat_delta_close(SquatSearchIndex *index, int fd)
+{
+    if (index) squat_search_close(index);
+    if (fd >= 0) close(fd);
+}
+
+struct delta_receiver_data {
+    SquatIndex *index;
+    int err;
+};
+
+/* Like squatter's receiver: file each part under its document name,
+   skipping any too short to search */
+static void delta_receiver(int uid, int part, int cmd,
+			   char const *text, int text_len, void *rock)
+{
+    struct delta_receiver_data *d = (struct delta_receiver_data *) rock;
+
+    if (d->err) return;
+
+    if (cmd & SEARCHINDEX_CMD_BEGINPART) {
+	char buf[100];
+	char part_char = 0;
+
+	switch (part) {
+	case SEARCHINDEX_PART_FROM: part_char = 'f'; break;
+	case SEARCHINDEX_PART_TO:   part_char = 't'; break;
+	case SEARCHINDEX_PART_CC:   part_char = 'c'; break;
+	case SEARCHINDEX_PART_BCC:  part_char = 'b'; break;
+	case SEARCHINDEX_PART_SUBJECT: part_char = 's'; break;
+	case SEARCHINDEX_PART_HEADERS: part_char = 'h'; break;
+	case SEARCHINDEX_PART_BODY: part_char = 'm'; break;
+	default:
+	    d->err = 1;
+	    return;
+	}
+
+	snprintf(buf, sizeof(buf), "%c%d", part_char, uid);
+
+	if ((cmd & SEARCHINDEX_CMD_ENDPART)
+	    && (!(cmd & SEARCHINDEX_CMD_APPENDPART)
+		|| text_len < SQUAT_WORD_SIZE)) {
+	    return;
+	}
+
+	if (squat_index_open_document(d->index, buf) != SQUAT_OK) {
+	    d->err = 1;
+	    return;
+	}
+    }
+
+    if (cmd & SEARCHINDEX_CMD_APPENDPART) {
+	if (squat_index_append_document(d->index, text, text_len) != SQUAT_OK)
+	    d->err = 1;
+    }
+
+    if (cmd & SEARCHINDEX_CMD_ENDPART) {
+	if (squat_index_close_document(d->index) != SQUAT_OK)
+	    d->err = 1;
+    }
+}
+
+/*
+ * Open and lock the delta index's .NEW file, which is what serialises
+ * writers of the delta index.  The last holder may have renamed it
+ * into place or removed it, so make sure the file we lock is still
+ * the one under that name.  Returns IMAP_MAILBOX_LOCKED if 'nonblock'
+ * is set and someone else has it.
+ */
+static int delta_lock_new(const char *newfname, int nonblock, int *fdp)
+{
+    struct stat sbuf, fbuf;
+    int fd;
+
+    for (;;) {
+	fd = open(newfname, O_CREAT|O_WRONLY, 0666);
+	if (fd < 0) {
+	    syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	    return IMAP_IOERROR;
+	}
+	if ((nonblock ? lock_nonblocking(fd) : lock_blocking(fd)) < 0) {
+	    close(fd);
+	    if (nonblock && (errno == EWOULDBLOCK || errno == EAGAIN ||
+			     errno == EACCES))
+		return IMAP_MAILBOX_LOCKED;
+	    syslog(LOG_ERR, "IOERROR: locking %s: %m", newfname);
+	    return IMAP_IOERROR;
+	}
+	if (fstat(fd, &fbuf) == 0 && stat(newfname, &sbuf) == 0 &&
+	    fbuf.st_dev == sbuf.st_dev && fbuf.st_ino == sbuf.st_ino)
+	    break;
+	close(fd);
+    }
+
+    if (ftruncate(fd, 0) < 0) {
+	syslog(LOG_ERR, "IOERROR: truncating %s: %m", newfname);
+	close(fd);
+	return IMAP_IOERROR;
+    }
+
+    *fdp = fd;
+    return 0;
+}
+
+/*
+ * Write a new delta index for 'mailbox' holding the documents of the
+ * current one for messages after 'dropuid', plus (if 'firstuid' is
+ * non-zero) those of the messages from 'firstuid' on, up to 'maxmsgs'
+ * messages in all.  If that leaves nothing, the delta index is removed.
+ * If 'nonblock' is set and another process is rewriting the delta
+ * index, does nothing.
+ */
+static int squat_delta_rewrite(struct mailbox *mailbox,
+			       unsigned long dropuid,
+			       unsigned long firstuid,
+			       unsigned maxmsgs, int nonblock)
+{
+    SquatSearchIndex *old_index = NULL;
+    struct delta_receiver_data data;
+    struct delta_docs dd;
+    struct index_record record;
+    SquatOptions options;
+    struct stat sbuf;
+    char buf[100];
+    char *newfname;
+    uint32_t recno;
+    int old_fd = -1, new_fd = -1;
+    int r = 0;
+
+    memset(&dd, 0, sizeof(dd));
+    dd.mailbox = mailbox;
+    dd.dropuid = dropuid;
+    dd.valid = 1;
+
+    /* nothing to drop from */
+    if (!firstuid &&
+	stat(mailbox_meta_fname(mailbox, META_SQUATDELTA), &sbuf) < 0)
+	return 0;
+
+    newfname = mailbox_meta_newfname(mailbox, META_SQUATDELTA);
+    r = delta_lock_new(newfname, nonblock, &new_fd);
+    if (r == IMAP_MAILBOX_LOCKED) {
+	/* whoever has it may miss our messages; they're searched
+	   directly until the next rewrite or squatter run */
+	return 0;
+    }
+    if (r) return r;
+
+    old_index = squat_delta_open(mailbox, &old_fd);
+    if (!old_index && !firstuid) {
+	unlink(newfname);
+	goto done;
+    }
+
+    options.option_mask = SQUAT_OPTION_TMP_PATH;
+    options.tmp_path = mailbox_datapath(mailbox);
+    data.index = squat_index_init(new_fd, &options);
+    data.err = 0;
+    if (!data.index) {
+	unlink(newfname);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+
+    if (old_index) {
+	/* Copy the documents we are keeping.  They keep their doc_IDs,
+	   so they must go in before any new ones. */
+	if (squat_index_add_existing(data.index, old_index,
+				     delta_choose, &dd) != SQUAT_OK ||
+	    !dd.valid) {
+	    data.err = 1;
+	}
+    }
+    else {
+	snprintf(buf, sizeof(buf), "validity.%u", mailbox->i.uidvalidity);
+	if (squat_index_open_document(data.index, buf) != SQUAT_OK ||
+	    squat_index_close_document(data.index) != SQUAT_OK) {
+	    data.err = 1;
+	}
+    }
+
+    /* pick up anything a rewrite we skipped for would have added */
+    if (firstuid && dd.lastuid && dd.lastuid + 1 < firstuid)
+	firstuid = dd.lastuid + 1;
+
+    if (firstuid && !data.err) {
+	/* the new records are at the end, find the first one */
+	for (recno = mailbox->i.num_records; recno > 0; recno--) {
+	    if (mailbox_read_index_record(mailbox, recno, &record)) {
+		data.err = 1;
+		break;
+	    }
+	    if (record.uid < firstuid) break;
+	}
+
+	for (recno++; !data.err && recno <= mailbox->i.num_records; recno++) {
+	    if (dd.nmsgs >= maxmsgs) break;
+	    if (mailbox_read_index_record(mailbox, recno, &record)) {
+		data.err = 1;
+		break;
+	    }
+	    if (record.system_flags & FLAG_EXPUNGED) continue;
+	    squat_getsearchtext(mailbox, &record, delta_receiver, &data);
+	    dd.nmsgs++;
+	}
+    }
+
+    if (data.err) {
+	squat_index_destroy(data.index);
+	r = IMAP_IOERROR;
+    }
+    else if (!dd.nmsgs) {
+	/* nothing left to keep */
+	squat_index_destroy(data.index);
+	unlink(newfname);
+	unlink(mailbox_meta_fname(mailbox, META_SQUATDELTA));
+	goto done;
+    }
+    else if (squat_index_finish(data.index) != SQUAT_OK) {
+	r = IMAP_IOERROR;
+    }
+
+    if (!r && fsync(new_fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: fsyncing %s: %m", newfname);
+	r = IMAP_IOERROR;
+    }
+
+    /* still locked, so nobody truncates it on its way into place */
+    if (!r) r = mailbox_meta_rename(mailbox, META_SQUATDELTA);
+
+    if (r) {
+	syslog(LOG_ERR, "IOERROR: updating SQUAT delta index for %s: %s",
+	       mailbox->name, error_message(r));
+	/* the old one is still right, as far as it goes */
+	unlink(mailbox_meta_newfname(mailbox, META_SQUATDELTA));
+    }
+
+ done:
+    /* closing it drops the lock */
+    if (new_fd >= 0) close(new_fd);
+    squat_delta_close(old_index, old_fd);
+
+    return r;
+}
+
+void squat_delta_update(struct mailbox *mailbox, unsigned long firstuid)
+{
+    int maxmsgs = config_getint(IMAPOPT_SEARCH_SQUAT_DELTA);
+    struct stat sbuf;
+
+    if (!SQUAT_ENGINE || maxmsgs <= 0) return;
+    if (!firstuid || firstuid > mailbox->i.last_uid) return;
+
+    /* only mailboxes which squatter looks after */
+    if (stat(mailbox_meta_fname(mailbox, META_SQUAT), &sbuf) < 0) return;
+
+    squat_delta_rewrite(mailbox, 0, firstuid, maxmsgs, 1);
+}
+
+int squat_delta_merge(struct mailbox *mailbox, unsigned long lastuid)
+{
+    return squat_delta_rewrite(mailbox, lastuid, 0, 0, 0);
+}
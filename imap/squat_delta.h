@@ -0,0 +1,81 @@
+/* squat_delta.h -- SQUAT index of recently appended messages
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_SQUAT_DELTA_H
+#define INCLUDED_SQUAT_DELTA_H
+
+#include "charset.h"
+#include "mailbox.h"
+#include "squat.h"
+
+/*
+ * The delta index (cyrus.squat.delta) is a small SQUAT index, in the
+ * same format and with the same document names as cyrus.squat, of
+ * messages appended since squatter last ran.  After an append,
+ * mailbox_close() rebuilds it with the new messages added, once the
+ * index lock is gone; squatter drops everything it has folded into
+ * cyrus.squat.  Searches use both files.
+ */
+
+/* Send the canonical search text of each part of 'record' to
+ * 'receiver', as index_getsearchtext_single() does. */
+extern void squat_getsearchtext(struct mailbox *mailbox,
+				struct index_record *record,
+				index_search_text_receiver_t receiver,
+				void *rock);
+
+/* Open the delta index of 'mailbox' for searching.  Returns NULL if
+ * there is none, or it was built for a different UIDVALIDITY. */
+extern SquatSearchIndex *squat_delta_open(struct mailbox *mailbox, int *fdp);
+extern void squat_delta_close(SquatSearchIndex *index, int fd);
+
+/* Add the messages from 'firstuid' up to the end of 'mailbox' to its
+ * delta index.  The index needn't be locked; if another process is
+ * rewriting the delta index, this does nothing. */
+extern void squat_delta_update(struct mailbox *mailbox, unsigned long firstuid);
+
+/* Forget the messages up to 'lastuid', which squatter has indexed
+ * into cyrus.squat.  The mailbox must be locked. */
+extern int squat_delta_merge(struct mailbox *mailbox, unsigned long lastuid);
+
+#endif /* INCLUDED_SQUAT_DELTA_H */
@@ -0,0 +1,173 @@
+/* squat_threads.c -- run SQUAT index building work on several threads
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "squat.h"
+#include "xmalloc.h"
+
+/* The work being shared out. Threads take the next piece in turn, but
+   don't run more than 'ahead' past the last one done, so only a few
+   finished pieces are waiting at once. */
+typedef struct {
+  int n;
+  int ahead;
+  int next;                 /* The next piece to start */
+  int written;              /* Pieces below this are done */
+  char* finished;           /* finished[i] is set once i has been worked */
+  void (*work)(void* closure, int worker, int i);
+  void* closure;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} SquatWorkQueue;
+
+typedef struct {
+  SquatWorkQueue* q;
+  int id;
+  pthread_t thread;
+} SquatWorker;
+
+static void* worker_thread(void* arg) {
+  SquatWorker* w = (SquatWorker*)arg;
+  SquatWorkQueue* q = w->q;
+
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    int i;
+
+    while (q->next < q->n && q->next >= q->written + q->ahead) {
+      pthread_cond_wait(&q->cond, &q->lock);
+    }
+    if (q->next >= q->n) {
+      break;
+    }
+    i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+
+    q->work(q->closure, w->id, i);
+
+    pthread_mutex_lock(&q->lock);
+    q->finished[i] = 1;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
+}
+
+int squat_run_threads(int threads, int n, int ahead,
+                      void (*work)(void* closure, int worker, int i),
+                      int (*done)(void* closure, int i),
+                      void* closure) {
+  SquatWorkQueue q;
+  SquatWorker* workers;
+  int num_workers, i, t;
+  int r = 0;
+
+  memset(&q, 0, sizeof(q));
+  q.n = n;
+  q.ahead = ahead;
+  q.finished = (char*)xzmalloc(n);
+  q.work = work;
+  q.closure = closure;
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.cond, NULL);
+
+  workers = (SquatWorker*)xmalloc(threads*sizeof(SquatWorker));
+  for (num_workers = 0; num_workers < threads; num_workers++) {
+    workers[num_workers].q = &q;
+    workers[num_workers].id = num_workers;
+    if (pthread_create(&workers[num_workers].thread, NULL,
+                       worker_thread, workers + num_workers) != 0) {
+      /* Carry on with the threads we have; we always have this one */
+      syslog(LOG_WARNING, "squat: only started %d of %d threads",
+             num_workers, threads);
+      break;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (num_workers > 0) {
+      pthread_mutex_lock(&q.lock);
+      while (!q.finished[i]) {
+        pthread_cond_wait(&q.cond, &q.lock);
+      }
+      pthread_mutex_unlock(&q.lock);
+    } else {
+      work(closure, 0, i);
+    }
+
+    r = done(closure, i);
+
+    if (num_workers > 0) {
+      pthread_mutex_lock(&q.lock);
+      q.written = i + 1;
+      if (r != 0) {
+        /* No point starting anything more */
+        q.next = n;
+      }
+      pthread_cond_broadcast(&q.cond);
+      pthread_mutex_unlock(&q.lock);
+    }
+    if (r != 0) {
+      break;
+    }
+  }
+
+  for (t = 0; t < num_workers; t++) {
+    pthread_join(workers[t].thread, NULL);
+  }
+  pthread_cond_destroy(&q.cond);
+  pthread_mutex_destroy(&q.lock);
+  free(workers);
+  free(q.finished);
+
+  return r;
+}
+
+#endif /* HAVE_PTHREAD */
@@ -67,6 +67,15 @@
   in "cyrus.squat.tmp" and then, if creation was successful, it is
   atomically renamed to "cyrus.squat". This guarantees that we don't
   interfere with anyone who has the old index open.
+
+  Messages appended after the index was built go into a small delta
+  index, "cyrus.squat.delta" (see squat_delta.c), if search_squat_delta
+  is set. Once a new index is in place we drop the messages it covers
+  from the delta index, under the mailbox lock so that we don't lose
+  any that arrive meanwhile.
+
+  If search_textindex is enabled, the text index "cyrus.search" (see
+  search_text.c) is rebuilt the same way.
 */
 
 #include <config.h>
@@ -78,7 +87,10 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <syslog.h>
 #include <string.h>
 
@@ -96,7 +108,10 @@
 #include "seen.h"
 #include "mboxname.h"
 #include "map.h"
+#include "retry.h"
 #include "squat.h"
+#include "squat_delta.h"
+#include "search_text.h"
 #include "index.h"
 #include "util.h"
 
@@ -125,6 +140,8 @@ static int verbose = 0;
 static int mailbox_count = 0;
 static int skip_unmodified = 0;
 static int incremental_mode = 0;
+static int jobs = 1;
+static int threads = 1;
 static SquatStats total_stats;
 
 static void start_stats(SquatStats* stats) {
@@ -145,10 +162,27 @@ static void print_stats(FILE* out, SquatStats* stats) {
           stats->index_size, (int) (stats->end_time - stats->start_time));
 }
 
+static void log_throughput(SquatStats* stats) {
+  int secs = stats->end_time - stats->start_time;
+
+  if (secs < 1) secs = 1;
+  syslog(LOG_NOTICE, "indexed %d mailboxes, %lu messages (%lu bytes) "
+         "in %d seconds with %d jobs: %lu messages/sec, %lu KB/sec",
+         mailbox_count, stats->indexed_messages, stats->indexed_bytes,
+         secs, jobs, stats->indexed_messages / secs,
+         stats->indexed_bytes / 1024 / secs);
+  if (verbose > 0) {
+    printf("Throughput: %lu messages/sec, %lu KB/sec\n",
+           stats->indexed_messages / secs,
+           stats->indexed_bytes / 1024 / secs);
+  }
+}
+
 static int usage(const char *name)
 {
     fprintf(stderr,
-	    "usage: %s [-C <alt_config>] [-r] [-s] [-a] [-v] [mailbox...]\n",
+	    "usage: %s [-C <alt_config>] [-r] [-s] [-i] [-a] [-v] [-j <jobs>]"
+	    " [-t <threads>] [mailbox...]\n",
 	    name);
  
     exit(EC_USAGE);
@@ -401,6 +435,15 @@ static int squat_single(struct index_state *state, int incremental)
     options.tmp_path = mailbox_datapath(mailbox);
     options.stats_callback = stats_callback;
     options.stats_callback_closure = NULL;
+    if (threads > 1) {
+	options.option_mask |= SQUAT_OPTION_THREADS;
+	options.threads = threads;
+#ifdef HAVE_PTHREAD
+	options.run_threads = squat_run_threads;
+#else
+	options.run_threads = NULL;
+#endif
+    }
     data.index = squat_index_init(new_index_fd, &options);
     if (data.index == NULL)
 	fatal_squat_error("Initializing index");
@@ -523,6 +566,47 @@ static int squat_single(struct index_state *state, int incremental)
     return(r);
 }
 
+/* Drop the messages which are now in cyrus.squat from the delta index */
+static int squat_delta_single(struct index_state *state)
+{
+    struct mailbox *mailbox = state->mailbox;
+    int r;
+
+    r = mailbox_lock_index(mailbox, LOCK_EXCLUSIVE);
+    if (!r) {
+	r = squat_delta_merge(mailbox, state->last_uid);
+	mailbox_unlock_index(mailbox, NULL);
+    }
+
+    if (r) {
+	syslog(LOG_ERR, "failed to merge SQUAT delta index for %s: %s",
+	       mailbox->name, error_message(r));
+    }
+
+    return r;
+}
+
+/* Rebuild the text index of a single open mailbox */
+static int textindex_single(struct index_state *state)
+{
+    struct search_text *st = NULL;
+    uint32_t msgno;
+    int r;
+
+    r = search_text_open(state->mailbox, SEARCH_TEXT_REBUILD, &st);
+    for (msgno = 1; !r && msgno <= state->exists; msgno++)
+	r = search_text_add(st, &state->map[msgno-1].record);
+    if (!r) r = search_text_commit(st);
+    search_text_close(&st);
+
+    if (r) {
+	syslog(LOG_ERR, "failed to build text index for %s: %s",
+	       state->mailbox->name, error_message(r));
+    }
+
+    return r;
+}
+
 /* This is called once for each mailbox we're told to index. */
 static int index_me(char *name, int matchlen __attribute__((unused)),
 		    int maycreate __attribute__((unused)),
@@ -622,9 +706,17 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
 
     if (!incremental_mode || (squat_single(state, 1) != 0)) {
       /* Fall back to complete squat */
-      squat_single(state, 0);
+      r = squat_single(state, 0);
     }
 
+    /* only worth the exclusive lock if there could be a delta index
+       and cyrus.squat now covers what's in it */
+    if (!r && SQUAT_ENGINE && config_getint(IMAPOPT_SEARCH_SQUAT_DELTA) > 0)
+      squat_delta_single(state);
+
+    if (config_getswitch(IMAPOPT_SEARCH_TEXTINDEX))
+      textindex_single(state);
+
     index_close(&state);
     mailbox_count++;
 
@@ -634,6 +726,7 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
 struct tmpnode {
     struct tmpnode *next;
     char *name;
+    char *partition;	/* only looked up for -j */
 };
 struct tmplist {
     struct tmpnode *head;
@@ -651,6 +744,13 @@ static int addmbox(char *name,
 
     n->next = NULL;
     n->name = xstrdup(name);
+    n->partition = NULL;
+    if (jobs > 1) {
+	struct mboxlist_entry mbentry;
+
+	if (!mboxlist_lookup(name, &mbentry, NULL))
+	    n->partition = xstrdup(mbentry.partition);
+    }
 
     if (l->head) {
         l->tail->next = n;
@@ -662,6 +762,212 @@ static int addmbox(char *name,
     return 0;
 }
 
+/* ====================================================================== */
+
+/* With -j, mailboxes are handed out one at a time to a pool of worker
+   processes (neither SQUAT nor the mailbox code is thread safe), so
+   that a few huge mailboxes don't hold the rest up.  Each mailbox is
+   still opened and locked by index_me() exactly as in a serial run. */
+
+struct worker {
+    pid_t pid;
+    int fd;			/* mailbox names are sent down here */
+};
+
+/* Sent back by a worker when it has finished a mailbox.  It is much
+   smaller than PIPE_BUF, so reports from different workers sharing
+   the one pipe never interleave. */
+struct worker_report {
+    int worker;
+    int mailboxes;
+    unsigned long indexed_messages;
+    unsigned long indexed_bytes;
+    unsigned long index_size;
+};
+
+/* Reorder the list so that neighbouring mailboxes are on different
+   partitions where possible, spreading the workers over the spindles */
+static struct tmpnode *interleave_partitions(struct tmpnode *head)
+{
+    struct tmplist *parts = NULL;
+    int nparts = 0, i;
+    struct tmpnode *n, *next, *out = NULL, **tail = &out;
+    const char *part;
+
+    for (n = head; n; n = next) {
+	next = n->next;
+	n->next = NULL;
+	part = n->partition ? n->partition : "";
+	for (i = 0; i < nparts; i++) {
+	    const char *p = parts[i].head->partition;
+	    if (!strcmp(p ? p : "", part)) break;
+	}
+	if (i == nparts) {
+	    parts = xrealloc(parts, ++nparts * sizeof(struct tmplist));
+	    parts[i].head = parts[i].tail = n;
+	}
+	else {
+	    parts[i].tail->next = n;
+	    parts[i].tail = n;
+	}
+    }
+
+    while (nparts) {
+	for (i = 0; i < nparts; i++) {
+	    if (!parts[i].head) continue;
+	    n = parts[i].head;
+	    parts[i].head = n->next;
+	    n->next = NULL;
+	    *tail = n;
+	    tail = &n->next;
+	}
+	for (i = 0; i < nparts && !parts[i].head; i++);
+	if (i == nparts) break;
+    }
+
+    free(parts);
+    return out;
+}
+
+static int worker_send(struct worker *w, const char *name)
+{
+    char buf[MAX_MAILBOX_BUFFER+1];
+    int len = snprintf(buf, sizeof(buf), "%s\n", name);
+
+    return retry_write(w->fd, buf, len) == len ? 0 : -1;
+}
+
+static void worker_run(int worker, int infd, int reportfd, int *use_annot)
+{
+    FILE *in = fdopen(infd, "r");
+    char name[MAX_MAILBOX_BUFFER+1];
+    struct worker_report rep;
+    SquatStats before;
+    char *p;
+
+    mboxlist_open(NULL);
+    annotatemore_open(NULL);
+
+    while (fgets(name, sizeof(name), in)) {
+	if ((p = strchr(name, '\n'))) *p = '\0';
+
+	before = total_stats;
+	rep.mailboxes = mailbox_count;
+
+	index_me(name, strlen(name), 0, use_annot);
+
+	rep.worker = worker;
+	rep.mailboxes = mailbox_count - rep.mailboxes;
+	rep.indexed_messages =
+	    total_stats.indexed_messages - before.indexed_messages;
+	rep.indexed_bytes = total_stats.indexed_bytes - before.indexed_bytes;
+	rep.index_size = total_stats.index_size - before.index_size;
+	if (retry_write(reportfd, &rep, sizeof(rep)) != sizeof(rep)) break;
+    }
+
+    fclose(in);
+    annotatemore_close();
+    mboxlist_close();
+}
+
+static void squat_parallel(struct tmpnode *head, int *use_annot)
+{
+    struct worker *workers = xzmalloc(jobs * sizeof(struct worker));
+    struct worker_report rep;
+    struct tmpnode *next;
+    int reportfd[2], namefd[2];
+    int i, j, n, status;
+    pid_t pid;
+
+    next = interleave_partitions(head);
+
+    /* the workers open the databases for themselves */
+    annotatemore_close();
+    mboxlist_close();
+
+    if (pipe(reportfd) < 0) fatal_syserror("pipe");
+
+    for (i = 0; i < jobs; i++) {
+	if (pipe(namefd) < 0) fatal_syserror("pipe");
+
+	workers[i].pid = fork();
+	if (workers[i].pid < 0) fatal_syserror("fork");
+
+	if (!workers[i].pid) {
+	    /* don't hold other workers' pipes open */
+	    for (j = 0; j < i; j++) close(workers[j].fd);
+	    close(namefd[1]);
+	    close(reportfd[0]);
+
+	    worker_run(i, namefd[0], reportfd[1], use_annot);
+	    exit(0);
+	}
+
+	close(namefd[0]);
+	workers[i].fd = namefd[1];
+    }
+    close(reportfd[1]);
+
+    /* a worker dying mustn't take us with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* prime each worker with one mailbox */
+    for (i = 0; i < jobs; i++) {
+	if (next) {
+	    worker_send(&workers[i], next->name);
+	    next = next->next;
+	}
+	else {
+	    close(workers[i].fd);
+	    workers[i].fd = -1;
+	}
+    }
+
+    /* and give it another whenever it finishes one, until every
+       worker has exited */
+    while ((n = retry_read(reportfd[0], &rep, sizeof(rep))) == sizeof(rep)) {
+	mailbox_count += rep.mailboxes;
+	total_stats.indexed_messages += rep.indexed_messages;
+	total_stats.indexed_bytes += rep.indexed_bytes;
+	total_stats.index_size += rep.index_size;
+
+	if (rep.worker < 0 || rep.worker >= jobs) continue;
+	i = rep.worker;
+	if (workers[i].fd < 0) continue;
+
+	if (next && !worker_send(&workers[i], next->name)) {
+	    next = next->next;
+	}
+	else {
+	    close(workers[i].fd);
+	    workers[i].fd = -1;
+	}
+    }
+    close(reportfd[0]);
+
+    for (i = 0; i < jobs; i++) {
+	if (workers[i].fd >= 0) close(workers[i].fd);
+	while ((pid = waitpid(workers[i].pid, &status, 0)) < 0 &&
+	       errno == EINTR);
+	if (pid < 0) {
+	    syslog(LOG_ERR, "IOERROR: waiting for squatter worker %d: %m", i);
+	}
+	else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+	    syslog(LOG_ERR, "squatter worker %d exited abnormally", i);
+	}
+    }
+
+    /* anything left over was for a worker that died */
+    for (; next; next = next->next) {
+	syslog(LOG_ERR, "mailbox %s not indexed", next->name);
+    }
+
+    free(workers);
+
+    mboxlist_open(NULL);
+    annotatemore_open(NULL);
+}
+
 int main(int argc, char **argv)
 {
     int opt;
@@ -669,6 +975,8 @@ int main(int argc, char **argv)
     int rflag = 0, use_annot = 0;
     int i;
     char buf[MAX_MAILBOX_PATH+1];
+    struct tmplist *l;
+    struct tmpnode *current;
     int r;
 
     if ((geteuid()) == 0 && (become_cyrus() != 0)) {
@@ -677,7 +985,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:rsiav")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:rsiavj:t:")) != EOF) {
 	switch (opt) {
 	case 'C': /* alt config file */
           alt_config = optarg;
@@ -703,6 +1011,16 @@ int main(int argc, char **argv)
 	  use_annot = 1;
 	  break;
 
+	case 'j': /* number of worker processes */
+	  jobs = atoi(optarg);
+	  if (jobs < 1) usage("squatter");
+	  break;
+
+	case 't': /* number of threads per index */
+	  threads = atoi(optarg);
+	  if (threads < 1) usage("squatter");
+	  break;
+
 	default:
 	    usage("squatter");
 	}
@@ -725,13 +1043,10 @@ int main(int argc, char **argv)
 
     start_stats(&total_stats);
 
-    if (optind == argc) {
-        struct tmplist *l;
-        struct tmpnode *current;
-
-        l = xmalloc(sizeof(struct tmplist));
-        l->head = l->tail = NULL;
+    l = xmalloc(sizeof(struct tmplist));
+    l->head = l->tail = NULL;
 
+    if (optind == argc) {
 	if (rflag) {
 	    fprintf(stderr, "please specify a mailbox to recurse from\n");
 	    exit(EC_USAGE);
@@ -740,17 +1055,22 @@ int main(int argc, char **argv)
 	strlcpy(buf, "*", sizeof(buf));
 	(*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
 					    0, 0, addmbox, &l);
-
-        for (current = l->head; current; current = current->next) {
-            index_me(current->name, strlen(current->name), 0, &use_annot);
-            /* Ignore errors: most will be mailboxes moving around */
-        }
     }
 
     for (i = optind; i < argc; i++) {
 	/* Translate any separators in mailboxname */
 	(*squat_namespace.mboxname_tointernal)(&squat_namespace, argv[i],
 					       NULL, buf);
+	if (jobs > 1) {
+	    /* everything goes through the worker pool */
+	    addmbox(buf, 0, 0, &l);
+	    if (rflag) {
+		strlcat(buf, ".*", sizeof(buf));
+		(*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
+						    0, 0, addmbox, &l);
+	    }
+	    continue;
+	}
 	index_me(buf, 0, 0, &use_annot);
 	if (rflag) {
 	    strlcat(buf, ".*", sizeof(buf));
@@ -759,11 +1079,22 @@ int main(int argc, char **argv)
 	}
     }
 
+    if (jobs > 1) {
+	squat_parallel(l->head, &use_annot);
+    }
+    else {
+	for (current = l->head; current; current = current->next) {
+	    index_me(current->name, strlen(current->name), 0, &use_annot);
+	    /* Ignore errors: most will be mailboxes moving around */
+	}
+    }
+
+    stop_stats(&total_stats);
     if (verbose > 0 && mailbox_count > 1) {
-      stop_stats(&total_stats);
       printf("Total over all mailboxes: ");
       print_stats(stdout, &total_stats);
     }
+    log_throughput(&total_stats);
 
     syslog(LOG_NOTICE, "done indexing mailboxes");
 
@@ -77,6 +77,13 @@ extern int statuscache_update(const char *mboxname,
 extern int statuscache_invalidate(const char *mboxname,
 				  struct statusdata *sdata);
 
+/* rebuild the Bloom filter for the database, if enabled, and either
+   'force' or it has filled up */
+extern int statuscache_rebuild_filter(int force);
+
+/* remove the Bloom filter, without opening the database */
+extern void statuscache_remove_filter(void);
+
 /* close the database */
 extern void statuscache_close(void);
 
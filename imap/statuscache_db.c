@@ -59,6 +59,7 @@
 #include <syslog.h>
 
 #include "assert.h"
+#include "bloom.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
 #include "imapd.h"
@@ -77,20 +78,28 @@
 
 struct db *statuscachedb;
 static int statuscache_dbopen = 0;
+static struct bloom *statuscachebloom = NULL;
+static char *statuscachefname = NULL;
 
-void statuscache_open(const char *fname)
+/* the db file name, which the caller must free */
+static char *statuscache_fname(const char *fname)
 {
-    int ret;
-    char *tofree = NULL;
-
     if (!fname)
 	fname = config_getstring(IMAPOPT_STATUSCACHE_DB_PATH);
 
+    if (!fname)
+	return strconcat(config_dir, FNAME_STATUSCACHEDB, (char *)NULL);
+
+    return xstrdup(fname);
+}
+
+void statuscache_open(const char *fname)
+{
+    int ret;
+    char *tofree;
+
     /* create db file name */
-    if (!fname) {
-	tofree = strconcat(config_dir, FNAME_STATUSCACHEDB, (char *)NULL);
-	fname = tofree;
-    }
+    fname = tofree = statuscache_fname(fname);
 
     ret = DB->open(fname, CYRUSDB_CREATE, &statuscachedb);
     if (ret != 0) {
@@ -100,6 +109,10 @@ void statuscache_open(const char *fname)
 	return;
     }
 
+    statuscachefname = xstrdup(fname);
+    if (config_getswitch(IMAPOPT_STATUSCACHE_DB_BLOOM))
+	statuscachebloom = bloom_open(fname);
+
     free(tofree);
 
     statuscache_dbopen = 1;
@@ -117,6 +130,36 @@ void statuscache_close(void)
 	}
 	statuscache_dbopen = 0;
     }
+
+    bloom_close(statuscachebloom);
+    statuscachebloom = NULL;
+    free(statuscachefname);
+    statuscachefname = NULL;
+}
+
+/* rebuild the Bloom filter if 'force' or it wants it, or get rid of it
+   if it's not wanted */
+int statuscache_rebuild_filter(int force)
+{
+    if (!statuscache_dbopen) return 0;
+
+    if (!config_getswitch(IMAPOPT_STATUSCACHE_DB_BLOOM)) {
+	bloom_remove(statuscachefname);
+	return 0;
+    }
+
+    if (!force && !bloom_stale(statuscachebloom)) return 0;
+
+    return bloom_rebuild(statuscachebloom, DB, statuscachedb);
+}
+
+/* get rid of the Bloom filter left by a statuscache that's now off */
+void statuscache_remove_filter(void)
+{
+    char *fname = statuscache_fname(NULL);
+
+    bloom_remove(fname);
+    free(fname);
 }
 
 void statuscache_fill(struct statusdata *sdata, const char *userid,
@@ -277,6 +320,9 @@ int statuscache_lookup(const char *mboxname, const char *userid,
 
     memset(sdata, 0, sizeof(struct statusdata));
 
+    if (!bloom_test(statuscachebloom, key, keylen))
+	return IMAP_NO_NOSUCHMSG;
+
     /* Check if there is an entry in the database */
     do {
 	r = DB->fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
@@ -346,6 +392,9 @@ static int statuscache_update_txn(const char *mboxname,
 
     r = DB->store(statuscachedb, key, keylen, data, datalen, tidptr);
 
+    /* while we still hold the lock if we're in a transaction */
+    if (r == CYRUSDB_OK) bloom_add(statuscachebloom, key, keylen);
+
     if (r != CYRUSDB_OK) {
 	syslog(LOG_ERR, "DBERROR: error updating database: %s (%s)",
 	       mboxname, cyrusdb_strerror(r));
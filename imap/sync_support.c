@@ -72,6 +72,7 @@
 #include "xstrlcat.h"
 #include "xstrlcpy.h"
 #include "acl.h"
+#include "blobstore.h"
 #include "seen.h"
 #include "mboxname.h"
 #include "map.h"
@@ -86,6 +87,7 @@
 #include "dlist.h"
 
 #include "message_guid.h"
+#include "msgzip.h"
 #include "sync_support.h"
 #include "sync_log.h"
 
@@ -1580,6 +1582,9 @@ int sync_append_copyfile(struct mailbox *mailbox,
 	return IMAP_MAILBOX_CRC;
     }
 
+    /* compress the reserved copy, which later mailboxes link to */
+    msgzip_file(mailbox->part, fname);
+
     destname = mailbox_message_fname(mailbox, record->uid);
     cyrus_mkdir(destname, 0755);
     r = mailbox_copyfile(fname, destname, 0);
@@ -1588,6 +1593,8 @@ int sync_append_copyfile(struct mailbox *mailbox,
 	       fname, destname);
 	return r;
     }
+    if (blobstore_enabled())
+	blobstore_share(mailbox->part, &record->guid, destname);
 
  just_write:
     return mailbox_append_index_record(mailbox, record);
@@ -1715,8 +1722,17 @@ int sync_apply_reserve(struct dlist *kl,
 	if (!message_guid_decode(&tmp_guid, i->sval))
 	    continue;
 	item = sync_msgid_lookup(part_list, &tmp_guid);
-	if (item && !item->mark)
-	    dlist_atom(kout, "GUID", i->sval);
+	if (!item || item->mark)
+	    continue;
+	/* no need to upload it if we have a blob */
+	if (blobstore_enabled() &&
+	    !blobstore_link(partition, &tmp_guid,
+			    dlist_reserve_path(partition, &tmp_guid))) {
+	    item->mark = 1;
+	    part_list->marked++;
+	    continue;
+	}
+	dlist_atom(kout, "GUID", i->sval);
     }
     if (kout->head)
 	sync_send_response(kout, sstate->pout);
@@ -2596,7 +2612,8 @@ int sync_get_message(struct dlist *kin, struct sync_state *sstate)
 	return IMAP_PROTOCOL_BAD_PARAMETERS;
 
     fname = mboxname_datapath(partition, mboxname, uid);
-    if (stat(fname, &sbuf) == -1)
+    /* dlist sends the uncompressed message, so give its size */
+    if (msgzip_stat(fname, &sbuf) == -1)
 	return IMAP_MAILBOX_NONEXISTENT;
 
     kl = dlist_file(NULL, "MESSAGE", partition, &tmp_guid, sbuf.st_size, fname);
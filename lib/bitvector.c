@@ -0,0 +1,408 @@
+/* bitvector.c -- chunked bitmap sets of small integers
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "bitvector.h"
+#include "xmalloc.h"
+
+#define ONES	UINT64_C(0xffffffffffffffff)
+#define ONES8	ONES, ONES, ONES, ONES, ONES, ONES, ONES, ONES
+
+/* shared by every chunk which has all its bits set; never written */
+static const uint64_t full_chunk[BV_CHUNK_WORDS] = {
+    ONES8, ONES8, ONES8, ONES8, ONES8, ONES8, ONES8, ONES8
+};
+#define FULL	((uint64_t *) full_chunk)
+
+#ifdef __GNUC__
+#define popcount64(w)	__builtin_popcountll(w)
+#define ctz64(w)	__builtin_ctzll(w)
+#define clz64(w)	__builtin_clzll(w)
+#else
+static unsigned popcount64(uint64_t w)
+{
+    w = w - ((w >> 1) & UINT64_C(0x5555555555555555));
+    w = (w & UINT64_C(0x3333333333333333)) +
+	((w >> 2) & UINT64_C(0x3333333333333333));
+    w = (w + (w >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+    return (w * UINT64_C(0x0101010101010101)) >> 56;
+}
+
+static unsigned ctz64(uint64_t w)
+{
+    unsigned n = 0;
+    while (!(w & 1)) { w >>= 1; n++; }
+    return n;
+}
+
+static unsigned clz64(uint64_t w)
+{
+    unsigned n = 0;
+    while (!(w & (UINT64_C(1) << 63))) { w <<= 1; n++; }
+    return n;
+}
+#endif
+
+/* number of valid bits in chunk 'c' */
+static unsigned chunk_nbits(const bitvector_t *bv, unsigned c)
+{
+    if (c == bv->nchunks - 1)
+	return bv->nbits - c * BV_CHUNK_BITS;
+    return BV_CHUNK_BITS;
+}
+
+/* Bits past nbits are always kept clear, so the shared full chunk is
+ * only used for chunks which are entirely inside the vector; the last
+ * one, if partial, gets a private copy with just the valid bits set. */
+static uint64_t *chunk_new_full(const bitvector_t *bv, unsigned c)
+{
+    unsigned nbits = chunk_nbits(bv, c);
+    uint64_t *words;
+
+    if (nbits == BV_CHUNK_BITS) return FULL;
+
+    words = xzmalloc(BV_CHUNK_WORDS * sizeof(uint64_t));
+    memset(words, 0xff, (nbits / 64) * sizeof(uint64_t));
+    if (nbits % 64)
+	words[nbits / 64] = (UINT64_C(1) << (nbits % 64)) - 1;
+    return words;
+}
+
+static void chunk_free(uint64_t *words)
+{
+    if (words != FULL) free(words);
+}
+
+/* make chunk 'c' private and writable, allocating it if empty */
+static uint64_t *chunk_writable(bitvector_t *bv, unsigned c)
+{
+    uint64_t *words = bv->chunks[c];
+
+    if (!words) {
+	words = xzmalloc(BV_CHUNK_WORDS * sizeof(uint64_t));
+	bv->chunks[c] = words;
+    }
+    else if (words == FULL) {
+	words = xmalloc(BV_CHUNK_WORDS * sizeof(uint64_t));
+	memcpy(words, full_chunk, BV_CHUNK_WORDS * sizeof(uint64_t));
+	bv->chunks[c] = words;
+    }
+    return words;
+}
+
+/* release chunk 'c' if it has become empty, or share it if full */
+static void chunk_normalise(bitvector_t *bv, unsigned c)
+{
+    uint64_t *words = bv->chunks[c];
+    uint64_t any = 0, all = ONES;
+    unsigned i;
+
+    if (!words || words == FULL) return;
+
+    for (i = 0; i < BV_CHUNK_WORDS; i++) {
+	any |= words[i];
+	all &= words[i];
+    }
+    if (!any) {
+	free(words);
+	bv->chunks[c] = NULL;
+    }
+    else if (all == ONES) {
+	free(words);
+	bv->chunks[c] = FULL;
+    }
+}
+
+void bitvector_init(bitvector_t *bv, unsigned nbits, int fill)
+{
+    bv->nbits = nbits;
+    bv->nchunks = (nbits + BV_CHUNK_BITS - 1) / BV_CHUNK_BITS;
+    bv->chunks = bv->nchunks ?
+	xzmalloc(bv->nchunks * sizeof(uint64_t *)) : NULL;
+    if (fill) bitvector_fill(bv, fill);
+}
+
+void bitvector_fini(bitvector_t *bv)
+{
+    unsigned c;
+
+    if (!bv) return;
+
+    for (c = 0; c < bv->nchunks; c++)
+	chunk_free(bv->chunks[c]);
+    free(bv->chunks);
+    bv->chunks = NULL;
+    bv->nchunks = 0;
+    bv->nbits = 0;
+}
+
+void bitvector_fill(bitvector_t *bv, int fill)
+{
+    unsigned c;
+
+    for (c = 0; c < bv->nchunks; c++) {
+	chunk_free(bv->chunks[c]);
+	bv->chunks[c] = fill ? chunk_new_full(bv, c) : NULL;
+    }
+}
+
+/* The old last chunk, if partial, is private and has the bits past
+ * the old nbits clear already, so only the chunk array needs to grow */
+void bitvector_grow(bitvector_t *bv, unsigned nbits)
+{
+    unsigned nchunks = (nbits + BV_CHUNK_BITS - 1) / BV_CHUNK_BITS;
+
+    if (nbits <= bv->nbits) return;
+
+    if (nchunks > bv->nchunks) {
+	bv->chunks = xrealloc(bv->chunks, nchunks * sizeof(uint64_t *));
+	memset(bv->chunks + bv->nchunks, 0,
+	       (nchunks - bv->nchunks) * sizeof(uint64_t *));
+	bv->nchunks = nchunks;
+    }
+    bv->nbits = nbits;
+}
+
+int bitvector_isset(const bitvector_t *bv, unsigned n)
+{
+    const uint64_t *words;
+
+    if (n >= bv->nbits) return 0;
+    words = bv->chunks[n / BV_CHUNK_BITS];
+    if (!words) return 0;
+    n %= BV_CHUNK_BITS;
+    return (words[n / 64] >> (n % 64)) & 1;
+}
+
+void bitvector_set(bitvector_t *bv, unsigned n)
+{
+    uint64_t *words;
+
+    if (n >= bv->nbits) return;
+    if (bv->chunks[n / BV_CHUNK_BITS] == FULL) return;
+    words = chunk_writable(bv, n / BV_CHUNK_BITS);
+    n %= BV_CHUNK_BITS;
+    words[n / 64] |= UINT64_C(1) << (n % 64);
+}
+
+void bitvector_clear(bitvector_t *bv, unsigned n)
+{
+    uint64_t *words;
+
+    if (n >= bv->nbits) return;
+    if (!bv->chunks[n / BV_CHUNK_BITS]) return;
+    words = chunk_writable(bv, n / BV_CHUNK_BITS);
+    n %= BV_CHUNK_BITS;
+    words[n / 64] &= ~(UINT64_C(1) << (n % 64));
+}
+
+void bitvector_and(bitvector_t *dst, const bitvector_t *src)
+{
+    unsigned c, i;
+
+    for (c = 0; c < dst->nchunks; c++) {
+	uint64_t *d = dst->chunks[c];
+	const uint64_t *s = c < src->nchunks ? src->chunks[c] : NULL;
+
+	if (!d || s == FULL) continue;
+
+	if (!s) {
+	    chunk_free(d);
+	    dst->chunks[c] = NULL;
+	}
+	else if (d == FULL) {
+	    d = xmalloc(BV_CHUNK_WORDS * sizeof(uint64_t));
+	    memcpy(d, s, BV_CHUNK_WORDS * sizeof(uint64_t));
+	    dst->chunks[c] = d;
+	}
+	else {
+	    for (i = 0; i < BV_CHUNK_WORDS; i++)
+		d[i] &= s[i];
+	    chunk_normalise(dst, c);
+	}
+    }
+}
+
+void bitvector_or(bitvector_t *dst, const bitvector_t *src)
+{
+    unsigned c, i;
+
+    for (c = 0; c < dst->nchunks && c < src->nchunks; c++) {
+	uint64_t *d = dst->chunks[c];
+	const uint64_t *s = src->chunks[c];
+
+	if (!s || d == FULL) continue;
+
+	if (s == FULL) {
+	    chunk_free(d);
+	    dst->chunks[c] = FULL;
+	}
+	else if (!d) {
+	    d = xmalloc(BV_CHUNK_WORDS * sizeof(uint64_t));
+	    memcpy(d, s, BV_CHUNK_WORDS * sizeof(uint64_t));
+	    dst->chunks[c] = d;
+	}
+	else {
+	    for (i = 0; i < BV_CHUNK_WORDS; i++)
+		d[i] |= s[i];
+	    chunk_normalise(dst, c);
+	}
+    }
+}
+
+void bitvector_not(bitvector_t *bv)
+{
+    unsigned c, i;
+
+    for (c = 0; c < bv->nchunks; c++) {
+	uint64_t *words = bv->chunks[c];
+
+	if (!words) {
+	    bv->chunks[c] = chunk_new_full(bv, c);
+	}
+	else if (words == FULL) {
+	    bv->chunks[c] = NULL;
+	}
+	else {
+	    unsigned nbits = chunk_nbits(bv, c);
+
+	    for (i = 0; i < BV_CHUNK_WORDS; i++)
+		words[i] = ~words[i];
+	    /* keep the bits past the end clear */
+	    if (nbits < BV_CHUNK_BITS) {
+		if (nbits % 64)
+		    words[nbits / 64] &= (UINT64_C(1) << (nbits % 64)) - 1;
+		for (i = (nbits + 63) / 64; i < BV_CHUNK_WORDS; i++)
+		    words[i] = 0;
+	    }
+	    chunk_normalise(bv, c);
+	}
+    }
+}
+
+unsigned bitvector_count(const bitvector_t *bv)
+{
+    unsigned c, i, count = 0;
+
+    for (c = 0; c < bv->nchunks; c++) {
+	const uint64_t *words = bv->chunks[c];
+
+	if (!words) continue;
+	if (words == FULL) {
+	    count += BV_CHUNK_BITS;
+	    continue;
+	}
+	for (i = 0; i < BV_CHUNK_WORDS; i++)
+	    if (words[i]) count += popcount64(words[i]);
+    }
+    return count;
+}
+
+int bitvector_next(const bitvector_t *bv, unsigned n)
+{
+    unsigned c, i;
+
+    if (n >= bv->nbits) return -1;
+
+    for (c = n / BV_CHUNK_BITS; c < bv->nchunks; c++) {
+	const uint64_t *words = bv->chunks[c];
+	unsigned base = c * BV_CHUNK_BITS;
+
+	if (!words) continue;
+	if (words == FULL) return n > base ? n : base;
+
+	i = n > base ? (n - base) / 64 : 0;
+	for (; i < BV_CHUNK_WORDS; i++) {
+	    uint64_t w = words[i];
+	    unsigned bit = base + i * 64;
+
+	    if (n > bit) w &= ONES << (n - bit);
+	    if (w) return bit + ctz64(w);
+	}
+    }
+    return -1;
+}
+
+int bitvector_prev(const bitvector_t *bv, unsigned n)
+{
+    int c, i;
+
+    if (!bv->nbits) return -1;
+    if (n >= bv->nbits) n = bv->nbits - 1;
+
+    for (c = n / BV_CHUNK_BITS; c >= 0; c--) {
+	const uint64_t *words = bv->chunks[c];
+	unsigned base = c * BV_CHUNK_BITS;
+	unsigned top = base + BV_CHUNK_BITS - 1;
+
+	if (!words) continue;
+	if (words == FULL) return n < top ? n : top;
+
+	i = n < top ? (n - base) / 64 : BV_CHUNK_WORDS - 1;
+	for (; i >= 0; i--) {
+	    uint64_t w = words[i];
+	    unsigned bit = base + i * 64;
+
+	    if (n < bit + 63) w &= ONES >> (bit + 63 - n);
+	    if (w) return bit + 63 - clz64(w);
+	}
+    }
+    return -1;
+}
+
+uint64_t *bitvector_chunk(bitvector_t *bv, unsigned c)
+{
+    if (c >= bv->nchunks || !bv->chunks[c]) return NULL;
+    return chunk_writable(bv, c);
+}
+
+void bitvector_compact(bitvector_t *bv)
+{
+    unsigned c;
+
+    for (c = 0; c < bv->nchunks; c++)
+	chunk_normalise(bv, c);
+}
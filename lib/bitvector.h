@@ -0,0 +1,108 @@
+/* bitvector.h -- chunked bitmap sets of small integers
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __CYRUS_BITVECTOR_H__
+#define __CYRUS_BITVECTOR_H__
+
+#include <config.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * A set of integers 0..nbits-1, stored as an array of fixed size
+ * chunks of 64-bit words.  Bit n lives in bit n%64 of word n/64, so a
+ * chunk can be handed directly to code which works on plain word
+ * bitmaps (see imap/search_kernels.h).
+ *
+ * Chunks which are all clear are not allocated, and chunks which are
+ * all set share a single read-only block, so the common cases of
+ * sparse search results and "every message" cost next to nothing and
+ * the set operations skip them a whole chunk at a time.
+ */
+
+#define BV_CHUNK_BITS	4096
+#define BV_CHUNK_WORDS	(BV_CHUNK_BITS/64)
+
+typedef struct
+{
+    unsigned nbits;
+    unsigned nchunks;
+    uint64_t **chunks;
+} bitvector_t;
+
+#define BITVECTOR_INITIALIZER	{ 0, 0, NULL }
+
+/* 'fill' is 0 for the empty set or 1 for all of 0..nbits-1 */
+void bitvector_init(bitvector_t *bv, unsigned nbits, int fill);
+void bitvector_fini(bitvector_t *bv);
+void bitvector_fill(bitvector_t *bv, int fill);
+/* extend to 'nbits' with the new bits clear; never shrinks */
+void bitvector_grow(bitvector_t *bv, unsigned nbits);
+
+int bitvector_isset(const bitvector_t *bv, unsigned n);
+void bitvector_set(bitvector_t *bv, unsigned n);
+void bitvector_clear(bitvector_t *bv, unsigned n);
+
+/* word-at-a-time set operations; 'dst' and 'src' must be the same size */
+void bitvector_and(bitvector_t *dst, const bitvector_t *src);
+void bitvector_or(bitvector_t *dst, const bitvector_t *src);
+void bitvector_not(bitvector_t *bv);
+
+unsigned bitvector_count(const bitvector_t *bv);
+
+/* Return the first set bit >= n (or the last set bit <= n),
+ * or -1 if there is none */
+int bitvector_next(const bitvector_t *bv, unsigned n);
+int bitvector_prev(const bitvector_t *bv, unsigned n);
+
+#define bitvector_first(bv)  bitvector_next((bv), 0)
+#define bitvector_last(bv) \
+    ((bv)->nbits ? bitvector_prev((bv), (bv)->nbits-1) : -1)
+
+/* Direct access to the words of chunk 'c' for in-place filtering.
+ * Returns NULL if the chunk is empty (nothing to filter).  Call
+ * bitvector_compact() once done so emptied chunks are released. */
+uint64_t *bitvector_chunk(bitvector_t *bv, unsigned c);
+void bitvector_compact(bitvector_t *bv);
+
+#endif /* __CYRUS_BITVECTOR_H__ */
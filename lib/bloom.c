@@ -0,0 +1,541 @@
+/* bloom.c -- Bloom filters for negative cyrusdb lookups
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <netinet/in.h>
+
+#include "bloom.h"
+#include "cyr_lock.h"
+#include "map.h"
+#include "retry.h"
+#include "xmalloc.h"
+
+/*
+ * The filter file is a 64 byte header followed by 'nblocks' 64 byte
+ * blocks.  All the bits for a key live in the same block, so a test
+ * touches a single cache line.  Header fields are in network order:
+ *
+ *  0  magic (16 bytes)
+ * 16  version
+ * 20  nblocks (a power of 2)
+ * 24  nhash (bits set per key)
+ * 28  nkeys (number of keys the filter was sized for)
+ * 32  replaced (non-zero once the file has been renamed over or removed)
+ */
+
+#define BLOOM_MAGIC "\241\002\213\015bloom filter"
+#define BLOOM_MAGIC_SIZE 16
+#define BLOOM_VERSION 1
+
+#define HEADER_SIZE 64
+#define BLOCK_SIZE 64
+#define BLOCK_BITS (BLOCK_SIZE * 8)
+
+#define OFFSET_VERSION 16
+#define OFFSET_NBLOCKS 20
+#define OFFSET_NHASH 24
+#define OFFSET_NKEYS 28
+#define OFFSET_REPLACED 32
+
+/* 16 bits and 8 hashes per key gives well under 0.1% false positives;
+   leave room for the database to double before the next rebuild */
+#define BITS_PER_KEY 16
+#define NHASH 8
+#define MINKEYS 1024
+#define GROWTH 2
+
+/* how long to wait before looking for a filter that wasn't there */
+#define RETRY_INTERVAL 60
+
+/* bloom_stale() wants a rebuild once more than this fraction of
+   missing keys would get through */
+#define MAX_FALSE_POSITIVE 0.01
+
+struct bloom {
+    char *fname;
+    int fd;
+
+    const char *base;
+    unsigned long len;
+    uint32_t nblocks;
+    uint32_t nhash;
+
+    time_t lastopen;
+};
+
+#define HDR32(base, off) (ntohl(*((uint32_t *)((base) + (off)))))
+
+static uint64_t bloom_hash(const char *key, int keylen)
+{
+    const unsigned char *p = (const unsigned char *) key;
+    uint64_t h = 14695981039346656037ULL;	/* FNV-1a */
+    int i;
+
+    for (i = 0; i < keylen; i++) {
+	h ^= p[i];
+	h *= 1099511628211ULL;
+    }
+
+    /* FNV leaves the high bits poorly mixed */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* the block is chosen by the high word, the bits within it by the low
+   word; an odd stride visits 'nhash' different bits */
+#define BLOCK_OF(h, nblocks) ((uint32_t)((h) >> 32) & ((nblocks) - 1))
+#define BIT_OF(h, i) \
+    (((uint32_t)(h) + (i) * ((((uint32_t)(h) >> 9) & (BLOCK_BITS - 1)) | 1)) \
+     & (BLOCK_BITS - 1))
+
+static void set_bits(unsigned char *block, uint64_t h, uint32_t nhash)
+{
+    uint32_t i, bit;
+
+    for (i = 0; i < nhash; i++) {
+	bit = BIT_OF(h, i);
+	block[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+static int test_bits(const unsigned char *block, uint64_t h, uint32_t nhash)
+{
+    uint32_t i, bit;
+
+    for (i = 0; i < nhash; i++) {
+	bit = BIT_OF(h, i);
+	if (!(block[bit >> 3] & (1 << (bit & 7)))) return 0;
+    }
+
+    return 1;
+}
+
+static void bloom_unload(struct bloom *bloom)
+{
+    if (bloom->base) map_free(&bloom->base, &bloom->len);
+    if (bloom->fd != -1) close(bloom->fd);
+    bloom->fd = -1;
+    bloom->base = NULL;
+    bloom->len = 0;
+}
+
+/* (re)open and map the filter file; on failure the filter is inactive */
+static int bloom_load(struct bloom *bloom)
+{
+    struct stat sbuf;
+    const char *base;
+
+    bloom_unload(bloom);
+    bloom->lastopen = time(NULL);
+
+    bloom->fd = open(bloom->fname, O_RDWR, 0644);
+    if (bloom->fd == -1) {
+	if (errno != ENOENT)
+	    syslog(LOG_ERR, "IOERROR: opening %s: %m", bloom->fname);
+	return -1;
+    }
+
+    if (fstat(bloom->fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat %s: %m", bloom->fname);
+	goto bad;
+    }
+    if (sbuf.st_size < HEADER_SIZE) goto bad;
+
+    /* the file never grows, so map exactly what's there */
+    map_refresh(bloom->fd, 1, &bloom->base, &bloom->len, sbuf.st_size,
+		bloom->fname, 0);
+    base = bloom->base;
+
+    bloom->nblocks = HDR32(base, OFFSET_NBLOCKS);
+    bloom->nhash = HDR32(base, OFFSET_NHASH);
+
+    if (memcmp(base, BLOOM_MAGIC, BLOOM_MAGIC_SIZE) ||
+	HDR32(base, OFFSET_VERSION) != BLOOM_VERSION ||
+	!bloom->nblocks || (bloom->nblocks & (bloom->nblocks - 1)) ||
+	!bloom->nhash || bloom->nhash > BLOCK_BITS ||
+	(unsigned long) sbuf.st_size !=
+	    HEADER_SIZE + (unsigned long) bloom->nblocks * BLOCK_SIZE) {
+	syslog(LOG_ERR, "DBERROR: %s: invalid bloom filter, ignoring",
+	       bloom->fname);
+	goto bad;
+    }
+
+    /* somebody got rid of it between our open and our map */
+    if (HDR32(base, OFFSET_REPLACED)) goto bad;
+
+    return 0;
+
+ bad:
+    bloom_unload(bloom);
+    return -1;
+}
+
+struct bloom *bloom_open(const char *dbfname)
+{
+    struct bloom *bloom = xzmalloc(sizeof(struct bloom));
+
+    bloom->fname = xmalloc(strlen(dbfname) + 7);
+    strcpy(bloom->fname, dbfname);
+    strcat(bloom->fname, ".BLOOM");
+    bloom->fd = -1;
+
+    bloom_load(bloom);
+
+    return bloom;
+}
+
+void bloom_close(struct bloom *bloom)
+{
+    if (!bloom) return;
+
+    bloom_unload(bloom);
+    free(bloom->fname);
+    free(bloom);
+}
+
+int bloom_test(struct bloom *bloom, const char *key, int keylen)
+{
+    unsigned char buf[BLOCK_SIZE];
+    const unsigned char *block;
+    uint64_t h;
+    off_t offset;
+
+    if (!bloom) return 1;
+
+    if (!bloom->base) {
+	if (time(NULL) < bloom->lastopen + RETRY_INTERVAL) return 1;
+	if (bloom_load(bloom)) return 1;
+    }
+    else if (HDR32(bloom->base, OFFSET_REPLACED)) {
+	if (bloom_load(bloom)) return 1;
+    }
+
+    h = bloom_hash(key, keylen);
+    offset = HEADER_SIZE + (off_t) BLOCK_OF(h, bloom->nblocks) * BLOCK_SIZE;
+
+    if (strcmp(map_method_desc, "nommap")) {
+	block = (const unsigned char *) bloom->base + offset;
+    }
+    else {
+	/* our copy doesn't see other processes' additions */
+	if (pread(bloom->fd, buf, BLOCK_SIZE, offset) != BLOCK_SIZE) return 1;
+	block = buf;
+    }
+
+    return test_bits(block, h, bloom->nhash);
+}
+
+static void mark_replaced(int fd, const char *fname, int dounlink);
+
+/* a key may not have made it into the filter: nobody can trust it now */
+static void bloom_invalidate(struct bloom *bloom)
+{
+    syslog(LOG_ERR, "bloom: removing %s, which may be missing keys",
+	   bloom->fname);
+    mark_replaced(bloom->fd, bloom->fname, 1);
+    bloom_unload(bloom);
+}
+
+void bloom_add(struct bloom *bloom, const char *key, int keylen)
+{
+    unsigned char hdr[HEADER_SIZE], block[BLOCK_SIZE], old[BLOCK_SIZE];
+    uint64_t h;
+    off_t offset;
+
+    if (!bloom) return;
+
+    /* a filter built since we last looked must learn about this key,
+       so don't wait for RETRY_INTERVAL */
+    if (!bloom->base && bloom_load(bloom)) return;
+
+    h = bloom_hash(key, keylen);
+
+    for (;;) {
+	if (lock_blocking(bloom->fd) < 0) {
+	    syslog(LOG_ERR, "IOERROR: locking %s: %m", bloom->fname);
+	    bloom_invalidate(bloom);
+	    return;
+	}
+
+	/* once a file is replaced, additions have to go to its successor */
+	if (pread(bloom->fd, hdr, HEADER_SIZE, 0) == HEADER_SIZE &&
+	    !HDR32((const char *) hdr, OFFSET_REPLACED))
+	    break;
+
+	lock_unlock(bloom->fd);
+	if (bloom_load(bloom)) return;
+    }
+
+    offset = HEADER_SIZE + (off_t) BLOCK_OF(h, bloom->nblocks) * BLOCK_SIZE;
+    if (pread(bloom->fd, block, BLOCK_SIZE, offset) == BLOCK_SIZE) {
+	memcpy(old, block, BLOCK_SIZE);
+	set_bits(block, h, bloom->nhash);
+	if (memcmp(old, block, BLOCK_SIZE) &&
+	    pwrite(bloom->fd, block, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+	    syslog(LOG_ERR, "IOERROR: writing %s: %m", bloom->fname);
+	    bloom_invalidate(bloom);
+	    return;
+	}
+    }
+    else {
+	syslog(LOG_ERR, "IOERROR: reading %s: %m", bloom->fname);
+	bloom_invalidate(bloom);
+	return;
+    }
+
+    lock_unlock(bloom->fd);
+}
+
+static int count_bits(unsigned char c)
+{
+    int n;
+
+    for (n = 0; c; c &= c - 1) n++;
+
+    return n;
+}
+
+int bloom_stale(struct bloom *bloom)
+{
+    const unsigned char *block;
+    double fp = 0.0, fill, p;
+    uint32_t b, i;
+    int n;
+
+    if (!bloom) return 0;
+
+    /* (re)load, so that we see all the additions so far */
+    if (bloom_load(bloom)) return 1;
+
+    /* a missing key gets through when all of its bits in its block
+       are set by other keys */
+    block = (const unsigned char *) bloom->base + HEADER_SIZE;
+    for (b = 0; b < bloom->nblocks; b++, block += BLOCK_SIZE) {
+	for (n = 0, i = 0; i < BLOCK_SIZE; i++) n += count_bits(block[i]);
+	fill = (double) n / BLOCK_BITS;
+	for (p = 1.0, i = 0; i < bloom->nhash; i++) p *= fill;
+	fp += p;
+    }
+    fp /= bloom->nblocks;
+
+    if (fp <= MAX_FALSE_POSITIVE) return 0;
+
+    syslog(LOG_INFO, "bloom: %s lets through about %.1f%% of missing keys",
+	   bloom->fname, fp * 100);
+
+    return 1;
+}
+
+/* tell processes using 'fd' to go find its replacement */
+static void mark_replaced(int fd, const char *fname, int dounlink)
+{
+    uint32_t replaced = htonl(1);
+    int locked = 1;
+
+    /* carry on regardless: a filter that should go mustn't stay */
+    if (lock_blocking(fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: locking %s: %m", fname);
+	locked = 0;
+    }
+
+    if (pwrite(fd, &replaced, 4, OFFSET_REPLACED) != 4)
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+
+    if (dounlink && unlink(fname) == -1 && errno != ENOENT)
+	syslog(LOG_ERR, "IOERROR: unlinking %s: %m", fname);
+
+    if (locked) lock_unlock(fd);
+}
+
+struct rebuildrock {
+    uint64_t *hashes;
+    size_t count;
+    size_t alloc;
+};
+
+static int rebuild_cb(void *rock, const char *key, int keylen,
+		      const char *data __attribute__((unused)),
+		      int datalen __attribute__((unused)))
+{
+    struct rebuildrock *rrock = (struct rebuildrock *) rock;
+
+    if (rrock->count == rrock->alloc) {
+	rrock->alloc = rrock->alloc ? rrock->alloc * 2 : 4096;
+	rrock->hashes = xrealloc(rrock->hashes,
+				 rrock->alloc * sizeof(uint64_t));
+    }
+    rrock->hashes[rrock->count++] = bloom_hash(key, keylen);
+
+    return 0;
+}
+
+/*
+ * The scan runs inside a transaction, so nobody can store a key
+ * until the new file has been renamed into place and the old one
+ * marked as replaced: every key is either seen by the scan or added
+ * to the new file.  That holds up writers for the whole scan, so
+ * while the database is in use only rebuild when bloom_stale() says so.
+ */
+int bloom_rebuild(struct bloom *bloom,
+		  struct cyrusdb_backend *backend, struct db *db)
+{
+    struct rebuildrock rrock;
+    struct txn *tid = NULL;
+    char *newfname = NULL;
+    unsigned char *buf = NULL;
+    uint32_t nblocks, nkeys;
+    unsigned long bits, len;
+    size_t i;
+    int fd = -1, oldfd = -1;
+    int r;
+
+    memset(&rrock, 0, sizeof(rrock));
+
+    r = backend->foreach(db, "", 0, NULL, rebuild_cb, &rrock, &tid);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: scanning for %s: %s",
+	       bloom->fname, cyrusdb_strerror(r));
+	goto done;
+    }
+
+    nkeys = (rrock.count < MINKEYS ? MINKEYS : rrock.count) * GROWTH;
+    bits = (unsigned long) nkeys * BITS_PER_KEY;
+    for (nblocks = 1; (unsigned long) nblocks * BLOCK_BITS < bits;
+	 nblocks <<= 1);
+
+    len = HEADER_SIZE + (unsigned long) nblocks * BLOCK_SIZE;
+    buf = xzmalloc(len);
+    memcpy(buf, BLOOM_MAGIC, BLOOM_MAGIC_SIZE);
+    *((uint32_t *)(buf + OFFSET_VERSION)) = htonl(BLOOM_VERSION);
+    *((uint32_t *)(buf + OFFSET_NBLOCKS)) = htonl(nblocks);
+    *((uint32_t *)(buf + OFFSET_NHASH)) = htonl(NHASH);
+    *((uint32_t *)(buf + OFFSET_NKEYS)) = htonl(nkeys);
+
+    for (i = 0; i < rrock.count; i++) {
+	uint64_t h = rrock.hashes[i];
+	set_bits(buf + HEADER_SIZE + BLOCK_OF(h, nblocks) * BLOCK_SIZE,
+		 h, NHASH);
+    }
+
+    newfname = xmalloc(strlen(bloom->fname) + 5);
+    strcpy(newfname, bloom->fname);
+    strcat(newfname, ".NEW");
+
+    fd = open(newfname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+    if (retry_write(fd, buf, len) != (ssize_t) len || fdatasync(fd) == -1) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+	unlink(newfname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    /* hang on to the file we're replacing so we can flag it */
+    oldfd = open(bloom->fname, O_RDWR, 0644);
+
+    if (rename(newfname, bloom->fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+	unlink(newfname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    if (oldfd != -1) mark_replaced(oldfd, bloom->fname, 0);
+
+    bloom_load(bloom);
+
+    syslog(LOG_INFO, "bloom: rebuilt %s with %lu keys in %u blocks",
+	   bloom->fname, (unsigned long) rrock.count, nblocks);
+
+ done:
+    if (tid) {
+	if (r) backend->abort(db, tid);
+	else r = backend->commit(db, tid);
+    }
+    if (oldfd != -1) close(oldfd);
+    if (fd != -1) close(fd);
+    free(newfname);
+    free(buf);
+    free(rrock.hashes);
+
+    return r;
+}
+
+void bloom_remove(const char *dbfname)
+{
+    char *fname;
+    int fd;
+
+    fname = xmalloc(strlen(dbfname) + 7);
+    strcpy(fname, dbfname);
+    strcat(fname, ".BLOOM");
+
+    fd = open(fname, O_RDWR, 0644);
+    if (fd != -1) {
+	mark_replaced(fd, fname, 1);
+	close(fd);
+    }
+
+    free(fname);
+}
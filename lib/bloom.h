@@ -0,0 +1,86 @@
+/* bloom.h -- Bloom filters for negative cyrusdb lookups
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_BLOOM_H
+#define INCLUDED_BLOOM_H
+
+#include "cyrusdb.h"
+
+/*
+ * A Bloom filter kept next to a database ("<dbfname>.BLOOM") answers
+ * "is this key certainly not in the database?" without touching the
+ * database itself.  It is built by bloom_rebuild() from the keys in
+ * the database and kept up to date by every process that stores to
+ * the database calling bloom_add() after the store.  Deleted keys
+ * stay in the filter until the next rebuild.
+ *
+ * Until a filter has been built (or after bloom_remove()) every key
+ * "may" be present, so it's always safe to skip the filter.
+ */
+
+struct bloom;
+
+extern struct bloom *bloom_open(const char *dbfname);
+extern void bloom_close(struct bloom *bloom);
+
+/* returns 0 if 'key' is certainly not in the database */
+extern int bloom_test(struct bloom *bloom, const char *key, int keylen);
+
+/* 'key' has been stored in the database.  if that can't be recorded,
+   the filter is removed */
+extern void bloom_add(struct bloom *bloom, const char *key, int keylen);
+
+/* returns non-zero if there's no usable filter, or if it has filled up
+   (with growth or deleted keys) enough to want rebuilding */
+extern int bloom_stale(struct bloom *bloom);
+
+/* build a new filter from the keys of 'db' and put it in place.
+   writers to 'db' wait until it's done */
+extern int bloom_rebuild(struct bloom *bloom,
+			 struct cyrusdb_backend *backend, struct db *db);
+
+/* get rid of the filter for 'dbfname', e.g. because it can no longer
+   be trusted to hold every key */
+extern void bloom_remove(const char *dbfname);
+
+#endif /* INCLUDED_BLOOM_H */
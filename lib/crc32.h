@@ -16,4 +16,11 @@ uint32_t crc32_buf(struct buf *buf);
 uint32_t crc32_cstring(const char *buf);
 uint32_t crc32_iovec(struct iovec *iov, int iovcnt);
 
+/* name of the implementation picked for this CPU, for logging */
+const char *crc32_impl_name(void);
+
+/* use the named implementation ("portable", "pclmul") from now on;
+ * returns -1 if it isn't available here.  For testing. */
+int crc32_use_impl(const char *name);
+
 #endif
@@ -60,6 +60,7 @@
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
 #include "retry.h"
+#include "util.h"
 #include "xmalloc.h"
 
 struct cyrusdb_backend *cyrusdb_backends[] = {
@@ -69,6 +70,7 @@ struct cyrusdb_backend *cyrusdb_backends[] = {
     &cyrusdb_berkeley_hash,
     &cyrusdb_berkeley_hash_nosync,
 #endif
+    &cyrusdb_btree,
     &cyrusdb_flat,
     &cyrusdb_skiplist,
     &cyrusdb_quotalegacy,
@@ -161,10 +163,135 @@ int cyrusdb_copyfile(const char *srcname, const char *dstname)
     return 0;
 }
 
+struct cyrusdb_load {
+    struct cyrusdb_backend *backend;
+    struct bulkload *bl;	/* the backend's own loader, or */
+    struct db *db;		/* plain stores into this */
+    struct txn *tid;
+};
+
+int cyrusdb_load_begin(struct cyrusdb_backend *backend,
+		       const char *fname, int flags,
+		       struct cyrusdb_load **ret)
+{
+    struct cyrusdb_load *load;
+    int r;
+
+    load = xzmalloc(sizeof(struct cyrusdb_load));
+    load->backend = backend;
+
+    if (backend->bulkload_begin) {
+	r = (backend->bulkload_begin)(fname, flags, &load->bl);
+    } else {
+	r = (backend->open)(fname, flags | CYRUSDB_CREATE, &load->db);
+    }
+    if (r) {
+	free(load);
+	return r;
+    }
+
+    *ret = load;
+    return 0;
+}
+
+int cyrusdb_load_add(struct cyrusdb_load *load,
+		     const char *key, int keylen,
+		     const char *data, int datalen)
+{
+    if (load->bl) {
+	return (load->backend->bulkload_add)(load->bl, key, keylen,
+					     data, datalen);
+    }
+
+    return (load->backend->store)(load->db, key, keylen, data, datalen,
+				  &load->tid);
+}
+
+int cyrusdb_load_end(struct cyrusdb_load *load, int commit)
+{
+    int r = 0;
+
+    if (load->bl) {
+	r = (load->backend->bulkload_end)(load->bl, commit);
+    } else {
+	if (load->tid) {
+	    if (commit) r = (load->backend->commit)(load->db, load->tid);
+	    else (load->backend->abort)(load->db, load->tid);
+	}
+	(load->backend->close)(load->db);
+    }
+    free(load);
+
+    return r;
+}
+
+/* the fallback for cyrusdb_foreach_snapshot(): copy the records out
+   first, each as key size, data size, key, data */
+struct snapshot_rock {
+    foreach_p *p;
+    void *rock;
+    struct buf copy;
+};
+
+static int snapshot_cb(void *rock,
+		       const char *key, int keylen,
+		       const char *data, int datalen)
+{
+    struct snapshot_rock *sr = (struct snapshot_rock *) rock;
+    int lens[2];
+
+    if (sr->p && !sr->p(sr->rock, key, keylen, data, datalen)) return 0;
+
+    lens[0] = keylen;
+    lens[1] = datalen;
+    buf_appendmap(&sr->copy, (char *) lens, sizeof(lens));
+    buf_appendmap(&sr->copy, key, keylen);
+    buf_appendmap(&sr->copy, data, datalen);
+
+    return 0;
+}
+
+int cyrusdb_foreach_snapshot(struct cyrusdb_backend *backend,
+			     struct db *db,
+			     char *prefix, int prefixlen,
+			     foreach_p *p,
+			     foreach_cb *cb, void *rock)
+{
+    struct snapshot_rock sr;
+    const char *ptr, *end;
+    int lens[2];
+    int r;
+
+    if (backend->foreach_snapshot) {
+	return (backend->foreach_snapshot)(db, prefix, prefixlen,
+					   p, cb, rock);
+    }
+
+    sr.p = p;
+    sr.rock = rock;
+    buf_init(&sr.copy);
+
+    r = (backend->foreach)(db, prefix, prefixlen, NULL, &snapshot_cb, &sr,
+			   NULL);
+
+    ptr = sr.copy.s;
+    end = ptr + sr.copy.len;
+    while (!r && ptr < end) {
+	memcpy(lens, ptr, sizeof(lens));
+	ptr += sizeof(lens);
+	r = cb(rock, ptr, lens[0], ptr + lens[0], lens[1]);
+	ptr += lens[0] + lens[1];
+    }
+    buf_free(&sr.copy);
+
+    return r;
+}
+
 struct convert_rock {
     struct cyrusdb_backend *backend;
     struct db *db;
     struct txn *tid;
+    struct cyrusdb_load *load;
 };
 
 static int converter_cb(void *rock,
@@ -172,6 +299,10 @@ static int converter_cb(void *rock,
 			const char *data, int datalen) 
 {
     struct convert_rock *cr = (struct convert_rock *)rock;
+
+    if (cr->load) {
+	return cyrusdb_load_add(cr->load, key, keylen, data, datalen);
+    }
     return (cr->backend->store)(cr->db, key, keylen, data, datalen, &cr->tid);
 }
 
@@ -187,29 +318,49 @@ void cyrusdb_convert(const char *fromfname, const char *tofname,
     struct txn *fromtid = NULL;
     int r;
 
-    /* open both databases (create todb) */
+    /* open the old database */
     r = (frombackend->open)(fromfname, 0, &fromdb);
     if (r != CYRUSDB_OK)
 	fatal("can't open old database", EC_TEMPFAIL);
+
+    memset(&cr, 0, sizeof(cr));
+    cr.backend = tobackend;
+
+    if (tobackend->bulkload_begin) {
+	/* build the new database directly from the records in order */
+	r = cyrusdb_load_begin(tobackend, tofname, 0, &cr.load);
+	if (r != CYRUSDB_OK)
+	    fatal("can't create new database", EC_TEMPFAIL);
+
+	r = (frombackend->foreach)(fromdb, "", 0, NULL, converter_cb, &cr,
+				   &fromtid);
+	if (r == CYRUSDB_OK) r = cyrusdb_load_end(cr.load, 1);
+	else cyrusdb_load_end(cr.load, 0);
+
+	/* the old database wasn't in our order (e.g. it uses mailbox
+	   sort order): start again the slow way */
+	cr.load = NULL;
+	if (r == CYRUSDB_OK) goto done;
+	if (fromtid) (frombackend->abort)(fromdb, fromtid);
+	fromtid = NULL;
+    }
+
     r = (tobackend->open)(tofname, CYRUSDB_CREATE, &todb);
     if (r != CYRUSDB_OK)
 	fatal("can't open new database", EC_TEMPFAIL);
-
-    /* set up the copy rock */
-    cr.backend = tobackend;
     cr.db = todb;
-    cr.tid = NULL;
 
     /* copy each record to the destination DB (transactional for speed) */
     (frombackend->foreach)(fromdb, "", 0, NULL, converter_cb, &cr, &fromtid);
 
-    /* commit both transactions */
-    if (fromtid) (frombackend->commit)(fromdb, fromtid);
+    /* commit the destination transaction */
     if (cr.tid) (tobackend->commit)(todb, cr.tid);
+    (tobackend->close)(todb);
 
-    /* and close the DBs */
+ done:
+    /* and the source one */
+    if (fromtid) (frombackend->commit)(fromdb, fromtid);
     (frombackend->close)(fromdb);
-    (tobackend->close)(todb);
 }
 
 const char *cyrusdb_detect(const char *fname)
@@ -232,6 +383,9 @@ const char *cyrusdb_detect(const char *fname)
     if (!strncmp(buf, "\241\002\213\015skiplist file\0\0\0", 16))
 	return "skiplist";
 
+    if (!strncmp(buf, "\241\002\213\015btree file\0\0", 16))
+	return "btree";
+
     bdb_magic = *(uint32_t *)(buf+12);
 
     if (bdb_magic == 0x053162) /* BDB BTREE MAGIC */
@@ -46,6 +46,7 @@
 
 struct db;
 struct txn;
+struct bulkload;
 
 enum cyrusdb_ret {
     CYRUSDB_OK = 0,
@@ -69,7 +70,8 @@ enum cyrusdb_dbflags {
 
 enum cyrusdb_openflags {
     CYRUSDB_CREATE   = 0x01,	/* Create the database if not existant */
-    CYRUSDB_MBOXSORT = 0x02	/* Use mailbox sort order ('.' sorts 1st) */
+    CYRUSDB_MBOXSORT = 0x02,	/* Use mailbox sort order ('.' sorts 1st) */
+    CYRUSDB_GROUPCOMMIT = 0x04	/* Share commit syncs with other processes */
 };
 
 typedef int foreach_p(void *rock,
@@ -177,6 +179,32 @@ struct cyrusdb_backend {
 
     int (*dump)(struct db *db, int detail);
     int (*consistent)(struct db *db);
+
+    /* Bulk loading: bulkload_begin() starts building a new database
+       for 'fname' (as opened with 'flags'), bulkload_add() appends
+       records to it in key order and bulkload_end() puts it in place
+       of 'fname' if 'commit' is set, or throws it away.  Records must
+       be in strictly ascending order, or bulkload_add() returns
+       CYRUSDB_EXISTS.  Backends that can't do better than store() leave
+       these NULL; use cyrusdb_load_begin() etc. rather than calling
+       them directly. */
+    int (*bulkload_begin)(const char *fname, int flags,
+			  struct bulkload **ret);
+    int (*bulkload_add)(struct bulkload *bl,
+			const char *key, int keylen,
+			const char *data, int datalen);
+    int (*bulkload_end)(struct bulkload *bl, int commit);
+
+    /* foreach_snapshot: like foreach() outside of a transaction, but
+       'p' and 'cb' see the records as they were committed when it
+       started, and no lock is held while they run.  changes made
+       meanwhile, by 'cb' or anyone else, are not seen.  Backends which
+       can't do this cheaply leave it NULL; use
+       cyrusdb_foreach_snapshot() rather than calling it directly. */
+    int (*foreach_snapshot)(struct db *mydb,
+			    char *prefix, int prefixlen,
+			    foreach_p *p,
+			    foreach_cb *cb, void *rock);
 };
 
 extern struct cyrusdb_backend *cyrusdb_backends[];
@@ -187,6 +215,7 @@ extern struct cyrusdb_backend cyrusdb_berkeley;
 extern struct cyrusdb_backend cyrusdb_berkeley_nosync;
 extern struct cyrusdb_backend cyrusdb_berkeley_hash;
 extern struct cyrusdb_backend cyrusdb_berkeley_hash_nosync;
+extern struct cyrusdb_backend cyrusdb_btree;
 extern struct cyrusdb_backend cyrusdb_flat;
 extern struct cyrusdb_backend cyrusdb_skiplist;
 extern struct cyrusdb_backend cyrusdb_quotalegacy;
@@ -198,6 +227,31 @@ extern void cyrusdb_convert(const char *fromfname, const char *tofname,
 			    struct cyrusdb_backend *frombackend,
 			    struct cyrusdb_backend *tobackend);
 
+/* Fill a database from records in key order, building the file
+ * directly where the backend supports it.  Otherwise the records are
+ * stored in a single transaction, so 'fname' should be empty for the
+ * result to be the same. */
+struct cyrusdb_load;
+
+extern int cyrusdb_load_begin(struct cyrusdb_backend *backend,
+			      const char *fname, int flags,
+			      struct cyrusdb_load **ret);
+extern int cyrusdb_load_add(struct cyrusdb_load *load,
+			    const char *key, int keylen,
+			    const char *data, int datalen);
+extern int cyrusdb_load_end(struct cyrusdb_load *load, int commit);
+
+/* Iterate over a snapshot of the records starting with 'prefix', so
+ * that a long walk doesn't hold up writers.  Backends without their
+ * own way of doing this copy the matching records first, so the
+ * snapshot costs memory in proportion to what matches; 'p' is then
+ * called while the backend's foreach() is running. */
+extern int cyrusdb_foreach_snapshot(struct cyrusdb_backend *backend,
+				    struct db *db,
+				    char *prefix, int prefixlen,
+				    foreach_p *p,
+				    foreach_cb *cb, void *rock);
+
 extern const char *cyrusdb_detect(const char *fname);
 
 /* Start/Stop the backends */
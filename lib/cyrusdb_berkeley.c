@@ -1014,6 +1014,12 @@ struct cyrusdb_backend cyrusdb_berkeley =
     &abort_txn,
     
     NULL,
+    NULL,
+
+    NULL,
+    NULL,
+    NULL,
+
     NULL
 };
 
@@ -1040,6 +1046,12 @@ struct cyrusdb_backend cyrusdb_berkeley_nosync =
     &abort_txn,
 
     NULL,
+    NULL,
+
+    NULL,
+    NULL,
+    NULL,
+
     NULL
 };
 
@@ -1066,6 +1078,12 @@ struct cyrusdb_backend cyrusdb_berkeley_hash =
     &abort_txn,
     
     NULL,
+    NULL,
+
+    NULL,
+    NULL,
+    NULL,
+
     NULL
 };
 
@@ -1092,5 +1110,11 @@ struct cyrusdb_backend cyrusdb_berkeley_hash_nosync =
     &abort_txn,
 
     NULL,
+    NULL,
+
+    NULL,
+    NULL,
+    NULL,
+
     NULL
 };
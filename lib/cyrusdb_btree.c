@@ -0,0 +1,2333 @@
+/* cyrusdb_btree.c -- cyrusdb copy-on-write B+tree implementation
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <netinet/in.h>
+
+#include "assert.h"
+#include "bsearch.h"
+#include "crc32.h"
+#include "cyrusdb.h"
+#include "libcyr_cfg.h"
+#include "cyr_lock.h"
+#include "groupcommit.h"
+#include "map.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "xstrlcpy.h"
+
+/*
+ * disk format; all numbers in network byte order
+ *
+ * the file is a copy-on-write B+tree.  nodes are only ever appended
+ * to the file, never modified in place: a transaction builds the
+ * changed nodes in memory, and commit appends them (leaves first, the
+ * new root last) and then publishes the new root by writing one of
+ * the two meta slots in the header.
+ *
+ * a reader picks the newest meta slot with a valid checksum and walks
+ * the tree below it.  since nothing below that slot's "end" is ever
+ * rewritten, readers need no lock at all: they see the last committed
+ * state and never wait behind a writer.  writers serialize on an
+ * exclusive lock.
+ *
+ * every node carries a checksum.  it is verified whenever a writer
+ * copies a node to change it (so damage is never propagated into new
+ * nodes), during a checkpoint, and by consistent(); plain lookups only
+ * bounds-check the nodes they visit.
+ *
+ * superseded nodes are reclaimed by a checkpoint, which writes the
+ * live tree to fname.NEW and renames it into place.  readers which
+ * still have the old file mapped carry on with their snapshot and
+ * switch to the new file on their next operation.
+ */
+
+/*
+   header "\241\002\213\015btree file\0\0\0\0\0\0" (20 bytes)
+   version (4 bytes)
+   padding (8 bytes)
+   2 meta slots (32 bytes each), the valid one with the higher
+   generation wins:
+     generation (4 bytes)
+     root (4 bytes)
+       offset of the root node, 0 if the tree is empty
+     end (4 bytes)
+       end of the committed data; the next commit appends here
+     count (4 bytes)
+       number of records
+     logstart (4 bytes)
+       file size after the last checkpoint, used to tell when to
+       checkpoint again
+     padding (8 bytes)
+     checksum (4 bytes)
+       crc32 of the previous 28 bytes
+
+   1 or more nodes:
+     type (4 bytes) [LEAF, BRANCH]
+     nkeys (4 bytes)
+     size (4 bytes)
+       of the whole node, including this header
+     checksum (4 bytes)
+       crc32 of the rest of the node
+     entry offsets (4 bytes each, relative to the node)
+     entries, each padded to a 4 byte boundary:
+       LEAF: key size (4 bytes), data size (4 bytes), key, data
+       BRANCH: child offset (4 bytes), key size (4 bytes), key
+
+   the key of a branch entry is a lower bound for the keys below that
+   child; the first entry of a branch matches anything smaller too.
+*/
+
+enum {
+    LEAF = 1,
+    BRANCH = 2
+};
+
+enum {
+    BTREE_VERSION = 1,
+    BTREE_NODESIZE = 4096,	/* split nodes bigger than this */
+    BTREE_FILLSIZE = 3072,	/* how full a checkpoint packs nodes */
+    BTREE_MAXDEPTH = 32,
+    BTREE_MINREWRITE = 65536	/* don't rewrite files smaller than this */
+};
+
+#define HEADER_MAGIC ("\241\002\213\015btree file\0\0\0\0\0\0")
+#define HEADER_MAGIC_SIZE (20)
+
+/* offsets in the header */
+enum {
+    OFFSET_HEADER = 0,
+    OFFSET_VERSION = 20,
+    OFFSET_SLOT0 = 32,
+    OFFSET_SLOT1 = 64,
+    HEADER_SIZE = 96
+};
+
+/* offsets in a meta slot */
+enum {
+    SLOT_GENERATION = 0,
+    SLOT_ROOT = 4,
+    SLOT_END = 8,
+    SLOT_COUNT = 12,
+    SLOT_LOGSTART = 16,
+    SLOT_CRC = 28,
+    SLOT_SIZE = 32
+};
+
+/* offsets in a node */
+enum {
+    NODE_TYPE = 0,
+    NODE_NKEYS = 4,
+    NODE_SIZE = 8,
+    NODE_CRC = 12,
+    NODE_HEADER = 16
+};
+
+#define ROUNDUP(num) (((num) + 3) & 0xFFFFFFFC)
+
+#define GET32(ptr) (ntohl(*((uint32_t *)(ptr))))
+
+#define TYPE(ptr) GET32((ptr) + NODE_TYPE)
+#define NKEYS(ptr) GET32((ptr) + NODE_NKEYS)
+#define SIZE(ptr) GET32((ptr) + NODE_SIZE)
+#define ENTRY(ptr, i) ((ptr) + GET32((ptr) + NODE_HEADER + 4 * (i)))
+
+/* leaf entries */
+#define KEYLEN(ent) GET32(ent)
+#define DATALEN(ent) GET32((ent) + 4)
+#define KEY(ent) ((ent) + 8)
+#define DATA(ent) ((ent) + 8 + ROUNDUP(KEYLEN(ent)))
+
+/* branch entries */
+#define CHILD(ent) GET32(ent)
+#define BKEYLEN(ent) GET32((ent) + 4)
+#define BKEY(ent) ((ent) + 8)
+
+enum {
+    UNLOCKED = 0,
+    WRITELOCKED = 2
+};
+
+struct meta {
+    uint32_t generation;
+    uint32_t root;
+    uint32_t end;
+    uint32_t count;
+    uint32_t logstart;
+};
+
+/* an in-memory node, built by a transaction from the on-disk node it
+ * replaces.  keys and data point either into the map (which can't
+ * move while we hold the write lock) or into 'buf' for entries this
+ * transaction wrote. */
+struct bent {
+    const char *key;
+    int keylen;
+    const char *data;		/* LEAF */
+    int datalen;
+    uint32_t child;		/* BRANCH: on-disk child... */
+    struct bnode *cnode;	/* ...unless we've copied it */
+    char *buf;
+};
+
+struct bnode {
+    int type;
+    int n;
+    int alloc;
+    struct bent *ent;
+};
+
+/* a reference to either an on-disk or an in-memory node */
+struct nref {
+    const char *disk;
+    struct bnode *mem;
+};
+
+struct cursor {
+    int depth;
+    struct nref node[BTREE_MAXDEPTH];
+    int idx[BTREE_MAXDEPTH];
+};
+
+struct txn {
+    struct bnode *root;		/* NULL until the first change */
+    uint32_t count;
+};
+
+struct db {
+    /* file data */
+    char *fname;
+    int fd;
+
+    const char *map_base;
+    unsigned long map_len;	/* mapped size */
+    unsigned long map_size;	/* actual size */
+    ino_t map_ino;
+
+    /* the committed state we're looking at */
+    struct meta meta;
+
+    /* bumped whenever pointers into the tree may have gone stale */
+    unsigned version;
+
+    /* tracking info */
+    int lock_status;
+    struct txn *current_txn;
+    struct groupcommit *gc;	/* share commit syncs, or NULL */
+
+    /* comparator function to use for sorting */
+    int (*compar) (const char *s1, int l1, const char *s2, int l2);
+};
+
+struct db_list {
+    struct db *db;
+    struct db_list *next;
+    int refcount;
+};
+
+/* buffered appends to the end of the file */
+struct wbuf {
+    int fd;
+    uint32_t offset;		/* file offset of buf[0] */
+    char *buf;
+    unsigned len;
+    unsigned alloc;
+};
+
+static struct db_list *open_db = NULL;
+
+/* Perform an FSYNC/FDATASYNC if we are *not* operating in UNSAFE mode */
+#define DO_FSYNC (!libcyrus_config_getswitch(CYRUSOPT_SKIPLIST_UNSAFE))
+
+static int mycommit(struct db *db, struct txn *tid);
+static int myabort(struct db *db, struct txn *tid);
+static int mycheckpoint(struct db *db);
+static int unlock(struct db *db);
+
+static int myinit(const char *dbdir __attribute__((unused)),
+		  int myflags __attribute__((unused)))
+{
+    open_db = NULL;
+
+    return 0;
+}
+
+static int mydone(void)
+{
+    return 0;
+}
+
+static int mysync(void)
+{
+    return 0;
+}
+
+static int myarchive(const char **fnames, const char *dirname)
+{
+    int r;
+    const char **fname;
+    char dstname[1024], *dp;
+    int length, rest;
+
+    strlcpy(dstname, dirname, sizeof(dstname));
+    length = strlen(dstname);
+    dp = dstname + length;
+    rest = sizeof(dstname) - length;
+
+    /* archive those files specified by the app */
+    for (fname = fnames; *fname != NULL; ++fname) {
+	syslog(LOG_DEBUG, "archiving database file: %s", *fname);
+	strlcpy(dp, strrchr(*fname, '/'), rest);
+	r = cyrusdb_copyfile(*fname, dstname);
+	if (r) {
+	    syslog(LOG_ERR,
+		   "DBERROR: error archiving database file: %s", *fname);
+	    return CYRUSDB_IOERROR;
+	}
+    }
+
+    return 0;
+}
+
+static int compare(const char *s1, int l1, const char *s2, int l2)
+{
+    int min = l1 < l2 ? l1 : l2;
+    int cmp = 0;
+
+    while (min-- > 0 && (cmp = *s1 - *s2) == 0) {
+	s1++;
+	s2++;
+    }
+    if (min >= 0) {
+	return cmp;
+    } else {
+	if (l1 > l2) return 1;
+	else if (l2 > l1) return -1;
+	else return 0;
+    }
+}
+
+/* --- meta slots --- */
+
+static void pack_slot(char *buf, const struct meta *meta)
+{
+    memset(buf, 0, SLOT_SIZE);
+    *((uint32_t *)(buf + SLOT_GENERATION)) = htonl(meta->generation);
+    *((uint32_t *)(buf + SLOT_ROOT)) = htonl(meta->root);
+    *((uint32_t *)(buf + SLOT_END)) = htonl(meta->end);
+    *((uint32_t *)(buf + SLOT_COUNT)) = htonl(meta->count);
+    *((uint32_t *)(buf + SLOT_LOGSTART)) = htonl(meta->logstart);
+    *((uint32_t *)(buf + SLOT_CRC)) = htonl(crc32_map(buf, SLOT_CRC));
+}
+
+/* returns 1 if the slot at 'ptr' is intact */
+static int unpack_slot(const char *ptr, struct meta *meta)
+{
+    char buf[SLOT_SIZE];
+
+    /* copy it first; a writer may be updating it under us */
+    memcpy(buf, ptr, SLOT_SIZE);
+    if (GET32(buf + SLOT_CRC) != crc32_map(buf, SLOT_CRC)) return 0;
+
+    meta->generation = GET32(buf + SLOT_GENERATION);
+    meta->root = GET32(buf + SLOT_ROOT);
+    meta->end = GET32(buf + SLOT_END);
+    meta->count = GET32(buf + SLOT_COUNT);
+    meta->logstart = GET32(buf + SLOT_LOGSTART);
+
+    if (meta->end < HEADER_SIZE) return 0;
+    if (meta->root && meta->root >= meta->end) return 0;
+
+    return 1;
+}
+
+static int read_meta(struct db *db)
+{
+    struct meta m0, m1;
+    int ok0, ok1;
+    int tries;
+
+    if (db->map_size < HEADER_SIZE) {
+	/* being created; looks empty */
+	memset(&db->meta, 0, sizeof(db->meta));
+	db->meta.end = HEADER_SIZE;
+	return 0;
+    }
+
+    if (memcmp(db->map_base, HEADER_MAGIC, HEADER_MAGIC_SIZE)) {
+	syslog(LOG_ERR, "DBERROR: btree %s: invalid magic header", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    if (GET32(db->map_base + OFFSET_VERSION) != BTREE_VERSION) {
+	syslog(LOG_ERR, "DBERROR: btree %s: version mismatch: %u",
+	       db->fname, GET32(db->map_base + OFFSET_VERSION));
+	return CYRUSDB_IOERROR;
+    }
+
+    /* a slot can only be torn by a concurrent commit, which leaves the
+       other one alone; try again if we were very unlucky */
+    for (tries = 0; tries < 3; tries++) {
+	ok0 = unpack_slot(db->map_base + OFFSET_SLOT0, &m0);
+	ok1 = unpack_slot(db->map_base + OFFSET_SLOT1, &m1);
+
+	if (ok0 && (!ok1 || m0.generation > m1.generation)) {
+	    m1 = m0;
+	} else if (!ok1) {
+	    continue;
+	}
+
+	/* committed after we looked at the file size */
+	if (m1.end > db->map_size) return CYRUSDB_AGAIN;
+
+	db->meta = m1;
+	return 0;
+    }
+
+    syslog(LOG_ERR, "DBERROR: btree %s: no valid meta slot", db->fname);
+    return CYRUSDB_IOERROR;
+}
+
+static int write_meta(struct db *db, int fd, const struct meta *meta)
+{
+    char buf[SLOT_SIZE];
+    off_t offset = (meta->generation & 1) ? OFFSET_SLOT1 : OFFSET_SLOT0;
+
+    pack_slot(buf, meta);
+    if (lseek(fd, offset, SEEK_SET) < 0 ||
+	retry_write(fd, buf, SLOT_SIZE) != SLOT_SIZE) {
+	syslog(LOG_ERR, "DBERROR: btree %s: writing meta: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+static int write_header(struct db *db, int fd, const struct meta *meta)
+{
+    char buf[HEADER_SIZE];
+
+    memset(buf, 0, HEADER_SIZE);
+    memcpy(buf + OFFSET_HEADER, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    *((uint32_t *)(buf + OFFSET_VERSION)) = htonl(BTREE_VERSION);
+    pack_slot(buf + ((meta->generation & 1) ? OFFSET_SLOT1 : OFFSET_SLOT0),
+	      meta);
+
+    if (lseek(fd, 0, SEEK_SET) < 0 ||
+	retry_write(fd, buf, HEADER_SIZE) != HEADER_SIZE) {
+	syslog(LOG_ERR, "DBERROR: btree %s: writing header: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* --- locking and mapping --- */
+
+/* map the file as it is now, following a checkpoint if there was one */
+static int map_latest(struct db *db, struct stat *sbuf, struct stat *sbuffile)
+{
+    int newfd;
+
+    for (;;) {
+	if (fstat(db->fd, sbuf) == -1) {
+	    syslog(LOG_ERR, "IOERROR: fstat %s: %m", db->fname);
+	    return CYRUSDB_IOERROR;
+	}
+	if (stat(db->fname, sbuffile) == -1) {
+	    syslog(LOG_ERR, "IOERROR: stat %s: %m", db->fname);
+	    return CYRUSDB_IOERROR;
+	}
+	if (sbuf->st_ino == sbuffile->st_ino) break;
+
+	/* checkpointed under us */
+	newfd = open(db->fname, O_RDWR, 0644);
+	if (newfd == -1) {
+	    syslog(LOG_ERR, "IOERROR: open %s: %m", db->fname);
+	    return CYRUSDB_IOERROR;
+	}
+	dup2(newfd, db->fd);
+	close(newfd);
+    }
+
+    if (db->map_ino == sbuf->st_ino &&
+	db->map_size == (unsigned long) sbuf->st_size) {
+	/* nothing new */
+	return 0;
+    }
+
+    if (db->map_ino != sbuf->st_ino) {
+	map_free(&db->map_base, &db->map_len);
+    }
+    db->map_size = sbuf->st_size;
+    db->map_ino = sbuf->st_ino;
+    db->version++;
+
+    map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf->st_size,
+		db->fname, 0);
+
+    return 0;
+}
+
+/* map whatever has been committed last, without taking any lock */
+static int refresh(struct db *db)
+{
+    struct stat sbuf, sbuffile;
+    uint32_t generation = db->meta.generation;
+    int tries, r = 0;
+
+    if (db->lock_status == WRITELOCKED) return 0;
+
+    for (tries = 0; tries < 10; tries++) {
+	r = map_latest(db, &sbuf, &sbuffile);
+	if (r) return r;
+
+	r = read_meta(db);
+	if (r != CYRUSDB_AGAIN) break;
+    }
+    if (r == CYRUSDB_AGAIN) {
+	syslog(LOG_ERR, "DBERROR: btree %s: file shorter than its meta",
+	       db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    if (db->meta.generation != generation) db->version++;
+
+    return r;
+}
+
+static int write_lock(struct db *db, const char *altname)
+{
+    struct stat sbuf;
+    const char *lockfailaction;
+    const char *fname = altname ? altname : db->fname;
+
+    assert(db->lock_status == UNLOCKED);
+    if (lock_reopen(db->fd, fname, &sbuf, &lockfailaction) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s %s: %m", lockfailaction, fname);
+	return CYRUSDB_IOERROR;
+    }
+    if (db->map_ino != sbuf.st_ino) {
+	map_free(&db->map_base, &db->map_len);
+    }
+    db->map_size = sbuf.st_size;
+    db->map_ino = sbuf.st_ino;
+    db->lock_status = WRITELOCKED;
+    db->version++;
+
+    map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
+		fname, 0);
+
+    if (read_meta(db)) {
+	unlock(db);
+	return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+static int unlock(struct db *db)
+{
+    if (db->lock_status == UNLOCKED) {
+	syslog(LOG_NOTICE, "btree: unlock while not locked");
+    }
+    if (lock_unlock(db->fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: lock_unlock %s: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+    db->lock_status = UNLOCKED;
+
+    return 0;
+}
+
+static int lock_or_refresh(struct db *db, struct txn **tidptr)
+{
+    int r;
+
+    assert(db != NULL && tidptr != NULL);
+
+    if (*tidptr) {
+	/* check that the DB agrees that we're in this transaction */
+	assert(db->current_txn == *tidptr);
+    } else {
+	/* check that the DB isn't in a transaction */
+	assert(db->current_txn == NULL);
+
+	/* grab a r/w lock */
+	if ((r = write_lock(db, NULL)) < 0) {
+	    return r;
+	}
+
+	/* start the transaction */
+	*tidptr = (struct txn *) xzmalloc(sizeof(struct txn));
+	(*tidptr)->count = db->meta.count;
+	db->current_txn = *tidptr;
+    }
+
+    return 0;
+}
+
+/* --- nodes --- */
+
+/* sanity check an on-disk node before we follow a pointer to it */
+static int check_node(struct db *db, uint32_t offset)
+{
+    const char *ptr = db->map_base + offset;
+    uint32_t size;
+
+    if (offset < HEADER_SIZE || offset % 4 ||
+	offset + NODE_HEADER > db->meta.end) goto bad;
+
+    size = SIZE(ptr);
+    if ((TYPE(ptr) != LEAF && TYPE(ptr) != BRANCH) ||
+	size < NODE_HEADER + 4 * NKEYS(ptr) ||
+	size > db->meta.end - offset) goto bad;
+
+    return 0;
+
+ bad:
+    syslog(LOG_ERR, "DBERROR: btree %s: bad node at offset %u",
+	   db->fname, offset);
+    return CYRUSDB_IOERROR;
+}
+
+static int verify_node(struct db *db, uint32_t offset)
+{
+    const char *ptr = db->map_base + offset;
+    int r;
+
+    if ((r = check_node(db, offset))) return r;
+
+    if (GET32(ptr + NODE_CRC) !=
+	crc32_map(ptr + NODE_HEADER, SIZE(ptr) - NODE_HEADER)) {
+	syslog(LOG_ERR, "DBERROR: btree %s: checksum mismatch at offset %u",
+	       db->fname, offset);
+	return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+static int nref_type(struct nref r)
+{
+    return r.mem ? r.mem->type : (int) TYPE(r.disk);
+}
+
+static int nref_n(struct nref r)
+{
+    return r.mem ? r.mem->n : (int) NKEYS(r.disk);
+}
+
+static const char *nref_key(struct nref r, int i, int *keylen)
+{
+    const char *ent;
+
+    if (r.mem) {
+	*keylen = r.mem->ent[i].keylen;
+	return r.mem->ent[i].key;
+    }
+
+    ent = ENTRY(r.disk, i);
+    if (TYPE(r.disk) == LEAF) {
+	*keylen = KEYLEN(ent);
+	return KEY(ent);
+    }
+    *keylen = BKEYLEN(ent);
+    return BKEY(ent);
+}
+
+static const char *nref_data(struct nref r, int i, int *datalen)
+{
+    const char *ent;
+
+    if (r.mem) {
+	*datalen = r.mem->ent[i].datalen;
+	return r.mem->ent[i].data;
+    }
+
+    ent = ENTRY(r.disk, i);
+    *datalen = DATALEN(ent);
+    return DATA(ent);
+}
+
+static int nref_child(struct db *db, struct nref r, int i, struct nref *child)
+{
+    uint32_t offset;
+    int r2;
+
+    child->mem = NULL;
+    child->disk = NULL;
+
+    if (r.mem) {
+	if (r.mem->ent[i].cnode) {
+	    child->mem = r.mem->ent[i].cnode;
+	    return 0;
+	}
+	offset = r.mem->ent[i].child;
+    } else {
+	offset = CHILD(ENTRY(r.disk, i));
+    }
+
+    if ((r2 = check_node(db, offset))) return r2;
+    child->disk = db->map_base + offset;
+
+    return 0;
+}
+
+static int root_ref(struct db *db, struct txn *tid, struct nref *root)
+{
+    root->mem = NULL;
+    root->disk = NULL;
+
+    if (tid && tid->root) {
+	root->mem = tid->root;
+	return 0;
+    }
+    if (!db->meta.root) return 0;
+
+    if (check_node(db, db->meta.root)) return CYRUSDB_IOERROR;
+    root->disk = db->map_base + db->meta.root;
+
+    return 0;
+}
+
+/* index of the first entry >= key */
+static int node_search(struct db *db, struct nref r,
+		       const char *key, int keylen, int *exact)
+{
+    int lo = 0, hi = nref_n(r);
+    const char *k;
+    int kl, cmp;
+
+    *exact = 0;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+
+	k = nref_key(r, mid, &kl);
+	cmp = db->compar(k, kl, key, keylen);
+	if (cmp < 0) {
+	    lo = mid + 1;
+	} else {
+	    if (!cmp) *exact = 1;
+	    hi = mid;
+	}
+    }
+
+    return lo;
+}
+
+/* which child of a branch could hold key */
+static int branch_search(struct db *db, struct nref r,
+			 const char *key, int keylen)
+{
+    int exact;
+    int i = node_search(db, r, key, keylen, &exact);
+
+    if (!exact && i > 0) i--;
+    return i;
+}
+
+static struct bent *node_insert(struct bnode *node, int i)
+{
+    if (node->n == node->alloc) {
+	node->alloc = node->alloc ? 2 * node->alloc : 16;
+	node->ent = xrealloc(node->ent, node->alloc * sizeof(struct bent));
+    }
+    memmove(node->ent + i + 1, node->ent + i,
+	    (node->n - i) * sizeof(struct bent));
+    node->n++;
+    memset(node->ent + i, 0, sizeof(struct bent));
+
+    return node->ent + i;
+}
+
+static struct bnode *node_new(int type)
+{
+    struct bnode *node = (struct bnode *) xzmalloc(sizeof(struct bnode));
+
+    node->type = type;
+
+    return node;
+}
+
+static void node_free(struct bnode *node)
+{
+    int i;
+
+    if (!node) return;
+
+    for (i = 0; i < node->n; i++) {
+	node_free(node->ent[i].cnode);
+	free(node->ent[i].buf);
+    }
+    free(node->ent);
+    free(node);
+}
+
+static void node_remove(struct bnode *node, int i)
+{
+    node_free(node->ent[i].cnode);
+    free(node->ent[i].buf);
+    node->n--;
+    memmove(node->ent + i, node->ent + i + 1,
+	    (node->n - i) * sizeof(struct bent));
+}
+
+/* point an entry at its own copy of key (and data) */
+static void ent_set(struct bent *ent, const char *key, int keylen,
+		    const char *data, int datalen)
+{
+    char *buf = xmalloc(keylen + datalen + 1);
+
+    memcpy(buf, key, keylen);
+    if (datalen) memcpy(buf + keylen, data, datalen);
+
+    free(ent->buf);
+    ent->buf = buf;
+    ent->key = buf;
+    ent->keylen = keylen;
+    ent->data = buf + keylen;
+    ent->datalen = datalen;
+}
+
+static unsigned ent_bytes(int type, const struct bent *ent)
+{
+    if (type == LEAF) {
+	return 8 + ROUNDUP(ent->keylen) + ROUNDUP(ent->datalen);
+    }
+    return 8 + ROUNDUP(ent->keylen);
+}
+
+static unsigned node_bytes(const struct bnode *node)
+{
+    unsigned bytes = NODE_HEADER + 4 * node->n;
+    int i;
+
+    for (i = 0; i < node->n; i++) {
+	bytes += ent_bytes(node->type, node->ent + i);
+    }
+
+    return bytes;
+}
+
+/* copy an on-disk node into memory so we can change it */
+static int load_node(struct db *db, uint32_t offset, struct bnode **ret)
+{
+    const char *ptr = db->map_base + offset;
+    const char *ent;
+    struct bnode *node;
+    int i, n, r;
+
+    if ((r = verify_node(db, offset))) return r;
+
+    n = NKEYS(ptr);
+    node = node_new(TYPE(ptr));
+    node->alloc = n + 1;
+    node->ent = (struct bent *) xzmalloc(node->alloc * sizeof(struct bent));
+    node->n = n;
+
+    for (i = 0; i < n; i++) {
+	ent = ENTRY(ptr, i);
+	if (node->type == LEAF) {
+	    node->ent[i].key = KEY(ent);
+	    node->ent[i].keylen = KEYLEN(ent);
+	    node->ent[i].data = DATA(ent);
+	    node->ent[i].datalen = DATALEN(ent);
+	} else {
+	    node->ent[i].key = BKEY(ent);
+	    node->ent[i].keylen = BKEYLEN(ent);
+	    node->ent[i].child = CHILD(ent);
+	}
+    }
+
+    *ret = node;
+
+    return 0;
+}
+
+static int load_child(struct db *db, struct bnode *node, int i)
+{
+    if (node->ent[i].cnode) return 0;
+
+    return load_node(db, node->ent[i].child, &node->ent[i].cnode);
+}
+
+static int txn_root(struct db *db, struct txn *tid)
+{
+    if (tid->root) return 0;
+    if (!db->meta.root) {
+	tid->root = node_new(LEAF);
+	return 0;
+    }
+
+    return load_node(db, db->meta.root, &tid->root);
+}
+
+/* move the upper half of 'node' into a new sibling */
+static struct bnode *node_split(struct bnode *node)
+{
+    struct bnode *sib = node_new(node->type);
+    unsigned half = node_bytes(node) / 2;
+    unsigned bytes = NODE_HEADER + 4 + ent_bytes(node->type, node->ent);
+    int i;
+
+    /* both halves get at least one entry */
+    for (i = 1; i < node->n - 1 && bytes < half; i++) {
+	bytes += 4 + ent_bytes(node->type, node->ent + i);
+    }
+
+    sib->n = sib->alloc = node->n - i;
+    sib->ent = (struct bent *) xmalloc(sib->alloc * sizeof(struct bent));
+    memcpy(sib->ent, node->ent + i, sib->n * sizeof(struct bent));
+    node->n = i;
+
+    return sib;
+}
+
+static int tree_insert(struct db *db, struct txn *tid, struct bnode *node,
+		       int depth, const char *key, int keylen,
+		       const char *data, int datalen, int overwrite,
+		       struct bnode **split)
+{
+    struct nref ref;
+    struct bent *ent;
+    int exact, i, r;
+
+    *split = NULL;
+
+    if (depth >= BTREE_MAXDEPTH) {
+	syslog(LOG_ERR, "DBERROR: btree %s: tree too deep", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    ref.disk = NULL;
+    ref.mem = node;
+
+    if (node->type == LEAF) {
+	i = node_search(db, ref, key, keylen, &exact);
+	if (exact) {
+	    if (!overwrite) return CYRUSDB_EXISTS;
+	    ent = node->ent + i;
+	} else {
+	    ent = node_insert(node, i);
+	    tid->count++;
+	}
+	ent_set(ent, key, keylen, data, datalen);
+    } else {
+	struct bnode *sib;
+
+	i = branch_search(db, ref, key, keylen);
+	if ((r = load_child(db, node, i))) return r;
+
+	r = tree_insert(db, tid, node->ent[i].cnode, depth + 1,
+			key, keylen, data, datalen, overwrite, &sib);
+	if (r) return r;
+
+	if (sib) {
+	    ent = node_insert(node, i + 1);
+	    ent_set(ent, sib->ent[0].key, sib->ent[0].keylen, NULL, 0);
+	    ent->cnode = sib;
+	}
+    }
+
+    if (node->n > 1 && node_bytes(node) > BTREE_NODESIZE) {
+	*split = node_split(node);
+    }
+
+    return 0;
+}
+
+static int tree_delete(struct db *db, struct txn *tid, struct bnode *node,
+		       int depth, const char *key, int keylen, int *found)
+{
+    struct nref ref;
+    int exact, i, r;
+
+    if (depth >= BTREE_MAXDEPTH) {
+	syslog(LOG_ERR, "DBERROR: btree %s: tree too deep", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    ref.disk = NULL;
+    ref.mem = node;
+
+    if (node->type == LEAF) {
+	i = node_search(db, ref, key, keylen, &exact);
+	if (exact) {
+	    node_remove(node, i);
+	    tid->count--;
+	    *found = 1;
+	}
+	return 0;
+    }
+
+    i = branch_search(db, ref, key, keylen);
+    if ((r = load_child(db, node, i))) return r;
+
+    r = tree_delete(db, tid, node->ent[i].cnode, depth + 1,
+		    key, keylen, found);
+    if (r) return r;
+
+    /* we don't merge underfull nodes (checkpoints repack the tree),
+       but empty ones go */
+    if (!node->ent[i].cnode->n) {
+	node_remove(node, i);
+    }
+
+    return 0;
+}
+
+/* --- writing nodes --- */
+
+static int wbuf_flush(struct db *db, struct wbuf *w)
+{
+    if (!w->len) return 0;
+
+    if (lseek(w->fd, w->offset, SEEK_SET) < 0 ||
+	retry_write(w->fd, w->buf, w->len) != (int) w->len) {
+	syslog(LOG_ERR, "DBERROR: btree %s: writing nodes: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+    w->offset += w->len;
+    w->len = 0;
+
+    return 0;
+}
+
+/* append 'node' (whose children are already written) */
+static int write_node(struct db *db, struct wbuf *w, const struct bnode *node,
+		      uint32_t *offset)
+{
+    unsigned size = node_bytes(node);
+    unsigned pos;
+    char *ptr;
+    int i, r;
+
+    /* nodes are addressed by 32 bit offsets */
+    if ((uint64_t) w->offset + w->len + size > UINT32_MAX) {
+	syslog(LOG_ERR, "DBERROR: btree %s: file would exceed 4GB",
+	       db->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    if (w->len + size > w->alloc) {
+	if (w->len && (r = wbuf_flush(db, w))) return r;
+	if (size > w->alloc) {
+	    w->alloc = size > 65536 ? size : 65536;
+	    w->buf = xrealloc(w->buf, w->alloc);
+	}
+    }
+
+    *offset = w->offset + w->len;
+    ptr = w->buf + w->len;
+    memset(ptr, 0, size);
+
+    *((uint32_t *)(ptr + NODE_TYPE)) = htonl(node->type);
+    *((uint32_t *)(ptr + NODE_NKEYS)) = htonl(node->n);
+    *((uint32_t *)(ptr + NODE_SIZE)) = htonl(size);
+
+    pos = NODE_HEADER + 4 * node->n;
+    for (i = 0; i < node->n; i++) {
+	const struct bent *ent = node->ent + i;
+
+	*((uint32_t *)(ptr + NODE_HEADER + 4 * i)) = htonl(pos);
+	if (node->type == LEAF) {
+	    *((uint32_t *)(ptr + pos)) = htonl(ent->keylen);
+	    *((uint32_t *)(ptr + pos + 4)) = htonl(ent->datalen);
+	    memcpy(ptr + pos + 8, ent->key, ent->keylen);
+	    if (ent->datalen) {
+		memcpy(ptr + pos + 8 + ROUNDUP(ent->keylen),
+		       ent->data, ent->datalen);
+	    }
+	} else {
+	    *((uint32_t *)(ptr + pos)) = htonl(ent->child);
+	    *((uint32_t *)(ptr + pos + 4)) = htonl(ent->keylen);
+	    memcpy(ptr + pos + 8, ent->key, ent->keylen);
+	}
+	pos += ent_bytes(node->type, ent);
+    }
+
+    *((uint32_t *)(ptr + NODE_CRC)) =
+	htonl(crc32_map(ptr + NODE_HEADER, size - NODE_HEADER));
+    w->len += size;
+
+    return 0;
+}
+
+/* append every node this transaction changed, children first */
+static int write_tree(struct db *db, struct wbuf *w, struct bnode *node,
+		      uint32_t *offset)
+{
+    int i, r;
+
+    if (node->type == BRANCH) {
+	for (i = 0; i < node->n; i++) {
+	    if (!node->ent[i].cnode) continue;
+	    r = write_tree(db, w, node->ent[i].cnode, &node->ent[i].child);
+	    if (r) return r;
+	}
+    }
+
+    return write_node(db, w, node, offset);
+}
+
+/* --- the cyrusdb interface --- */
+
+static int dispose_db(struct db *db)
+{
+    if (!db) return 0;
+
+    if (db->lock_status) {
+	syslog(LOG_ERR, "btree: closed while still locked");
+	unlock(db);
+    }
+    if (db->fname) {
+	free(db->fname);
+    }
+    if (db->map_base) {
+	map_free(&db->map_base, &db->map_len);
+    }
+    if (db->fd != -1) {
+	close(db->fd);
+    }
+    groupcommit_close(db->gc);
+
+    free(db);
+
+    return 0;
+}
+
+static int myopen(const char *fname, int flags, struct db **ret)
+{
+    struct db *db;
+    struct db_list *list_ent = open_db;
+    int r;
+
+    while (list_ent && strcmp(list_ent->db->fname, fname)) {
+	list_ent = list_ent->next;
+    }
+    if (list_ent) {
+	/* we already have this DB open! */
+	syslog(LOG_NOTICE, "btree: %s is already open %d time%s, returning object",
+	fname, list_ent->refcount, list_ent->refcount == 1 ? "" : "s");
+	*ret = list_ent->db;
+	++list_ent->refcount;
+	return 0;
+    }
+
+    db = (struct db *) xzmalloc(sizeof(struct db));
+    db->fd = -1;
+    db->fname = xstrdup(fname);
+    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare : compare;
+
+    db->fd = open(fname, O_RDWR, 0644);
+    if (db->fd == -1 && errno == ENOENT) {
+	if (!(flags & CYRUSDB_CREATE)) {
+	    dispose_db(db);
+	    return CYRUSDB_NOTFOUND;
+	}
+	if (cyrus_mkdir(fname, 0755) == -1) {
+	    dispose_db(db);
+	    return CYRUSDB_IOERROR;
+	}
+	db->fd = open(fname, O_RDWR | O_CREAT, 0644);
+    }
+
+    if (db->fd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	dispose_db(db);
+	return CYRUSDB_IOERROR;
+    }
+
+    db->lock_status = UNLOCKED;
+
+    r = refresh(db);
+    if (r) {
+	dispose_db(db);
+	return r;
+    }
+
+    /* if the file is empty, then the header needs to be created first */
+    if (db->map_size < HEADER_SIZE) {
+	r = write_lock(db, NULL);
+	if (r < 0) {
+	    dispose_db(db);
+	    return r;
+	}
+
+	/* somebody else may have beaten us to it */
+	if (db->map_size < HEADER_SIZE) {
+	    struct meta meta;
+
+	    memset(&meta, 0, sizeof(meta));
+	    meta.generation = 1;
+	    meta.end = meta.logstart = HEADER_SIZE;
+
+	    r = write_header(db, db->fd, &meta);
+	    if (!r && DO_FSYNC && (fsync(db->fd) < 0)) {
+		syslog(LOG_ERR, "DBERROR: fsync(%s): %m", db->fname);
+		r = CYRUSDB_IOERROR;
+	    }
+	    if (!r) {
+		db->map_size = HEADER_SIZE;
+		map_refresh(db->fd, 0, &db->map_base, &db->map_len,
+			    HEADER_SIZE, db->fname, 0);
+		r = read_meta(db);
+	    }
+	}
+
+	unlock(db);
+	if (r) {
+	    dispose_db(db);
+	    return r;
+	}
+    }
+
+    if ((flags & CYRUSDB_GROUPCOMMIT) && DO_FSYNC) {
+	groupcommit_open(fname, &db->gc);
+    }
+
+    *ret = db;
+
+    /* track this database in the open list */
+    list_ent = (struct db_list *) xzmalloc(sizeof(struct db_list));
+    list_ent->db = db;
+    list_ent->next = open_db;
+    list_ent->refcount = 1;
+    open_db = list_ent;
+
+    return 0;
+}
+
+static int myclose(struct db *db)
+{
+    struct db_list *list_ent = open_db;
+    struct db_list *prev = NULL;
+
+    /* remove this DB from the open list */
+    while (list_ent && list_ent->db != db) {
+	prev = list_ent;
+	list_ent = list_ent->next;
+    }
+    assert(list_ent);
+    if (--list_ent->refcount <= 0) {
+	if (prev) prev->next = list_ent->next;
+	else open_db = list_ent->next;
+	free(list_ent);
+	return dispose_db(db);
+    }
+
+    return 0;
+}
+
+/* position 'cur' at the first record >= key */
+static int cursor_settle(struct db *db, struct cursor *cur);
+
+static int cursor_seek(struct db *db, struct txn *tid, struct cursor *cur,
+		       const char *key, int keylen, int *exact)
+{
+    struct nref node;
+    int d, r;
+
+    *exact = 0;
+    cur->depth = 0;
+
+    if ((r = root_ref(db, tid, &node))) return r;
+    if (!node.disk && !node.mem) return 0;
+
+    for (d = 0; d < BTREE_MAXDEPTH; d++) {
+	cur->node[d] = node;
+	if (nref_type(node) == LEAF) {
+	    cur->idx[d] = node_search(db, node, key, keylen, exact);
+	    cur->depth = d + 1;
+	    return cursor_settle(db, cur);
+	}
+	if (!nref_n(node)) break;
+	cur->idx[d] = branch_search(db, node, key, keylen);
+	if ((r = nref_child(db, node, cur->idx[d], &node))) return r;
+    }
+
+    syslog(LOG_ERR, "DBERROR: btree %s: malformed tree", db->fname);
+    return CYRUSDB_IOERROR;
+}
+
+/* make sure 'cur' points at a record, moving on to the next leaf if
+ * need be; depth 0 means we've run out */
+static int cursor_settle(struct db *db, struct cursor *cur)
+{
+    struct nref node;
+    int d, r;
+
+    while (cur->depth) {
+	d = cur->depth - 1;
+	if (cur->idx[d] < nref_n(cur->node[d])) return 0;
+
+	/* climb to the next unvisited subtree */
+	while (cur->idx[d] >= nref_n(cur->node[d]) - 1) {
+	    if (!d) {
+		cur->depth = 0;
+		return 0;
+	    }
+	    d--;
+	}
+	cur->idx[d]++;
+
+	/* and down its left edge */
+	while (nref_type(cur->node[d]) == BRANCH) {
+	    if ((r = nref_child(db, cur->node[d], cur->idx[d], &node))) {
+		return r;
+	    }
+	    if (++d >= BTREE_MAXDEPTH) {
+		syslog(LOG_ERR, "DBERROR: btree %s: malformed tree", db->fname);
+		return CYRUSDB_IOERROR;
+	    }
+	    cur->node[d] = node;
+	    cur->idx[d] = 0;
+	}
+	cur->depth = d + 1;
+    }
+
+    return 0;
+}
+
+static int myfetch(struct db *db,
+		   const char *key, int keylen,
+		   const char **data, int *datalen,
+		   struct txn **tidptr)
+{
+    struct cursor cur;
+    int exact = 0;
+    int r = 0;
+
+    assert(db != NULL && key != NULL);
+
+    if (data) *data = NULL;
+    if (datalen) *datalen = 0;
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn != NULL) {
+	tidptr = &(db->current_txn);
+    }
+
+    if (tidptr) {
+	/* make sure we're write locked */
+	if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	    return r;
+	}
+    } else {
+	/* no lock needed, just look at the latest commit */
+	if ((r = refresh(db)) < 0) {
+	    return r;
+	}
+    }
+
+    r = cursor_seek(db, tidptr ? *tidptr : NULL, &cur, key, keylen, &exact);
+    if (r) return r;
+
+    if (!exact) return CYRUSDB_NOTFOUND;
+
+    if (data) {
+	*data = nref_data(cur.node[cur.depth-1], cur.idx[cur.depth-1],
+			  datalen);
+    }
+
+    return 0;
+}
+
+static int fetch(struct db *mydb,
+		 const char *key, int keylen,
+		 const char **data, int *datalen,
+		 struct txn **tidptr)
+{
+    return myfetch(mydb, key, keylen, data, datalen, tidptr);
+}
+static int fetchlock(struct db *db,
+		     const char *key, int keylen,
+		     const char **data, int *datalen,
+		     struct txn **tidptr)
+{
+    return myfetch(db, key, keylen, data, datalen, tidptr);
+}
+
+/* call 'cb' for the records starting with 'prefix' as seen by 'tid'
+   (or the committed tree if tid is NULL) */
+static int walk(struct db *db, struct txn *tid,
+		const char *prefix, int prefixlen,
+		foreach_p *goodp, foreach_cb *cb, void *rock)
+{
+    struct cursor cur;
+    struct nref leaf;
+    const char *key, *data;
+    int keylen, datalen;
+    char *savebuf = NULL;
+    int savebuflen = 0;
+    int savebufsize;
+    unsigned version;
+    int exact;
+    int r = 0, cb_r = 0;
+
+    r = cursor_seek(db, tid, &cur, prefix, prefixlen, &exact);
+    version = db->version;
+
+    while (!r && cur.depth) {
+	leaf = cur.node[cur.depth-1];
+	key = nref_key(leaf, cur.idx[cur.depth-1], &keylen);
+
+	/* does it match prefix? */
+	if (keylen < prefixlen) break;
+	if (prefixlen && db->compar(key, prefixlen, prefix, prefixlen)) break;
+
+	data = nref_data(leaf, cur.idx[cur.depth-1], &datalen);
+
+	if (!goodp || goodp(rock, key, keylen, data, datalen)) {
+	    /* save KEY, KEYLEN */
+	    if (!savebuf || keylen > savebuflen) {
+		savebuflen = keylen + 1024;
+		savebuf = xrealloc(savebuf, savebuflen);
+	    }
+	    memcpy(savebuf, key, keylen);
+	    savebufsize = keylen;
+
+	    /* make callback */
+	    cb_r = cb(rock, key, keylen, data, datalen);
+	    if (cb_r) break;
+
+	    if (db->version != version) {
+		/* the callback changed something; reseek.  if 'savebuf'
+		   is still there move past it, otherwise we're already
+		   pointing at the right thing */
+		if (!tid) r = refresh(db);
+		if (!r) {
+		    r = cursor_seek(db, tid, &cur,
+				    savebuf, savebufsize, &exact);
+		}
+		version = db->version;
+		if (r || !exact) continue;
+	    }
+	}
+
+	/* move to the next one */
+	cur.idx[cur.depth-1]++;
+	r = cursor_settle(db, &cur);
+    }
+
+    free(savebuf);
+
+    return r ? r : cb_r;
+}
+
+/* foreach allows for subsidary mailbox operations in 'cb'.
+   if there is a txn, 'cb' must make use of it.
+*/
+static int myforeach(struct db *db,
+		     char *prefix, int prefixlen,
+		     foreach_p *goodp,
+		     foreach_cb *cb, void *rock,
+		     struct txn **tidptr)
+{
+    int r;
+
+    assert(db != NULL);
+    assert(prefixlen >= 0);
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn != NULL) {
+	tidptr = &(db->current_txn);
+    }
+
+    if (tidptr) {
+	/* make sure we're write locked */
+	if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	    return r;
+	}
+    } else {
+	/* no lock needed; we walk a snapshot of the latest commit */
+	if ((r = refresh(db)) < 0) {
+	    return r;
+	}
+    }
+
+    return walk(db, tidptr ? *tidptr : NULL, prefix, prefixlen,
+		goodp, cb, rock);
+}
+
+/* readers take no lock anyway, but walk() follows the callback's
+   changes.  a snapshot walks the tree as committed when it started,
+   through a map of its own which refresh() won't move: nothing below
+   the committed end of the file is ever rewritten, and a checkpoint
+   leaves the old file be. */
+static int myforeach_snapshot(struct db *db,
+			      char *prefix, int prefixlen,
+			      foreach_p *goodp,
+			      foreach_cb *cb, void *rock)
+{
+    struct db snap;
+    int r;
+
+    assert(db != NULL);
+    assert(prefixlen >= 0);
+
+    if (db->current_txn) {
+	return myforeach(db, prefix, prefixlen, goodp, cb, rock, NULL);
+    }
+
+    if ((r = refresh(db)) < 0) {
+	return r;
+    }
+
+    snap = *db;
+    snap.map_base = NULL;
+    snap.map_len = 0;
+    if (snap.meta.root) {
+	map_refresh(db->fd, 1, &snap.map_base, &snap.map_len,
+		    db->map_size, db->fname, 0);
+    }
+
+    r = walk(&snap, NULL, prefix, prefixlen, goodp, cb, rock);
+
+    map_free(&snap.map_base, &snap.map_len);
+
+    return r;
+}
+
+static int mystore(struct db *db,
+		   const char *key, int keylen,
+		   const char *data, int datalen,
+		   struct txn **tidptr, int overwrite)
+{
+    struct txn *tid, *localtid = NULL;
+    struct bnode *sib, *root;
+    struct bent *ent;
+    int r;
+
+    assert(db != NULL);
+    assert(key && keylen);
+
+    /* not keeping the transaction, just create one local to
+     * this function */
+    if (!tidptr) {
+	tidptr = &localtid;
+    }
+
+    /* make sure we're write locked */
+    if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	return r;
+    }
+
+    tid = *tidptr; /* consistent naming is nice */
+    db->version++;
+
+    r = txn_root(db, tid);
+    if (!r) {
+	r = tree_insert(db, tid, tid->root, 0, key, keylen,
+			data, datalen, overwrite, &sib);
+    }
+    if (!r && sib) {
+	/* grow a new root */
+	root = node_new(BRANCH);
+	ent = node_insert(root, 0);
+	ent_set(ent, tid->root->ent[0].key, tid->root->ent[0].keylen, NULL, 0);
+	ent->cnode = tid->root;
+	ent = node_insert(root, 1);
+	ent_set(ent, sib->ent[0].key, sib->ent[0].keylen, NULL, 0);
+	ent->cnode = sib;
+	tid->root = root;
+    }
+
+    if (r) {
+	myabort(db, tid);
+	return r;
+    }
+
+    if (localtid) {
+	/* commit the store, which releases the write lock */
+	r = mycommit(db, tid);
+    }
+
+    return r;
+}
+
+static int create(struct db *db,
+		  const char *key, int keylen,
+		  const char *data, int datalen,
+		  struct txn **tid)
+{
+    return mystore(db, key, keylen, data, datalen, tid, 0);
+}
+
+static int store(struct db *db,
+		 const char *key, int keylen,
+		 const char *data, int datalen,
+		 struct txn **tid)
+{
+    return mystore(db, key, keylen, data, datalen, tid, 1);
+}
+
+static int mydelete(struct db *db,
+		    const char *key, int keylen,
+		    struct txn **tidptr, int force __attribute__((unused)))
+{
+    struct txn *tid, *localtid = NULL;
+    struct cursor cur;
+    struct bnode *root;
+    int found = 0;
+    int r;
+
+    /* not keeping the transaction, just create one local to
+     * this function */
+    if (!tidptr) {
+	tidptr = &localtid;
+    }
+
+    /* make sure we're write locked */
+    if ((r = lock_or_refresh(db, tidptr)) < 0) {
+	return r;
+    }
+
+    tid = *tidptr; /* consistent naming is nice */
+
+    /* don't copy a path down the tree for nothing */
+    r = cursor_seek(db, tid, &cur, key, keylen, &found);
+    if (!r && !found) goto done;
+
+    db->version++;
+    found = 0;
+
+    if (!r) r = txn_root(db, tid);
+    if (!r) r = tree_delete(db, tid, tid->root, 0, key, keylen, &found);
+
+    /* shrink the tree while the root has a single child */
+    while (!r && tid->root->type == BRANCH && tid->root->n <= 1) {
+	root = tid->root;
+	if (!root->n) {
+	    tid->root = node_new(LEAF);
+	} else if (!(r = load_child(db, root, 0))) {
+	    tid->root = root->ent[0].cnode;
+	    root->ent[0].cnode = NULL;
+	} else {
+	    break;
+	}
+	node_free(root);
+    }
+
+    if (r) {
+	myabort(db, tid);
+	return r;
+    }
+
+ done:
+    if (localtid) {
+	/* commit the delete, which releases the write lock */
+	r = mycommit(db, tid);
+    }
+
+    return r;
+}
+
+static int mycommit(struct db *db, struct txn *tid)
+{
+    struct wbuf w;
+    struct meta meta;
+    uint32_t ticket = 0;
+    int group = 0;
+    int r = 0;
+
+    assert(db && tid);
+    assert(db->current_txn == tid);
+
+    /* verify that we did something this txn */
+    if (!tid->root) goto done;
+
+    meta = db->meta;
+    meta.generation++;
+    meta.count = tid->count;
+
+    /* append the changed nodes after the last commit; anything that
+       is already there was left by a commit that didn't make it */
+    memset(&w, 0, sizeof(w));
+    w.fd = db->fd;
+    w.offset = meta.end;
+
+    if (tid->root->type == LEAF && !tid->root->n) {
+	meta.root = 0;
+    } else {
+	r = write_tree(db, &w, tid->root, &meta.root);
+    }
+    if (!r) r = wbuf_flush(db, &w);
+    meta.end = w.offset;
+    free(w.buf);
+
+    /* the nodes must be on disk before the meta slot points at them.
+       this also makes the meta of any group commits before us durable. */
+    if (!r && DO_FSYNC &&
+	((db->gc ? groupcommit_fdatasync(db->gc, db->fd) :
+	  fdatasync(db->fd)) < 0)) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    if (!r) r = write_meta(db, db->fd, &meta);
+
+    /* the meta slot can be synced along with other committers' once
+       we've let go of the lock */
+    if (!r && db->gc && !groupcommit_begin(db->gc, &ticket)) group = 1;
+
+    if (!r && !group && DO_FSYNC && (fdatasync(db->fd) < 0)) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    if (r) {
+	int r2;
+
+	/* error during commit; we must abort */
+	r2 = myabort(db, tid);
+	if (r2) {
+	    syslog(LOG_ERR, "DBERROR: btree %s: commit AND abort failed",
+		   db->fname);
+	}
+	return r;
+    }
+
+    /* the tree in memory points into the old map */
+    node_free(tid->root);
+    tid->root = NULL;
+
+    db->meta = meta;
+    if (meta.end > db->map_size) db->map_size = meta.end;
+    map_refresh(db->fd, 0, &db->map_base, &db->map_len, db->map_size,
+		db->fname, 0);
+    db->version++;
+
+    /* consider checkpointing; the commit stands even if this fails */
+    if (meta.end > 2 * meta.logstart + BTREE_MINREWRITE) {
+	mycheckpoint(db);
+    }
+
+ done:
+    db->current_txn = NULL;
+    node_free(tid->root);
+    free(tid);
+
+    if (db->lock_status == WRITELOCKED) {
+	int r2 = unlock(db);
+	if (!r) r = r2;
+    }
+
+    if (group && groupcommit_finish(db->gc, db->fd, ticket) < 0) {
+	/* too late to abort: readers may already have seen it */
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    return r;
+}
+
+static int myabort(struct db *db, struct txn *tid)
+{
+    assert(db && tid);
+    assert(db->current_txn == tid);
+
+    /* nothing reached the disk that a reader would look at */
+    node_free(tid->root);
+    free(tid);
+    db->current_txn = NULL;
+    db->version++;
+
+    return unlock(db);
+}
+
+/* builds a packed tree bottom up from records in key order */
+struct builder {
+    struct db *db;
+    struct wbuf w;
+    int copy;			/* keep our own copies of keys and data */
+    int nlevels;
+    struct bnode level[BTREE_MAXDEPTH];
+};
+
+static int builder_add(struct builder *b, int l, const char *key, int keylen,
+		       const char *data, int datalen, uint32_t child);
+
+/* write out the node at level 'l' and add it to its parent */
+static int builder_flush(struct builder *b, int l)
+{
+    struct bnode *node = b->level + l;
+    uint32_t offset;
+    int r;
+
+    r = write_node(b->db, &b->w, node, &offset);
+    if (!r) {
+	if (l + 1 >= BTREE_MAXDEPTH) return CYRUSDB_INTERNAL;
+	if (l + 1 == b->nlevels) b->nlevels++;
+	r = builder_add(b, l + 1, node->ent[0].key, node->ent[0].keylen,
+			NULL, 0, offset);
+    }
+    if (b->copy) {
+	int i;
+
+	for (i = 0; i < node->n; i++) free((char *) node->ent[i].key);
+    }
+    node->n = 0;
+
+    return r;
+}
+
+static int builder_add(struct builder *b, int l, const char *key, int keylen,
+		       const char *data, int datalen, uint32_t child)
+{
+    struct bnode *node = b->level + l;
+    struct bent *ent;
+    int r;
+
+    if (node->n) {
+	struct bent tmp;
+
+	tmp.keylen = keylen;
+	tmp.datalen = datalen;
+	if (node_bytes(node) + 4 + ent_bytes(node->type, &tmp) >
+	    BTREE_FILLSIZE && (r = builder_flush(b, l))) {
+	    return r;
+	}
+    }
+
+    if (b->copy) {
+	/* key and data share one allocation */
+	char *buf = xmalloc(keylen + datalen);
+
+	memcpy(buf, key, keylen);
+	if (datalen) memcpy(buf + keylen, data, datalen);
+	key = buf;
+	if (data) data = buf + keylen;
+    }
+
+    ent = node_insert(node, node->n);
+    ent->key = key;
+    ent->keylen = keylen;
+    ent->data = data;
+    ent->datalen = datalen;
+    ent->child = child;
+
+    return 0;
+}
+
+/* finish the tree, returning the offset of its root */
+static int builder_finish(struct builder *b, uint32_t *root)
+{
+    int l, r;
+
+    *root = 0;
+    for (l = 0; l < b->nlevels; l++) {
+	if (l == b->nlevels - 1) {
+	    /* the only node at this level */
+	    if (!b->level[l].n) return 0;
+	    return write_node(b->db, &b->w, b->level + l, root);
+	}
+	if (b->level[l].n && (r = builder_flush(b, l))) return r;
+    }
+
+    return 0;
+}
+
+static void builder_free(struct builder *b)
+{
+    int i, l;
+
+    for (l = 0; l < BTREE_MAXDEPTH; l++) {
+	if (b->copy) {
+	    for (i = 0; i < b->level[l].n; i++) {
+		free((char *) b->level[l].ent[i].key);
+	    }
+	}
+	free(b->level[l].ent);
+    }
+    free(b->w.buf);
+}
+
+static int copy_cb(void *rock,
+		   const char *key, int keylen,
+		   const char *data, int datalen)
+{
+    return builder_add((struct builder *) rock, 0, key, keylen,
+		       data, datalen, 0);
+}
+
+/* write the live tree, tightly packed, to a new file and rename it into
+   place.  readers carry on with the old file meanwhile. */
+static int mycheckpoint(struct db *db)
+{
+    char fname[1024];
+    struct builder b;
+    struct meta meta;
+    struct stat sbuf;
+    const char *lockfailaction;
+    int l, r = 0;
+    time_t start = time(NULL);
+
+    assert(db->lock_status == WRITELOCKED);
+
+    memset(&b, 0, sizeof(b));
+    b.db = db;
+    b.nlevels = 1;
+    for (l = 0; l < BTREE_MAXDEPTH; l++) {
+	b.level[l].type = l ? BRANCH : LEAF;
+    }
+
+    /* open fname.NEW */
+    snprintf(fname, sizeof(fname), "%s.NEW", db->fname);
+    b.w.fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (b.w.fd < 0) {
+	syslog(LOG_ERR, "DBERROR: btree checkpoint: open(%s): %m", fname);
+	return CYRUSDB_IOERROR;
+    }
+    b.w.offset = HEADER_SIZE;
+
+    /* copy the committed tree */
+    r = walk(db, NULL, "", 0, NULL, &copy_cb, &b);
+
+    memset(&meta, 0, sizeof(meta));
+    meta.generation = 1;
+    meta.count = db->meta.count;
+    if (!r) r = builder_finish(&b, &meta.root);
+    if (!r) r = wbuf_flush(db, &b.w);
+    meta.end = meta.logstart = b.w.offset;
+    if (!r) r = write_header(db, b.w.fd, &meta);
+    builder_free(&b);
+
+    /* sync new file */
+    if (!r && DO_FSYNC && (fdatasync(b.w.fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: btree checkpoint: fdatasync(%s): %m", fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    /* lock the new file before anyone can open it by the real name.
+       the map and meta are left on the old file until we're sure */
+    if (!r && lock_reopen(b.w.fd, fname, NULL, &lockfailaction) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s %s: %m", lockfailaction, fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    /* move new file to original file name */
+    if (!r && (rename(fname, db->fname) < 0)) {
+	syslog(LOG_ERR, "DBERROR: btree checkpoint: rename(%s, %s): %m",
+	       fname, db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    if (r) {
+	/* clean up */
+	close(b.w.fd);
+	unlink(fname);
+
+	/* we're still locked on the old file, which is as it was */
+	return r;
+    }
+
+    /* force the new file name to disk.  it's in place whatever
+       happens, so we have to move over to it regardless */
+    if (DO_FSYNC && (fsync(b.w.fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: btree checkpoint: fsync(%s): %m",
+	       db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    /* release old write lock.  unlike skiplist, we leave the old file's
+       contents alone: readers may still have it mapped */
+    close(db->fd);
+    db->fd = b.w.fd;
+
+    /* let's make sure we're up to date */
+    map_free(&db->map_base, &db->map_len);
+    if (fstat(db->fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat %s: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+    db->map_size = sbuf.st_size;
+    db->map_ino = sbuf.st_ino;
+    map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
+		db->fname, 0);
+    db->version++;
+    {
+	int r2 = read_meta(db);
+	if (!r) r = r2;
+    }
+
+    {
+	int diff = time(NULL) - start;
+	syslog(LOG_INFO,
+	       "btree: checkpointed %s (%u record%s, %u bytes) in %d second%s",
+	       db->fname, db->meta.count, db->meta.count == 1 ? "" : "s",
+	       db->meta.end, diff, diff == 1 ? "" : "s");
+    }
+
+    return r;
+}
+
+/* bulk loading: the same bottom up build as a checkpoint, from records
+   the caller hands us in order */
+struct bulkload {
+    struct db db;		/* just enough of one to describe the file */
+    char *newfname;
+    struct builder b;
+    uint32_t count;
+    char *lastkey;
+    int lastkeylen;
+    int lastkeyalloc;
+};
+
+static int bulkload_end(struct bulkload *bl, int commit);
+
+static int bulkload_begin(const char *fname, int flags,
+			  struct bulkload **ret)
+{
+    struct bulkload *bl;
+    const char *lockfailaction;
+    int l;
+
+    bl = (struct bulkload *) xzmalloc(sizeof(struct bulkload));
+    bl->db.fd = -1;
+    bl->db.fname = xstrdup(fname);
+    bl->db.compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare : compare;
+
+    bl->b.db = &bl->db;
+    bl->b.copy = 1;
+    bl->b.nlevels = 1;
+    for (l = 0; l < BTREE_MAXDEPTH; l++) {
+	bl->b.level[l].type = l ? BRANCH : LEAF;
+    }
+    bl->b.w.offset = HEADER_SIZE;
+
+    bl->newfname = xmalloc(strlen(fname) + 6);
+    sprintf(bl->newfname, "%s.LOAD", fname);
+
+    if (cyrus_mkdir(bl->newfname, 0755) == -1) {
+	bulkload_end(bl, 0);
+	return CYRUSDB_IOERROR;
+    }
+
+    /* one load at a time */
+    bl->db.fd = open(bl->newfname, O_RDWR | O_CREAT, 0644);
+    if (bl->db.fd == -1 ||
+	lock_reopen(bl->db.fd, bl->newfname, NULL, &lockfailaction) < 0 ||
+	ftruncate(bl->db.fd, 0) < 0) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", bl->newfname);
+	bulkload_end(bl, 0);
+	return CYRUSDB_IOERROR;
+    }
+    bl->b.w.fd = bl->db.fd;
+
+    *ret = bl;
+    return 0;
+}
+
+static int bulkload_add(struct bulkload *bl,
+			const char *key, int keylen,
+			const char *data, int datalen)
+{
+    int r;
+
+    assert(key && keylen);
+
+    if (bl->count &&
+	bl->db.compar(key, keylen, bl->lastkey, bl->lastkeylen) <= 0) {
+	return CYRUSDB_EXISTS;
+    }
+
+    r = builder_add(&bl->b, 0, key, keylen, data, datalen, 0);
+    if (r) return r;
+
+    if (keylen > bl->lastkeyalloc) {
+	bl->lastkeyalloc = keylen + 256;
+	bl->lastkey = xrealloc(bl->lastkey, bl->lastkeyalloc);
+    }
+    memcpy(bl->lastkey, key, keylen);
+    bl->lastkeylen = keylen;
+    bl->count++;
+
+    return 0;
+}
+
+static int bulkload_end(struct bulkload *bl, int commit)
+{
+    struct meta meta;
+    const char *lockfailaction;
+    int oldfd = -1;
+    int r = 0;
+
+    if (!commit || bl->db.fd == -1) goto done;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.generation = 1;
+    meta.count = bl->count;
+    r = builder_finish(&bl->b, &meta.root);
+    if (!r) r = wbuf_flush(&bl->db, &bl->b.w);
+    meta.end = meta.logstart = bl->b.w.offset;
+    if (!r) r = write_header(&bl->db, bl->db.fd, &meta);
+    if (r) goto done;
+
+    if (DO_FSYNC && (fdatasync(bl->db.fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: btree load %s: fdatasync: %m",
+	       bl->db.fname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    /* wait for any writer to the old file to finish; readers and
+       later writers will find the new one */
+    oldfd = open(bl->db.fname, O_RDWR, 0644);
+    if (oldfd != -1 &&
+	lock_reopen(oldfd, bl->db.fname, NULL, &lockfailaction) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s %s: %m", lockfailaction, bl->db.fname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    if (rename(bl->newfname, bl->db.fname) < 0) {
+	syslog(LOG_ERR, "DBERROR: btree load: rename(%s, %s): %m",
+	       bl->newfname, bl->db.fname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    /* force the new file name to disk */
+    if (DO_FSYNC && (fsync(bl->db.fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: btree load %s: fsync: %m", bl->db.fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+ done:
+    if (bl->db.fd != -1) {
+	if (r || !commit) unlink(bl->newfname);
+	close(bl->db.fd);
+    }
+    if (oldfd != -1) close(oldfd);
+
+    builder_free(&bl->b);
+    free(bl->lastkey);
+    free(bl->newfname);
+    free(bl->db.fname);
+    free(bl);
+
+    return r;
+}
+
+static int dump_node(struct db *db, uint32_t offset, int depth, int detail)
+{
+    const char *ptr = db->map_base + offset;
+    const char *ent;
+    int i, r;
+
+    if ((r = verify_node(db, offset))) return r;
+
+    printf("%*s%s 0x%X n=%u size=%u\n", 2 * depth, "",
+	   TYPE(ptr) == LEAF ? "LEAF" : "BRANCH", offset,
+	   NKEYS(ptr), SIZE(ptr));
+
+    for (i = 0; i < (int) NKEYS(ptr); i++) {
+	ent = ENTRY(ptr, i);
+	if (TYPE(ptr) == LEAF) {
+	    if (detail > 1) {
+		printf("%*s  '%.*s' -> '%.*s'\n", 2 * depth, "",
+		       KEYLEN(ent), KEY(ent), DATALEN(ent), DATA(ent));
+	    }
+	} else {
+	    printf("%*s  '%.*s' 0x%X\n", 2 * depth, "",
+		   BKEYLEN(ent), BKEY(ent), CHILD(ent));
+	    if (depth + 1 >= BTREE_MAXDEPTH) return CYRUSDB_IOERROR;
+	    r = dump_node(db, CHILD(ent), depth + 1, detail);
+	    if (r) return r;
+	}
+    }
+
+    return 0;
+}
+
+/* dump the database.
+   if detail == 1, dump the tree structure.
+   if detail >= 2, also dump the records.
+*/
+static int dump(struct db *db, int detail)
+{
+    int r;
+
+    if ((r = refresh(db))) return r;
+
+    printf("HEADER: v=%d gen=%u root=0x%X end=0x%X count=%u logstart=0x%X\n",
+	   BTREE_VERSION, db->meta.generation, db->meta.root, db->meta.end,
+	   db->meta.count, db->meta.logstart);
+
+    if (!db->meta.root) return 0;
+
+    return dump_node(db, db->meta.root, 0, detail);
+}
+
+struct check_rock {
+    struct db *db;
+    uint32_t count;
+    char *last;
+    int lastlen;
+};
+
+/* verify checksums and ordering below 'offset'; the keys must be >= lo */
+static int check_tree(struct check_rock *crock, uint32_t offset, int depth,
+		      const char *lo, int lolen)
+{
+    struct db *db = crock->db;
+    const char *ptr = db->map_base + offset;
+    const char *ent, *key;
+    int i, n, keylen, r;
+
+    if (depth >= BTREE_MAXDEPTH) return CYRUSDB_IOERROR;
+    if ((r = verify_node(db, offset))) return r;
+
+    n = NKEYS(ptr);
+    for (i = 0; i < n; i++) {
+	ent = ENTRY(ptr, i);
+	if (TYPE(ptr) == LEAF) {
+	    key = KEY(ent);
+	    keylen = KEYLEN(ent);
+	} else {
+	    key = BKEY(ent);
+	    keylen = BKEYLEN(ent);
+	}
+
+	if (lo && db->compar(key, keylen, lo, lolen) < 0) {
+	    syslog(LOG_ERR, "DBERROR: btree %s: key '%.*s' below its bound "
+		   "in node 0x%X", db->fname, keylen, key, offset);
+	    return CYRUSDB_INTERNAL;
+	}
+
+	if (TYPE(ptr) == BRANCH) {
+	    r = check_tree(crock, CHILD(ent), depth + 1,
+			   i ? key : lo, i ? keylen : lolen);
+	    if (r) return r;
+	    continue;
+	}
+
+	if (crock->last &&
+	    db->compar(crock->last, crock->lastlen, key, keylen) >= 0) {
+	    syslog(LOG_ERR, "DBERROR: btree %s: out of order key '%.*s' "
+		   "in node 0x%X", db->fname, keylen, key, offset);
+	    return CYRUSDB_INTERNAL;
+	}
+	crock->last = (char *) key;
+	crock->lastlen = keylen;
+	crock->count++;
+    }
+
+    return 0;
+}
+
+static int consistent(struct db *db)
+{
+    struct check_rock crock;
+    int r;
+
+    if ((r = refresh(db))) return r;
+
+    memset(&crock, 0, sizeof(crock));
+    crock.db = db;
+
+    if (db->meta.root) r = check_tree(&crock, db->meta.root, 0, NULL, 0);
+
+    if (!r && crock.count != db->meta.count) {
+	syslog(LOG_ERR, "DBERROR: btree %s: %u records, expected %u",
+	       db->fname, crock.count, db->meta.count);
+	r = CYRUSDB_INTERNAL;
+    }
+
+    return r;
+}
+
+struct cyrusdb_backend cyrusdb_btree =
+{
+    "btree",			/* name */
+
+    &myinit,
+    &mydone,
+    &mysync,
+    &myarchive,
+
+    &myopen,
+    &myclose,
+
+    &fetch,
+    &fetchlock,
+    &myforeach,
+    &create,
+    &store,
+    &mydelete,
+
+    &mycommit,
+    &myabort,
+
+    &dump,
+    &consistent,
+
+    &bulkload_begin,
+    &bulkload_add,
+    &bulkload_end,
+
+    &myforeach_snapshot
+};
@@ -742,5 +742,11 @@ struct cyrusdb_backend cyrusdb_flat =
     &abort_txn,
 
     NULL,
+    NULL,
+
+    NULL,
+    NULL,
+    NULL,
+
     NULL
 };
@@ -918,5 +918,11 @@ struct cyrusdb_backend cyrusdb_quotalegacy =
     &abort_txn,
 
     NULL,
+    NULL,
+
+    NULL,
+    NULL,
+    NULL,
+
     NULL
 };
@@ -66,6 +66,7 @@
 #include "cyrusdb.h"
 #include "libcyr_cfg.h"
 #include "cyr_lock.h"
+#include "groupcommit.h"
 #include "map.h"
 #include "retry.h"
 #include "util.h"
@@ -121,6 +122,26 @@
      record ptr (4 bytes; record to be deleted)
 
      record type (4 bytes) [COMMIT]
+
+   version 2 files may also contain packed nodes, which put everything
+   a search looks at near the start of the node and can share the
+   beginning of their key with an earlier node:
+
+     record type | PACKED (4 bytes) [DUMMY, INORDER, ADD]
+     key size (4 bytes; whole key)
+     data size (4 bytes)
+     level (1 byte), prefix size (1 byte),
+       distance back to the node holding the prefix (2 bytes, in words)
+     skip pointers (4 bytes each)
+       least to most
+     key string, less the prefix (rounded up to 4 bytes w/ 0s)
+     data string (rounded up to 4 bytes w/ 0s)
+     padding (4 bytes, must be -1)
+
+   the node holding the prefix is never itself prefixed.  only
+   checkpoints and loads, which write in key order, prefix nodes; the
+   prefix then stays put until the next checkpoint, even if its node
+   is deleted.
      
 
    record type is either
@@ -139,6 +160,8 @@ enum {
     DUMMY = 257
 };
 
+#define PACKED (0x10000)
+
 enum {
     UNLOCKED = 0,
     READLOCKED = 1,
@@ -176,7 +199,9 @@ struct db {
     /* tracking info */
     int lock_status;
     int is_open;
+    int in_checkpoint;		/* replaying into a checkpoint file */
     struct txn *current_txn;
+    struct groupcommit *gc;	/* share commit syncs, or NULL */
 
     /* comparator function to use for sorting */
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
@@ -194,6 +219,11 @@ static struct db_list *open_db = NULL;
 /* Perform an FSYNC/FDATASYNC if we are *not* operating in UNSAFE mode */
 #define DO_FSYNC (!libcyrus_config_getswitch(CYRUSOPT_SKIPLIST_UNSAFE))
 
+/* the format of new files and of checkpoints */
+#define NEW_VERSION \
+    (libcyrus_config_getswitch(CYRUSOPT_SKIPLIST_PACKED) ? \
+     SKIPLIST_VERSION_PACKED : SKIPLIST_VERSION)
+
 enum {
     be_paranoid = 0,
     use_osync = 0
@@ -310,6 +340,7 @@ static int myarchive(const char **fnames, const char *dirname)
 
 enum {
     SKIPLIST_VERSION = 1,
+    SKIPLIST_VERSION_PACKED = 2,
     SKIPLIST_VERSION_MINOR = 2,
     SKIPLIST_MAXLEVEL = 20,
     SKIPLIST_MINREWRITE = 16834 /* don't rewrite logs smaller than this */
@@ -337,6 +368,7 @@ enum {
 static int mycommit(struct db *db, struct txn *tid);
 static int myabort(struct db *db, struct txn *tid);
 static int mycheckpoint(struct db *db, int locked);
+static int incremental_checkpoint(struct db *db);
 static int myconsistent(struct db *db, struct txn *tid, int locked);
 static int recovery(struct db *db, int flags);
 
@@ -361,20 +393,44 @@ enum {
        uint32_t ds = 0;
        uint32_t forward[db->maxlevel];
        uint32_t pad = -1;
-   } */
+   }
+   (or the packed equivalent, in version 2 files) */
+#define IS_PACKED(db) ((db)->version >= SKIPLIST_VERSION_PACKED)
 #define DUMMY_OFFSET(db) (HEADER_SIZE)
 #define DUMMY_PTR(db) ((db)->map_base + HEADER_SIZE)
-#define DUMMY_SIZE(db) (4 * (3 + db->maxlevel + 1))
+#define DUMMY_SIZE(db) (4 * ((IS_PACKED(db) ? 4 : 3) + (db)->maxlevel + 1))
+/* where the dummy's xth pointer lives */
+#define DUMMY_PTROFFSET(db, x) \
+    (DUMMY_OFFSET(db) + (IS_PACKED(db) ? 16 : 12) + 4 * (x))
 
 /* bump to the next multiple of 4 bytes */
 #define ROUNDUP(num) (((num) + 3) & 0xFFFFFFFC)
 
-#define TYPE(ptr) (ntohl(*((uint32_t *)(ptr))))
-#define KEY(ptr) ((ptr) + 8)
+#define RAWTYPE(ptr) (ntohl(*((uint32_t *)(ptr))))
+#define TYPE(ptr) (RAWTYPE(ptr) & ~PACKED)
+#define PACKEDNODE(ptr) (RAWTYPE(ptr) & PACKED)
 #define KEYLEN(ptr) (ntohl(*((uint32_t *)((ptr) + 4))))
-#define DATA(ptr) ((ptr) + 8 + ROUNDUP(KEYLEN(ptr)) + 4)
-#define DATALEN(ptr) (ntohl(*((uint32_t *)((ptr) + 8 + ROUNDUP(KEYLEN(ptr))))))
-#define FIRSTPTR(ptr) ((ptr) + 8 + ROUNDUP(KEYLEN(ptr)) + 4 + ROUNDUP(DATALEN(ptr)))
+
+/* packed nodes */
+#define PACKINFO(ptr) (ntohl(*((uint32_t *)((ptr) + 12))))
+#define PACKLEVEL(ptr) (PACKINFO(ptr) >> 24)
+#define PREFIXLEN(ptr) (PACKEDNODE(ptr) ? (PACKINFO(ptr) >> 16) & 0xff : 0)
+#define PREFIXNODE(ptr) ((ptr) - 4 * (PACKINFO(ptr) & 0xffff))
+
+/* the part of the key stored in this node */
+#define SKEY(ptr) \
+    (PACKEDNODE(ptr) ? (ptr) + 16 + 4 * PACKLEVEL(ptr) : (ptr) + 8)
+#define SKEYLEN(ptr) (KEYLEN(ptr) - PREFIXLEN(ptr))
+
+#define DATA(ptr) \
+    (PACKEDNODE(ptr) ? SKEY(ptr) + ROUNDUP(SKEYLEN(ptr)) : \
+     (ptr) + 8 + ROUNDUP(KEYLEN(ptr)) + 4)
+#define DATALEN(ptr) \
+    (PACKEDNODE(ptr) ? ntohl(*((uint32_t *)((ptr) + 8))) : \
+     ntohl(*((uint32_t *)((ptr) + 8 + ROUNDUP(KEYLEN(ptr))))))
+#define FIRSTPTR(ptr) \
+    (PACKEDNODE(ptr) ? (ptr) + 16 : \
+     (ptr) + 8 + ROUNDUP(KEYLEN(ptr)) + 4 + ROUNDUP(DATALEN(ptr)))
 
 /* return a pointer to the pointer */
 #define PTR(ptr, x) (FIRSTPTR(ptr) + 4 * (x))
@@ -391,6 +447,7 @@ static unsigned LEVEL(const char *ptr)
     const uint32_t *p, *q;
 
     assert(TYPE(ptr) == DUMMY || TYPE(ptr) == INORDER || TYPE(ptr) == ADD);
+    if (PACKEDNODE(ptr)) return PACKLEVEL(ptr);
     p = q = (uint32_t *) FIRSTPTR(ptr);
     while (*p != (uint32_t)-1) p++;
     return (p - q);
@@ -404,6 +461,14 @@ static unsigned RECSIZE(const char *ptr)
     case DUMMY:
     case INORDER:
     case ADD:
+	if (PACKEDNODE(ptr)) {
+	    ret += 16;			/* tag, keylen, datalen, info */
+	    ret += 4 * PACKLEVEL(ptr);	/* pointers */
+	    ret += ROUNDUP(SKEYLEN(ptr));	/* key */
+	    ret += ROUNDUP(DATALEN(ptr));	/* data */
+	    ret += 4;			/* padding */
+	    break;
+	}
 	ret += 4;			/* tag */
 	ret += 4;			/* keylen */
 	ret += ROUNDUP(KEYLEN(ptr));    /* key */
@@ -487,6 +552,209 @@ static int newtxn(struct db *db, struct txn **tidptr)
 
 #define PADDING(ptr) (ntohl(*((uint32_t *)((ptr) + RECSIZE(ptr) - 4))))
 
+/* the whole key of the node at 'ptr'.  it's only copied into 'buf'
+   if the node shares a prefix with another one. */
+static const char *NODEKEY(const char *ptr, struct buf *buf)
+{
+    unsigned prefixlen = PREFIXLEN(ptr);
+
+    if (!prefixlen) return SKEY(ptr);
+
+    buf_setmap(buf, SKEY(PREFIXNODE(ptr)), prefixlen);
+    buf_appendmap(buf, SKEY(ptr), SKEYLEN(ptr));
+    return buf->s;
+}
+
+/* reads the keys of nodes visited in key order.  nodes next to each
+   other nearly always borrow their prefix from the same node, so the
+   prefix is copied once and only each tail after that. */
+struct keyreader {
+    struct buf buf;
+    const char *base;		/* node whose key 'buf' starts with */
+    unsigned baselen;		/* how many of its bytes are there */
+};
+
+/* forget 'base', e.g. because the file was mapped again */
+#define KEYREADER_RESET(kr) ((kr)->base = NULL)
+
+static const char *read_key(struct keyreader *kr, const char *ptr)
+{
+    unsigned prefixlen = PREFIXLEN(ptr);
+
+    if (!prefixlen) {
+	/* whole in the node, nothing to copy */
+	kr->base = ptr;
+	kr->baselen = 0;
+	return SKEY(ptr);
+    }
+
+    if (PREFIXNODE(ptr) == kr->base && prefixlen <= kr->baselen) {
+	buf_truncate(&kr->buf, prefixlen);
+    }
+    else {
+	kr->base = PREFIXNODE(ptr);
+	buf_setmap(&kr->buf, SKEY(kr->base), prefixlen);
+    }
+    kr->baselen = prefixlen;
+    buf_appendmap(&kr->buf, SKEY(ptr), SKEYLEN(ptr));
+
+    return kr->buf.s;
+}
+
+/* compar(key of the node at 'ptr', key) without putting the node's
+   key back together */
+static int compare_node(int (*compar)(const char *s1, int l1,
+				      const char *s2, int l2),
+			const char *ptr, const char *key, int keylen)
+{
+    int prefixlen = PREFIXLEN(ptr);
+    int cmp;
+
+    if (!prefixlen) return compar(SKEY(ptr), KEYLEN(ptr), key, keylen);
+
+    if (keylen < prefixlen) {
+	/* can't be equal, and the prefix decides */
+	return compar(SKEY(PREFIXNODE(ptr)), prefixlen, key, keylen);
+    }
+
+    cmp = compar(SKEY(PREFIXNODE(ptr)), prefixlen, key, prefixlen);
+    if (cmp) return cmp;
+
+    return compar(SKEY(ptr), SKEYLEN(ptr), key + prefixlen,
+		  keylen - prefixlen);
+}
+
+/* nodes this tall are visited by most searches, so they keep their
+   keys whole rather than send each comparison to another node */
+#define PACK_MAXLEVEL 3
+#define PACK_MAXPREFIX 0xff
+#define PACK_MAXDIST (4 * 0xffff)
+
+/* state for prefixing nodes written in key order */
+struct packer {
+    unsigned baseoffset;	/* last node written whole */
+    struct buf base;		/* and its key */
+    struct buf last;		/* key of the last node written */
+};
+
+static void packer_free(struct packer *pk)
+{
+    buf_free(&pk->base);
+    buf_free(&pk->last);
+}
+
+static unsigned common_prefix(const struct buf *buf,
+			      const char *key, unsigned keylen)
+{
+    unsigned i, max = buf->len < keylen ? buf->len : keylen;
+
+    if (max > PACK_MAXPREFIX) max = PACK_MAXPREFIX;
+    for (i = 0; i < max && buf->s[i] == key[i]; i++);
+
+    return i;
+}
+
+/* how much of 'key' can the node written at 'offset' take from the
+   last whole one?  if it's not worth it (or the previous key would
+   make a better base) the node is written whole, and is the new base. */
+static unsigned pack_prefix(struct packer *pk, unsigned offset,
+			    const char *key, unsigned keylen, unsigned lvl)
+{
+    unsigned prefixlen = 0;
+
+    if (!pk) return 0;
+
+    if (pk->base.len && lvl <= PACK_MAXLEVEL &&
+	offset - pk->baseoffset <= PACK_MAXDIST) {
+	prefixlen = common_prefix(&pk->base, key, keylen);
+	if (ROUNDUP(keylen - prefixlen) == ROUNDUP(keylen) ||
+	    common_prefix(&pk->last, key, keylen) > prefixlen) {
+	    prefixlen = 0;
+	}
+    }
+
+    if (!prefixlen) {
+	pk->baseoffset = offset;
+	buf_setmap(&pk->base, key, keylen);
+    }
+    buf_setmap(&pk->last, key, keylen);
+
+    return prefixlen;
+}
+
+/* lay out a node of 'type' to be written at 'offset', in the format
+   of 'db', as iovecs.  'hdr' (5 words) holds the fixed fields and
+   'ptrs' the forward pointers, in network order.  'pk' is given when
+   nodes are being written in key order.  returns the offset of the
+   node's first forward pointer. */
+static unsigned node_iovec(struct db *db, struct packer *pk,
+			   struct iovec *iov, unsigned *num_iov,
+			   uint32_t *hdr, uint32_t type, unsigned offset,
+			   const char *key, unsigned keylen,
+			   const char *data, unsigned datalen,
+			   const uint32_t *ptrs, unsigned lvl)
+{
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    unsigned prefixlen;
+
+    if (!IS_PACKED(db)) {
+	hdr[0] = htonl(type);
+	hdr[1] = htonl(keylen);
+	hdr[2] = htonl(datalen);
+	hdr[3] = htonl(-1);
+	WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) hdr, 8);
+	WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) key, keylen);
+	WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) zeros,
+			    ROUNDUP(keylen) - keylen);
+	WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) &hdr[2], 4);
+	WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) data, datalen);
+	WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) zeros,
+			    ROUNDUP(datalen) - datalen);
+	WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) ptrs, 4 * lvl);
+	WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) &hdr[3], 4);
+
+	return 8 + ROUNDUP(keylen) + 4 + ROUNDUP(datalen);
+    }
+
+    prefixlen = pack_prefix(pk, offset, key, keylen, lvl);
+
+    hdr[0] = htonl(type | PACKED);
+    hdr[1] = htonl(keylen);
+    hdr[2] = htonl(datalen);
+    hdr[3] = htonl((lvl << 24) | (prefixlen << 16) |
+		   (prefixlen ? (offset - pk->baseoffset) / 4 : 0));
+    hdr[4] = htonl(-1);
+    WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) hdr, 16);
+    WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) ptrs, 4 * lvl);
+    WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) key + prefixlen,
+			keylen - prefixlen);
+    WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) zeros,
+			ROUNDUP(keylen - prefixlen) - (keylen - prefixlen));
+    WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) data, datalen);
+    WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) zeros,
+			ROUNDUP(datalen) - datalen);
+    WRITEV_ADD_TO_IOVEC(iov, *num_iov, (char *) &hdr[4], 4);
+
+    return 16;
+}
+
+/* a new dummy node for 'db', DUMMY_SIZE(db) bytes */
+static uint32_t *new_dummy(struct db *db)
+{
+    int dsize = DUMMY_SIZE(db);
+    uint32_t *buf = (uint32_t *) xzmalloc(dsize);
+
+    if (IS_PACKED(db)) {
+	buf[0] = htonl(DUMMY | PACKED);
+	buf[3] = htonl(db->maxlevel << 24);
+    } else {
+	buf[0] = htonl(DUMMY);
+    }
+    buf[(dsize / 4) - 1] = htonl(-1);
+
+    return buf;
+}
+
 /* given an open, mapped db, read in the header information */
 static int read_header(struct db *db)
 {
@@ -508,7 +776,8 @@ static int read_header(struct db *db)
     db->version = ntohl(*((uint32_t *)(db->map_base + OFFSET_VERSION)));
     db->version_minor = 
 	ntohl(*((uint32_t *)(db->map_base + OFFSET_VERSION_MINOR)));
-    if (db->version != SKIPLIST_VERSION) {
+    if (db->version != SKIPLIST_VERSION &&
+	db->version != SKIPLIST_VERSION_PACKED) {
 	syslog(LOG_ERR, "skiplist: version mismatch: %s has version %d.%d",
 	       db->fname, db->version, db->version_minor);
 	return CYRUSDB_IOERROR;
@@ -565,14 +834,8 @@ static int read_header(struct db *db)
     return r;
 }
 
-/* given an open, mapped db, locked db,
-   write the header information */
-static int write_header(struct db *db)
+static void pack_header(struct db *db, char *buf)
 {
-    char buf[HEADER_SIZE];
-    int n;
-
-    assert (db->lock_status == WRITELOCKED);
     memcpy(buf + 0, HEADER_MAGIC, HEADER_MAGIC_SIZE);
     *((uint32_t *)(buf + OFFSET_VERSION)) = htonl(db->version);
     *((uint32_t *)(buf + OFFSET_VERSION_MINOR)) = htonl(db->version_minor);
@@ -581,6 +844,17 @@ static int write_header(struct db *db)
     *((uint32_t *)(buf + OFFSET_LISTSIZE)) = htonl(db->listsize);
     *((uint32_t *)(buf + OFFSET_LOGSTART)) = htonl(db->logstart);
     *((uint32_t *)(buf + OFFSET_LASTRECOVERY)) = htonl(db->last_recovery);
+}
+
+/* given an open, mapped db, locked db,
+   write the header information */
+static int write_header(struct db *db)
+{
+    char buf[HEADER_SIZE];
+    int n;
+
+    assert (db->lock_status == WRITELOCKED);
+    pack_header(db, buf);
 
     /* write it out */
     lseek(db->fd, 0, SEEK_SET);
@@ -757,6 +1031,7 @@ static int dispose_db(struct db *db)
     if (db->fd != -1) {
 	close(db->fd);
     }
+    groupcommit_close(db->gc);
 
     free(db);
 
@@ -833,7 +1108,7 @@ static int myopen(const char *fname, int flags, struct db **ret)
      * still zero (read/write_lock updates map_size). */
     if (db->map_size == 0) {
 	/* initialize in memory structure */
-	db->version = SKIPLIST_VERSION;
+	db->version = NEW_VERSION;
 	db->version_minor = SKIPLIST_VERSION_MINOR;
 	db->maxlevel = SKIPLIST_MAXLEVEL;
 	db->curlevel = 1;
@@ -848,10 +1123,7 @@ static int myopen(const char *fname, int flags, struct db **ret)
 	if (!r) {
 	    int n;
 	    int dsize = DUMMY_SIZE(db);
-	    uint32_t *buf = (uint32_t *) xzmalloc(dsize);
-
-	    buf[0] = htonl(DUMMY);
-	    buf[(dsize / 4) - 1] = htonl(-1);
+	    uint32_t *buf = new_dummy(db);
 
 	    lseek(db->fd, DUMMY_OFFSET(db), SEEK_SET);
 	    n = retry_write(db->fd, (char *) buf, dsize);
@@ -877,6 +1149,11 @@ static int myopen(const char *fname, int flags, struct db **ret)
 
     db->is_open = 1;
 
+    /* without syncs there's nothing to share */
+    if ((flags & CYRUSDB_GROUPCOMMIT) && !use_osync && DO_FSYNC) {
+	groupcommit_open(fname, &db->gc);
+    }
+
     r = read_header(db);
     if (r) {
 	dispose_db(db);
@@ -966,8 +1243,8 @@ static const char *find_node(struct db *db,
 
     for (i = db->curlevel - 1; i >= 0; i--) {
 	while ((offset = FORWARD(ptr, i)) && 
-	       db->compar(KEY(db->map_base + offset), KEYLEN(db->map_base + offset), 
-		       key, keylen) < 0) {
+	       compare_node(db->compar, db->map_base + offset,
+			    key, keylen) < 0) {
 	    /* move forward at level 'i' */
 	    ptr = db->map_base + offset;
 	}
@@ -1015,7 +1292,8 @@ int myfetch(struct db *db,
 
     ptr = find_node(db, key, keylen, 0);
 
-    if (ptr == db->map_base || db->compar(KEY(ptr), KEYLEN(ptr), key, keylen)) {
+    if (ptr == db->map_base ||
+	compare_node(db->compar, ptr, key, keylen)) {
 	/* failed to find key/keylen */
 	r = CYRUSDB_NOTFOUND;
     } else {
@@ -1058,10 +1336,12 @@ int myforeach(struct db *db,
 	      foreach_cb *cb, void *rock, 
 	      struct txn **tidptr)
 {
-    const char *ptr;
+    const char *ptr, *key;
+    struct keyreader kr;
     char *savebuf = NULL;
     size_t savebuflen = 0;
     size_t savebufsize;
+    const char *savekey;
     int r = 0, cb_r = 0;
     int need_unlock = 0;
 
@@ -1090,42 +1370,51 @@ int myforeach(struct db *db,
 	need_unlock = 1;
     } 
 
+    memset(&kr, 0, sizeof(kr));
     ptr = find_node(db, prefix, prefixlen, 0);
 
     while (ptr != db->map_base) {
 	/* does it match prefix? */
 	if (KEYLEN(ptr) < (uint32_t) prefixlen) break;
-	if (prefixlen && db->compar(KEY(ptr), prefixlen, prefix, prefixlen)) break;
+	key = read_key(&kr, ptr);
+	if (prefixlen && db->compar(key, prefixlen, prefix, prefixlen)) break;
 
 	if (!goodp ||
-	    goodp(rock, KEY(ptr), KEYLEN(ptr), DATA(ptr), DATALEN(ptr))) {
+	    goodp(rock, key, KEYLEN(ptr), DATA(ptr), DATALEN(ptr))) {
 	    ino_t ino = db->map_ino;
 	    unsigned long sz = db->map_size;
 
 	    if (!tidptr) {
 		/* release read lock */
 		if ((r = unlock(db)) < 0) {
+		    buf_free(&kr.buf);
 		    return r;
 		}
 		need_unlock = 0;
 	    }
 
-	    /* save KEY, KEYLEN */
-	    if (!savebuf || KEYLEN(ptr) > savebuflen) {
-		savebuflen = KEYLEN(ptr) + 1024;
-		savebuf = xrealloc(savebuf, savebuflen);
+	    /* save KEY, KEYLEN, unless read_key() already copied it */
+	    if (key == kr.buf.s) {
+		savekey = kr.buf.s;
+	    } else {
+		if (!savebuf || KEYLEN(ptr) > savebuflen) {
+		    savebuflen = KEYLEN(ptr) + 1024;
+		    savebuf = xrealloc(savebuf, savebuflen);
+		}
+		memcpy(savebuf, key, KEYLEN(ptr));
+		savekey = savebuf;
 	    }
-	    memcpy(savebuf, KEY(ptr), KEYLEN(ptr));
 	    savebufsize = KEYLEN(ptr);
 
 	    /* make callback */
-	    cb_r = cb(rock, KEY(ptr), KEYLEN(ptr), DATA(ptr), DATALEN(ptr));
+	    cb_r = cb(rock, key, KEYLEN(ptr), DATA(ptr), DATALEN(ptr));
 	    if (cb_r) break;
 
 	    if (!tidptr) {
 		/* grab a r lock */
 		if ((r = read_lock(db)) < 0) {
 		    free(savebuf);
+		    buf_free(&kr.buf);
 		    return r;
 		}
 		need_unlock = 1;
@@ -1137,13 +1426,14 @@ int myforeach(struct db *db,
 	    /* reposition */
 	    if (!(ino == db->map_ino && sz == db->map_size)) {
 		/* something changed in the file; reseek */
-		ptr = find_node(db, savebuf, savebufsize, 0);
+		KEYREADER_RESET(&kr);
+		ptr = find_node(db, savekey, savebufsize, 0);
 
 		/* 'ptr' might not equal 'savebuf'.  if it's different,
 		   we want to stay where we are.  if it's the same, we
 		   should move on to the next one */
-		if (savebufsize == KEYLEN(ptr) &&
-		    !memcmp(savebuf, KEY(ptr), savebufsize)) {
+		if (ptr != db->map_base &&
+		    !compare_node(compare, ptr, savekey, savebufsize)) {
 		    ptr = db->map_base + FORWARD(ptr, 0);
 		} else {
 		    /* 'savebuf' got deleted, so we're now pointing at the
@@ -1160,6 +1450,7 @@ int myforeach(struct db *db,
     }
 
     free(savebuf);
+    buf_free(&kr.buf);
 
     if (need_unlock) {
 	/* release read lock */
@@ -1171,6 +1462,83 @@ int myforeach(struct db *db,
     return r ? r : cb_r;
 }
 
+/* a foreach that lets go of the lock: note which records match under
+   the read lock, then visit them with no lock held.  records are never
+   changed in place (only their pointers are), and a checkpoint leaves
+   the old file's contents alone, so our own map of the file keeps them
+   readable however the database moves on meanwhile. */
+static int myforeach_snapshot(struct db *db,
+			      char *prefix, int prefixlen,
+			      foreach_p *goodp,
+			      foreach_cb *cb, void *rock)
+{
+    const char *base = NULL;
+    unsigned long len = 0;
+    uint32_t *offsets = NULL;
+    unsigned count = 0, alloc = 0;
+    unsigned i;
+    struct keyreader kr;
+    const char *ptr, *key;
+    int r;
+
+    assert(db != NULL);
+    assert(prefixlen >= 0);
+
+    if (db->current_txn) {
+	/* we already hold the write lock; see our own changes too */
+	return myforeach(db, prefix, prefixlen, goodp, cb, rock, NULL);
+    }
+
+    if ((r = read_lock(db)) < 0) {
+	return r;
+    }
+
+    memset(&kr, 0, sizeof(kr));
+    ptr = find_node(db, prefix, prefixlen, 0);
+    while (ptr != db->map_base) {
+	/* does it match prefix? */
+	if (KEYLEN(ptr) < (uint32_t) prefixlen) break;
+	key = read_key(&kr, ptr);
+	if (prefixlen && db->compar(key, prefixlen, prefix, prefixlen)) break;
+
+	if (count == alloc) {
+	    alloc = alloc ? 2 * alloc : 1024;
+	    offsets = xrealloc(offsets, alloc * sizeof(uint32_t));
+	}
+	offsets[count++] = ptr - db->map_base;
+
+	ptr = db->map_base + FORWARD(ptr, 0);
+    }
+
+    if (count) {
+	map_refresh(db->fd, 1, &base, &len, db->map_size, db->fname, 0);
+    }
+
+    if ((r = unlock(db)) < 0) {
+	map_free(&base, &len);
+	free(offsets);
+	buf_free(&kr.buf);
+	return r;
+    }
+
+    KEYREADER_RESET(&kr);
+    for (i = 0; !r && i < count; i++) {
+	ptr = base + offsets[i];
+	key = read_key(&kr, ptr);
+
+	if (!goodp ||
+	    goodp(rock, key, KEYLEN(ptr), DATA(ptr), DATALEN(ptr))) {
+	    r = cb(rock, key, KEYLEN(ptr), DATA(ptr), DATALEN(ptr));
+	}
+    }
+
+    map_free(&base, &len);
+    free(offsets);
+    buf_free(&kr.buf);
+
+    return r;
+}
+
 unsigned int randlvl(struct db *db)
 {
     unsigned int lvl = 1;
@@ -1190,19 +1558,15 @@ int mystore(struct db *db,
 	    struct txn **tidptr, int overwrite)
 {
     const char *ptr;
-    uint32_t klen;
-    uint32_t dlen;
+    uint32_t hdr[5];
     struct iovec iov[50];
     unsigned lvl;
     unsigned i;
     unsigned num_iov;
     struct txn *tid;
     struct txn *localtid = NULL;
-    uint32_t endpadding = htonl(-1);
-    uint32_t zeropadding[4] = { 0, 0, 0, 0 };
     unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
-    unsigned newoffsets[SKIPLIST_MAXLEVEL+1];
-    uint32_t addrectype = htonl(ADD);
+    uint32_t newoffsets[SKIPLIST_MAXLEVEL+1];
     uint32_t delrectype = htonl(DELETE);
     uint32_t todelete;
     unsigned newoffset;
@@ -1234,7 +1598,7 @@ int mystore(struct db *db,
     newoffset = tid->logend;
     ptr = find_node(db, key, keylen, updateoffsets);
     if (ptr != db->map_base && 
-	!db->compar(KEY(ptr), KEYLEN(ptr), key, keylen)) {
+	!compare_node(db->compar, ptr, key, keylen)) {
 	    
 	if (!overwrite) {
 	    myabort(db, tid);	/* releases lock */
@@ -1280,26 +1644,10 @@ int mystore(struct db *db,
 	}
     }
 
-    klen = htonl(keylen);
-    dlen = htonl(datalen);
-    
     netnewoffset = htonl(newoffset);
 
-    WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) &addrectype, 4);
-    WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) &klen, 4);
-    WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) key, keylen);
-    if (ROUNDUP(keylen) - keylen > 0) {
-	WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) zeropadding,
-			    ROUNDUP(keylen) - keylen);
-    }
-    WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) &dlen, 4);
-    WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) data, datalen);
-    if (ROUNDUP(datalen) - datalen > 0) {
-	WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) zeropadding,
-			    ROUNDUP(datalen) - datalen);
-    }
-    WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) newoffsets, 4 * lvl);
-    WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) &endpadding, 4);
+    node_iovec(db, NULL, iov, &num_iov, hdr, ADD, newoffset,
+	       key, keylen, data, datalen, newoffsets, lvl);
 
     getsyncfd(db, tid);
     lseek(tid->syncfd, tid->logend, SEEK_SET);
@@ -1383,7 +1731,7 @@ int mydelete(struct db *db,
 
     ptr = find_node(db, key, keylen, updateoffsets);
     if (ptr != db->map_base &&
-	!db->compar(KEY(ptr), KEYLEN(ptr), key, keylen)) {
+	!compare_node(db->compar, ptr, key, keylen)) {
 	/* gotcha */
 	offset = ptr - db->map_base;
 
@@ -1433,6 +1781,9 @@ int mydelete(struct db *db,
 int mycommit(struct db *db, struct txn *tid)
 {
     uint32_t commitrectype = htonl(COMMIT);
+    int need_checkpoint = 0;
+    int group = db->gc && !db->in_checkpoint;
+    uint32_t ticket = 0;
     int r = 0;
 
     assert(db && tid);
@@ -1449,28 +1800,34 @@ int mycommit(struct db *db, struct txn *tid)
     if (tid->logstart == tid->logend) {
 	/* empty txn, done */
         r = 0;
+	group = 0;
 	goto done;
     }
 
-    /* fsync if we're not using O_SYNC writes */
-    if (!use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
+    /* fsync if we're not using O_SYNC writes.  this also makes the
+       commit records of any group commits before us durable. */
+    if (group ? (groupcommit_fdatasync(db->gc, db->fd) < 0) :
+	(!use_osync && DO_FSYNC && (fdatasync(db->fd) < 0))) {
 	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
 	r = CYRUSDB_IOERROR;
         goto done;
     }
 
-    /* xxx consider unlocking the database here: the transaction isn't
-       yet durable but the file is in a form that is consistent for
-       other transactions to use. releasing the lock here would give
-       ACI properties. */
-    
     /* write a commit record */
     assert(tid->syncfd != -1);
     lseek(tid->syncfd, tid->logend, SEEK_SET);
     retry_write(tid->syncfd, (char *) &commitrectype, 4);
 
+    if (group) {
+	/* the transaction isn't yet durable but the file is in a form
+	   that is consistent for other transactions to use, so we sync
+	   it after we've let go of the lock, along with anyone else
+	   committing meanwhile */
+	if (groupcommit_begin(db->gc, &ticket) < 0) group = 0;
+    }
+
     /* fsync if we're not using O_SYNC writes */
-    if (!use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
+    if (!group && !use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
 	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
 	r = CYRUSDB_IOERROR;
         goto done;
@@ -1481,8 +1838,14 @@ int mycommit(struct db *db, struct txn *tid)
 	db->current_txn = NULL;
 
     /* consider checkpointing */
-    if (!r && tid->logend > (2 * db->logstart + SKIPLIST_MINREWRITE)) {
-	r = mycheckpoint(db, 1);
+    if (!r && !db->in_checkpoint &&
+	tid->logend > (2 * db->logstart + SKIPLIST_MINREWRITE)) {
+	if (libcyrus_config_getswitch(CYRUSOPT_SKIPLIST_INCREMENTAL_CHECKPOINT)) {
+	    /* after we've let go of the lock */
+	    need_checkpoint = 1;
+	} else {
+	    r = mycheckpoint(db, 1);
+	}
     }
     
     if (be_paranoid) {
@@ -1498,6 +1861,11 @@ int mycommit(struct db *db, struct txn *tid)
             syslog(LOG_ERR, "DBERROR: skiplist %s: commit AND abort failed",
 		   db->fname);
         }
+    } else if (db->in_checkpoint) {
+	/* incremental_checkpoint() keeps the lock until it has renamed
+	   the new file into place */
+	closesyncfd(db, tid);
+	free(tid);
     } else {
         /* release the write lock */
         if ((r = unlock(db)) < 0) {
@@ -1509,6 +1877,15 @@ int mycommit(struct db *db, struct txn *tid)
 
         /* free tid */
         free(tid);
+
+	if (group && groupcommit_finish(db->gc, db->fd, ticket) < 0) {
+	    /* too late to abort: others may already have seen it */
+	    syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
+	    return CYRUSDB_IOERROR;
+	}
+
+	/* the commit stands even if this fails */
+	if (need_checkpoint) incremental_checkpoint(db);
     }
 
     return r;
@@ -1517,6 +1894,7 @@ int mycommit(struct db *db, struct txn *tid)
 int myabort(struct db *db, struct txn *tid)
 {
     const char *ptr;
+    struct buf keybuf = BUF_INITIALIZER;
     unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
     unsigned offset;
     unsigned i;
@@ -1547,7 +1925,8 @@ int myabort(struct db *db, struct txn *tid)
 
 	case ADD:
 	    /* remove this record */
-	    (void) find_node(db, KEY(ptr), KEYLEN(ptr), updateoffsets);
+	    (void) find_node(db, NODEKEY(ptr, &keybuf), KEYLEN(ptr),
+			     updateoffsets);
 	    for (i = 0; i < db->curlevel; i++) {
 		uint32_t netnewoffset;
 
@@ -1572,7 +1951,8 @@ int myabort(struct db *db, struct txn *tid)
 	    netnewoffset = *((uint32_t *)(ptr + 4));
 	    q = db->map_base + ntohl(netnewoffset);
 	    lvl = LEVEL(q);
-	    (void) find_node(db, KEY(q), KEYLEN(q), updateoffsets);
+	    (void) find_node(db, NODEKEY(q, &keybuf), KEYLEN(q),
+			     updateoffsets);
 	    for (i = 0; i < lvl; i++) {
 		/* the current pointers FROM this node are correct,
 		   so we just have to update 'updateoffsets' */
@@ -1588,6 +1968,7 @@ int myabort(struct db *db, struct txn *tid)
 	/* remove looking at this */
 	tid->logend -= RECSIZE(ptr);
     }
+    buf_free(&keybuf);
 
     /* truncate the file to remove log entries */
     if (ftruncate(db->fd, tid->logstart) < 0) {
@@ -1627,9 +2008,12 @@ static int mycheckpoint(struct db *db, int locked)
     unsigned num_iov;
     unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
     const char *ptr;
+    struct buf keybuf = BUF_INITIALIZER;
+    struct packer pk;
+    uint32_t hdr[5];
+    uint32_t oldversion = db->version;
     unsigned offset;
     int r = 0;
-    uint32_t iorectype = htonl(INORDER);
     unsigned i;
     time_t start = time(NULL);
 
@@ -1674,13 +2058,15 @@ static int mycheckpoint(struct db *db, int locked)
 	return CYRUSDB_IOERROR;
     }
 
+    /* the new file may be in a different format.  records from the old
+       one are self-describing, so we can still read them. */
+    db->version = NEW_VERSION;
+    memset(&pk, 0, sizeof(pk));
+
     /* write dummy record */
     if (!r) {
 	int dsize = DUMMY_SIZE(db);
-	uint32_t *buf = (uint32_t *) xzmalloc(dsize);
-
-	buf[0] = htonl(DUMMY);
-	buf[(dsize / 4) - 1] = htonl(-1);
+	uint32_t *buf = new_dummy(db);
 
 	lseek(db->fd, DUMMY_OFFSET(db), SEEK_SET);
 	r = retry_write(db->fd, (char *) buf, dsize);
@@ -1694,9 +2080,7 @@ static int mycheckpoint(struct db *db, int locked)
 	/* initialize the updateoffsets array so when we append records
 	   we know where to set the pointers */
 	for (i = 0; i < db->maxlevel; i++) {
-	    /* header_size + 4 (rectype) + 4 (ksize) + 4 (dsize)
-	       + 4 * i */
-	    updateoffsets[i] = DUMMY_OFFSET(db) + 12 + 4 * i;
+	    updateoffsets[i] = DUMMY_PTROFFSET(db, i);
 	}
     }
 
@@ -1705,20 +2089,23 @@ static int mycheckpoint(struct db *db, int locked)
     db->listsize = 0;
     while (!r && offset != 0) {
 	unsigned int lvl;
-	unsigned newoffset; 
+	unsigned newoffset, ptroffset;
 	uint32_t netnewoffset;
 
 	ptr = db->map_base + offset;
 	lvl = LEVEL(ptr);
 	db->listsize++;
 
-	num_iov = 0;
-	WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) &iorectype, 4);
-	/* copy all but the rectype from the record */
-	WRITEV_ADD_TO_IOVEC(iov, num_iov, (char *) ptr + 4, RECSIZE(ptr) - 4);
-
 	newoffset = lseek(db->fd, 0, SEEK_END);
 	netnewoffset = htonl(newoffset);
+
+	/* the old pointers are placeholders; they're all patched */
+	num_iov = 0;
+	ptroffset = newoffset +
+	    node_iovec(db, &pk, iov, &num_iov, hdr, INORDER, newoffset,
+		       NODEKEY(ptr, &keybuf), KEYLEN(ptr),
+		       DATA(ptr), DATALEN(ptr),
+		       (const uint32_t *) FIRSTPTR(ptr), lvl);
 	r = retry_writev(db->fd, iov, num_iov);
 	if (r < 0) {
 	    r = CYRUSDB_IOERROR;
@@ -1743,13 +2130,14 @@ static int mycheckpoint(struct db *db, int locked)
 		r = 0;
 	    }
 
-	    /* PTR(ptr, i) - ptr is the offset relative to me
-	       to my ith pointer */
-	    updateoffsets[i] = newoffset + (PTR(ptr, i) - ptr);
+	    /* my ith pointer, wherever this format puts it */
+	    updateoffsets[i] = ptroffset + 4 * i;
 	}
 
 	offset = FORWARD(ptr, 0);
     }
+    packer_free(&pk);
+    buf_free(&keybuf);
 
     /* set any dangling pointers to zero */
     for (i = 0; !r && i < db->maxlevel; i++) {
@@ -1806,13 +2194,15 @@ static int mycheckpoint(struct db *db, int locked)
 	/* clean up */
 	close(db->fd);
 	db->fd = oldfd;
+	db->version = oldversion;
 	unlink(fname);
     }
     else {
 	struct stat sbuf;
 
-	/* remove content of old file so it doesn't sit around using disk */
-	ftruncate(oldfd, 0);
+	/* leave the old file's contents alone: an incremental checkpoint
+	   in another process may still be copying records out of it.  it
+	   goes away once the last process lets go of it. */
 
 	/* release old write lock */
 	close(oldfd);
@@ -1851,6 +2241,675 @@ static int mycheckpoint(struct db *db, int locked)
     return r;
 }
 
+/* incremental checkpoints.
+
+   mycheckpoint() copies every live record while holding the write
+   lock, which stops everybody else writing for as long as that takes.
+   instead:
+
+   1. under a read lock, note the offsets of the live records (cheap);
+   2. with no lock at all, copy those records to fname.INC and sync it.
+      records are never changed in place (only their pointers are), so
+      the copy is good however the file moves on meanwhile;
+   3. under the write lock, replay whatever was committed after step 1
+      into the new file, and rename it into place.
+
+   only step 3 holds up writers, and its work is proportional to what
+   they wrote during step 2.  should anything else have happened to the
+   file meanwhile (a recovery or another checkpoint) the new file is
+   thrown away.  fname.INC is locked for the duration so two processes
+   don't both do the work. */
+
+struct ckpt_buf {
+    int fd;
+    unsigned start;		/* file offset of buf[0] */
+    unsigned len;
+    unsigned alloc;
+    char *buf;
+};
+
+enum {
+    CKPT_BUFSIZE = 1024 * 1024
+};
+
+static int ckpt_flush(struct ckpt_buf *b)
+{
+    if (!b->len) return 0;
+
+    lseek(b->fd, b->start, SEEK_SET);
+    if (retry_write(b->fd, b->buf, b->len) != (int) b->len) {
+	return CYRUSDB_IOERROR;
+    }
+    b->start += b->len;
+    b->len = 0;
+
+    return 0;
+}
+
+static int ckpt_append(struct ckpt_buf *b, const char *data, unsigned len)
+{
+    int r;
+
+    if (b->len + len > b->alloc) {
+	if ((r = ckpt_flush(b))) return r;
+	if (len > b->alloc) {
+	    b->alloc = len;
+	    b->buf = xrealloc(b->buf, b->alloc);
+	}
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+
+    return 0;
+}
+
+static int ckpt_appendv(struct ckpt_buf *b, const struct iovec *iov,
+			unsigned num_iov)
+{
+    unsigned i;
+    int r = 0;
+
+    for (i = 0; !r && i < num_iov; i++) {
+	r = ckpt_append(b, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    return r;
+}
+
+/* point the 4 bytes at 'offset' at 'value' */
+static int ckpt_patch(struct ckpt_buf *b, unsigned offset, uint32_t value)
+{
+    uint32_t netvalue = htonl(value);
+
+    if (offset >= b->start) {
+	memcpy(b->buf + offset - b->start, &netvalue, 4);
+	return 0;
+    }
+
+    lseek(b->fd, offset, SEEK_SET);
+    if (retry_write(b->fd, (char *) &netvalue, 4) != 4) {
+	return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* step 2: write the records at 'offsets' to 'fd' as a fresh database */
+static int ckpt_write(struct db *db, int fd,
+		      const uint32_t *offsets, unsigned count)
+{
+    struct ckpt_buf b;
+    struct db layout = *db;	/* the new file's format */
+    unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
+    char hdr[HEADER_SIZE];
+    struct iovec iov[10];
+    unsigned num_iov;
+    uint32_t rhdr[5];
+    struct packer pk;
+    struct buf keybuf = BUF_INITIALIZER;
+    uint32_t *dummy;
+    int dsize;
+    unsigned i, j;
+    int r;
+
+    layout.version = NEW_VERSION;
+    dsize = DUMMY_SIZE(&layout);
+    memset(&pk, 0, sizeof(pk));
+
+    memset(&b, 0, sizeof(b));
+    b.fd = fd;
+    b.alloc = CKPT_BUFSIZE;
+    b.buf = xmalloc(b.alloc);
+
+    /* header goes in last; then the dummy record */
+    memset(hdr, 0, HEADER_SIZE);
+    r = ckpt_append(&b, hdr, HEADER_SIZE);
+
+    dummy = new_dummy(&layout);
+    if (!r) r = ckpt_append(&b, (char *) dummy, dsize);
+    free(dummy);
+
+    for (i = 0; i < db->maxlevel; i++) {
+	updateoffsets[i] = DUMMY_PTROFFSET(&layout, i);
+    }
+
+    for (j = 0; !r && j < count; j++) {
+	const char *ptr = db->map_base + offsets[j];
+	unsigned lvl = LEVEL(ptr);
+	unsigned newoffset = b.start + b.len;
+	unsigned ptroffset;
+
+	/* the old pointers are placeholders; they're all patched */
+	num_iov = 0;
+	ptroffset = newoffset +
+	    node_iovec(&layout, &pk, iov, &num_iov, rhdr, INORDER, newoffset,
+		       NODEKEY(ptr, &keybuf), KEYLEN(ptr),
+		       DATA(ptr), DATALEN(ptr),
+		       (const uint32_t *) FIRSTPTR(ptr), lvl);
+	r = ckpt_appendv(&b, iov, num_iov);
+
+	for (i = 0; !r && i < lvl; i++) {
+	    r = ckpt_patch(&b, updateoffsets[i], newoffset);
+	    updateoffsets[i] = ptroffset + 4 * i;
+	}
+    }
+    packer_free(&pk);
+    buf_free(&keybuf);
+
+    /* set any dangling pointers to zero */
+    for (i = 0; !r && i < db->maxlevel; i++) {
+	r = ckpt_patch(&b, updateoffsets[i], 0);
+    }
+
+    if (!r) r = ckpt_flush(&b);
+    free(b.buf);
+
+    if (!r) {
+	/* the header of the new file */
+	pack_header(&layout, hdr);
+	*((uint32_t *)(hdr + OFFSET_LISTSIZE)) = htonl(count);
+	*((uint32_t *)(hdr + OFFSET_LOGSTART)) = htonl(b.start);
+	*((uint32_t *)(hdr + OFFSET_LASTRECOVERY)) = htonl(time(NULL));
+
+	lseek(fd, 0, SEEK_SET);
+	if (retry_write(fd, hdr, HEADER_SIZE) != HEADER_SIZE) {
+	    r = CYRUSDB_IOERROR;
+	}
+    }
+
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: skiplist checkpoint %s: writing: %m",
+	       db->fname);
+	return r;
+    }
+
+    /* sync new file */
+    if (DO_FSYNC && (fdatasync(fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: skiplist checkpoint %s: fdatasync: %m",
+	       db->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* bulk loading: records arrive in order, so we can lay the file out
+   just as a checkpoint would, without searching or logging */
+struct bulkload {
+    struct db db;		/* just enough of one to describe the file */
+    char *newfname;
+    struct ckpt_buf b;
+    unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
+    struct packer pk;
+    char *lastkey;
+    int lastkeylen;
+    int lastkeyalloc;
+};
+
+static int bulkload_end(struct bulkload *bl, int commit);
+
+static int bulkload_begin(const char *fname, int flags,
+			  struct bulkload **ret)
+{
+    struct bulkload *bl;
+    struct db *db;
+    const char *lockfailaction;
+    char hdr[HEADER_SIZE];
+    uint32_t *dummy;
+    int dsize;
+    unsigned i;
+    int r = 0;
+
+    bl = (struct bulkload *) xzmalloc(sizeof(struct bulkload));
+    bl->b.fd = -1;
+    db = &bl->db;
+    db->fname = xstrdup(fname);
+    db->version = NEW_VERSION;
+    db->version_minor = SKIPLIST_VERSION_MINOR;
+    db->maxlevel = SKIPLIST_MAXLEVEL;
+    db->curlevel = 1;
+    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare : compare;
+
+    bl->newfname = xmalloc(strlen(fname) + 6);
+    sprintf(bl->newfname, "%s.LOAD", fname);
+
+    if (cyrus_mkdir(bl->newfname, 0755) == -1) {
+	r = CYRUSDB_IOERROR;
+	goto err;
+    }
+
+    /* one load at a time */
+    bl->b.fd = open(bl->newfname, O_RDWR | O_CREAT, 0644);
+    if (bl->b.fd == -1 ||
+	lock_reopen(bl->b.fd, bl->newfname, NULL, &lockfailaction) < 0 ||
+	ftruncate(bl->b.fd, 0) < 0) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", bl->newfname);
+	r = CYRUSDB_IOERROR;
+	goto err;
+    }
+
+    bl->b.alloc = CKPT_BUFSIZE;
+    bl->b.buf = xmalloc(bl->b.alloc);
+
+    /* header goes in last; then the dummy record */
+    memset(hdr, 0, HEADER_SIZE);
+    r = ckpt_append(&bl->b, hdr, HEADER_SIZE);
+
+    dsize = DUMMY_SIZE(db);
+    dummy = new_dummy(db);
+    if (!r) r = ckpt_append(&bl->b, (char *) dummy, dsize);
+    free(dummy);
+
+    for (i = 0; i < db->maxlevel; i++) {
+	bl->updateoffsets[i] = DUMMY_PTROFFSET(db, i);
+    }
+
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: skiplist load %s: writing: %m", fname);
+	goto err;
+    }
+
+    *ret = bl;
+    return 0;
+
+ err:
+    bulkload_end(bl, 0);
+    return r;
+}
+
+static int bulkload_add(struct bulkload *bl,
+			const char *key, int keylen,
+			const char *data, int datalen)
+{
+    static const uint32_t zeroptrs[SKIPLIST_MAXLEVEL];
+    struct iovec iov[10];
+    unsigned num_iov = 0;
+    uint32_t hdr[5];
+    unsigned offset = bl->b.start + bl->b.len;
+    unsigned ptroffset;
+    unsigned lvl, i;
+    int r;
+
+    assert(key && keylen);
+
+    if (bl->db.listsize &&
+	bl->db.compar(key, keylen, bl->lastkey, bl->lastkeylen) <= 0) {
+	return CYRUSDB_EXISTS;
+    }
+
+    lvl = randlvl(&bl->db);
+    if (lvl > bl->db.curlevel) bl->db.curlevel = lvl;
+
+    /* forward pointers get filled in as later records arrive */
+    ptroffset = offset +
+	node_iovec(&bl->db, &bl->pk, iov, &num_iov, hdr, INORDER, offset,
+		   key, keylen, data, datalen, zeroptrs, lvl);
+    r = ckpt_appendv(&bl->b, iov, num_iov);
+
+    for (i = 0; !r && i < lvl; i++) {
+	r = ckpt_patch(&bl->b, bl->updateoffsets[i], offset);
+	bl->updateoffsets[i] = ptroffset + 4 * i;
+    }
+
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: skiplist load %s: writing: %m",
+	       bl->db.fname);
+	return r;
+    }
+
+    if (keylen > bl->lastkeyalloc) {
+	bl->lastkeyalloc = keylen + 256;
+	bl->lastkey = xrealloc(bl->lastkey, bl->lastkeyalloc);
+    }
+    memcpy(bl->lastkey, key, keylen);
+    bl->lastkeylen = keylen;
+    bl->db.listsize++;
+
+    return 0;
+}
+
+static int bulkload_end(struct bulkload *bl, int commit)
+{
+    char hdr[HEADER_SIZE];
+    const char *lockfailaction;
+    int oldfd = -1;
+    unsigned i;
+    int r = 0;
+
+    if (!commit || bl->b.fd == -1) goto done;
+
+    /* set any dangling pointers to zero */
+    for (i = 0; !r && i < bl->db.maxlevel; i++) {
+	r = ckpt_patch(&bl->b, bl->updateoffsets[i], 0);
+    }
+    if (!r) r = ckpt_flush(&bl->b);
+
+    if (!r) {
+	bl->db.logstart = bl->b.start;
+	bl->db.last_recovery = time(NULL);
+	pack_header(&bl->db, hdr);
+
+	lseek(bl->b.fd, 0, SEEK_SET);
+	if (retry_write(bl->b.fd, hdr, HEADER_SIZE) != HEADER_SIZE) {
+	    r = CYRUSDB_IOERROR;
+	}
+    }
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: skiplist load %s: writing: %m",
+	       bl->db.fname);
+	goto done;
+    }
+
+    if (DO_FSYNC && (fdatasync(bl->b.fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: skiplist load %s: fdatasync: %m",
+	       bl->db.fname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    /* wait for any writer to the old file to finish; they'll find the
+       new one when they next lock */
+    oldfd = open(bl->db.fname, O_RDWR, 0644);
+    if (oldfd != -1 &&
+	lock_reopen(oldfd, bl->db.fname, NULL, &lockfailaction) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s %s: %m", lockfailaction, bl->db.fname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    if (rename(bl->newfname, bl->db.fname) < 0) {
+	syslog(LOG_ERR, "DBERROR: skiplist load: rename(%s, %s): %m",
+	       bl->newfname, bl->db.fname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+
+    /* force the new file name to disk */
+    if (DO_FSYNC && (fsync(bl->b.fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: skiplist load %s: fsync: %m",
+	       bl->db.fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+ done:
+    if (bl->b.fd != -1) {
+	if (r || !commit) unlink(bl->newfname);
+	close(bl->b.fd);
+    }
+    if (oldfd != -1) close(oldfd);
+
+    free(bl->b.buf);
+    packer_free(&bl->pk);
+    free(bl->lastkey);
+    free(bl->newfname);
+    free(bl->db.fname);
+    free(bl);
+
+    return r;
+}
+
+/* a record committed after the snapshot, to be replayed */
+struct ckpt_op {
+    int type;
+    char *key;
+    int keylen;
+    char *data;
+    int datalen;
+};
+
+static void ckpt_free_ops(struct ckpt_op *ops, int nops)
+{
+    int i;
+
+    for (i = 0; i < nops; i++) {
+	free(ops[i].key);
+    }
+    free(ops);
+}
+
+/* step 3, part 1: read the committed log from 'end' onwards.  returns
+   the number of operations, or -1 if it doesn't look right. */
+static int ckpt_tail(struct db *db, unsigned end, struct ckpt_op **opsp)
+{
+    struct ckpt_op *ops = NULL;
+    int nops = 0, nalloc = 0;
+    unsigned offset = end, committed = end;
+    const char *ptr, *q;
+    struct buf keybuf = BUF_INITIALIZER;
+
+    while (offset + 4 <= db->map_size) {
+	ptr = db->map_base + offset;
+
+	if (TYPE(ptr) == COMMIT) {
+	    offset += 4;
+	    committed = offset;
+	    continue;
+	}
+	if (TYPE(ptr) != ADD && TYPE(ptr) != DELETE) break;
+	if (offset + 8 > db->map_size) break;
+
+	if (nops == nalloc) {
+	    nalloc += 64;
+	    ops = xrealloc(ops, nalloc * sizeof(struct ckpt_op));
+	}
+
+	if (TYPE(ptr) == DELETE) {
+	    /* the record being deleted names the key */
+	    unsigned target = ntohl(*((uint32_t *)(ptr + 4)));
+
+	    if (target < DUMMY_OFFSET(db) + DUMMY_SIZE(db) ||
+		target >= offset) break;
+	    q = db->map_base + target;
+	    if (TYPE(q) != INORDER && TYPE(q) != ADD) break;
+
+	    ops[nops].type = DELETE;
+	    ops[nops].key = xmalloc(KEYLEN(q) + 1);
+	    memcpy(ops[nops].key, NODEKEY(q, &keybuf), KEYLEN(q));
+	    ops[nops].keylen = KEYLEN(q);
+	    ops[nops].data = NULL;
+	    ops[nops].datalen = 0;
+	    offset += 8;
+	} else {
+	    if (offset + RECSIZE(ptr) > db->map_size) break;
+
+	    ops[nops].type = ADD;
+	    ops[nops].key = xmalloc(KEYLEN(ptr) + DATALEN(ptr) + 1);
+	    memcpy(ops[nops].key, NODEKEY(ptr, &keybuf), KEYLEN(ptr));
+	    ops[nops].keylen = KEYLEN(ptr);
+	    ops[nops].data = ops[nops].key + KEYLEN(ptr);
+	    memcpy(ops[nops].data, DATA(ptr), DATALEN(ptr));
+	    ops[nops].datalen = DATALEN(ptr);
+	    offset += RECSIZE(ptr);
+	}
+	nops++;
+    }
+    buf_free(&keybuf);
+
+    /* we hold the write lock, so everything should have been committed */
+    if (committed != db->map_size) {
+	ckpt_free_ops(ops, nops);
+	return -1;
+    }
+
+    *opsp = ops;
+
+    return nops;
+}
+
+static int incremental_checkpoint(struct db *db)
+{
+    char fname[1024];
+    uint32_t *offsets = NULL;
+    unsigned count = 0, alloc = 0;
+    unsigned offset;
+    unsigned long end;
+    ino_t ino;
+    uint32_t logstart;
+    time_t last_recovery;
+    struct ckpt_op *ops = NULL;
+    int nops = 0;
+    struct txn *tid = NULL;
+    struct stat sbuf, sbuffile;
+    int newfd, oldfd;
+    int i, r;
+    time_t start = time(NULL);
+
+    assert(db->current_txn == NULL && db->lock_status == UNLOCKED);
+
+    /* is somebody else already on it? */
+    snprintf(fname, sizeof(fname), "%s.INC", db->fname);
+    newfd = open(fname, O_RDWR | O_CREAT, 0644);
+    if (newfd < 0) {
+	syslog(LOG_ERR, "DBERROR: skiplist checkpoint: open(%s): %m", fname);
+	return CYRUSDB_IOERROR;
+    }
+    if (lock_nonblocking(newfd) < 0) {
+	close(newfd);
+	return 0;
+    }
+
+    /* whoever held it may have renamed it into place or removed it
+       between our open and lock; then we have the database itself, or
+       a file nobody will see.  either way it's just been done */
+    if (fstat(newfd, &sbuf) < 0 || stat(fname, &sbuffile) < 0 ||
+	sbuf.st_ino != sbuffile.st_ino) {
+	close(newfd);
+	return 0;
+    }
+
+    if (ftruncate(newfd, 0) < 0) {
+	syslog(LOG_ERR, "DBERROR: skiplist checkpoint %s: ftruncate %m", fname);
+	r = CYRUSDB_IOERROR;
+	goto fail;
+    }
+
+    /* 1. which records are live? */
+    if ((r = read_lock(db)) < 0) goto fail;
+
+    if (SAFE_TO_APPEND(db)) {
+	/* leave this one for recovery */
+	unlock(db);
+	r = 0;
+	goto fail;
+    }
+
+    ino = db->map_ino;
+    end = db->map_size;
+    logstart = db->logstart;
+    last_recovery = db->last_recovery;
+
+    offset = FORWARD(db->map_base + DUMMY_OFFSET(db), 0);
+    while (offset != 0) {
+	if (count == alloc) {
+	    alloc = alloc ? 2 * alloc : 1024;
+	    offsets = xrealloc(offsets, alloc * sizeof(uint32_t));
+	}
+	offsets[count++] = offset;
+	offset = FORWARD(db->map_base + offset, 0);
+    }
+
+    unlock(db);
+
+    /* 2. copy them */
+    r = ckpt_write(db, newfd, offsets, count);
+    free(offsets);
+    if (r) goto fail;
+
+    /* 3. catch up and switch over */
+    if ((r = write_lock(db, NULL)) < 0) goto fail;
+
+    if (db->map_ino != ino || db->logstart != logstart ||
+	db->last_recovery != last_recovery || db->map_size < end ||
+	(nops = ckpt_tail(db, end, &ops)) < 0) {
+	syslog(LOG_NOTICE, "skiplist: %s changed during checkpoint, "
+	       "abandoning it", db->fname);
+	unlock(db);
+	r = 0;
+	goto fail;
+    }
+
+    oldfd = db->fd;
+    db->fd = newfd;
+    db->lock_status = UNLOCKED; /* well, the new file is... */
+    r = write_lock(db, fname);
+
+    if (!r && nops) {
+	/* replay what was committed since the snapshot; mycommit()
+	   leaves us locked */
+	db->in_checkpoint = 1;
+	r = newtxn(db, &tid);
+	for (i = 0; !r && i < nops; i++) {
+	    if (ops[i].type == ADD) {
+		r = mystore(db, ops[i].key, ops[i].keylen,
+			    ops[i].data, ops[i].datalen, &tid, 1);
+	    } else {
+		r = mydelete(db, ops[i].key, ops[i].keylen, &tid, 1);
+	    }
+	}
+	if (!r) r = mycommit(db, tid);
+	db->in_checkpoint = 0;
+    }
+    ckpt_free_ops(ops, nops);
+
+    /* move new file to original file name */
+    if (!r && (rename(fname, db->fname) < 0)) {
+	syslog(LOG_ERR, "DBERROR: skiplist checkpoint: rename(%s, %s): %m",
+	       fname, db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    /* force the new file name to disk */
+    if (!r && DO_FSYNC && (fsync(db->fd) < 0)) {
+	syslog(LOG_ERR, "DBERROR: skiplist checkpoint: fsync(%s): %m", fname);
+	r = CYRUSDB_IOERROR;
+    }
+
+    if (r) {
+	/* back to the old file, which is as it was */
+	if (db->current_txn) myabort(db, db->current_txn);
+	db->fd = oldfd;
+	db->lock_status = WRITELOCKED;
+	unlock(db);
+	map_free(&db->map_base, &db->map_len);
+	db->map_ino = 0;
+	goto fail;
+    }
+
+    /* release old write lock */
+    close(oldfd);
+
+    /* let's make sure we're up to date */
+    map_free(&db->map_base, &db->map_len);
+    if (fstat(db->fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat %s: %m", db->fname);
+	unlock(db);
+	return CYRUSDB_IOERROR;
+    }
+    db->map_size = sbuf.st_size;
+    db->map_ino = sbuf.st_ino;
+    map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
+		db->fname, 0);
+    read_header(db);
+
+    unlock(db);
+
+    {
+	int diff = time(NULL) - start;
+	syslog(LOG_INFO,
+	       "skiplist: checkpointed %s (%d record%s, %d bytes, "
+	       "%d replayed) in %d second%s",
+	       db->fname, count, count == 1 ? "" : "s", db->logstart,
+	       nops, diff, diff == 1 ? "" : "s");
+    }
+
+    return 0;
+
+ fail:
+    unlink(fname);
+    close(newfd);
+    return r;
+}
+
 /* dump the database.
    if detail == 1, dump all records.
    if detail == 2, also dump pointers for active records.
@@ -1889,8 +2948,12 @@ static int dump(struct db *db, int detail __attribute__((unused)))
 	case DUMMY:
 	case INORDER:
 	case ADD:
-	    printf("kl=%d dl=%d lvl=%d\n",
-		   KEYLEN(ptr), DATALEN(ptr), LEVEL(ptr));
+	    printf("kl=%d dl=%d lvl=%d", KEYLEN(ptr), DATALEN(ptr), LEVEL(ptr));
+	    if (PACKEDNODE(ptr) && PREFIXLEN(ptr)) {
+		printf(" prefix=%d@%04lX", PREFIXLEN(ptr),
+		       (unsigned long) (PREFIXNODE(ptr) - db->map_base));
+	    }
+	    printf("\n");
 	    printf("\t");
 	    for (i = 0; i < LEVEL(ptr); i++) {
 		printf("%04X ", FORWARD(ptr, i));
@@ -1922,7 +2985,8 @@ static int consistent(struct db *db)
 /* perform some basic consistency checks */
 static int myconsistent(struct db *db, struct txn *tid, int locked)
 {
-    const char *ptr;
+    const char *ptr, *key;
+    struct buf keybuf = BUF_INITIALIZER;
     uint32_t offset;
 
     assert(db->current_txn == tid); /* could both be null */
@@ -1935,6 +2999,7 @@ static int myconsistent(struct db *db, struct txn *tid, int locked)
 	unsigned i;
 
 	ptr = db->map_base + offset;
+	key = NODEKEY(ptr, &keybuf);
 
 	for (i = 0; i < LEVEL(ptr); i++) {
 	    offset = FORWARD(ptr, i);
@@ -1946,6 +3011,7 @@ static int myconsistent(struct db *db, struct txn *tid, int locked)
 			(unsigned int) (ptr - db->map_base),
 			i, offset, (unsigned int) db->map_size);
 		if (!locked) unlock(db);
+		buf_free(&keybuf);
 		return CYRUSDB_INTERNAL;
 	    }
 
@@ -1954,7 +3020,7 @@ static int myconsistent(struct db *db, struct txn *tid, int locked)
 		const char *q = db->map_base + offset;
 		int cmp;
 
-		cmp = db->compar(KEY(ptr), KEYLEN(ptr), KEY(q), KEYLEN(q));
+		cmp = -compare_node(db->compar, q, key, KEYLEN(ptr));
 		if (cmp >= 0) {
 		    syslog(LOG_ERR,
 			    "skiplist inconsistent: %04X: ptr %d is %04X; "
@@ -1963,6 +3029,7 @@ static int myconsistent(struct db *db, struct txn *tid, int locked)
 			    i,
 			    offset, cmp);
 		    if (!locked) unlock(db);
+		    buf_free(&keybuf);
 		    return CYRUSDB_INTERNAL;
 		}
 	    }
@@ -1970,6 +3037,7 @@ static int myconsistent(struct db *db, struct txn *tid, int locked)
 
 	offset = FORWARD(ptr, 0);
     }
+    buf_free(&keybuf);
 
     if (!locked) unlock(db);
 
@@ -1979,7 +3047,8 @@ static int myconsistent(struct db *db, struct txn *tid, int locked)
 /* run recovery on this file */
 static int recovery(struct db *db, int flags)
 {
-    const char *ptr, *keyptr;
+    const char *ptr, *keyptr, *key;
+    struct buf keybuf = BUF_INITIALIZER;
     unsigned updateoffsets[SKIPLIST_MAXLEVEL+1];
     uint32_t offset, offsetnet, myoff = 0;
     int r = 0, need_checkpoint = 0;
@@ -2044,9 +3113,7 @@ static int recovery(struct db *db, int flags)
     }
     
     for (i = 0; i < db->maxlevel; i++) {
-	/* header_size + 4 (rectype) + 4 (ksize) + 4 (dsize)
-	   + 4 * i */
-	updateoffsets[i] = DUMMY_OFFSET(db) + 12 + 4 * i;
+	updateoffsets[i] = DUMMY_PTROFFSET(db, i);
     }
     
     /* reset the data that was written INORDER by the last checkpoint */
@@ -2206,9 +3273,10 @@ static int recovery(struct db *db, int flags)
 	keyptr = NULL;
 	/* look for the key */
 	if (TYPE(ptr) == ADD) {
-	    keyptr = find_node(db, KEY(ptr), KEYLEN(ptr), updateoffsets);
+	    key = NODEKEY(ptr, &keybuf);
+	    keyptr = find_node(db, key, KEYLEN(ptr), updateoffsets);
 	    if (keyptr == db->map_base ||
-		db->compar(KEY(ptr), KEYLEN(ptr), KEY(keyptr), KEYLEN(keyptr))) {
+		compare_node(db->compar, keyptr, key, KEYLEN(ptr))) {
 		/* didn't find exactly this node */
 		keyptr = NULL;
 	    }
@@ -2217,9 +3285,10 @@ static int recovery(struct db *db, int flags)
 
 	    myoff = ntohl(*((uint32_t *)(ptr + 4)));
 	    p = db->map_base + myoff;
-	    keyptr = find_node(db, KEY(p), KEYLEN(p), updateoffsets);
+	    key = NODEKEY(p, &keybuf);
+	    keyptr = find_node(db, key, KEYLEN(p), updateoffsets);
 	    if (keyptr == db->map_base ||
-		db->compar(KEY(p), KEYLEN(p), KEY(keyptr), KEYLEN(keyptr))) {
+		compare_node(db->compar, keyptr, key, KEYLEN(p))) {
 		/* didn't find exactly this node */
 		keyptr = NULL;
 	    }
@@ -2332,6 +3401,7 @@ static int recovery(struct db *db, int flags)
 	/* move to next record */
 	offset += RECSIZE(ptr);
     }
+    buf_free(&keybuf);
 
     if (libcyrus_config_getswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT)) {
 	/* refresh map, so we see the writes we've just done */
@@ -2410,5 +3480,11 @@ struct cyrusdb_backend cyrusdb_skiplist =
     &myabort,
 
     &dump,
-    &consistent
+    &consistent,
+
+    &bulkload_begin,
+    &bulkload_add,
+    &bulkload_end,
+
+    &myforeach_snapshot
 };
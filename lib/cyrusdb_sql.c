@@ -883,5 +883,11 @@ struct cyrusdb_backend cyrusdb_sql =
     &abort_txn,
 
     NULL,
+    NULL,
+
+    NULL,
+    NULL,
+    NULL,
+
     NULL
 };
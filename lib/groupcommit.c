@@ -0,0 +1,276 @@
+/* groupcommit.c -- coalesce fdatasync() calls between processes
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "cyr_lock.h"
+#include "groupcommit.h"
+#include "libcyr_cfg.h"
+#include "retry.h"
+#include "xmalloc.h"
+
+#define GROUPCOMMIT_MAGIC 0x47435331	/* "GCS1" */
+
+/* how often waiters look at the shared state (microseconds) */
+#define GROUPCOMMIT_POLL 200
+
+/* give up on a sync that another process started but never finished,
+   e.g. because it died, and do our own (microseconds) */
+#define GROUPCOMMIT_MAXWAIT 1000000
+
+/* tickets wrap; compare them the way TCP compares sequence numbers */
+#define SEQ_GE(a, b) ((int32_t)((a) - (b)) >= 0)
+
+/* the shared state file.  it's only ever used on this host so it is
+   kept in native byte order. */
+struct gcstate {
+    uint32_t magic;
+    uint32_t seq;		/* ticket of the last sync started */
+    uint32_t durable;		/* highest ticket of a completed sync */
+    uint32_t failed;		/* highest ticket of a failed sync */
+    uint32_t pending;		/* pid of a process gathering a group */
+    uint32_t pad;
+    uint64_t ino;		/* the file 'durable' was synced on */
+};
+
+struct groupcommit {
+    char *fname;
+    int fd;
+};
+
+static int gc_lock(struct groupcommit *gc, struct gcstate *st)
+{
+    int n;
+
+    if (lock_blocking(gc->fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: locking %s: %m", gc->fname);
+	return -1;
+    }
+
+    lseek(gc->fd, 0, SEEK_SET);
+    n = retry_read(gc->fd, st, sizeof(*st));
+    if (n != sizeof(*st) || st->magic != GROUPCOMMIT_MAGIC) {
+	/* new (or mangled) file: nobody can be waiting on it */
+	memset(st, 0, sizeof(*st));
+	st->magic = GROUPCOMMIT_MAGIC;
+    }
+
+    return 0;
+}
+
+static int gc_unlock(struct groupcommit *gc, struct gcstate *st, int dirty)
+{
+    int r = 0;
+
+    if (dirty) {
+	lseek(gc->fd, 0, SEEK_SET);
+	if (retry_write(gc->fd, st, sizeof(*st)) != sizeof(*st)) {
+	    syslog(LOG_ERR, "IOERROR: writing %s: %m", gc->fname);
+	    r = -1;
+	}
+    }
+    lock_unlock(gc->fd);
+
+    return r;
+}
+
+int groupcommit_open(const char *fname, struct groupcommit **gcp)
+{
+    struct groupcommit *gc;
+
+    gc = xzmalloc(sizeof(struct groupcommit));
+    gc->fname = xmalloc(strlen(fname) + 6);
+    strcpy(gc->fname, fname);
+    strcat(gc->fname, ".SYNC");
+
+    gc->fd = open(gc->fname, O_RDWR | O_CREAT, 0644);
+    if (gc->fd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", gc->fname);
+	free(gc->fname);
+	free(gc);
+	return -1;
+    }
+
+    *gcp = gc;
+    return 0;
+}
+
+void groupcommit_close(struct groupcommit *gc)
+{
+    if (!gc) return;
+
+    close(gc->fd);
+    free(gc->fname);
+    free(gc);
+}
+
+/* sync 'fd' and publish the result for everyone who got a ticket
+   before we started */
+static int gc_sync(struct groupcommit *gc, int fd, struct gcstate *st)
+{
+    struct stat sbuf;
+    uint32_t ticket;
+    int r;
+
+    /* called with the state locked */
+    ticket = ++st->seq;
+    if (gc_unlock(gc, st, 1)) return -1;
+
+    r = fdatasync(fd);
+    if (r == 0) r = fstat(fd, &sbuf);
+
+    if (gc_lock(gc, st)) return -1;
+    if (r < 0) {
+	if (!SEQ_GE(st->failed, ticket)) st->failed = ticket;
+    } else if (!SEQ_GE(st->durable, ticket)) {
+	st->durable = ticket;
+	st->ino = sbuf.st_ino;
+    }
+    gc_unlock(gc, st, 1);
+
+    return r;
+}
+
+int groupcommit_fdatasync(struct groupcommit *gc, int fd)
+{
+    struct gcstate st;
+
+    if (gc_lock(gc, &st)) return fdatasync(fd);
+
+    return gc_sync(gc, fd, &st);
+}
+
+int groupcommit_begin(struct groupcommit *gc, uint32_t *ticket)
+{
+    struct gcstate st;
+
+    if (gc_lock(gc, &st)) return -1;
+    *ticket = st.seq + 1;
+    gc_unlock(gc, &st, 0);
+
+    return 0;
+}
+
+static long elapsed(struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000L +
+	(now.tv_usec - start->tv_usec);
+}
+
+int groupcommit_finish(struct groupcommit *gc, int fd, uint32_t ticket)
+{
+    struct gcstate st;
+    struct stat sbuf;
+    struct timeval start;
+    long window;
+    int leader = 0;
+
+    window = libcyrus_config_getint(CYRUSOPT_GROUP_COMMIT_WINDOW) * 1000L;
+    if (window < 0) window = 0;
+
+    if (fstat(fd, &sbuf) < 0) return fdatasync(fd);
+    gettimeofday(&start, NULL);
+
+    for (;;) {
+	if (gc_lock(gc, &st)) return fdatasync(fd);
+
+	if (SEQ_GE(st.durable, ticket)) {
+	    if (leader) st.pending = 0;
+	    gc_unlock(gc, &st, leader);
+
+	    /* a sync of someone else's copy (e.g. after a checkpoint
+	       renamed a new file into place) doesn't help us */
+	    if ((ino_t) st.ino != sbuf.st_ino) return fdatasync(fd);
+	    return 0;
+	}
+
+	if (SEQ_GE(st.failed, ticket) ||
+	    elapsed(&start) > window + GROUPCOMMIT_MAXWAIT) {
+	    /* find out for ourselves */
+	    if (leader) st.pending = 0;
+	    gc_unlock(gc, &st, leader);
+	    return fdatasync(fd);
+	}
+
+	if (leader) {
+	    /* the window is over: if nobody else has started a sync
+	       since we got our ticket, it's up to us */
+	    st.pending = 0;
+	    if (!SEQ_GE(st.seq, ticket)) return gc_sync(gc, fd, &st);
+	    leader = 0;
+	    gc_unlock(gc, &st, 1);
+	}
+	else if (!SEQ_GE(st.seq, ticket) &&
+		 (!st.pending ||
+		  (kill(st.pending, 0) < 0 && errno == ESRCH))) {
+	    /* nobody is going to sync for us; gather a group */
+	    if (!window) return gc_sync(gc, fd, &st);
+	    st.pending = getpid();
+	    leader = 1;
+	    gc_unlock(gc, &st, 1);
+	    usleep(window);
+	    continue;
+	}
+	else {
+	    gc_unlock(gc, &st, 0);
+	}
+
+	usleep(GROUPCOMMIT_POLL);
+    }
+}
@@ -0,0 +1,80 @@
+/* groupcommit.h -- coalesce fdatasync() calls between processes
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_GROUPCOMMIT_H
+#define INCLUDED_GROUPCOMMIT_H
+
+#include <config.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * Group commit for files which several processes append to under a
+ * write lock, such as the cyrusdb backends.
+ *
+ * Every fdatasync() on the file takes a ticket from a small shared
+ * state file ("<fname>.SYNC").  A committer that has finished writing
+ * asks for the next ticket with groupcommit_begin() while it still
+ * holds its write lock, lets go of the lock, and then calls
+ * groupcommit_finish().  That returns as soon as any sync with at
+ * least that ticket has completed on the same file -- whether it was
+ * started by another committer, by the next writer's own sync or by
+ * us after waiting up to 'group_commit_window' for others to join.
+ */
+
+struct groupcommit;
+
+/* returns 0 on success, -1 (having logged) on failure */
+extern int groupcommit_open(const char *fname, struct groupcommit **gcp);
+extern void groupcommit_close(struct groupcommit *gc);
+
+/* fdatasync() 'fd', counting it for anyone who is waiting */
+extern int groupcommit_fdatasync(struct groupcommit *gc, int fd);
+
+/* everything written to the file so far needs a sync at 'ticket' or later */
+extern int groupcommit_begin(struct groupcommit *gc, uint32_t *ticket);
+
+/* wait until such a sync has completed on 'fd', starting one if need be */
+extern int groupcommit_finish(struct groupcommit *gc, int fd, uint32_t ticket);
+
+#endif /* INCLUDED_GROUPCOMMIT_H */
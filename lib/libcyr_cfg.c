@@ -158,6 +158,18 @@ struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_SKIPLIST_INCREMENTAL_CHECKPOINT,
+      CFGVAL(long, 1),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_GROUP_COMMIT_WINDOW,
+      CFGVAL(long, 2),
+      CYRUS_OPT_INT },
+
+    { CYRUSOPT_SKIPLIST_PACKED,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
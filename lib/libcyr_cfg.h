@@ -116,6 +116,12 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Checkpoint without holding the write lock throughout (ON) */
+    CYRUSOPT_SKIPLIST_INCREMENTAL_CHECKPOINT,
+    /* Milliseconds to gather a group commit (2) */
+    CYRUSOPT_GROUP_COMMIT_WINDOW,
+    /* Write skiplist files with packed nodes (OFF) */
+    CYRUSOPT_SKIPLIST_PACKED,
 
     CYRUSOPT_LAST
     
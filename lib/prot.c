@@ -45,6 +45,7 @@
 #include <config.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <syslog.h>
 #include <signal.h>
@@ -58,10 +59,17 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #include "assert.h"
 #include "exitcodes.h"
@@ -80,8 +88,29 @@ struct protgroup
     size_t nalloced; /* Number of nodes in the group */
     size_t next_element; /* Node number of next group member */
     struct protstream **group;
+#ifdef HAVE_EPOLL
+    /* The epoll set is created by the first prot_select() on the group
+     * and kept in step with the members on each later call, so that
+     * members which stay in the group (even across protgroup_reset())
+     * are registered only once. */
+    int epfd;			/* -1 until first used, -2 if unusable */
+    pid_t eppid;		/* process that created epfd */
+    struct protstream **registered; /* stream registered for each fd */
+    unsigned *regmark;		/* prot_select() call that last saw it */
+    unsigned *regserial;	/* serial of that stream */
+    int nregalloced;		/* size of the above, indexed by fd */
+    int nregistered;
+    int extra_fd;		/* extra_read_fd registered, or PROT_NO_FD */
+    unsigned mark;
+    struct epoll_event *events;
+    int neventsalloced;
+#endif
 };
 
+/* Not locked: a stream only needs a serial different from that of any
+ * earlier stream on the same fd at the same address */
+static unsigned prot_serial;
+
 /*
  * Create a new protection stream for file descriptor 'fd'.  Stream
  * will be used for writing iff 'write' is nonzero.
@@ -100,6 +129,7 @@ struct protstream *prot_new(int fd, int write)
     newstream->write = write;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer = PROT_NO_FD;
+    newstream->serial = ++prot_serial;
     if(write)
 	newstream->cnt = PROT_BUFSIZE;
 
@@ -326,6 +356,12 @@ int prot_setcompress(struct protstream *s)
 	        goto error;
 	}
 
+	/* Compress at most PROT_BUFSIZE at a time (see below) */
+	if (s->maxplain > PROT_BUFSIZE) {
+	    s->maxplain = PROT_BUFSIZE;
+	    s->cnt = s->maxplain - (s->ptr - s->buf);
+	}
+
 	s->zlevel = Z_DEFAULT_COMPRESSION;
 	zr = deflateInit2(zstrm, s->zlevel, Z_DEFLATED,
 		          -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
@@ -923,6 +959,112 @@ static int prot_flush_writebuffer(struct protstream *s,
     return n;
 }
 
+/*
+ * Does data written to 's' go to the descriptor exactly as it is?
+ * Not with TLS, a SASL security layer, COMPRESS or the telemetry log.
+ */
+static int prot_passthrough(struct protstream *s)
+{
+    if (s->saslssf || s->logfd != PROT_NO_FD) return 0;
+#ifdef HAVE_SSL
+    if (s->tls_conn) return 0;
+#endif
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif
+    return 1;
+}
+
+/*
+ * Size the (empty) output buffer of 's' to suit the application, given
+ * that 'used' bytes were in it when it was last flushed.  If it keeps
+ * getting filled, data is streaming out and a bigger buffer saves
+ * system calls; if it's mostly empty, go back down to the default.
+ * Not done under a SASL security layer or COMPRESS, which rely on
+ * the buffer size.
+ */
+static void prot_adaptbuffer(struct protstream *s, unsigned used)
+{
+    unsigned newsize = s->maxplain;
+
+    if (s->saslssf) return;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return;
+#endif
+
+    if (used >= (unsigned) s->maxplain) {
+	if (++s->fillcount >= 4 && s->maxplain < PROT_BUFSIZE_MAX)
+	    newsize = s->maxplain * 2;
+    }
+    else if (used < (unsigned) s->maxplain / 4) {
+	if (--s->fillcount <= -16 && s->maxplain > PROT_BUFSIZE)
+	    newsize = s->maxplain / 2;
+    }
+
+    if (newsize != (unsigned) s->maxplain) {
+	s->buf = xrealloc(s->buf, newsize);
+	s->buf_size = s->maxplain = s->cnt = newsize;
+	s->ptr = s->buf;
+	s->fillcount = 0;
+    }
+}
+
+/*
+ * Write what's buffered on 's' followed by 'len' bytes at 'buf' with a
+ * single writev(), rather than copying 'buf' through the buffer.  Only
+ * for blocking streams where prot_passthrough() holds.
+ */
+static int prot_write_direct(struct protstream *s, const char *buf,
+			     unsigned len)
+{
+    struct iovec iov[2], *iovp = iov;
+    int niov = 0;
+    ssize_t n;
+
+    if (s->dontblock_isset) {
+	nonblock(s->fd, 0);
+	s->dontblock_isset = 0;
+    }
+
+    if (s->ptr != s->buf) {
+	iov[niov].iov_base = s->buf;
+	iov[niov].iov_len = s->ptr - s->buf;
+	niov++;
+    }
+    iov[niov].iov_base = (void *) buf;
+    iov[niov].iov_len = len;
+    niov++;
+
+    while (niov) {
+	cmdtime_netstart();
+	n = writev(s->fd, iovp, niov);
+	cmdtime_netend();
+
+	if (n == -1) {
+	    if (errno == EINTR && !signals_poll()) continue;
+	    s->error = xstrdup(strerror(errno));
+	    return EOF;
+	}
+
+	/* Skip what was written */
+	while (niov && (size_t) n >= iovp->iov_len) {
+	    n -= iovp->iov_len;
+	    iovp++;
+	    niov--;
+	}
+	if (niov) {
+	    iovp->iov_base = (char *) iovp->iov_base + n;
+	    iovp->iov_len -= n;
+	}
+    }
+
+    s->ptr = s->buf;
+    s->cnt = s->maxplain;
+    s->bytes_out += len;
+
+    return 0;
+}
+
 int prot_flush_internal(struct protstream *s, int force)
 {
     int n;
@@ -930,6 +1072,7 @@ int prot_flush_internal(struct protstream *s, int force)
 
     const char *ptr = (char *) s->buf; /* Memory buffer info */
     unsigned left = s->ptr - s->buf;
+    unsigned used = left;
 
     assert(s->write);
 
@@ -1102,6 +1245,8 @@ int prot_flush_internal(struct protstream *s, int force)
     /* Reset the memory buffer -- should be done on EOF or on success. */
     s->ptr = s->buf;
     s->cnt = s->maxplain;
+
+    prot_adaptbuffer(s, used);
         
  done:
     /* are we done with the big buffer? If so, free it. This includes
@@ -1171,6 +1316,12 @@ int prot_write(struct protstream *s, const char *buf, unsigned len)
 	s->boundary = 0;
     }
 
+    /* Send at least a buffer's worth straight from the caller's memory */
+    if (len >= (unsigned) s->maxplain && !s->dontblock &&
+	s->big_buffer == PROT_NO_FD && prot_passthrough(s)) {
+	return prot_write_direct(s, buf, len);
+    }
+
     while (len >= s->cnt) {
 	/* XXX can we manage to write data from 'buf' without copying it
 	   to s->ptr ? */
@@ -1196,6 +1347,74 @@ int prot_putbuf(struct protstream *s, struct buf *buf)
     return prot_write(s, buf->s, buf->len);
 }
 
+/*
+ * Can data be passed straight from a file to the output stream 's'?
+ * Only if nothing on the way needs to see it: TLS, a SASL security
+ * layer, COMPRESS or the telemetry log.
+ */
+int prot_can_sendfile(struct protstream *s)
+{
+#ifdef HAVE_SENDFILE
+    assert(s->write);
+
+    if (s->error || s->eof) return 0;
+    return prot_passthrough(s);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Write to the output stream 's' the 'len' bytes at 'offset' in file 'fd',
+ * using sendfile() so that the data isn't copied through our buffers.
+ * Anything already buffered is flushed first.
+ *
+ * Returns 0 on success, EOF on error, or 1 if the stream can't do this,
+ * in which case nothing was written and the caller should use prot_write()
+ */
+int prot_sendfile(struct protstream *s, int fd, off_t offset, size_t len)
+{
+#ifdef HAVE_SENDFILE
+    ssize_t n;
+    int sent = 0;
+
+    if (!prot_can_sendfile(s)) return 1;
+    if (len == 0) return 0;
+
+    /* Get everything before the data out, leaving the fd blocking */
+    if (prot_flush_internal(s, 1) == EOF) return EOF;
+
+    while (len) {
+	cmdtime_netstart();
+	n = sendfile(s->fd, fd, &offset, len);
+	cmdtime_netend();
+
+	if (n == -1) {
+	    if (errno == EINTR && !signals_poll()) continue;
+	    if (!sent && (errno == EINVAL || errno == ENOSYS)) {
+		/* Not supported for this pair of descriptors */
+		return 1;
+	    }
+	    s->error = xstrdup(strerror(errno));
+	    return EOF;
+	}
+	if (n == 0) {
+	    /* The file is shorter than we were told */
+	    s->error = xstrdup("file shrank during sendfile");
+	    return EOF;
+	}
+
+	sent = 1;
+	len -= n;
+	s->bytes_out += n;
+    }
+
+    return 0;
+#else
+    return 1;
+#endif
+}
+
 int prot_puts(struct protstream *s, const char *str)
 {
     return prot_write(s, str, strlen(str));
@@ -1470,6 +1689,149 @@ int prot_readbuf(struct protstream *s, struct buf *buf, unsigned size)
     return size;
 }
 
+#ifdef HAVE_EPOLL
+static void protgroup_epoll_init(struct protgroup *group)
+{
+    group->epfd = -1;
+    group->registered = NULL;
+    group->regserial = NULL;
+    group->regmark = NULL;
+    group->nregalloced = 0;
+    group->nregistered = 0;
+    group->extra_fd = PROT_NO_FD;
+    group->mark = 0;
+    group->events = NULL;
+    group->neventsalloced = 0;
+}
+
+static void protgroup_epoll_free(struct protgroup *group)
+{
+    if (group->epfd >= 0) close(group->epfd);
+    free(group->registered);
+    free(group->regserial);
+    free(group->regmark);
+    free(group->events);
+    protgroup_epoll_init(group);
+}
+
+static int protgroup_epoll_add(struct protgroup *group, int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(group->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+	(errno != EEXIST ||
+	 epoll_ctl(group->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)) {
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Bring the epoll set of 'group' into line with its members and
+ * 'extra_read_fd'.  Only streams that are new to the group since the
+ * last call cost a system call.
+ *
+ * Returns -1 if epoll can't be used, in which case the caller should
+ * fall back to select()
+ */
+static int protgroup_epoll_sync(struct protgroup *group, int extra_read_fd)
+{
+    struct epoll_event ev;
+    int live = 0;
+    unsigned i;
+    int fd;
+
+    if (group->epfd == -2) return -1;
+    if (group->epfd >= 0 && group->eppid != getpid()) {
+	/* We've forked since; the epoll set is shared with the parent */
+	protgroup_epoll_free(group);
+    }
+    if (group->epfd == -1) {
+	group->epfd = epoll_create(group->nalloced + 1);
+	if (group->epfd == -1) return -1;
+	group->eppid = getpid();
+    }
+
+    group->mark++;
+
+    for (i = 0; i < group->next_element; i++) {
+	struct protstream *s = group->group[i];
+
+	if (!s) continue;
+	fd = s->fd;
+	live++;
+
+	if (fd >= group->nregalloced) {
+	    int n = group->nregalloced;
+
+	    group->nregalloced = 2 * fd + 16;
+	    group->registered =
+		xrealloc(group->registered,
+			 group->nregalloced * sizeof(struct protstream *));
+	    group->regserial =
+		xrealloc(group->regserial,
+			 group->nregalloced * sizeof(unsigned));
+	    group->regmark =
+		xrealloc(group->regmark,
+			 group->nregalloced * sizeof(unsigned));
+	    memset(group->registered + n, 0,
+		   (group->nregalloced - n) * sizeof(struct protstream *));
+	}
+
+	if (group->registered[fd] != s ||
+	    group->regserial[fd] != s->serial) {
+	    /* A new stream, or a new stream on an old fd */
+	    if (protgroup_epoll_add(group, fd) == -1) goto fail;
+	    if (!group->registered[fd]) group->nregistered++;
+	    group->registered[fd] = s;
+	    group->regserial[fd] = s->serial;
+	}
+	group->regmark[fd] = group->mark;
+    }
+
+    /* Drop anything that has left the group.  The fd may well have
+     * been closed already, which removes it from the set anyway. */
+    memset(&ev, 0, sizeof(ev));
+    for (fd = 0; group->nregistered > live && fd < group->nregalloced; fd++) {
+	if (group->registered[fd] && group->regmark[fd] != group->mark) {
+	    epoll_ctl(group->epfd, EPOLL_CTL_DEL, fd, &ev);
+	    group->registered[fd] = NULL;
+	    group->nregistered--;
+	}
+    }
+
+    if (extra_read_fd != group->extra_fd) {
+	if (group->extra_fd != PROT_NO_FD) {
+	    epoll_ctl(group->epfd, EPOLL_CTL_DEL, group->extra_fd, &ev);
+	}
+	group->extra_fd = PROT_NO_FD;
+	if (extra_read_fd != PROT_NO_FD) {
+	    if (protgroup_epoll_add(group, extra_read_fd) == -1) goto fail;
+	    group->extra_fd = extra_read_fd;
+	}
+    }
+
+    if (group->neventsalloced < live + 1) {
+	group->neventsalloced = live + 1;
+	group->events = xrealloc(group->events,
+				 group->neventsalloced *
+				 sizeof(struct epoll_event));
+    }
+
+    return 0;
+
+ fail:
+    syslog(LOG_WARNING, "protgroup: epoll failed, using select(): %m");
+    protgroup_epoll_free(group);
+    group->epfd = -2;	/* don't try again */
+    return -1;
+}
+#endif /* HAVE_EPOLL */
+
 /*
  * select() for protection streams, read only
  * Also supports selecting on an extra file descriptor
@@ -1477,6 +1839,10 @@ int prot_readbuf(struct protstream *s, struct buf *buf, unsigned size)
  * returns # of protstreams with pending data (including the extra fd)
  *
  * Only works for readable protstreams
+ *
+ * Uses epoll where available, in which case the streams stay registered
+ * with the kernel between calls (see protgroup_epoll_sync()) and there
+ * is no FD_SETSIZE limit.
  */ 
 int prot_select(struct protgroup *readstreams, int extra_read_fd,
 		struct protgroup **out, int *extra_read_flag,
@@ -1492,11 +1858,17 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
     struct prot_waitevent *event;
     time_t now = time(NULL);
     time_t read_timeout = 0;
+    int use_epoll = 0;
     
     assert(readstreams || extra_read_fd != PROT_NO_FD);
     assert(extra_read_fd == PROT_NO_FD || extra_read_flag);
     assert(out);
 
+#ifdef HAVE_EPOLL
+    if (readstreams && protgroup_epoll_sync(readstreams, extra_read_fd) == 0)
+	use_epoll = 1;
+#endif
+
     /* Initialize things we might use */
     errno = 0;
     found_fds = 0;
@@ -1539,9 +1911,11 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
 		timeout_prot = s;
 	}
 	    
-	FD_SET(s->fd, &rfds);
-	if(s->fd > max_fd)
-	    max_fd = s->fd;
+	if(!use_epoll) {
+	    FD_SET(s->fd, &rfds);
+	    if(s->fd > max_fd)
+		max_fd = s->fd;
+	}
 
 	/* Is something currently pending in our protstream's buffer? */
 	if(s->cnt > 0) {
@@ -1591,6 +1965,68 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
 	    timeout->tv_usec = 0;
 	}
 
+#ifdef HAVE_EPOLL
+	if(use_epoll) {
+	    struct epoll_event *ev = readstreams->events;
+	    int n, timeout_prot_ready = 0;
+	    int ms = -1;
+
+	    /* epoll wants milliseconds in an int; wait as long as it can */
+	    if(timeout) {
+		if(timeout->tv_sec >= INT_MAX / 1000)
+		    ms = INT_MAX;
+		else
+		    ms = timeout->tv_sec * 1000 +
+			 (timeout->tv_usec + 999) / 1000;
+	    }
+
+	    n = epoll_wait(readstreams->epfd, ev, readstreams->neventsalloced,
+			   ms);
+	    if(n == -1)
+		return -1;
+
+	    /* Reset now */
+	    now = time(NULL);
+
+	    if(extra_read_flag)
+		*extra_read_flag = 0;
+
+	    /* Only look at the streams that are ready */
+	    for(; n > 0; n--, ev++) {
+		if(ev->data.fd == extra_read_fd) {
+		    *extra_read_flag = 1;
+		    found_fds++;
+		    continue;
+		}
+
+		s = readstreams->registered[ev->data.fd];
+		if (!s) continue;
+		if (s == timeout_prot) timeout_prot_ready = 1;
+
+		found_fds++;
+
+		if(!retval)
+		    retval = protgroup_new(readstreams->next_element + 1);
+
+		protgroup_insert(retval, s);
+	    }
+
+	    if(timeout_prot && !timeout_prot_ready && now >= read_timeout) {
+		/* If we timed out, be sure to add the protstream we were
+		 * waiting for, even if it didn't show up */
+		found_fds++;
+
+		if(!retval)
+		    retval = protgroup_new(readstreams->next_element + 1);
+
+		protgroup_insert(retval, timeout_prot);
+	    }
+
+	    *out = retval;
+	    return found_fds;
+	}
+#endif
+
 	if(select(max_fd + 1, &rfds, NULL, NULL, timeout) == -1)
 	    return -1;
 
@@ -1667,6 +2103,9 @@ struct protgroup *protgroup_new(size_t size)
     ret->nalloced = size;
     ret->next_element = 0;
     ret->group = xzmalloc(size * sizeof(struct protstream *));
+#ifdef HAVE_EPOLL
+    protgroup_epoll_init(ret);
+#endif
 
     return ret;
 }
@@ -1683,6 +2122,8 @@ struct protgroup *protgroup_copy(struct protgroup *src)
     return dest;
 }
 
+/* The epoll registrations are kept, since the group is usually refilled
+ * with mostly the same streams */
 void protgroup_reset(struct protgroup *group) 
 {
     if(group) {
@@ -1697,6 +2138,9 @@ void protgroup_free(struct protgroup *group)
     if(group) {
 	assert(group->group);
 	free(group->group);
+#ifdef HAVE_EPOLL
+	protgroup_epoll_free(group);
+#endif
 	free(group);
     }
 }
@@ -64,6 +64,7 @@
 
 #define PROT_BUFSIZE 4096
 /* #define PROT_BUFSIZE 8192 */
+#define PROT_BUFSIZE_MAX (16*PROT_BUFSIZE) /* output buffers grow to this */
 
 #define PROT_NO_FD -1
 
@@ -78,11 +79,13 @@ struct protstream {
     unsigned buf_size;
     unsigned char *ptr; /* The end of data in the buffer */
     unsigned cnt; /* Space Remaining in buffer */
+    int fillcount; /* How often we've recently filled an output buffer */
 
     /* File Descriptors */
     int fd;         /* The Socket */
     int logfd;      /* The Telemetry Log (or PROT_NO_FD) */
     int big_buffer; /* The Big Buffer (or PROT_NO_FD) */
+    unsigned serial; /* Tells apart streams that reuse an fd */
 
     /* SASL / TLS */
     sasl_conn_t *conn;
@@ -251,6 +254,9 @@ extern int prot_flush(struct protstream *s);
 /* These are protlayer versions of the specified functions */
 extern int prot_write(struct protstream *s, const char *buf, unsigned len);
 extern int prot_putbuf(struct protstream *s, struct buf *buf);
+extern int prot_can_sendfile(struct protstream *s);
+extern int prot_sendfile(struct protstream *s, int fd, off_t offset,
+			 size_t len);
 extern int prot_puts(struct protstream *s, const char *str);
 extern int prot_vprintf(struct protstream *, const char *, va_list);
 extern int prot_printf(struct protstream *, const char *, ...)
@@ -0,0 +1,410 @@
+/* sha1.c -- SHA1 digests with a CPU-specific fast path
+ *
+ * Copyright (c) 1994-2012 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * With OpenSSL we use its SHA1(), which already picks the best code
+ * for the CPU.  Otherwise the bundled portable code is used, with the
+ * block function replaced by a SHA-NI version when the CPU has the
+ * SHA extensions; it is picked on first use, as in search_kernels.c.
+ */
+
+#include <config.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#else
+# include <inttypes.h>
+#endif
+#ifdef HAVE_X86_CRYPTO
+#include <immintrin.h>
+#endif
+
+#include "sha1.h"
+
+#ifdef HAVE_SSL
+
+#include <openssl/sha.h>
+
+void sha1_buf(const unsigned char *buf, unsigned long len,
+	      unsigned char dest[SHA1_DIGEST_LENGTH])
+{
+    SHA1(buf, len, dest);
+}
+
+const char *sha1_impl_name(void)
+{
+    return "openssl";
+}
+
+int sha1_use_impl(const char *name)
+{
+    return strcmp(name, "openssl") ? -1 : 0;
+}
+
+#else /* HAVE_SSL */
+
+/*
+ * sha1.c
+ *
+ * Originally witten by Steve Reid <steve@edmweb.com>
+ * 
+ * Modified by Aaron D. Gifford <agifford@infowest.com>
+ *
+ * NO COPYRIGHT - THIS IS 100% IN THE PUBLIC DOMAIN
+ *
+ * The original unmodified version is available at:
+ *    ftp://ftp.funet.fi/pub/crypt/hash/sha/sha1.c
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR(S) OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* to limit changes to the code below, set up the right types here */
+
+typedef uint32_t sha1_quadbyte; /* 4 byte type */
+typedef uint8_t sha1_byte;    /* single byte type */
+
+#define SHA1_BLOCK_LENGTH   64
+
+/* The SHA1 structure: */
+typedef struct _SHA_CTX {
+    sha1_quadbyte   state[5];
+    sha1_quadbyte   count[2];
+    sha1_byte	buffer[SHA1_BLOCK_LENGTH];
+} SHA_CTX;
+
+
+/* Downloaded from http://www.aarongifford.com/computers/hmac_sha1.tar.gz
+ * by Bron Gondwana <brong@fastmail.fm> on 2011-09-20
+ */
+
+#define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+/* blk0() and blk() perform the initial expand. */
+/* I got the idea of expanding during the round function from SSLeay */
+
+#ifdef LITTLE_ENDIAN
+#define blk0(i) (block->l[i] = (rol(block->l[i],24)&(sha1_quadbyte)0xFF00FF00) \
+    |(rol(block->l[i],8)&(sha1_quadbyte)0x00FF00FF))
+#else
+#define blk0(i) block->l[i]
+#endif
+
+#define blk(i) (block->l[i&15] = rol(block->l[(i+13)&15]^block->l[(i+8)&15] \
+    ^block->l[(i+2)&15]^block->l[i&15],1))
+
+/* (R0+R1), R2, R3, R4 are the different operations used in SHA1 */
+#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk0(i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define R1(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk(i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define R2(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0x6ED9EBA1+rol(v,5);w=rol(w,30);
+#define R3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+blk(i)+0x8F1BBCDC+rol(v,5);w=rol(w,30);
+#define R4(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0xCA62C1D6+rol(v,5);w=rol(w,30);
+
+typedef union _BYTE64QUAD16 {
+    sha1_byte c[64];
+    sha1_quadbyte l[16];
+} BYTE64QUAD16;
+
+/* Hash a single 512-bit block. This is the core of the algorithm. */
+static void SHA1_Transform(sha1_quadbyte state[5], const sha1_byte buffer[64]) {
+    sha1_quadbyte   a, b, c, d, e;
+    BYTE64QUAD16    *block;
+    BYTE64QUAD16    copy;
+
+    /* take a copy of the data */
+    memcpy(&copy, buffer, 64);
+    block = &copy;
+
+    /* Copy context->state[] to working vars */
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    /* 4 rounds of 20 operations each. Loop unrolled. */
+    R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
+    R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
+    R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
+    R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
+    R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
+    R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
+    R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
+    R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
+    R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
+    R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
+    R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
+    R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
+    R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
+    R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
+    R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
+    R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
+    R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
+    R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
+    R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
+    R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+    /* Add the working vars back into context.state[] */
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    /* Wipe variables */
+    a = b = c = d = e = 0;
+}
+
+
+static void sha1_blocks_portable(sha1_quadbyte state[5],
+				 const sha1_byte *data, size_t nblocks)
+{
+    while (nblocks--) {
+	SHA1_Transform(state, data);
+	data += SHA1_BLOCK_LENGTH;
+    }
+}
+
+#ifdef HAVE_X86_CRYPTO
+/*
+ * SHA-NI: sha1rnds4 does four rounds, sha1nexte derives E for the
+ * next four, and sha1msg1/sha1msg2 plus an xor produce the next four
+ * words of the message schedule.  Round group g (rounds 4g..4g+3)
+ * consumes msg[g%4], so the schedule is kept in a ring of four
+ * registers, and e[] alternates between the value being consumed and
+ * the one being produced.
+ */
+#define SHANI_GROUP(g) do { \
+    if (g == 0) { \
+	e[0] = _mm_add_epi32(e[0], msg[0]); \
+    } else { \
+	e[g%2] = _mm_sha1nexte_epu32(e[g%2], msg[g%4]); \
+    } \
+    e[(g+1)%2] = abcd; \
+    if (g >= 3 && g <= 18) \
+	msg[(g+1)%4] = _mm_sha1msg2_epu32(msg[(g+1)%4], msg[g%4]); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[g%2], g/5); \
+    if (g >= 1 && g <= 16) \
+	msg[(g+3)%4] = _mm_sha1msg1_epu32(msg[(g+3)%4], msg[g%4]); \
+    if (g >= 2 && g <= 17) \
+	msg[(g+2)%4] = _mm_xor_si128(msg[(g+2)%4], msg[g%4]); \
+} while (0)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1_blocks_shani(sha1_quadbyte state[5],
+			      const sha1_byte *data, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+					 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e_save, e[2], msg[4];
+    int i;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+    e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (nblocks--) {
+	abcd_save = abcd;
+	e_save = e[0];
+
+	for (i = 0; i < 4; i++)
+	    msg[i] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *) (data + 16*i)), bswap);
+
+	SHANI_GROUP(0);  SHANI_GROUP(1);  SHANI_GROUP(2);  SHANI_GROUP(3);
+	SHANI_GROUP(4);  SHANI_GROUP(5);  SHANI_GROUP(6);  SHANI_GROUP(7);
+	SHANI_GROUP(8);  SHANI_GROUP(9);  SHANI_GROUP(10); SHANI_GROUP(11);
+	SHANI_GROUP(12); SHANI_GROUP(13); SHANI_GROUP(14); SHANI_GROUP(15);
+	SHANI_GROUP(16); SHANI_GROUP(17); SHANI_GROUP(18); SHANI_GROUP(19);
+
+	/* group 19 left the next E in e[0] */
+	e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+
+	data += SHA1_BLOCK_LENGTH;
+    }
+
+    _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e[0], 3);
+}
+#endif /* HAVE_X86_CRYPTO */
+
+struct sha1_impl {
+    const char *name;
+    void (*blocks)(sha1_quadbyte state[5], const sha1_byte *data,
+		   size_t nblocks);
+};
+
+static const struct sha1_impl sha1_impls[] = {
+    { "portable", sha1_blocks_portable },
+#ifdef HAVE_X86_CRYPTO
+    { "shani", sha1_blocks_shani },
+#endif
+    { NULL, NULL }
+};
+
+static const struct sha1_impl *sha1_impl = NULL;
+
+static int sha1_impl_supported(const struct sha1_impl *impl)
+{
+#ifdef HAVE_X86_CRYPTO
+    __builtin_cpu_init();
+    if (impl->blocks == sha1_blocks_shani)
+	return __builtin_cpu_supports("sha") &&
+	       __builtin_cpu_supports("sse4.1");
+#endif
+    return 1;
+}
+
+/* the last one this CPU can run is the fastest */
+static void sha1_pick_impl(void)
+{
+    const struct sha1_impl *impl;
+
+    for (impl = sha1_impls; impl->name; impl++) {
+	if (sha1_impl_supported(impl))
+	    sha1_impl = impl;
+    }
+}
+
+/* SHA1_Init - Initialize new context */
+static void SHA1_Init(SHA_CTX* context) {
+    /* SHA1 initialization constants */
+    context->state[0] = 0x67452301;
+    context->state[1] = 0xEFCDAB89;
+    context->state[2] = 0x98BADCFE;
+    context->state[3] = 0x10325476;
+    context->state[4] = 0xC3D2E1F0;
+    context->count[0] = context->count[1] = 0;
+}
+
+/* Run your data through this. */
+static void SHA1_Update(SHA_CTX *context, const sha1_byte *data, unsigned int len) {
+    unsigned int    i, j;
+
+    j = (context->count[0] >> 3) & 63;
+    if ((context->count[0] += len << 3) < (len << 3)) context->count[1]++;
+    context->count[1] += (len >> 29);
+    if ((j + len) > 63) {
+        memcpy(&context->buffer[j], data, (i = 64-j));
+        sha1_impl->blocks(context->state, context->buffer, 1);
+        if (len - i >= 64) {
+            sha1_impl->blocks(context->state, &data[i], (len - i) / 64);
+            i += (len - i) & ~63U;
+        }
+        j = 0;
+    }
+    else i = 0;
+    memcpy(&context->buffer[j], &data[i], len - i);
+}
+
+
+static const sha1_byte sha1_padding[SHA1_BLOCK_LENGTH] = { 0x80 };
+
+/* Add padding and return the message digest. */
+static void SHA1_Final(sha1_byte digest[SHA1_DIGEST_LENGTH], SHA_CTX *context) {
+    sha1_quadbyte   i, j;
+    sha1_byte	finalcount[8];
+
+    for (i = 0; i < 8; i++) {
+        finalcount[i] = (sha1_byte)((context->count[(i >= 4 ? 0 : 1)]
+         >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
+    }
+    /* 0x80 then zeros up to 56 mod 64, in one go */
+    j = (context->count[0] >> 3) & 63;
+    SHA1_Update(context, sha1_padding, j < 56 ? 56 - j : 120 - j);
+    /* Should cause a SHA1_Transform() */
+    SHA1_Update(context, finalcount, 8);
+    for (i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+        digest[i] = (sha1_byte)
+         ((context->state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
+    }
+    /* Wipe variables */
+    i = j = 0;
+    memset(context->buffer, 0, SHA1_BLOCK_LENGTH);
+    memset(context->state, 0, SHA1_DIGEST_LENGTH);
+    memset(context->count, 0, 8);
+    memset(&finalcount, 0, 8);
+}
+
+void sha1_buf(const unsigned char *buf, unsigned long len,
+	      unsigned char dest[SHA1_DIGEST_LENGTH])
+{
+    SHA_CTX ctx;
+
+    if (!sha1_impl) sha1_pick_impl();
+
+    memset(&ctx, 0, sizeof(SHA_CTX));
+
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, buf, len);
+    SHA1_Final(dest, &ctx);
+}
+
+const char *sha1_impl_name(void)
+{
+    if (!sha1_impl) sha1_pick_impl();
+    return sha1_impl->name;
+}
+
+int sha1_use_impl(const char *name)
+{
+    const struct sha1_impl *impl;
+
+    for (impl = sha1_impls; impl->name; impl++) {
+	if (!strcmp(impl->name, name)) {
+	    if (!sha1_impl_supported(impl)) return -1;
+	    sha1_impl = impl;
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+#endif /* HAVE_SSL */
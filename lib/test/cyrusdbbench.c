@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../cyrusdb.h"
+#include "../xmalloc.h"
+#include "../exitcodes.h"
+
+/*
+ * cyrusdb benchmark
+ *
+ * Runs the same workload against each cyrusdb backend (all compiled
+ * ones unless -b is given) and each key distribution, and prints one
+ * line per phase:
+ *
+ *   store	insert every key in random order, one transaction per -t
+ *   fetch	random lookups, skewed towards some keys, 10% misses
+ *   foreach	prefix scans (one user's mailboxes etc.)
+ *   scan	full scans
+ *   update	rewrite every key with a longer value
+ *   delete	delete every other key
+ *   checkpoint	the commits above during which the backend rewrote its
+ *		file (its inode changed), plus the backend's sync()
+ *
+ * with the number of operations, operations per second, median, 99th
+ * percentile and worst latency, the number of fsync()s per operation
+ * and the size of the database directory after the phase.
+ *
+ * fsync()s are only counted on Linux, where they can be intercepted
+ * without help from the linker.
+ */
+
+#ifdef __linux__
+#include <sys/syscall.h>
+
+static unsigned long nsyncs;
+
+int fsync(int fd)
+{
+    nsyncs++;
+    return syscall(SYS_fsync, fd);
+}
+
+int fdatasync(int fd)
+{
+    nsyncs++;
+    return syscall(SYS_fdatasync, fd);
+}
+#define COUNT_SYNCS 1
+#else
+static unsigned long nsyncs;
+#define COUNT_SYNCS 0
+#endif
+
+enum dist { MAILBOX, DUPLICATE, SEEN };
+static const char *distnames[] = { "mailbox", "duplicate", "seen", NULL };
+
+struct key {
+    char *key;
+    int keylen;
+    char *data;
+    int datalen;
+    int prefixlen;		/* of a meaningful prefix for foreach */
+};
+
+struct phase {
+    const char *name;
+    int n;
+    int alloc;
+    double *lat;		/* microseconds */
+    double total;
+    unsigned long syncs;
+};
+
+static int nkeys = 10000;
+static int nops = 0;
+static int txnsize = 1;
+static const char *basedir = "cyrusdbbench.tmp";
+static int keep = 0;
+
+void fatal(const char *msg, int code)
+{
+    fprintf(stderr, "fatal: %s\n", msg);
+    exit(code);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void phase_add(struct phase *p, double usec)
+{
+    if (p->n == p->alloc) {
+	p->alloc = p->alloc ? p->alloc * 2 : 1024;
+	p->lat = xrealloc(p->lat, p->alloc * sizeof(double));
+    }
+    p->lat[p->n++] = usec;
+    p->total += usec;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static off_t dirsize(const char *path)
+{
+    DIR *dir;
+    struct dirent *d;
+    struct stat sbuf;
+    char buf[1024];
+    off_t size = 0;
+
+    if (!(dir = opendir(path))) return 0;
+    while ((d = readdir(dir))) {
+	if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+	snprintf(buf, sizeof(buf), "%s/%s", path, d->d_name);
+	if (lstat(buf, &sbuf) == -1) continue;
+	if (S_ISDIR(sbuf.st_mode)) size += dirsize(buf);
+	else size += sbuf.st_size;
+    }
+    closedir(dir);
+
+    return size;
+}
+
+static void rmtree(const char *path)
+{
+    DIR *dir;
+    struct dirent *d;
+    struct stat sbuf;
+    char buf[1024];
+
+    if ((dir = opendir(path))) {
+	while ((d = readdir(dir))) {
+	    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+	    snprintf(buf, sizeof(buf), "%s/%s", path, d->d_name);
+	    if (lstat(buf, &sbuf) == -1) continue;
+	    if (S_ISDIR(sbuf.st_mode)) rmtree(buf);
+	    else unlink(buf);
+	}
+	closedir(dir);
+    }
+    rmdir(path);
+}
+
+static void report(const char *backend, const char *dist, struct phase *p,
+		   off_t size)
+{
+    double p50 = 0, p99 = 0, max = 0, rate = 0;
+
+    if (p->n) {
+	qsort(p->lat, p->n, sizeof(double), cmpdouble);
+	p50 = p->lat[p->n / 2];
+	p99 = p->lat[(int) ((p->n - 1) * 0.99)];
+	max = p->lat[p->n - 1];
+	if (p->total > 0) rate = p->n / (p->total / 1000000.0);
+    }
+
+    printf("%-16s %-9s %-10s %8d %10.0f %8.0f %8.0f %9.0f ",
+	   backend, dist, p->name, p->n, rate, p50, p99, max);
+    if (!COUNT_SYNCS) printf("%7s", "-");
+    else printf("%7.2f", p->n ? (double) p->syncs / p->n : 0.0);
+    printf(" %10lu\n", (unsigned long) size);
+
+    free(p->lat);
+    memset(p, 0, sizeof(*p));
+}
+
+/* keys as the mailbox list, duplicate delivery and seen state
+   databases have them */
+static struct key *genkeys(enum dist dist, int n)
+{
+    static const char *folders[] = { "", ".Drafts", ".Sent", ".Trash",
+				     ".Lists.l%02d", ".Archive.%04d" };
+    struct key *keys = xzmalloc(n * sizeof(struct key));
+    char buf[256], data[256], folder[32];
+    int i, len;
+
+    for (i = 0; i < n; i++) {
+	switch (dist) {
+	case MAILBOX:
+	    snprintf(folder, sizeof(folder), folders[i % 6],
+		     i % 6 == 4 ? rand() % 100 : 1990 + i / 6 % 30);
+	    len = snprintf(buf, sizeof(buf), "user.u%06d", i / 6);
+	    /* the user's folders: "user.uNNNNNN.", or just the INBOX */
+	    keys[i].prefixlen = folder[0] ? len + 1 : len;
+	    len += snprintf(buf + len, sizeof(buf) - len, "%s", folder);
+	    keys[i].datalen = snprintf(data, sizeof(data),
+				       "0 default u%06d\tlrswipkxtecda\t",
+				       i / 6);
+	    break;
+
+	case DUPLICATE:
+	    /* message-id \0 recipient \0 date \0 */
+	    len = snprintf(buf, sizeof(buf), "<%08x.%d@mx%d.example.com>",
+			   (unsigned) rand(), i, rand() % 8);
+	    len++;
+	    len += snprintf(buf + len, sizeof(buf) - len, "user.u%06d",
+			    rand() % (n / 4 + 1));
+	    len++;
+	    len += snprintf(buf + len, sizeof(buf) - len,
+			    "Mon, %d Jan 2011 10:%02d:00 +0000",
+			    rand() % 28 + 1, rand() % 60);
+	    buf[len++] = '\0';
+	    keys[i].prefixlen = 4;
+	    memset(data, 0, sizeof(time_t) + sizeof(unsigned long));
+	    *(unsigned long *) (data + sizeof(time_t)) = i;
+	    keys[i].datalen = sizeof(time_t) + sizeof(unsigned long);
+	    break;
+
+	case SEEN:
+	    /* mailbox uniqueid -> version lastread lastuid lastchange seq */
+	    len = snprintf(buf, sizeof(buf), "%08x%08x", (unsigned) rand(), i);
+	    keys[i].prefixlen = 2;
+	    keys[i].datalen = snprintf(data, sizeof(data),
+				       "1 %lu %u %lu 1:%u,%u:%u",
+				       1300000000UL + i, 5000 + i % 1000,
+				       1300000000UL + i, 4000 + i % 1000,
+				       4002 + i % 1000, 4900 + i % 1000);
+	    break;
+
+	default:
+	    abort();
+	}
+
+	keys[i].key = xmalloc(len);
+	memcpy(keys[i].key, buf, len);
+	keys[i].keylen = len;
+	keys[i].data = xmalloc(keys[i].datalen);
+	memcpy(keys[i].data, data, keys[i].datalen);
+    }
+
+    return keys;
+}
+
+static void freekeys(struct key *keys, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+	free(keys[i].key);
+	free(keys[i].data);
+    }
+    free(keys);
+}
+
+static void shuffle(struct key *keys, int n)
+{
+    struct key tmp;
+    int i, j;
+
+    for (i = n - 1; i > 0; i--) {
+	j = rand() % (i + 1);
+	tmp = keys[i];
+	keys[i] = keys[j];
+	keys[j] = tmp;
+    }
+}
+
+/* pick keys with a Zipf-like skew, the way a few busy users dominate */
+static int *gencdf_pick(int n, int count)
+{
+    double *cdf = xmalloc(n * sizeof(double));
+    int *picks = xmalloc(count * sizeof(int));
+    double sum = 0, u;
+    int i, lo, hi;
+
+    for (i = 0; i < n; i++) {
+	sum += 1.0 / (i + 1);
+	cdf[i] = sum;
+    }
+    for (i = 0; i < count; i++) {
+	u = sum * (rand() / (RAND_MAX + 1.0));
+	lo = 0;
+	hi = n - 1;
+	while (lo < hi) {
+	    int mid = (lo + hi) / 2;
+	    if (cdf[mid] < u) lo = mid + 1;
+	    else hi = mid;
+	}
+	picks[i] = lo;
+    }
+    free(cdf);
+
+    return picks;
+}
+
+static int count_cb(void *rock, const char *key, int keylen,
+		    const char *data, int datalen)
+{
+    (*(int *) rock)++;
+    return 0;
+}
+
+static ino_t fileino(const char *fname)
+{
+    struct stat sbuf;
+
+    if (stat(fname, &sbuf) == -1) return 0;
+    return sbuf.st_ino;
+}
+
+/* store or delete keys[i] for every i in [0, n) stepping by 'step',
+   committing every txnsize operations */
+static int writeall(struct cyrusdb_backend *backend, struct db *db,
+		    const char *fname, struct key *keys, int n, int step,
+		    int delete, struct phase *ph, struct phase *ckpt)
+{
+    struct txn *tid = NULL;
+    unsigned long syncs;
+    double t, dt;
+    ino_t ino;
+    int i, j, r = 0, inbatch = 0;
+
+    ino = fileino(fname);
+    t = now();
+    syncs = nsyncs;
+    for (i = 0; i < n; i += step) {
+	if (delete) r = backend->delete(db, keys[i].key, keys[i].keylen,
+					&tid, 0);
+	else r = backend->store(db, keys[i].key, keys[i].keylen,
+				keys[i].data, keys[i].datalen, &tid);
+	if (r) break;
+
+	if (++inbatch < txnsize && i + step < n) continue;
+
+	r = backend->commit(db, tid);
+	tid = NULL;
+	if (r) break;
+
+	/* a batch costs each of its operations the same */
+	dt = now() - t;
+	for (j = 0; j < inbatch; j++) phase_add(ph, dt / inbatch);
+	ph->syncs += nsyncs - syncs;
+	inbatch = 0;
+
+	/* not timed */
+	if (fileino(fname) != ino) {
+	    ino = fileino(fname);
+	    phase_add(ckpt, dt);
+	    ckpt->syncs += nsyncs - syncs;
+	}
+
+	t = now();
+	syncs = nsyncs;
+    }
+    if (tid) backend->abort(db, tid);
+
+    return r;
+}
+
+static int runone(struct cyrusdb_backend *backend, enum dist dist)
+{
+    char dir[512], fname[1024];
+    struct key *keys;
+    struct phase ph, ckpt;
+    struct db *db = NULL;
+    const char *data;
+    int datalen, i, r, *picks, count, step;
+    unsigned long syncs;
+    double t;
+
+    if (!strcmp(backend->name, "quotalegacy") && dist != MAILBOX) {
+	/* one file per key, named after the key */
+	return 0;
+    }
+    if (!strcmp(backend->name, "flat") && dist == DUPLICATE) {
+	/* one line per record: keys can't hold NULs */
+	return 0;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/%s-%s", basedir, backend->name,
+	     distnames[dist]);
+    rmtree(dir);
+    if (mkdir(dir, 0755) == -1) {
+	fprintf(stderr, "mkdir %s: %s\n", dir, strerror(errno));
+	return -1;
+    }
+    snprintf(fname, sizeof(fname), "%s/bench.db", dir);
+
+    r = backend->init(dir, CYRUSDB_RECOVER);
+    if (!r) r = backend->open(fname, CYRUSDB_CREATE, &db);
+    if (r) {
+	printf("%-16s %-9s can't open: %s\n", backend->name,
+	       distnames[dist], cyrusdb_strerror(r));
+	backend->done();
+	return 0;
+    }
+
+    memset(&ph, 0, sizeof(ph));
+    memset(&ckpt, 0, sizeof(ckpt));
+    ckpt.name = "checkpoint";
+
+    keys = genkeys(dist, nkeys);
+    shuffle(keys, nkeys);
+
+    /* store */
+    ph.name = "store";
+    r = writeall(backend, db, fname, keys, nkeys, 1, 0, &ph, &ckpt);
+    report(backend->name, distnames[dist], &ph, dirsize(dir));
+    if (r) goto err;
+
+    /* fetch */
+    ph.name = "fetch";
+    picks = gencdf_pick(nkeys, nops);
+    syncs = nsyncs;
+    for (i = 0; i < nops; i++) {
+	struct key *k = &keys[picks[i]];
+	char miss[256];
+
+	if (i % 10 == 9) {
+	    /* a key that isn't there */
+	    memcpy(miss, k->key, k->keylen);
+	    miss[k->keylen - 1] ^= 0x40;
+	    t = now();
+	    r = backend->fetch(db, miss, k->keylen, &data, &datalen, NULL);
+	} else {
+	    t = now();
+	    r = backend->fetch(db, k->key, k->keylen, &data, &datalen, NULL);
+	}
+	phase_add(&ph, now() - t);
+	if (r && r != CYRUSDB_NOTFOUND) break;
+	r = 0;
+    }
+    ph.syncs = nsyncs - syncs;
+    report(backend->name, distnames[dist], &ph, dirsize(dir));
+    if (r) goto err_picks;
+
+    /* foreach */
+    ph.name = "foreach";
+    syncs = nsyncs;
+    for (i = 0; i < nops / 10 + 1; i++) {
+	struct key *k = &keys[picks[i]];
+
+	count = 0;
+	t = now();
+	r = backend->foreach(db, k->key, k->prefixlen, NULL, count_cb,
+			     &count, NULL);
+	phase_add(&ph, now() - t);
+	if (r) break;
+    }
+    ph.syncs = nsyncs - syncs;
+    report(backend->name, distnames[dist], &ph, dirsize(dir));
+    if (r) goto err_picks;
+
+    ph.name = "scan";
+    syncs = nsyncs;
+    for (i = 0; i < 5; i++) {
+	count = 0;
+	t = now();
+	r = backend->foreach(db, "", 0, NULL, count_cb, &count, NULL);
+	phase_add(&ph, now() - t);
+	if (r) break;
+	if (count != nkeys) {
+	    fprintf(stderr, "%s: scan found %d of %d records\n",
+		    backend->name, count, nkeys);
+	}
+    }
+    ph.syncs = nsyncs - syncs;
+    report(backend->name, distnames[dist], &ph, dirsize(dir));
+    if (r) goto err_picks;
+
+    /* update, with values twice the size */
+    for (i = 0; i < nkeys; i++) {
+	keys[i].data = xrealloc(keys[i].data, 2 * keys[i].datalen);
+	memcpy(keys[i].data + keys[i].datalen, keys[i].data, keys[i].datalen);
+	keys[i].datalen *= 2;
+    }
+    shuffle(keys, nkeys);
+    ph.name = "update";
+    r = writeall(backend, db, fname, keys, nkeys, 1, 0, &ph, &ckpt);
+    report(backend->name, distnames[dist], &ph, dirsize(dir));
+    if (r) goto err_picks;
+
+    /* delete */
+    ph.name = "delete";
+    step = 2;
+    r = writeall(backend, db, fname, keys, nkeys, step, 1, &ph, &ckpt);
+    report(backend->name, distnames[dist], &ph, dirsize(dir));
+    if (r) goto err_picks;
+
+    /* and whatever the backend does to checkpoint its environment */
+    syncs = nsyncs;
+    t = now();
+    r = backend->sync();
+    phase_add(&ckpt, now() - t);
+    ckpt.syncs += nsyncs - syncs;
+    report(backend->name, distnames[dist], &ckpt, dirsize(dir));
+
+ err_picks:
+    free(picks);
+ err:
+    if (r) {
+	printf("%-16s %-9s failed: %s\n", backend->name, distnames[dist],
+	       cyrusdb_strerror(r));
+    }
+    if (db) backend->close(db);
+    backend->done();
+    freekeys(keys, nkeys);
+    if (!keep) rmtree(dir);
+
+    return r;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+	    "usage: %s [-n keys] [-o ops] [-t ops per txn] [-s seed]\n"
+	    "       [-d dir] [-K] [-b backend]... [-k mailbox|duplicate|seen]...\n",
+	    name);
+    exit(EC_USAGE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct cyrusdb_backend *backends[32];
+    int dists[3];
+    int nbackends = 0, ndists = 0;
+    int opt, i, j, r = 0;
+
+    while ((opt = getopt(argc, argv, "n:o:t:s:d:Kb:k:")) != EOF) {
+	switch (opt) {
+	case 'n':
+	    nkeys = atoi(optarg);
+	    break;
+	case 'o':
+	    nops = atoi(optarg);
+	    break;
+	case 't':
+	    txnsize = atoi(optarg);
+	    break;
+	case 's':
+	    srand(atoi(optarg));
+	    break;
+	case 'd':
+	    basedir = optarg;
+	    break;
+	case 'K':
+	    keep = 1;
+	    break;
+	case 'b':
+	    if (nbackends == 32) usage(argv[0]);
+	    backends[nbackends++] = cyrusdb_fromname(optarg);
+	    break;
+	case 'k':
+	    for (i = 0; distnames[i]; i++) {
+		if (!strcmp(distnames[i], optarg)) break;
+	    }
+	    if (!distnames[i] || ndists == 3) usage(argv[0]);
+	    dists[ndists++] = i;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (nkeys < 10 || txnsize < 1) usage(argv[0]);
+    if (nops <= 0) nops = nkeys;
+
+    if (!nbackends) {
+	for (i = 0; cyrusdb_backends[i] && nbackends < 32; i++) {
+	    backends[nbackends++] = cyrusdb_backends[i];
+	}
+    }
+    if (!ndists) {
+	for (i = 0; i < 3; i++) dists[ndists++] = i;
+    }
+
+    if (mkdir(basedir, 0755) == -1 && errno != EEXIST) {
+	fprintf(stderr, "mkdir %s: %s\n", basedir, strerror(errno));
+	exit(EC_IOERR);
+    }
+
+    printf("%-16s %-9s %-10s %8s %10s %8s %8s %9s %7s %10s\n",
+	   "backend", "keys", "phase", "ops", "ops/s", "p50us", "p99us",
+	   "maxus", "syncs", "size");
+    for (i = 0; i < nbackends; i++) {
+	for (j = 0; j < ndists; j++) {
+	    if (runone(backends[i], dists[j])) r = 1;
+	}
+    }
+
+    if (!keep) rmdir(basedir);
+
+    return r;
+}